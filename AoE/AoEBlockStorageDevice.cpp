@@ -0,0 +1,480 @@
+/*
+ *  AoEBlockStorageDevice.cpp
+ *  AoE
+ *
+ * The nub published for a target when PUBLISH_MODE_BLOCK_STORAGE is selected. IOBlockStorageDriver attaches to it
+ * directly, so IOATABlockStorageDriver (and its one-command-at-a-time handling and register accesses) is left out.
+ *
+ * Each block request becomes a single 48-bit READ/WRITE EXT for the controller's queue. From there it's split into
+ * frames like any other read/write, and can be queued with others, coalesced, read ahead, cached or written back.
+ * The controller's ATA nub is still created (it issues the IDENTIFY and owns the command path) but it isn't
+ * registered, so nothing matches against it.
+ *
+ * Only the block storage layer is bypassed. The request is still handed to the controller as an IOATABusCommand
+ * through the ATA nub rather than straight to issue_block_transfer: the controller's frame building works on
+ * IOATAController's current command, and it's IOATAController's queue that serialises commands on the work loop,
+ * holds a flush behind the writes before it and times commands out. The command costs one allocation and a queue
+ * insert per request, small next to the frames it's split into.
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/storage/IOBlockStorageDevice.h>
+#include <IOKit/ata/IOATATypes.h>
+#include <IOKit/ata/IOATABusCommand.h>
+#include "AoEController.h"
+#include "AoEDevice.h"
+#include "../Shared/AoEcommon.h"
+#include "AoEBlockStorageDevice.h"
+#include "debug.h"
+
+// Longest the controller is allowed for a block request (it retransmits within this)
+#define BLOCK_COMMAND_TIMEOUT_MS		30000
+
+// The sector count of a 48-bit command is 16 bits
+#define MAX_BLOCKS_PER_COMMAND			0xFFFF
+
+struct BlockRequest
+{
+	IOStorageCompletion	Completion;
+	IOMemoryDescriptor*	pBuffer;
+	UInt64				Bytes;
+};
+
+#define super IOBlockStorageDevice
+
+OSDefineMetaClassAndStructors(AOE_BLOCK_DEVICE_NAME, IOBlockStorageDevice)
+
+AOE_BLOCK_DEVICE_NAME* AOE_BLOCK_DEVICE_NAME::create_block_device(AOE_CONTROLLER_NAME* pController, AOE_DEVICE_NAME* pATADevice, int nShelf, int nSlot)
+{
+	AOE_BLOCK_DEVICE_NAME* nub;
+
+	debug("AOE_BLOCK_DEVICE_NAME::create_block_device\n");
+
+	nub = new AOE_BLOCK_DEVICE_NAME;
+
+	if ( !nub )
+		return NULL;
+
+	if ( !nub->init(pController, pATADevice) )
+	{
+		debugError("AOE_BLOCK_DEVICE_NAME failed to initialise\n");
+
+		nub->release();
+		return NULL;
+	}
+
+	snprintf(nub->m_szProduct, sizeof(nub->m_szProduct), "Shelf:%d Slot:%d", nShelf, nSlot);
+
+	return nub;
+}
+
+//---------------------------------------------------------------------------
+
+bool AOE_BLOCK_DEVICE_NAME::init(AOE_CONTROLLER_NAME* pController, AOE_DEVICE_NAME* pATADevice)
+{
+	debug("AOE_BLOCK_DEVICE_NAME::init\n");
+
+	if ( !super::init((OSDictionary*) 0L) )
+		return false;
+
+	if ( !pController || !pATADevice )
+		return false;
+
+	m_pController = pController;
+	m_pATADevice = pATADevice;
+	m_pATADevice->retain();
+	m_fUninitialised = false;
+
+	m_szProduct[0] = 0;
+	m_szRevision[0] = 0;
+	m_szSerial[0] = 0;
+
+	// This is what IOBlockStorageDriver matches on
+	setProperty(kIOBlockStorageDeviceTypeKey, kIOBlockStorageDeviceTypeGeneric);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------
+ * Requests that are still queued complete after this (with an error once the controller cancels them) and
+ * free their commands through the ATA nub, so it's kept until we're freed
+ ---------------------------------------------------------------------------*/
+void AOE_BLOCK_DEVICE_NAME::uninit(void)
+{
+	debug("AOE_BLOCK_DEVICE_NAME::uninit\n");
+
+	m_fUninitialised = true;
+}
+
+void AOE_BLOCK_DEVICE_NAME::free(void)
+{
+	CLEAN_RELEASE(m_pATADevice);
+
+	super::free();
+}
+
+//---------------------------------------------------------------------------
+
+bool AOE_BLOCK_DEVICE_NAME::attach(IOService* provider)
+{
+	debug("AOE_BLOCK_DEVICE_NAME::attach\n");
+
+	if ( provider!=(IOService*) m_pController )
+	{
+		debugError("Provider isn't our controller\n");
+		return false;
+	}
+
+	if ( !super::attach(provider) )
+	{
+		debugError("AOE_BLOCK_DEVICE_NAME's super is unable to attach to provider");
+		return false;
+	}
+
+	return true;
+}
+
+
+
+
+#pragma mark -
+#pragma mark Reads and writes
+
+/*---------------------------------------------------------------------------
+ * Start a read/write. IOBlockStorageDriver has already split the request at reportMaxRead/WriteTransfer
+ ---------------------------------------------------------------------------*/
+IOReturn AOE_BLOCK_DEVICE_NAME::doAsyncReadWrite(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion)
+{
+	struct BlockRequest* pRequest;
+	IOATABusCommand* cmd;
+	IOReturn err;
+
+	debug("AOE_BLOCK_DEVICE_NAME::doAsyncReadWrite(%s %d blocks at %d)\n", (buffer->getDirection()==kIODirectionIn) ? "read" : "write", nblks, block);
+
+	if ( m_fUninitialised )
+		return kIOReturnNoDevice;
+
+	pRequest = (struct BlockRequest*) IOMalloc(sizeof(struct BlockRequest));
+	if ( NULL==pRequest )
+		return kIOReturnNoMemory;
+
+	cmd = build_transfer(buffer, block, nblks);
+	if ( NULL==cmd )
+	{
+		IOFree(pRequest, sizeof(struct BlockRequest));
+		return kIOReturnBadArgument;
+	}
+
+	pRequest->Completion = completion;
+	pRequest->pBuffer = buffer;
+	pRequest->Bytes = (UInt64) nblks*kATADefaultSectorSize;
+
+	cmd->setCallbackPtr(&BlockCommandDone);
+	cmd->refCon = (void*) pRequest;
+	cmd->refCon2 = (void*) this;
+
+	// Released by block_command_done, the request can complete after the controller has let go of us
+	retain();
+	buffer->prepare();
+
+	err = m_pATADevice->executeCommand(cmd);
+
+	if ( err )
+	{
+		debugError("Unable to queue block request (%#x)\n", err);
+
+		buffer->complete();
+		IOFree(pRequest, sizeof(struct BlockRequest));
+		m_pATADevice->freeCommand(cmd);
+		release();
+		return err;
+	}
+
+	return kIOReturnSuccess;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Synchronous by definition. A command without a callback blocks the caller in AOE_DEVICE_NAME::executeCommand until it
+ * completes, the storage stack's reads and writes don't come this way (see doAsyncReadWrite)
+ ---------------------------------------------------------------------------*/
+IOReturn AOE_BLOCK_DEVICE_NAME::doSyncReadWrite(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks)
+{
+	IOATABusCommand* cmd;
+	IOReturn err;
+
+	debug("AOE_BLOCK_DEVICE_NAME::doSyncReadWrite\n");
+
+	if ( m_fUninitialised )
+		return kIOReturnNoDevice;
+
+	cmd = build_transfer(buffer, block, nblks);
+	if ( NULL==cmd )
+		return kIOReturnBadArgument;
+
+	buffer->prepare();
+	err = m_pATADevice->executeCommand(cmd);
+	buffer->complete();
+
+	m_pATADevice->freeCommand(cmd);
+
+	return err;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Sent to the target or answered locally depending on the flush mode. In queued mode the controller
+ * holds it back until the writes before it have been acknowledged
+ ---------------------------------------------------------------------------*/
+IOReturn AOE_BLOCK_DEVICE_NAME::doSynchronizeCache(void)
+{
+	IOATABusCommand* cmd;
+	IOReturn err;
+
+	debug("AOE_BLOCK_DEVICE_NAME::doSynchronizeCache\n");
+
+	if ( m_fUninitialised )
+		return kIOReturnNoDevice;
+
+	cmd = (IOATABusCommand*) m_pATADevice->allocCommand();
+	if ( NULL==cmd )
+		return kIOReturnNoMemory;
+
+	cmd->zeroCommand();
+	cmd->setOpcode(kATAFnExecIO);
+	cmd->setFlags(0);
+	cmd->setUnit(kATADevice0DeviceID);
+	cmd->setTimeoutMS(BLOCK_COMMAND_TIMEOUT_MS);
+	cmd->setDevice_Head(((UInt8) kATADevice0DeviceID) << 4);
+	cmd->setCommand(kATAcmdFlushCache);
+
+	err = m_pATADevice->executeCommand(cmd);
+
+	m_pATADevice->freeCommand(cmd);
+
+	return err;
+}
+
+
+
+IOATABusCommand* AOE_BLOCK_DEVICE_NAME::build_transfer(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks)
+{
+	IOATABusCommand* cmd;
+	IOExtendedLBA* extLBA;
+	bool fRead;
+
+	if ( (NULL==buffer) || (0==nblks) || (nblks>max_transfer_blocks()) )
+	{
+		debugError("Unable to transfer %d blocks (the most is %d)\n", nblks, max_transfer_blocks());
+		return NULL;
+	}
+
+	cmd = (IOATABusCommand*) m_pATADevice->allocCommand();
+	if ( NULL==cmd )
+		return NULL;
+
+	fRead = (buffer->getDirection()==kIODirectionIn);
+
+	// Set up as IOATABlockStorageDriver would, the controller turns the DMA commands into the ones AoE supports
+	cmd->zeroCommand();
+	cmd->setOpcode(kATAFnExecIO);
+	cmd->setFlags((fRead ? mATAFlagIORead : mATAFlagIOWrite) | mATAFlagUseDMA | mATAFlag48BitLBA);
+	cmd->setUnit(kATADevice0DeviceID);
+	cmd->setTimeoutMS(BLOCK_COMMAND_TIMEOUT_MS);
+	cmd->setBuffer(buffer);
+	cmd->setPosition(0);
+	cmd->setByteCount((IOByteCount) nblks*kATADefaultSectorSize);
+
+	extLBA = cmd->getExtendedLBA();
+	extLBA->setExtendedLBA(0, block, kATADevice0DeviceID, (UInt16) nblks, fRead ? kATAcmdReadDMAExtended : kATAcmdWriteDMAExtended);
+
+	return cmd;
+}
+
+
+
+void AOE_BLOCK_DEVICE_NAME::BlockCommandDone(IOATACommand* command)
+{
+	AOE_BLOCK_DEVICE_NAME* self = (AOE_BLOCK_DEVICE_NAME*) command->refCon2;
+
+	if ( self )
+		self->block_command_done(command);
+}
+
+
+
+void AOE_BLOCK_DEVICE_NAME::block_command_done(IOATACommand* command)
+{
+	struct BlockRequest* pRequest;
+	IOStorageCompletion Completion;
+	IOReturn err;
+	UInt64 Bytes;
+
+	pRequest = (struct BlockRequest*) command->refCon;
+
+	err = command->getResult();
+	if ( err )
+		debugError("Block request failed with err=%d\n", err);
+
+	Completion = pRequest->Completion;
+	Bytes = (kATANoErr==err) ? pRequest->Bytes : 0;
+
+	pRequest->pBuffer->complete();
+	IOFree(pRequest, sizeof(struct BlockRequest));
+
+	m_pATADevice->freeCommand(command);
+
+	IOStorage::complete(Completion, err, Bytes);
+
+	// Taken by doAsyncReadWrite
+	release();
+}
+
+
+
+UInt32 AOE_BLOCK_DEVICE_NAME::max_transfer_blocks(void)
+{
+	return MIN(m_pController->max_transfer_size()/kATADefaultSectorSize, MAX_BLOCKS_PER_COMMAND);
+}
+
+
+
+
+#pragma mark -
+#pragma mark Device description
+
+char* AOE_BLOCK_DEVICE_NAME::getVendorString(void)
+{
+	return (char*) "AoE";
+}
+
+char* AOE_BLOCK_DEVICE_NAME::getProductString(void)
+{
+	return m_szProduct;
+}
+
+char* AOE_BLOCK_DEVICE_NAME::getRevisionString(void)
+{
+	copy_ata_property(kATARevisionPropertyKey, m_szRevision);
+
+	return m_szRevision;
+}
+
+char* AOE_BLOCK_DEVICE_NAME::getAdditionalDeviceInfoString(void)
+{
+	copy_ata_property(kATASerialNumPropertyKey, m_szSerial);
+
+	return m_szSerial;
+}
+
+/*---------------------------------------------------------------------------
+ * The ATA nub publishes the strings from the IDENTIFY data once it has them
+ ---------------------------------------------------------------------------*/
+void AOE_BLOCK_DEVICE_NAME::copy_ata_property(const char* pszKey, char* pszString)
+{
+	OSString* pProperty;
+
+	pProperty = OSDynamicCast(OSString, m_pATADevice->getProperty(pszKey));
+
+	if ( pProperty )
+		strlcpy(pszString, pProperty->getCStringNoCopy(), BLOCK_DEVICE_STRING_LENGTH);
+}
+
+//---------------------------------------------------------------------------
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportBlockSize(UInt64* blockSize)
+{
+	*blockSize = kATADefaultSectorSize;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportMaxReadTransfer(UInt64 blockSize, UInt64* max)
+{
+	*max = (UInt64) max_transfer_blocks()*kATADefaultSectorSize;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportMaxWriteTransfer(UInt64 blockSize, UInt64* max)
+{
+	*max = (UInt64) max_transfer_blocks()*kATADefaultSectorSize;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportMaxValidBlock(UInt64* maxBlock)
+{
+	UInt64 Capacity;
+
+	Capacity = m_pController->identified_capacity();
+
+	*maxBlock = Capacity ? Capacity-1 : 0;
+	return kIOReturnSuccess;
+}
+
+// The controller only registers us once the target has answered an IDENTIFY, so there's always media
+IOReturn AOE_BLOCK_DEVICE_NAME::reportMediaState(bool* mediaPresent, bool* changedState)
+{
+	*mediaPresent = (0!=m_pController->identified_capacity());
+	*changedState = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportPollRequirements(bool* pollRequired, bool* pollIsExpensive)
+{
+	*pollRequired = false;
+	*pollIsExpensive = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportEjectability(bool* isEjectable)
+{
+	*isEjectable = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportLockability(bool* isLockable)
+{
+	*isLockable = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportRemovability(bool* isRemovable)
+{
+	*isRemovable = false;
+	return kIOReturnSuccess;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::reportWriteProtection(bool* isWriteProtected)
+{
+	*isWriteProtected = false;
+	return kIOReturnSuccess;
+}
+
+//---------------------------------------------------------------------------
+
+IOReturn AOE_BLOCK_DEVICE_NAME::doEjectMedia(void)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::doFormatMedia(UInt64 byteCapacity)
+{
+	return kIOReturnUnsupported;
+}
+
+UInt32 AOE_BLOCK_DEVICE_NAME::doGetFormatCapacities(UInt64* capacities, UInt32 capacitiesMaxCount) const
+{
+	if ( capacities && capacitiesMaxCount )
+		capacities[0] = m_pController->identified_capacity()*kATADefaultSectorSize;
+
+	return 1;
+}
+
+IOReturn AOE_BLOCK_DEVICE_NAME::doLockUnlockMedia(bool doLock)
+{
+	return kIOReturnUnsupported;
+}
@@ -0,0 +1,84 @@
+/*
+ *  AoEBlockStorageDevice.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __AOEBLOCKSTORAGEDEVICE_H__
+#define __AOEBLOCKSTORAGEDEVICE_H__
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/storage/IOBlockStorageDevice.h>
+#include <IOKit/ata/IOATATypes.h>
+#include <IOKit/ata/IOATABusCommand.h>
+
+class AOE_CONTROLLER_NAME;
+class AOE_DEVICE_NAME;
+
+#define BLOCK_DEVICE_STRING_LENGTH		48
+
+class AOE_BLOCK_DEVICE_NAME : public IOBlockStorageDevice
+{
+	OSDeclareDefaultStructors(AOE_BLOCK_DEVICE_NAME)
+
+public:
+	void uninit(void);
+	virtual void free(void);
+
+	static AOE_BLOCK_DEVICE_NAME* create_block_device(AOE_CONTROLLER_NAME* pController, AOE_DEVICE_NAME* pATADevice, int nShelf, int nSlot);
+
+	virtual bool attach(IOService* provider);
+
+	// overrides from IOBlockStorageDevice, these are what IOBlockStorageDriver uses in place of IOATABlockStorageDriver
+
+	/*!@function doAsyncReadWrite
+	 @abstract Start a read or write, the completion is called once the target has answered it
+	 */
+	virtual IOReturn doAsyncReadWrite(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks, IOStorageCompletion completion);
+	virtual IOReturn doSyncReadWrite(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks);
+	virtual IOReturn doSynchronizeCache(void);
+	virtual IOReturn doEjectMedia(void);
+	virtual IOReturn doFormatMedia(UInt64 byteCapacity);
+	virtual UInt32 doGetFormatCapacities(UInt64* capacities, UInt32 capacitiesMaxCount) const;
+	virtual IOReturn doLockUnlockMedia(bool doLock);
+
+	virtual char* getVendorString(void);
+	virtual char* getProductString(void);
+	virtual char* getRevisionString(void);
+	virtual char* getAdditionalDeviceInfoString(void);
+
+	virtual IOReturn reportBlockSize(UInt64* blockSize);
+	virtual IOReturn reportEjectability(bool* isEjectable);
+	virtual IOReturn reportLockability(bool* isLockable);
+	virtual IOReturn reportMaxReadTransfer(UInt64 blockSize, UInt64* max);
+	virtual IOReturn reportMaxWriteTransfer(UInt64 blockSize, UInt64* max);
+	virtual IOReturn reportMaxValidBlock(UInt64* maxBlock);
+	virtual IOReturn reportMediaState(bool* mediaPresent, bool* changedState);
+	virtual IOReturn reportPollRequirements(bool* pollRequired, bool* pollIsExpensive);
+	virtual IOReturn reportRemovability(bool* isRemovable);
+	virtual IOReturn reportWriteProtection(bool* isWriteProtected);
+
+protected:
+	virtual bool init(AOE_CONTROLLER_NAME* pController, AOE_DEVICE_NAME* pATADevice);
+
+	/*!@function build_transfer
+	 @abstract fill in a 48-bit read/write for the controller's queue.
+	 */	IOATABusCommand* build_transfer(IOMemoryDescriptor* buffer, UInt32 block, UInt32 nblks);
+	/*!@function BlockCommandDone
+	 @abstract completion for reads/writes started by doAsyncReadWrite.
+	 */	static void BlockCommandDone(IOATACommand* command);
+	void block_command_done(IOATACommand* command);
+	UInt32 max_transfer_blocks(void);
+	void copy_ata_property(const char* pszKey, char* pszString);
+
+	AOE_CONTROLLER_NAME*	m_pController;
+	AOE_DEVICE_NAME*		m_pATADevice;			// Commands are run through the (unregistered) ATA nub, it holds the IDENTIFY data too
+	bool					m_fUninitialised;		// No new requests are taken, those still running hold a reference on us until they complete
+	char					m_szProduct[BLOCK_DEVICE_STRING_LENGTH];
+	char					m_szRevision[BLOCK_DEVICE_STRING_LENGTH];
+	char					m_szSerial[BLOCK_DEVICE_STRING_LENGTH];
+};
+
+#endif		// __AOEBLOCKSTORAGEDEVICE_H__
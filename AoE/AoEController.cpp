@@ -54,6 +54,9 @@
  - handleRegAccess - Command to set ATA registers
  - issueCommand() - Initialise a packet for sending out the interface
  - registerAccess() - Copy ATA data to the outgoing packet
+ - dispatchNext()/completeIO() - In queued mode, several read/write commands are run at once (see "Queued commands")
+ - dequeueFirstCommand() - Writes to adjacent sectors are merged into a single transfer (see "Write coalescing")
+                           and reads that have been read ahead are completed from memory (see "Read-ahead")
  
  Here's the mappings between the various formats and names
  
@@ -85,12 +88,15 @@
  */
 
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOKitKeys.h>
 #include "AoEControllerInterface.h"
 #include "AoEtherFilter.h"
 #include "AoEService.h"
 #include "AoEController.h"
 #include "AoEDevice.h"
+#include "AoEBlockStorageDevice.h"
 #include "../Shared/AoEcommon.h"
 #include "debug.h"
 
@@ -118,10 +124,15 @@ bool AOE_CONTROLLER_NAME::init(AOE_CONTROLLER_INTERFACE_NAME* pProvider, int nSh
 {
 	OSNumber* num;
 	bool fRet;
+	int n;
 	
 	fRet = super::init(NULL);
 	m_pProvider = pProvider;
 	m_pAoEDevice = NULL;
+	m_pBlockDevice = NULL;
+	m_fBlockDeviceRegistered = FALSE;
+	m_nPublishMode = DEFAULT_PUBLISH_MODE;
+	m_pWorkLoop = NULL;
 	m_MTU = MTU;
 	m_pReceivedATAHeader = NULL;
 	m_fExtendedLBA = FALSE;
@@ -137,10 +148,81 @@ bool AOE_CONTROLLER_NAME::init(AOE_CONTROLLER_INTERFACE_NAME* pProvider, int nSh
 	m_ATAState = kATAOnlineEvent;	// Record the present state
 	m_nOutstandingIdentTag = 0;
 	m_IdentifiedCapacity = 0;
-	
-	// All our constraints are determined by the MTU and the remaining data in the packet
-	m_nMaxSectorsPerTransfer = COUNT_SECTORS_FROM_MTU(m_MTU);
-	debug("[%d.%d] Setting transfer sizes based on MTU of: %d bytes (%d sectors per transfer)\n", nShelf, nSlot, m_MTU, m_nMaxSectorsPerTransfer);
+	m_fCapacityChanged = FALSE;
+	m_nTagSlot = 0;
+	memset(m_aQueued, 0, sizeof(m_aQueued));
+	m_nQueued = 0;
+	m_nQueueDepth = DEFAULT_QUEUE_DEPTH;
+	m_pDeferredCommand = NULL;
+	m_pQueueTimer = NULL;
+	m_fQueueTimerRunning = FALSE;
+	m_pFakeResponseTimer = NULL;
+	m_pReceiveTimer = NULL;
+	m_pReceiveLock = IOSimpleLockAlloc();
+	m_ReceivedFrames = NULL;
+	m_LastReceivedFrame = NULL;
+	m_nReceivedFrames = 0;
+	m_pWriteMapping = NULL;
+	m_pReadMapping = NULL;
+	m_ReadBytesCopied = 0;
+	m_ReadCopyTime = 0;
+	m_nChunks = 0;
+	m_nRetryChunk = 0;
+	m_fSinglePath = TRUE;
+	m_nWriteCoalesce_us = DEFAULT_WRITE_COALESCE_US;
+	memset(&m_Gathering, 0, sizeof(m_Gathering));
+	m_nUnmergedWrites = 0;
+	m_pLookahead = NULL;
+	m_pCoalesceTimer = NULL;
+	m_fCoalesceTimerRunning = FALSE;
+	m_fCoalesceExpired = FALSE;
+	memset(m_aCoalesced, 0, sizeof(m_aCoalesced));
+	m_fInNextCommand = FALSE;
+	memset(&m_ReadAhead, 0, sizeof(m_ReadAhead));
+	m_ReadAhead.nWindow = READ_AHEAD_MIN_SECTORS;
+	m_pReadAheadTimer = NULL;
+	m_nCacheGeneration = 0;
+	bzero(m_aCacheFills, sizeof(m_aCacheFills));
+	m_nFlushMode = DEFAULT_FLUSH_MODE;
+	bzero(m_aWriteBacks, sizeof(m_aWriteBacks));
+	m_nWriteBacks = 0;
+	m_WriteBackError = kATANoErr;
+
+	m_nTargetMaxSectors = 0;
+	memset(m_aPathProbe, 0, sizeof(m_aPathProbe));
+	m_pProbeTimer = NULL;
+	m_nFramePath = -1;
+	m_nFrameSectors = 0;
+
+	// A command is never split into more frames than it has sectors (and commands without 48-bit addressing can have 256)
+	m_nChunkTableSize = MAX(m_nMaxTransferSize, 256*kATADefaultSectorSize)/kATADefaultSectorSize;
+	m_nChunkBitmapWords = CHUNK_BITMAP_WORDS(m_nChunkTableSize);
+	m_pChunkBitmaps = (UInt32*) IOMalloc((1+MAX_QUEUE_DEPTH)*m_nChunkBitmapWords*sizeof(UInt32));
+	m_pChunkOffsetTables = (UInt16*) IOMalloc((1+MAX_QUEUE_DEPTH)*m_nChunkTableSize*sizeof(UInt16));
+	
+	if ( m_pChunkBitmaps && m_pChunkOffsetTables )
+	{
+		for (n=0; n<numberof(m_aQueued); n++)
+		{
+			m_aQueued[n].pReceivedChunks = m_pChunkBitmaps + (1+n)*m_nChunkBitmapWords;
+			m_aQueued[n].pChunkOffsets = m_pChunkOffsetTables + (1+n)*m_nChunkTableSize;
+		}
+	}
+	else
+	{
+		debugError("Unable to allocate the chunk tables\n");
+
+		if ( m_pChunkBitmaps )
+			IOFree(m_pChunkBitmaps, (1+MAX_QUEUE_DEPTH)*m_nChunkBitmapWords*sizeof(UInt32));
+		if ( m_pChunkOffsetTables )
+			IOFree(m_pChunkOffsetTables, (1+MAX_QUEUE_DEPTH)*m_nChunkTableSize*sizeof(UInt16));
+		m_pChunkBitmaps = NULL;
+		m_pChunkOffsetTables = NULL;
+		fRet = FALSE;
+	}
+
+	m_pReceivedChunks = m_pChunkBitmaps;
+	m_pChunkOffsets = m_pChunkOffsetTables;
 	
 	memset(&m_target, 0, sizeof(TargetInfo));
 
@@ -157,6 +239,9 @@ bool AOE_CONTROLLER_NAME::init(AOE_CONTROLLER_INTERFACE_NAME* pProvider, int nSh
 	bcopy(pTargetsMACAddress, m_target.aaDestMACAddress[0], ETHER_ADDR_LEN);
 	clock_get_uptime(&m_time_since_last_comm);
 
+	// Frames are sized for the path they're sent on (the MTU passed in is only used if an interface doesn't report one)
+	update_path_sizes();
+
 	// Register properties:
 	num = OSNumber::withNumber(nNumber, 16);
 	setProperty(TARGET_PROPERTY, num);
@@ -185,12 +270,204 @@ bool AOE_CONTROLLER_NAME::init(AOE_CONTROLLER_INTERFACE_NAME* pProvider, int nSh
 }
 
 
+void AOE_CONTROLLER_NAME::free(void)
+{
+	IOWorkLoop* pWorkLoop;
+	
+	// IOATAController takes its command gate off the work loop as it's freed, so the loop has to outlive it
+	pWorkLoop = m_pWorkLoop;
+	m_pWorkLoop = NULL;
+	
+	if ( m_ReceivedFrames )
+		mbuf_freem_list(m_ReceivedFrames);
+	m_ReceivedFrames = NULL;
+	
+	if ( m_pReceiveLock )
+		IOSimpleLockFree(m_pReceiveLock);
+	m_pReceiveLock = NULL;
+	
+	super::free();
+	
+	if ( pWorkLoop )
+		pWorkLoop->release();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Run the target on its own work loop, rather than the one we'd inherit from the provider. This has to be set
+ * before start(), which puts IOATAController's command gate and timer on it
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::set_work_loop(IOWorkLoop* pWorkLoop)
+{
+	if ( pWorkLoop )
+		pWorkLoop->retain();
+	
+	CLEAN_RELEASE(m_pWorkLoop);
+	m_pWorkLoop = pWorkLoop;
+}
+
+
+IOWorkLoop* AOE_CONTROLLER_NAME::getWorkLoop() const
+{
+	return m_pWorkLoop ? m_pWorkLoop : super::getWorkLoop();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Anything touching the target's state from outside its work loop must hold the gate, just as the
+ * event sources on the loop do. The gate is recursive, so this is safe on the target's own loop too.
+ * NOTE: Nothing on the target's work loop waits on the service's work loop, so the service can always take this
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::lock_target(void)
+{
+	getWorkLoop()->closeGate();
+}
+
+
+void AOE_CONTROLLER_NAME::unlock_target(void)
+{
+	getWorkLoop()->openGate();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Responses are handed to our work loop by the receive timer, so it has to be there before we're in the dispatch table
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::start(IOService* provider)
+{
+	IOTimerEventSource* pReceiveTimer;
+	
+	if ( (NULL==m_pReceiveLock) || !super::start(provider) )
+		return FALSE;
+	
+	pReceiveTimer = IOTimerEventSource::timerEventSource(this, ReceiveTimer);
+	
+	if ( pReceiveTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(pReceiveTimer)) )
+		CLEAN_RELEASE(pReceiveTimer);
+	
+	if ( NULL==pReceiveTimer )
+	{
+		debugError("[%d.%d] Unable to create the receive timer\n", m_target.nShelf, m_target.nSlot);
+		super::stop(provider);
+		return FALSE;
+	}
+	
+	IOSimpleLockLock(m_pReceiveLock);
+	m_pReceiveTimer = pReceiveTimer;
+	IOSimpleLockUnlock(m_pReceiveLock);
+	
+	return TRUE;
+}
+
+
+
 void AOE_CONTROLLER_NAME::uninit(void)
 {
+	IOTimerEventSource* pReceiveTimer;
+	mbuf_t ReceivedFrames;
+	
 	debug("AOE_CONTROLLER_NAME::uninit\n");
 
 	cancel_command(TRUE);
 
+	// Stop taking responses before the timer goes. Any still waiting can't be for a command now
+	if ( m_pReceiveLock )
+	{
+		IOSimpleLockLock(m_pReceiveLock);
+		pReceiveTimer = m_pReceiveTimer;
+		ReceivedFrames = m_ReceivedFrames;
+		m_pReceiveTimer = NULL;
+		m_ReceivedFrames = m_LastReceivedFrame = NULL;
+		m_nReceivedFrames = 0;
+		IOSimpleLockUnlock(m_pReceiveLock);
+		
+		if ( pReceiveTimer )
+		{
+			pReceiveTimer->cancelTimeout();
+			if ( getWorkLoop() )
+				getWorkLoop()->removeEventSource(pReceiveTimer);
+			pReceiveTimer->release();
+		}
+		
+		if ( ReceivedFrames )
+			mbuf_freem_list(ReceivedFrames);
+	}
+
+	// Nothing else can be cached under this controller once it's gone
+	m_pProvider->cache_drop_target(this);
+
+	if ( m_pProbeTimer )
+	{
+		m_pProbeTimer->cancelTimeout();
+		if ( getWorkLoop() )
+			getWorkLoop()->removeEventSource(m_pProbeTimer);
+		CLEAN_RELEASE(m_pProbeTimer);
+	}
+
+	if ( m_pFakeResponseTimer )
+	{
+		m_pFakeResponseTimer->cancelTimeout();
+		if ( getWorkLoop() )
+			getWorkLoop()->removeEventSource(m_pFakeResponseTimer);
+		CLEAN_RELEASE(m_pFakeResponseTimer);
+	}
+
+	if ( m_pQueueTimer )
+	{
+		m_pQueueTimer->cancelTimeout();
+		if ( getWorkLoop() )
+			getWorkLoop()->removeEventSource(m_pQueueTimer);
+		CLEAN_RELEASE(m_pQueueTimer);
+	}
+	m_fQueueTimerRunning = FALSE;
+
+	if ( m_pCoalesceTimer )
+	{
+		m_pCoalesceTimer->cancelTimeout();
+		if ( getWorkLoop() )
+			getWorkLoop()->removeEventSource(m_pCoalesceTimer);
+		CLEAN_RELEASE(m_pCoalesceTimer);
+	}
+
+	if ( m_pReadAheadTimer )
+	{
+		m_pReadAheadTimer->cancelTimeout();
+		if ( getWorkLoop() )
+			getWorkLoop()->removeEventSource(m_pReadAheadTimer);
+		CLEAN_RELEASE(m_pReadAheadTimer);
+	}
+
+	if ( m_ReadAhead.pBuffer )
+	{
+		IOFree(m_ReadAhead.pBuffer, READ_AHEAD_BUFFER_SECTORS*kATADefaultSectorSize);
+		m_ReadAhead.pBuffer = NULL;
+	}
+
+	if ( m_ReadAhead.pReceived )
+	{
+		IOFree(m_ReadAhead.pReceived, CHUNK_BITMAP_WORDS(READ_AHEAD_BUFFER_SECTORS)*sizeof(UInt32));
+		m_ReadAhead.pReceived = NULL;
+	}
+
+	if ( m_pChunkBitmaps )
+	{
+		IOFree(m_pChunkBitmaps, (1+MAX_QUEUE_DEPTH)*m_nChunkBitmapWords*sizeof(UInt32));
+		m_pChunkBitmaps = NULL;
+		m_pReceivedChunks = NULL;
+	}
+
+	if ( m_pChunkOffsetTables )
+	{
+		IOFree(m_pChunkOffsetTables, (1+MAX_QUEUE_DEPTH)*m_nChunkTableSize*sizeof(UInt16));
+		m_pChunkOffsetTables = NULL;
+		m_pChunkOffsets = NULL;
+	}
+
+	memset(m_aQueued, 0, sizeof(m_aQueued));
+
 	removeProperty(SHELF_PROPERTY);
 	removeProperty(SLOT_PROPERTY);
 	removeProperty(CAPACITY_PROPERTY);
@@ -202,6 +479,13 @@ void AOE_CONTROLLER_NAME::uninit(void)
 	removeProperty(IDENT_MODEL_PROPERTY);
 	removeProperty(IDENT_SERIAL_PROPERTY);
 	
+	if ( m_pBlockDevice )
+	{
+		m_pBlockDevice->uninit();
+		m_pBlockDevice->terminate();
+		CLEAN_RELEASE(m_pBlockDevice);
+	}
+	
 	if ( m_pAoEDevice )
 	{
 		m_pAoEDevice->uninit();
@@ -223,12 +507,35 @@ void AOE_CONTROLLER_NAME::registerDiskService(void)
 
 	debug("AOE_CONTROLLER_NAME::registerDiskService\n");
 //#warning not registering disk service
-	if ( m_pAoEDevice && (0==device_attached()) )
+	if ( m_pBlockDevice )
+		register_block_device();
+	else if ( m_pAoEDevice && (0==device_attached()) )
 		m_pAoEDevice->registerService();
 }
 
 
 
+/*---------------------------------------------------------------------------
+ * IOBlockStorageDriver asks for the capacity as soon as it attaches, so the block device isn't registered
+ * until the target has answered an IDENTIFY (handle_identify calls this again when it does)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::register_block_device(void)
+{
+	if ( !m_fRegistered || (NULL==m_pBlockDevice) || m_fBlockDeviceRegistered )
+		return;
+
+	if ( 0==m_IdentifiedCapacity )
+	{
+		debug("[%d.%d] Waiting for the target's capacity before registering the block device\n", m_target.nShelf, m_target.nSlot);
+		return;
+	}
+
+	m_fBlockDeviceRegistered = TRUE;
+	m_pBlockDevice->registerService();
+}
+
+
+
 /*---------------------------------------------------------------------------
  * Inform our clients that we are now online
  ---------------------------------------------------------------------------*/
@@ -261,6 +568,13 @@ void AOE_CONTROLLER_NAME::cancel_command(bool fClean)
 
 	// Stop any commands that may be in process
 	executeEventCallouts( kATAOfflineEvent, kATADevice0DeviceID );
+
+	// The reads being cancelled haven't been filled in
+	bzero(m_aCacheFills, sizeof(m_aCacheFills));
+
+	cancel_queued_commands(err);
+	flush_coalesced_writes(err);
+	cancel_read_ahead(err);
 	if ( _currentCommand )
 		_currentCommand->state = IOATAController::kATAComplete;	
 
@@ -314,7 +628,18 @@ void AOE_CONTROLLER_NAME::handle_aoe_cmd(ifnet_t ifnet_receive, aoe_cfghdr_rd* p
 	setProperty(BUFFER_COUNT_PROPERTY, num);
 	num->release();
 
-	m_pProvider->set_max_outstanding(ifnet_receive, m_target.nShelf, m_nBufferCount);
+	m_pProvider->set_max_outstanding(ifnet_receive, TARGET_NUMBER(m_target.nShelf, m_target.nSlot), m_nBufferCount);
+
+	// The target may not be able to take as many sectors in a command as our interfaces could carry
+	if ( AOE_CFGHEADER_GETSCOUNT(pCfgHeader) && (AOE_CFGHEADER_GETSCOUNT(pCfgHeader)!=m_nTargetMaxSectors) )
+	{
+		m_nTargetMaxSectors = AOE_CFGHEADER_GETSCOUNT(pCfgHeader);
+		debug("[%d.%d] Target takes up to %d sectors per command\n", m_target.nShelf, m_target.nSlot, m_nTargetMaxSectors);
+		update_path_sizes();
+	}
+
+	// The target is answering, so this is a good time to probe any paths we haven't yet
+	schedule_path_probes();
 
 	switch ( AOE_CFGHEADER_GETCCMD(pCfgHeader) )
 	{
@@ -355,6 +680,9 @@ void AOE_CONTROLLER_NAME::handle_aoe_cmd(ifnet_t ifnet_receive, aoe_cfghdr_rd* p
 int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData, UInt32 Tag)
 {
 	bool fReadyToIssueInterrupt;
+	QueuedATACommand* pQueued;
+	IOATABusCommand* pQueuedCommand;
+	int nRet;
 	
 	fReadyToIssueInterrupt = FALSE;		// Only handled if command is outstanding
 
@@ -377,6 +705,10 @@ int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufDa
 		  AOE_ATAHEADER_GETLBA4(pATAHeader),
 		  AOE_ATAHEADER_GETLBA5(pATAHeader));
 	
+	// Path probes aren't part of any command
+	if ( handle_probe_response(pATAHeader, Tag) )
+		return 0;
+	
 	// Store this info in member variables as it'll be accessed later when the read state machine is accessed
 	m_ReceivedMBufCont = pMBufData ? mbuf_next(*pMBufData) : NULL;
 	m_pReceivedATAHeader = pATAHeader;
@@ -384,6 +716,19 @@ int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufDa
 	
 	m_unReceivedTag = Tag;
 
+	// Neither is read-ahead
+	if ( handle_read_ahead_response(pATAHeader, pMBufData, Tag) )
+		return 0;
+
+	// Responses to a queued command are handled with that command's state loaded in
+	pQueuedCommand = NULL;
+	pQueued = find_queued_command(Tag);
+	if ( pQueued )
+	{
+		pQueuedCommand = pQueued->pCommand;
+		load_queued_command(pQueued);
+	}
+
 	// At this point, we can pre-process the data (if necessary and possible)
 	if ( _currentCommand )
 	{
@@ -422,6 +767,12 @@ int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufDa
 			case kATAcmdWrite :
 			case kATAcmdWriteExtended :
 			{
+				if ( !mark_chunk_received() )
+				{
+					fReadyToIssueInterrupt = FALSE;
+					break;
+				}
+
 				if ( 0==m_nReadWriteRepliesRequired )
 					debugError("m_nReadWriteRepliesRequired is already zero, but received a response\n");
 				
@@ -451,6 +802,12 @@ int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufDa
 			}
 			case kATAcmdRead :
 			case kATAcmdReadExtended :
+				if ( !mark_chunk_received() )
+				{
+					fReadyToIssueInterrupt = FALSE;
+					break;
+				}
+
 				--m_nReadWriteRepliesRequired;
 				
 				completeDataRead(&fReadyToIssueInterrupt);
@@ -483,10 +840,149 @@ int AOE_CONTROLLER_NAME::ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufDa
 	if ( !fReadyToIssueInterrupt )
 		debug("Holding off on interrupt command as more replies are still expected\n");
 	
-	return fReadyToIssueInterrupt ? handleDeviceInterrupt() : 0;
+	nRet = fReadyToIssueInterrupt ? handleDeviceInterrupt() : 0;
+	
+	// If the command is still running, save its state until the next response (completeIO has released it otherwise)
+	if ( pQueuedCommand && (pQueuedCommand==_currentCommand) )
+	{
+		store_queued_command(pQueued);
+		_currentCommand = NULL;
+	}
+
+	return nRet;
+}
+
+
+/*---------------------------------------------------------------------------
+ * Answer the current command ourselves. It's used for commands that are not supported by the AoE specification,
+ * but are required for higher level drivers (ATA protocol). The response comes from a timer so it's handled
+ * after the command has finished being issued, on our own work loop
+ ---------------------------------------------------------------------------*/
+int AOE_CONTROLLER_NAME::fake_response(void)
+{
+	if ( NULL==m_pFakeResponseTimer )
+	{
+		if ( NULL==getWorkLoop() )
+			return -1;
+		
+		m_pFakeResponseTimer = IOTimerEventSource::timerEventSource(this, FakeResponseTimer);
+		
+		if ( m_pFakeResponseTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(m_pFakeResponseTimer)) )
+			CLEAN_RELEASE(m_pFakeResponseTimer);
+		
+		if ( NULL==m_pFakeResponseTimer )
+		{
+			debugError("[%d.%d] Unable to create the fake response timer\n", m_target.nShelf, m_target.nSlot);
+			return -1;
+		}
+	}
+	
+	return m_pFakeResponseTimer->setTimeoutMS(0);
+}
+
+
+
+void AOE_CONTROLLER_NAME::FakeResponseTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	aoe_atahdr_rd ATAHeader;
+	
+	debug("AOE_CONTROLLER_NAME::FakeResponseTimer\n");
+	
+	if ( pThis )
+	{
+		AOE_ATAHEADER_CLEAR(&ATAHeader);
+		ATAHeader.aa_scnt_cmdstat = 0x40<<8;			// Just requires the DRDY bit to be set high in the status register
+		
+		pThis->ata_response(&ATAHeader, NULL, 0);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Queue a response for our work loop. This runs on the interface filter's thread, which mustn't touch the target, so
+ * all it does is keep a copy of the frame (clusters are shared, not copied) and kick the receive timer.
+ * Returns FALSE if we can't take it (eg. we're being removed), the caller then handles it on the service's command gate
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::queue_response(mbuf_t m)
+{
+	IOTimerEventSource* pReceiveTimer;
+	mbuf_t Copy;
+	
+	if ( 0!=mbuf_copym(m, 0, MBUF_COPYALL, MBUF_DONTWAIT, &Copy) )
+		return FALSE;
+	
+	IOSimpleLockLock(m_pReceiveLock);
+	
+	pReceiveTimer = m_pReceiveTimer;
+	if ( NULL==pReceiveTimer )
+	{
+		IOSimpleLockUnlock(m_pReceiveLock);
+		mbuf_freem(Copy);
+		return FALSE;
+	}
+	
+	// If the work loop is this far behind, the frame is lost just as if it was dropped on the wire, and is resent
+	if ( m_nReceivedFrames>=MAX_QUEUED_RESPONSES )
+	{
+		IOSimpleLockUnlock(m_pReceiveLock);
+		mbuf_freem(Copy);
+		return TRUE;
+	}
+	
+	mbuf_setnextpkt(Copy, NULL);
+	if ( m_LastReceivedFrame )
+		mbuf_setnextpkt(m_LastReceivedFrame, Copy);
+	else
+		m_ReceivedFrames = Copy;
+	m_LastReceivedFrame = Copy;
+	++m_nReceivedFrames;
+	
+	// Hold the timer until it's set, uninit may be taking it away
+	pReceiveTimer->retain();
+	IOSimpleLockUnlock(m_pReceiveLock);
+	
+	pReceiveTimer->setTimeoutMS(0);
+	pReceiveTimer->release();
+	
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Run the queued responses. We're on our own work loop with the gate held, so this is the same as the service
+ * handling the frame on its command gate, except that targets on other loops carry on in parallel
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::ReceiveTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	mbuf_t ReceivedFrames;
+	mbuf_t m;
+	
+	if ( NULL==pThis )
+		return;
+	
+	IOSimpleLockLock(pThis->m_pReceiveLock);
+	ReceivedFrames = pThis->m_ReceivedFrames;
+	pThis->m_ReceivedFrames = pThis->m_LastReceivedFrame = NULL;
+	pThis->m_nReceivedFrames = 0;
+	IOSimpleLockUnlock(pThis->m_pReceiveLock);
+	
+	while ( ReceivedFrames )
+	{
+		m = ReceivedFrames;
+		ReceivedFrames = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+		
+		pThis->m_pProvider->ata_response_received(&m);
+		mbuf_freem(m);
+	}
 }
 
 
+
 /*---------------------------------------------------------------------------
  * Handle the reception of an identify command
  ---------------------------------------------------------------------------*/
@@ -607,12 +1103,14 @@ bool AOE_CONTROLLER_NAME::handle_identify(aoe_atahdr_rd* pATAHeader)
 			{
 				debugError("Device's capacity has changed!!!!\n");
 
-				// Forcibly remove the target from the list
-				m_pProvider->remove_target(m_target.nTargetNumber);
+				// Forcibly remove the target from the list (the provider does this on its own work loop, as the list is kept there)
+				m_fCapacityChanged = TRUE;
 			}
 
 			m_IdentifiedCapacity = NumSectors;
 			debug("Capacity: %llu\n", m_IdentifiedCapacity);
+
+			register_block_device();
 		}
 		else
 		{
@@ -818,7 +1316,7 @@ int AOE_CONTROLLER_NAME::set_config_string(const char* pszString, int nLength)
 		return -1;
 
 	// Initialise our mbuf
-	Tag = m_pProvider->next_tag();
+	Tag = m_pProvider->next_tag(m_nTagSlot);
 	if ( 0!=create_mbuf_for_transfer(&m, Tag, FALSE) )
 		return -1;
 	pAoEFullCfgHeader = MTOD(m, aoe_cfghdr_full*);
@@ -852,18 +1350,35 @@ int AOE_CONTROLLER_NAME::set_config_string(const char* pszString, int nLength)
 /*---------------------------------------------------------------------------
  * Attaches external data to an mbuf. This is mostly used for writing large amounts of data
  * to the AoE target device
+ *
+ * With a mapping, the new mbuf points straight at the mapped memory (holding a reference on the mapping
+ * until it's freed). Otherwise the data is copied into a newly allocated mbuf.
  ---------------------------------------------------------------------------*/
 //#define DEBUG_MBUF_ATTACH
-int AOE_CONTROLLER_NAME::attach_ext_to_mbuf(mbuf_t* pm, caddr_t MBufExtData, IOByteCount Size)
+int AOE_CONTROLLER_NAME::attach_ext_to_mbuf(mbuf_t* pm, caddr_t MBufExtData, IOByteCount Size, struct ClientMapping* pMapping)
 {
 	mbuf_t NewMBuf;
 	errno_t err;
 
-	err = mbuf_allocpacket(MBUF_WAITOK, Size, 0, &NewMBuf);
-	if ( 0!=err )
-		debugError("Trouble creating mbuf (err=%d)\n", err);
-	
-	err = mbuf_copyback(NewMBuf, 0, Size, MBufExtData, MBUF_WAITOK);
+	NewMBuf = NULL;
+	if ( pMapping )
+	{
+		OSIncrementAtomic(&pMapping->nReferences);
+		
+		err = mbuf_attachcluster(MBUF_WAITOK, MBUF_TYPE_DATA, &NewMBuf, MBufExtData, &AOE_CONTROLLER_NAME::cluster_free, Size, (caddr_t)pMapping);
+		
+		// cluster_free won't be called for an mbuf we didn't get
+		if ( 0!=err )
+			release_client_mapping(pMapping);
+	}
+	else
+	{
+		err = mbuf_allocpacket(MBUF_WAITOK, Size, 0, &NewMBuf);
+		if ( 0!=err )
+			debugError("Trouble creating mbuf (err=%d)\n", err);
+		
+		err = mbuf_copyback(NewMBuf, 0, Size, MBufExtData, MBUF_WAITOK);
+	}
 
 	if ( 0!=err )
 	{
@@ -1409,9 +1924,8 @@ IOReturn AOE_CONTROLLER_NAME::completeDataRead(bool* pfInterrupt)
 {
 	UInt16* pReceiveNetworkData;
 	IOByteCount bytesRemaining;
-	IOMemoryDescriptor* descriptor;
 	IOByteCount xfrPosition, thisPass, bufferBytes;
-	int nMaxTransferSize = m_nMaxSectorsPerTransfer*kATADefaultSectorSize;
+	int nChunk, nMaxTransferSize;
 	
 	// first check and see if data is remaining for transfer
 	bytesRemaining = _currentCommand->getByteCount() - _currentCommand->getActualTransfer();
@@ -1446,8 +1960,8 @@ IOReturn AOE_CONTROLLER_NAME::completeDataRead(bool* pfInterrupt)
 		return kATATimeoutErr;
 	}
 	
-	descriptor = _currentCommand->getBuffer();
-	
+	// NOTE: For AoE, asyncCommand maps the read buffer once for the whole command (see copy_to_client)
+	//
 	// The IOMemoryDescriptor may not have a logical address mapping (aka, 
 	// virtual address) within the kernel address space. This poses a problem 
 	// when doing PIO data transfers, which means the CPU is reading/writing 
@@ -1460,18 +1974,34 @@ IOReturn AOE_CONTROLLER_NAME::completeDataRead(bool* pfInterrupt)
 	// in the kernel space. IOMemoryDescriptor provides methods to read/write 
 	// the physical address it contains.
 	
-	debug("BASE TAG=%#x | RECEIVED TAG=%#x | position=%d * %d=%d\n", m_unReadBaseTag, m_unReceivedTag, (m_unReceivedTag-m_unReadBaseTag), _currentCommand->getTransferChunkSize(), (m_unReceivedTag-m_unReadBaseTag)*_currentCommand->getTransferChunkSize());
+	// The frames can be different sizes (see issue_block_transfer), so the chunk's position comes from the chunk offsets
+	nChunk = TAG_SEQUENCE_DIFF(m_unReceivedTag, m_unReadBaseTag);
+	
+	if ( (NULL==m_pChunkOffsets) || (nChunk>=m_nChunks) )
+	{
+		debugError("No position for chunk %d of the read\n", nChunk);
+		_currentCommand->state = kATAStatus;
+		return kATADeviceError;
+	}
 	
 	//	xfrPosition = _currentCommand->getPosition() + _currentCommand->getActualTransfer();
-	xfrPosition = (m_unReceivedTag-m_unReadBaseTag) * _currentCommand->getTransferChunkSize();
+	xfrPosition = m_pChunkOffsets[nChunk] * kATADefaultSectorSize;
+	
+	// This chunk runs up to the start of the next one
+	if ( nChunk+1 < m_nChunks )
+		nMaxTransferSize = (m_pChunkOffsets[nChunk+1]-m_pChunkOffsets[nChunk]) * kATADefaultSectorSize;
+	else
+		nMaxTransferSize = _currentCommand->getByteCount() - xfrPosition;
+	
+	debug("BASE TAG=%#x | RECEIVED TAG=%#x | chunk=%d | position=%d, size=%d\n", m_unReadBaseTag, m_unReceivedTag, nChunk, xfrPosition, nMaxTransferSize);
 	
 	thisPass = bytesRemaining;
 	
 	// pare down to the number of bytes between interrupts 
 	// to be transferred. Do this chunk, then pend the 
 	// next IRQ if bytes remain.
-	if( thisPass > _currentCommand->getTransferChunkSize() )
-		thisPass = _currentCommand->getTransferChunkSize();
+	if( thisPass > nMaxTransferSize )
+		thisPass = nMaxTransferSize;
 	
 	// Read data from the first mbuf
 	pReceiveNetworkData = &m_pReceivedATAHeader->aa_Data[0];
@@ -1493,7 +2023,7 @@ IOReturn AOE_CONTROLLER_NAME::completeDataRead(bool* pfInterrupt)
 		debug("'Reading' data:\n");
 		print_mem((UInt8*)pReceiveNetworkData, bufferBytes);
 		
-		descriptor->writeBytes(xfrPosition, (void*)(pReceiveNetworkData), bufferBytes);
+		copy_to_client(xfrPosition, (void*)(pReceiveNetworkData), bufferBytes);
 		
 		// update indicators
 		_currentCommand->setActualTransfer(_currentCommand->getActualTransfer() + bufferBytes);	
@@ -1522,7 +2052,7 @@ IOReturn AOE_CONTROLLER_NAME::completeDataRead(bool* pfInterrupt)
 		//debug("\Copying from Mbuf (base=%#x)\n", MTOD(m_ReceivedMBufCont, void*));
 		
 		print_mem(MTOD(m_ReceivedMBufCont, UInt8*), bufferBytes);
-		descriptor->writeBytes(xfrPosition, MTOD(m_ReceivedMBufCont, void*), bufferBytes);
+		copy_to_client(xfrPosition, MTOD(m_ReceivedMBufCont, void*), bufferBytes);
 		
 		// update indicators
 		_currentCommand->setActualTransfer(_currentCommand->getActualTransfer() + bufferBytes);	
@@ -1588,8 +2118,8 @@ int AOE_CONTROLLER_NAME::append_write_data(mbuf_t* pm)
 	// pare down to the number of bytes between interrupts 
 	// to be transferred. Do this chunk, then pend the 
 	// next IRQ if bytes remain.
-	if( thisPass > _currentCommand->getTransferChunkSize() )
-		thisPass = _currentCommand->getTransferChunkSize();
+	if( thisPass > m_nFrameSectors*kATADefaultSectorSize )
+		thisPass = m_nFrameSectors*kATADefaultSectorSize;
 	
 	// Update size of transfer and remaining data to transfer
 	while( thisPass > 0 )
@@ -1599,8 +2129,11 @@ int AOE_CONTROLLER_NAME::append_write_data(mbuf_t* pm)
 		debug("Mem transfer remaining=%d. This read/write: Position=%d, Size=%d\n", bytesRemaining, xfrPosition, bufferBytes);
 
 		// Have a look at the memory we will be writing
-		MBufExtData = (caddr_t) _doubleBuffer.logicalBuffer+xfrPosition;
-		print_mem((UInt8*)_doubleBuffer.logicalBuffer+xfrPosition, bufferBytes);
+		if ( m_pWriteMapping )
+			MBufExtData = (caddr_t) m_pWriteMapping->pMap->getVirtualAddress()+xfrPosition;
+		else
+			MBufExtData = (caddr_t) _doubleBuffer.logicalBuffer+xfrPosition;
+		print_mem((UInt8*)MBufExtData, bufferBytes);
 
 		// update indicators
 		xfrPosition += bufferBytes; 	
@@ -1611,33 +2144,142 @@ int AOE_CONTROLLER_NAME::append_write_data(mbuf_t* pm)
 
 	debug("%d bytes remaining for next WRITE.\n", bytesRemaining);
 
-	return attach_ext_to_mbuf(pm, MBufExtData, bufferBytes);
+	m_pProvider->add_write_statistics(bufferBytes, m_pWriteMapping ? 0 : bufferBytes);
+
+	return attach_ext_to_mbuf(pm, MBufExtData, bufferBytes, m_pWriteMapping);
 }
 
 
 
-void AOE_CONTROLLER_NAME::cluster_free(caddr_t add, u_int size, caddr_t add2)
+/*---------------------------------------------------------------------------
+ * Copy received data into the current command's buffer. With the buffer mapped, this is a straight copy
+ * rather than a writeBytes call (which has to find the right range of the descriptor each time)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::copy_to_client(IOByteCount Position, void* pData, IOByteCount Bytes)
 {
-	// memory is not freed after transfer
+	IOByteCount Length;
+	uint64_t StartTime;
+	uint64_t EndTime;
+	
+	clock_get_uptime(&StartTime);
+	
+	if ( NULL==m_pReadMapping )
+	{
+		Bytes = _currentCommand->getBuffer()->writeBytes(Position, pData, Bytes);
+	}
+	else
+	{
+		// Don't trust the position any more than writeBytes would
+		Length = m_pReadMapping->pMap->getLength();
+		Bytes = (Position<Length) ? MIN(Bytes, Length-Position) : 0;
+		
+		bcopy(pData, (UInt8*)m_pReadMapping->pMap->getVirtualAddress()+Position, Bytes);
+	}
+	
+	clock_get_uptime(&EndTime);
+	m_ReadBytesCopied += Bytes;
+	m_ReadCopyTime += EndTime-StartTime;
 }
 
 
+
 /*---------------------------------------------------------------------------
- *
+ * Called as each mbuf pointing at a write command's memory is freed. The memory belongs to our client,
+ * so we just drop the frame's reference on the mapping. This can be called from any context (the last reference
+ * is often dropped by the driver's transmit completion), so the mapping isn't released here if it was the last
  ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::cluster_free(caddr_t add, u_int size, caddr_t add2)
+{
+	struct ClientMapping* pMapping = (struct ClientMapping*) add2;
+	
+	// OSDecrementAtomic returns the previous value
+	if ( pMapping && (1==OSDecrementAtomic(&pMapping->nReferences)) )
+		pMapping->pOwner->release_mapping_later(pMapping);
+}
+
+
 
 /*---------------------------------------------------------------------------
- * Some useful debug code to check the contents of our packet
+ * Wire and map a command's memory so we can read/write it directly
  ---------------------------------------------------------------------------*/
-void AOE_CONTROLLER_NAME::print_mem(UInt8* pMem, int nSize)
+struct ClientMapping* AOE_CONTROLLER_NAME::map_client_buffer(IOMemoryDescriptor* pDescriptor)
 {
-#ifndef PRINT_DATA_MEMORY
-	nSize = 0;
-#endif
+	struct ClientMapping* pMapping;
 	
-	const int nBytePerRow = 16;
-	int n;
-	int nRow, nRows = nSize/nBytePerRow;
+	if ( NULL==pDescriptor )
+		return NULL;
+	
+	pMapping = (struct ClientMapping*) IOMalloc(sizeof(struct ClientMapping));
+	if ( NULL==pMapping )
+		return NULL;
+	
+	if ( kIOReturnSuccess!=pDescriptor->prepare() )
+	{
+		debugError("Unable to prepare client buffer\n");
+		IOFree(pMapping, sizeof(struct ClientMapping));
+		return NULL;
+	}
+	
+	pMapping->pMap = pDescriptor->map();
+	if ( NULL==pMapping->pMap )
+	{
+		debugError("Unable to map client buffer\n");
+		pDescriptor->complete();
+		IOFree(pMapping, sizeof(struct ClientMapping));
+		return NULL;
+	}
+	
+	pDescriptor->retain();
+	pMapping->pDescriptor = pDescriptor;
+	pMapping->nReferences = 1;			// Held by the controller until it's done with the command
+	pMapping->pOwner = m_pProvider;
+	pMapping->pNextReleased = NULL;
+	
+	return pMapping;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Drop the controller's reference. This is only called on our work loop, so the mapping can be released here
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::release_client_mapping(struct ClientMapping* pMapping)
+{
+	// OSDecrementAtomic returns the previous value
+	if ( 1==OSDecrementAtomic(&pMapping->nReferences) )
+		free_client_mapping(pMapping);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Unmap and unwire the client's memory. This has to be called from a thread that's allowed to block
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::free_client_mapping(struct ClientMapping* pMapping)
+{
+	CLEAN_RELEASE(pMapping->pMap);
+	pMapping->pDescriptor->complete();
+	CLEAN_RELEASE(pMapping->pDescriptor);
+	IOFree(pMapping, sizeof(struct ClientMapping));
+}
+
+
+/*---------------------------------------------------------------------------
+ *
+ ---------------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------------
+ * Some useful debug code to check the contents of our packet
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::print_mem(UInt8* pMem, int nSize)
+{
+#ifndef PRINT_DATA_MEMORY
+	nSize = 0;
+#endif
+	
+	const int nBytePerRow = 16;
+	int n;
+	int nRow, nRows = nSize/nBytePerRow;
 	
 	if ( nSize )
 		debug("print_mem(size=%d, rows=%d, leftover=%d)\n", nSize, nRows, nSize-nRows*nBytePerRow);
@@ -1699,7 +2341,7 @@ IOReturn AOE_CONTROLLER_NAME::issueCommand(void)
 	// Initialise our mbuf //
 	//---------------------//
 
-	Tag = m_pProvider->next_tag();
+	Tag = m_pProvider->next_tag(m_nTagSlot);
 	if ( 0!=create_mbuf_for_transfer(&m, Tag, TRUE) )
 		return -1;
 	pAoEFullATAHeader = MTOD(m, aoe_atahdr_full*);
@@ -1828,7 +2470,9 @@ IOReturn AOE_CONTROLLER_NAME::issueCommand(void)
 	//--------------------------//
 	//debugVerbose("Sending Data out (Tag=%#x)\n", Tag);
 
-	if ( -1==m_pProvider->send_ata_packet(this, m, Tag, get_target_info()) )
+	// Any error means the frame didn't go out (eg. the service had no queue records left). Failing the command
+	// lets it be retried, rather than waiting for it to time out on a frame that was never sent
+	if ( 0!=m_pProvider->send_ata_packet(this, m, Tag, get_target_info(), m_nFramePath) )
 		nRet = kATAErrDevBusy;
 
 	return nRet;
@@ -1864,7 +2508,7 @@ IOReturn AOE_CONTROLLER_NAME::handleBusReset(void)
 IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 {
 	const int nMaxTransferSize = m_nMaxSectorsPerTransfer*kATADefaultSectorSize;
-	int n, nNumSectorsPerTranser;
+	int nNumSectorsPerTranser;
 	IOMemoryDescriptor* descriptor;
 	IOReturn err;
 
@@ -1881,12 +2525,18 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 
 	nNumSectorsPerTranser = _currentCommand->getTransferChunkSize()/kATADefaultSectorSize;
 
-	// Set the chunk size to the min of the transfer size and the size we can squeeze into the ethernet packet
+	// Set the chunk size to the min of the transfer size and the largest frame we can send (issue_block_transfer sizes each frame for its path)
 	_currentCommand->setTransferChunkSize(MIN(nMaxTransferSize, _currentCommand->getByteCount()));
 	nNumSectorsPerTranser = _currentCommand->getTransferChunkSize()/kATADefaultSectorSize;
 
 	// Set to zero to indicate the start of a group of packets
 	m_unReadBaseTag = 0;
+
+	// None of this command's chunks have been received yet
+	if ( m_pReceivedChunks )
+		bzero(m_pReceivedChunks, m_nChunkBitmapWords*sizeof(UInt32));
+	m_nRetryChunk = 0;
+	m_fSinglePath = TRUE;
 	
 	// Bring write data into virtual memory
 	if( (_currentCommand->getFlags() & mATAFlagIOWrite ) == mATAFlagIOWrite )
@@ -1895,22 +2545,35 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 
 		debug("Transfering %d sectors per transfer (Chunk size=%d)\n", nNumSectorsPerTranser, _currentCommand->getTransferChunkSize());
 
-		if ( _currentCommand->getByteCount() > _doubleBuffer.bufferSize )
-			debugError("Double buffer is not large enough for write transfer (needs %d and only have %d)\n", _currentCommand->getByteCount(), _doubleBuffer.bufferSize);
-
-		debug("Copying %d bytes to double buffer\n", _currentCommand->getByteCount());
+		// Send the frames straight from the client's memory if we can map it, otherwise copy it to the double buffer
 		descriptor = _currentCommand->getBuffer();
-		ActualBytesCopied = descriptor->readBytes(0, (void*) _doubleBuffer.logicalBuffer, _currentCommand->getByteCount());
+		m_pWriteMapping = map_client_buffer(descriptor);
 		
-		if ( ActualBytesCopied != _currentCommand->getByteCount() )
-			debugError("Only %d bytes copied, but expected %d\n", ActualBytesCopied, _currentCommand->getByteCount());
+		if ( NULL==m_pWriteMapping )
+		{
+			if ( _currentCommand->getByteCount() > _doubleBuffer.bufferSize )
+				debugError("Double buffer is not large enough for write transfer (needs %d and only have %d)\n", _currentCommand->getByteCount(), _doubleBuffer.bufferSize);
+
+			debug("Copying %d bytes to double buffer\n", _currentCommand->getByteCount());
+			ActualBytesCopied = descriptor->readBytes(0, (void*) _doubleBuffer.logicalBuffer, _currentCommand->getByteCount());
+			
+			if ( ActualBytesCopied != _currentCommand->getByteCount() )
+				debugError("Only %d bytes copied, but expected %d\n", ActualBytesCopied, _currentCommand->getByteCount());
+
+			m_pProvider->add_write_statistics(0, ActualBytesCopied);
 
-		print_mem((UInt8*)_doubleBuffer.logicalBuffer, _currentCommand->getByteCount());
+			print_mem((UInt8*)_doubleBuffer.logicalBuffer, _currentCommand->getByteCount());
+		}
 		
 		// Reset status/error states
 		m_PreviousWriteStatus = 0;
 		m_PreviousWriteError = 0;
 	}
+	else if( (_currentCommand->getFlags() & mATAFlagIORead ) == mATAFlagIORead )
+	{
+		// Map the read buffer once, each response is then copied straight into it
+		m_pReadMapping = map_client_buffer(_currentCommand->getBuffer());
+	}
 
 	// For reads/writes, we extend the number of reads that occur for a single call of asyncCommand
 	if ( is_extended_command() )
@@ -1948,38 +2611,10 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 				debug("$$$$$ Beginning Block transfer $$$$$$$\n");
 				debug("$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$$\n");
 		
-				m_nReadWriteRepliesRequired = MAX(1, extLBA->getSectorCount16()/nNumSectorsPerTranser);
-				
-				debug("Transfer size is: %d - should call issueCommand() %d times\n", _currentCommand->getByteCount(), m_nReadWriteRepliesRequired + ((extLBA->getSectorCount16()-m_nReadWriteRepliesRequired*nNumSectorsPerTranser)>0?1:0));
-
 				if ( extLBA->getSectorCount16() != _currentCommand->getByteCount()/kATADefaultSectorSize )
 					debugError("Unexpected sector count\n");
 
-				for(n=0; n<_currentCommand->getByteCount()/(kATADefaultSectorSize*nNumSectorsPerTranser); n++)
-				{
-					extLBA->setSectorCount16(nNumSectorsPerTranser);	
-					err = issueCommand();
-					increment_address(extLBA, nNumSectorsPerTranser);
-				}
-				
-				// Transfer any left overs
-				if ( _currentCommand->getByteCount()-m_nReadWriteRepliesRequired*(kATADefaultSectorSize*nNumSectorsPerTranser) )
-				{
-					nNumSectorsPerTranser = (_currentCommand->getByteCount()-m_nReadWriteRepliesRequired*(kATADefaultSectorSize*nNumSectorsPerTranser))/kATADefaultSectorSize;
-
-					debug("NOTE: Transferring %d additional sectors...\n", nNumSectorsPerTranser);
-					if ( nNumSectorsPerTranser>0 )
-					{
-						++m_nReadWriteRepliesRequired;
-						extLBA->setSectorCount16(nNumSectorsPerTranser);
-						err = issueCommand();
-						increment_address(extLBA, nNumSectorsPerTranser);
-					}
-					else
-					{
-						debugError("Invalid sector number\n");
-					}
-				}
+				err = issue_block_transfer(extLBA, NULL);
 			}
 			else
 				err = issueCommand();
@@ -2017,39 +2652,9 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 				(tfRegs->ataTFCommand==kATAcmdWriteExtended)
 				)
 			{
-				m_nReadWriteRepliesRequired = MAX(1, tfRegs->ataTFSector/nNumSectorsPerTranser);
-				debug("Transfer size is: %d - should call issueCommand() %d times\n", _currentCommand->getByteCount(), m_nReadWriteRepliesRequired + ((tfRegs->ataTFSector-m_nReadWriteRepliesRequired*nNumSectorsPerTranser)>0?1:0));
-				
-				if ( tfRegs->ataTFSector != _currentCommand->getByteCount()/kATADefaultSectorSize )
-					debugError("Unexpected sector count\n");
-				
 				debug("Overriding count of %d\n", tfRegs->ataTFCount);
 
-				for(n=0; n<_currentCommand->getByteCount()/(kATADefaultSectorSize*nNumSectorsPerTranser); n++)
-				{
-					tfRegs->ataTFCount = nNumSectorsPerTranser;
-					err = issueCommand();
-					increment_address(tfRegs, nNumSectorsPerTranser);
-				}
-				
-				// Transfer any left overs
-				if ( _currentCommand->getByteCount()-m_nReadWriteRepliesRequired*(kATADefaultSectorSize*nNumSectorsPerTranser) )
-				{
-					nNumSectorsPerTranser = (_currentCommand->getByteCount()-m_nReadWriteRepliesRequired*(kATADefaultSectorSize*nNumSectorsPerTranser))/kATADefaultSectorSize;
-					
-					debug("NOTE: Transferring %d additional sectors...\n", nNumSectorsPerTranser);
-					if ( nNumSectorsPerTranser>0 )
-					{
-						++m_nReadWriteRepliesRequired;
-						tfRegs->ataTFCount = nNumSectorsPerTranser;
-						err = issueCommand();
-						increment_address(tfRegs, nNumSectorsPerTranser);
-					}
-					else
-					{
-						debugError("Invalid sector number\n");
-					}
-				}
+				err = issue_block_transfer(NULL, tfRegs);
 			}
 			else
 				err = issueCommand();
@@ -2058,6 +2663,15 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 			err = issueCommand();
 	}
 	
+	m_nChunks = m_nReadWriteRepliesRequired;
+	
+	// The frames hold their own references on the mapping now
+	if ( m_pWriteMapping )
+	{
+		release_client_mapping(m_pWriteMapping);
+		m_pWriteMapping = NULL;
+	}
+	
 	if ( err )
 	{
 		debugError("asyncCommand - Failed to issueCommand\n");
@@ -2084,55 +2698,1857 @@ IOReturn AOE_CONTROLLER_NAME::asyncCommand(void)
 	}
 #endif
 	
-	if( (_currentCommand->getFlags() & mATAFlagIORead ) == mATAFlagIORead )
-	{
-		// read data on next phase.
-		_currentCommand->state = IOATAController::kATADataTx;
-		debugVerbose("asyncCommand complete for this state. - Need to read data after next AoE packet is received\n");
-	}
-	else
-	{
-		// this is a PIO non-data command or a DMA command the next step is to check status.
-		//debugVerbose("asyncCommand - PIO non-data command. Need to check status...\n");
-		debugVerbose("asyncCommand - writing data. Need to check status after write is complete...\n");
-		_currentCommand->state = IOATAController::kATAStatus;	
-	}
+	if( (_currentCommand->getFlags() & mATAFlagIORead ) == mATAFlagIORead )
+	{
+		// read data on next phase.
+		_currentCommand->state = IOATAController::kATADataTx;
+		debugVerbose("asyncCommand complete for this state. - Need to read data after next AoE packet is received\n");
+	}
+	else
+	{
+		// this is a PIO non-data command or a DMA command the next step is to check status.
+		//debugVerbose("asyncCommand - PIO non-data command. Need to check status...\n");
+		debugVerbose("asyncCommand - writing data. Need to check status after write is complete...\n");
+		_currentCommand->state = IOATAController::kATAStatus;	
+	}
+	
+	return err;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Split a read/write into frames and send them. Each frame is sized for the path it's going out on, so
+ * the frames of one command can be different sizes. Where each frame starts is kept in the command's chunk
+ * offsets, which is how the responses are put back in the right place.
+ ---------------------------------------------------------------------------*/
+IOReturn AOE_CONTROLLER_NAME::issue_block_transfer(IOExtendedLBA* extLBA, ataTaskFile* tfRegs)
+{
+	int nSectors, nSectorsSent;
+	int nFirstPath;
+	IOReturn err;
+
+	err = kATANoErr;
+	nFirstPath = -1;
+	nSectors = _currentCommand->getByteCount()/kATADefaultSectorSize;
+	nSectorsSent = 0;
+	m_nReadWriteRepliesRequired = 0;
+	
+	if ( NULL==m_pChunkOffsets )
+	{
+		debugError("Chunk tables have been released, unable to transfer\n");
+		return kATAErrDevBusy;
+	}
+
+	debug("Transfer size is: %d bytes (%d sectors)\n", _currentCommand->getByteCount(), nSectors);
+
+	while ( nSectorsSent < nSectors )
+	{
+		if ( m_nReadWriteRepliesRequired >= m_nChunkTableSize )
+		{
+			debugError("Transfer needs more than %d frames\n", m_nChunkTableSize);
+			err = kATAErrUnknownType;
+			break;
+		}
+		
+		// Pick the path first, that decides how large the frame can be
+		m_nFramePath = m_pProvider->next_interface(&m_target);
+		m_nFrameSectors = (m_nFramePath<0) ? m_nMaxSectorsPerTransfer : m_anPathSectors[m_nFramePath];
+		m_nFrameSectors = MIN(m_nFrameSectors, nSectors-nSectorsSent);
+		
+		if ( 0==m_nReadWriteRepliesRequired )
+			nFirstPath = m_nFramePath;
+		else if ( m_nFramePath!=nFirstPath )
+			m_fSinglePath = FALSE;
+		
+		m_pChunkOffsets[m_nReadWriteRepliesRequired] = nSectorsSent;
+		++m_nReadWriteRepliesRequired;
+		
+		if ( extLBA )
+			extLBA->setSectorCount16(m_nFrameSectors);
+		else
+			tfRegs->ataTFCount = m_nFrameSectors;
+		
+		err = issueCommand();
+
+		if ( extLBA )
+			increment_address(extLBA, m_nFrameSectors);
+		else
+			increment_address(tfRegs, m_nFrameSectors);
+		
+		nSectorsSent += m_nFrameSectors;
+		
+		if ( err )
+			break;
+	}
+	
+	debug("Sent %d sectors in %d frames\n", nSectorsSent, m_nReadWriteRepliesRequired);
+	
+	m_nFramePath = -1;
+	
+	return err;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Create the double buffer for drive read/writes
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::allocateDoubleBuffer( void )
+{
+    debug("IOATAController::allocateDoubleBuffer(%d)\n", m_nMaxTransferSize);
+	
+	_doubleBuffer.logicalBuffer = (IOLogicalAddress) IOMallocContiguous(m_nMaxTransferSize, 4096 /*=alignment*/, &_doubleBuffer.physicalBuffer);
+	
+	if( _doubleBuffer.logicalBuffer == 0L)
+		return false;
+	
+	_doubleBuffer.bufferSize = m_nMaxTransferSize;
+	
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------
+ * Determine if we're able to send more commands. We only fail this if there
+ * are no interfaces available, otherwise, we let the base class handle it
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::busCanDispatch( void )
+{
+	bool fCanDispatch;
+	
+	fCanDispatch = m_pProvider && m_pProvider->interfaces_active(&m_target) && super::busCanDispatch();
+
+
+	debugVerbose("busCanDispatch() - returning %d\n", fCanDispatch);
+	
+	return fCanDispatch;
+}
+
+#pragma mark -
+#pragma mark Queued commands
+
+/*---------------------------------------------------------------------------
+ * IOATAController only runs one command at a time. In queued mode, read/write commands are taken off its
+ * queue here and run alongside each other (up to the queue depth), each with its own range of tags.
+ * Anything else waits for the queued commands to finish and then runs through the base class as normal.
+ ---------------------------------------------------------------------------*/
+IOReturn AOE_CONTROLLER_NAME::dispatchNext( void )
+{
+	IOATABusCommand* pCommand;
+	
+	// Queued mode needs consecutive tags, which we only get from our own tag slot
+	if ( ((m_nQueueDepth<=1) || (0==m_nTagSlot)) && (0==m_nQueued) )
+		return super::dispatchNext();
+	
+	// A command running through the base class has the bus to itself
+	if ( _currentCommand )
+		return kATAErrDevBusy;
+	
+	if ( m_pDeferredCommand )
+		return m_nQueued ? kATAErrDevBusy : super::dispatchNext();
+	
+	if ( (m_nQueued>=m_nQueueDepth) || (0==m_nTagSlot) || !busCanDispatch() )
+		return kATAErrDevBusy;
+	
+	pCommand = next_command();
+	if ( NULL==pCommand )
+		return kATAQueueEmpty;
+	
+	// Anything that touches sectors a write-back write hasn't finished with waits for it too, as does a command
+	// whose frames won't fit in the sequence numbers left in our tag slot
+	if ( !is_queueable(pCommand) || overlaps_write_back(pCommand) || !sequence_space_available(pCommand) )
+	{
+		m_pDeferredCommand = pCommand;
+		return m_nQueued ? kATAErrDevBusy : super::dispatchNext();
+	}
+	
+	if ( start_write_back(pCommand) )
+		return kATANoErr;
+	
+	start_queued_command(pCommand);
+	return kATANoErr;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * A command that was held back by dispatchNext is handed to the base class first
+ ---------------------------------------------------------------------------*/
+IOATABusCommand* AOE_CONTROLLER_NAME::dequeueFirstCommand( void )
+{
+	IOATABusCommand* pCommand;
+	
+	if ( m_pDeferredCommand )
+	{
+		pCommand = m_pDeferredCommand;
+		m_pDeferredCommand = NULL;
+		return pCommand;
+	}
+	
+	return next_command();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Release a queued command's slot before the base class completes it (and dispatches the next command)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::completeIO( IOReturn commandResult )
+{
+	int n;
+	
+	// The command's read buffer won't be written again
+	if ( m_pReadMapping )
+	{
+		release_client_mapping(m_pReadMapping);
+		m_pReadMapping = NULL;
+	}
+	
+	if ( m_ReadBytesCopied )
+	{
+		m_pProvider->add_read_copy_statistics(m_ReadBytesCopied, m_ReadCopyTime);
+		m_ReadBytesCopied = 0;
+		m_ReadCopyTime = 0;
+	}
+	
+	if ( _currentCommand && m_nQueued )
+		for (n=0; n<numberof(m_aQueued); n++)
+			if ( m_aQueued[n].pCommand==_currentCommand )
+			{
+				m_aQueued[n].pCommand = NULL;
+				--m_nQueued;
+				break;
+			}
+	
+	// A read that went to the target is kept in the read cache
+	fill_read_cache(commandResult);
+	
+	// A write-back write that failed is reported on the next flush
+	if ( _currentCommand && (kATANoErr==commandResult) && (kATANoErr!=m_WriteBackError) && is_flush(_currentCommand) )
+	{
+		debugError("[%d.%d] Failing flush, an earlier write failed (%#x)\n", m_target.nShelf, m_target.nSlot, m_WriteBackError);
+		commandResult = m_WriteBackError;
+		m_WriteBackError = kATANoErr;
+	}
+	
+	// Writes that were merged into this one finish with it
+	complete_coalesced_writes(commandResult);
+	
+	super::completeIO(commandResult);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Only block reads and writes are run in queued mode
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::is_queueable(IOATABusCommand* pCommand)
+{
+	if ( (kATAFnExecIO!=pCommand->getOpcode()) || (NULL==pCommand->getBuffer()) )
+		return FALSE;
+	
+	switch ( ata_command(pCommand) )
+	{
+		case kATAcmdRead:
+		case kATAcmdReadExtended:
+		case kATAcmdReadDMA:
+		case kATAcmdReadDMAExtended:
+		case kATAcmdWrite:
+		case kATAcmdWriteExtended:
+		case kATAcmdWriteDMA:
+		case kATAcmdWriteDMAExtended:
+			return TRUE;
+	}
+	
+	return FALSE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Whether the frames of a command can be sent alongside those of the queued commands without their tags being
+ * confused. A command never needs more frames than it has sectors, so that's what's allowed for.
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::sequence_space_available(IOATABusCommand* pCommand)
+{
+	int n;
+	int nFrames;
+	
+	nFrames = pCommand->getByteCount()/kATADefaultSectorSize;
+	
+	for (n=0; n<MAX_QUEUE_DEPTH; n++)
+		if ( m_aQueued[n].pCommand )
+			nFrames += m_aQueued[n].nFrames;
+	
+	return nFrames<=QUEUED_MAX_FRAMES;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The ATA command a command will send (from whichever registers it uses)
+ ---------------------------------------------------------------------------*/
+UInt8 AOE_CONTROLLER_NAME::ata_command(IOATABusCommand* pCommand)
+{
+	IOATABusCommand* pPrevious;
+	IOExtendedLBA* extLBA;
+	ataTaskFile* tfRegs;
+	UInt8 Command;
+	
+	// is_extended_command works on the current command
+	pPrevious = _currentCommand;
+	_currentCommand = pCommand;
+	
+	Command = 0;
+	if ( is_extended_command() )
+	{
+		extLBA = pCommand->getExtendedLBA();
+		if ( extLBA )
+			Command = extLBA->getCommand();
+	}
+	else
+	{
+		tfRegs = pCommand->getTaskFilePtr();
+		if ( tfRegs )
+			Command = tfRegs->ataTFCommand;
+	}
+	
+	_currentCommand = pPrevious;
+	
+	return Command;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Send all the frames for a queued command. The write data is copied into each mbuf as it's built, so
+ * the double buffer is free for the next command as soon as this returns
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::start_queued_command(IOATABusCommand* pCommand)
+{
+	QueuedATACommand* pQueued;
+	IOReturn err;
+	int n;
+	
+	pQueued = NULL;
+	for (n=0; n<numberof(m_aQueued); n++)
+		if ( NULL==m_aQueued[n].pCommand )
+		{
+			pQueued = &m_aQueued[n];
+			break;
+		}
+	
+	pQueued->pCommand = pCommand;
+	++m_nQueued;
+	
+	_currentCommand = pCommand;
+	m_PreviousWriteStatus = 0;
+	m_PreviousWriteError = 0;
+	m_pReceivedChunks = pQueued->pReceivedChunks;
+	m_pChunkOffsets = pQueued->pChunkOffsets;
+	
+	clock_get_uptime(&pQueued->TimeStarted);
+	pQueued->nTimeoutMS = pCommand->getTimeoutMS() ? pCommand->getTimeoutMS() : QUEUED_DEFAULT_TIMEOUT_MS;
+	
+	err = asyncCommand();
+	
+	pQueued->BaseTag = m_unReadBaseTag;
+	pQueued->nFrames = m_nReadWriteRepliesRequired;
+	store_queued_command(pQueued);
+	
+	debugVerbose("[%d.%d] Queued command %d/%d started (base tag=%#x, %d frames)\n", m_target.nShelf, m_target.nSlot, m_nQueued, m_nQueueDepth, pQueued->BaseTag, pQueued->nFrames);
+	
+	if ( err )
+	{
+		// completeIO releases the slot, the command's read mapping and clears the current command
+		debugError("Failed to start queued command\n");
+		load_queued_command(pQueued);
+		_currentCommand->state = IOATAController::kATAComplete;
+		completeIO(err);
+	}
+	else
+	{
+		_currentCommand = NULL;
+		
+		if ( !start_queue_timer() )
+			debugError("[%d.%d] Unable to start the queue timer, a lost command won't time out\n", m_target.nShelf, m_target.nSlot);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Find the queued command a response belongs to from the range of tags it was sent with
+ ---------------------------------------------------------------------------*/
+QueuedATACommand* AOE_CONTROLLER_NAME::find_queued_command(UInt32 Tag)
+{
+	int n;
+	
+	if ( 0==m_nQueued )
+		return NULL;
+	
+	for (n=0; n<numberof(m_aQueued); n++)
+		if ( m_aQueued[n].pCommand &&
+			((Tag & ~TAG_SEQUENCE_MASK)==(m_aQueued[n].BaseTag & ~TAG_SEQUENCE_MASK)) &&
+			(TAG_SEQUENCE_DIFF(Tag, m_aQueued[n].BaseTag) < m_aQueued[n].nFrames) )
+			return &m_aQueued[n];
+	
+	return NULL;
+}
+
+
+
+void AOE_CONTROLLER_NAME::load_queued_command(QueuedATACommand* pQueued)
+{
+	_currentCommand = pQueued->pCommand;
+	m_unReadBaseTag = pQueued->BaseTag;
+	m_nReadWriteRepliesRequired = pQueued->nRepliesRequired;
+	m_PreviousWriteStatus = pQueued->PreviousWriteStatus;
+	m_PreviousWriteError = pQueued->PreviousWriteError;
+	m_pReadMapping = pQueued->pReadMapping;
+	m_pReceivedChunks = pQueued->pReceivedChunks;
+	m_pChunkOffsets = pQueued->pChunkOffsets;
+	m_nChunks = pQueued->nFrames;
+	m_nRetryChunk = pQueued->nRetryChunk;
+	m_fSinglePath = pQueued->fSinglePath;
+}
+
+
+
+void AOE_CONTROLLER_NAME::store_queued_command(QueuedATACommand* pQueued)
+{
+	pQueued->nRepliesRequired = m_nReadWriteRepliesRequired;
+	pQueued->PreviousWriteStatus = m_PreviousWriteStatus;
+	pQueued->PreviousWriteError = m_PreviousWriteError;
+	pQueued->pReadMapping = m_pReadMapping;
+	pQueued->nRetryChunk = m_nRetryChunk;
+	pQueued->fSinglePath = m_fSinglePath;
+	
+	// The mapping belongs to the queued command now, and the single command goes back to its own chunk tables
+	m_pReadMapping = NULL;
+	m_pReceivedChunks = m_pChunkBitmaps;
+	m_pChunkOffsets = m_pChunkOffsetTables;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Complete a queued command without waiting for the rest of its responses
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::complete_queued_command(QueuedATACommand* pQueued, IOReturn err)
+{
+	IOATABusCommand* pPrevious;
+	
+	pPrevious = _currentCommand;
+	load_queued_command(pQueued);
+	_currentCommand->state = IOATAController::kATAComplete;
+	completeIO(err);
+	
+	if ( NULL==_currentCommand )
+		_currentCommand = pPrevious;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Complete every queued command with an error (used when the target goes away)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::cancel_queued_commands(IOReturn err)
+{
+	IOATABusCommand* apCommands[MAX_QUEUE_DEPTH];
+	int n;
+	
+	// Take a copy, completing a command may start another
+	for (n=0; n<numberof(m_aQueued); n++)
+		apCommands[n] = m_aQueued[n].pCommand;
+	
+	for (n=0; n<numberof(m_aQueued); n++)
+	{
+		if ( (NULL==apCommands[n]) || (apCommands[n]!=m_aQueued[n].pCommand) )
+			continue;
+		
+		complete_queued_command(&m_aQueued[n], err);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The timer runs while there are queued commands. It isn't restarted as each command starts, or a busy
+ * target would keep pushing it back and a lost command would never be noticed
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::start_queue_timer(void)
+{
+	if ( m_fQueueTimerRunning )
+		return TRUE;
+	
+	if ( NULL==m_pQueueTimer )
+	{
+		if ( NULL==getWorkLoop() )
+			return FALSE;
+		
+		m_pQueueTimer = IOTimerEventSource::timerEventSource(this, QueueTimer);
+		
+		if ( m_pQueueTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(m_pQueueTimer)) )
+			CLEAN_RELEASE(m_pQueueTimer);
+		
+		if ( NULL==m_pQueueTimer )
+			return FALSE;
+	}
+	
+	m_fQueueTimerRunning = TRUE;
+	m_pQueueTimer->setTimeoutMS(QUEUED_TIMEOUT_CHECK_MS);
+	
+	return TRUE;
+}
+
+
+
+void AOE_CONTROLLER_NAME::QueueTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	
+	if ( pThis )
+	{
+		pThis->m_fQueueTimerRunning = FALSE;
+		pThis->check_queued_timeouts();
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Fail any queued command that's run past its timeout. This is what IOATAController's own timer does for
+ * _currentCommand, the service may have given up on one of its frames (see get_max_timeout_before_drop)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::check_queued_timeouts(void)
+{
+	IOATABusCommand* apCommands[MAX_QUEUE_DEPTH];
+	int n;
+	
+	// Take a copy, completing a command may start another
+	for (n=0; n<numberof(m_aQueued); n++)
+		apCommands[n] = m_aQueued[n].pCommand;
+	
+	for (n=0; n<numberof(m_aQueued); n++)
+	{
+		if ( (NULL==apCommands[n]) || (apCommands[n]!=m_aQueued[n].pCommand) )
+			continue;
+		
+		if ( time_since_now_ms(m_aQueued[n].TimeStarted) < m_aQueued[n].nTimeoutMS )
+			continue;
+		
+		debugError("[%d.%d] Queued command (base tag=%#x) timed out after %dms\n", m_target.nShelf, m_target.nSlot, m_aQueued[n].BaseTag, m_aQueued[n].nTimeoutMS);
+		complete_queued_command(&m_aQueued[n], kATATimeoutErr);
+	}
+	
+	if ( m_nQueued )
+		start_queue_timer();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set the number of read/write commands that can be outstanding at once
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::set_queue_depth(int nQueueDepth)
+{
+	m_nQueueDepth = MIN(MAX(nQueueDepth, 1), MAX_QUEUE_DEPTH);
+	
+	debug("[%d.%d] Queue depth set to %d\n", m_target.nShelf, m_target.nSlot, m_nQueueDepth);
+}
+
+
+
+#pragma mark -
+#pragma mark Write coalescing
+
+/*---------------------------------------------------------------------------
+ * Filesystem flushes arrive as lots of small writes to consecutive sectors. Rather than sending each one as its
+ * own command, writes to adjacent sectors are gathered up as they're taken off the queue and sent as one transfer.
+ * When the queue runs dry, the gathered writes wait a short while (m_nWriteCoalesce_us) for the next write
+ * to turn up. Anything else that's taken off the queue ends the gathering and goes straight after it.
+ *
+ * Reads are checked against the read-ahead here too (see "Read-ahead")
+ ---------------------------------------------------------------------------*/
+IOATABusCommand* AOE_CONTROLLER_NAME::next_command(void)
+{
+	IOATABusCommand* pCommand;
+	
+	// Completing a read below can queue and dispatch another command, that waits for the loop to get to it
+	if ( m_fInNextCommand )
+		return NULL;
+	
+	// A read that gave up waiting for read-ahead goes before anything that was queued after it
+	if ( m_ReadAhead.pReleased )
+	{
+		pCommand = m_ReadAhead.pReleased;
+		m_ReadAhead.pReleased = NULL;
+		return pCommand;
+	}
+	
+	// and nothing can overtake it while it's waiting
+	if ( m_ReadAhead.pWaiting )
+		return NULL;
+	
+	// Writes that couldn't be merged go out one at a time, in order
+	if ( m_nUnmergedWrites )
+	{
+		pCommand = m_Gathering.apCommands[m_nUnmergedWrites++];
+		
+		if ( m_nUnmergedWrites==m_Gathering.nCommands )
+		{
+			m_Gathering.nCommands = 0;
+			m_nUnmergedWrites = 0;
+		}
+		
+		return pCommand;
+	}
+	
+	m_fInNextCommand = TRUE;
+	
+	for (;;)
+	{
+		if ( m_pLookahead )
+		{
+			pCommand = m_pLookahead;
+			m_pLookahead = NULL;
+		}
+		else
+		{
+			pCommand = super::dequeueFirstCommand();
+		}
+		
+		if ( NULL==pCommand )
+			break;
+		
+		if ( fail_after_write_back(pCommand) )
+			continue;
+		
+		// Anything read ahead of a write (or cached) may not match the disk any more
+		if ( alters_data(pCommand) )
+		{
+			discard_read_ahead();
+			invalidate_read_cache(pCommand);
+		}
+		
+		if ( gather_write(pCommand) )
+			continue;
+		
+		if ( m_Gathering.nCommands )
+		{
+			m_pLookahead = pCommand;
+			pCommand = finish_gathering();
+			break;
+		}
+		
+		// Reads that have been read ahead are completed (or wait) here
+		if ( !handle_read(pCommand) )
+			break;
+		
+		pCommand = NULL;
+		if ( m_ReadAhead.pWaiting )
+			break;
+	}
+	
+	m_fInNextCommand = FALSE;
+	
+	if ( pCommand || m_ReadAhead.pWaiting || (0==m_Gathering.nCommands) )
+		return pCommand;
+	
+	// Give the next write a chance to turn up (unless there's no room for it anyway)
+	if ( !m_fCoalesceExpired && coalesce_has_room(m_Gathering.nCommands, m_Gathering.Bytes, m_nMaxTransferSize) && start_coalesce_timer() )
+		return NULL;
+	
+	return finish_gathering();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Add a command to the writes being gathered. Returns FALSE if it can't be merged with them (or isn't a write)
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::gather_write(IOATABusCommand* pCommand)
+{
+	IOExtendedLBA* extLBA;
+	IOByteCount Bytes;
+	
+	if ( (m_nWriteCoalesce_us<=0) || (kATAFnExecIO!=pCommand->getOpcode()) || (NULL==pCommand->getBuffer()) )
+		return FALSE;
+	
+	// Only 48-bit writes are merged, the sector count of the others only goes up to 256
+	if ( !(pCommand->getFlags() & mATAFlagIOWrite) || !(pCommand->getFlags() & mATAFlag48BitLBA) )
+		return FALSE;
+	
+	extLBA = pCommand->getExtendedLBA();
+	if ( (NULL==extLBA) || ((kATAcmdWriteExtended!=extLBA->getCommand()) && (kATAcmdWriteDMAExtended!=extLBA->getCommand())) )
+		return FALSE;
+	
+	// The buffers are joined end to end, so each command has to use all of its own
+	Bytes = pCommand->getByteCount();
+	if ( (0==Bytes) || (0!=pCommand->getPosition()) || (Bytes!=pCommand->getBuffer()->getLength()) || (extLBA->getSectorCount16()!=Bytes/kATADefaultSectorSize) )
+		return FALSE;
+	
+	if ( m_Gathering.nCommands )
+	{
+		if ( (pCommand->getUnit()!=m_Gathering.apCommands[0]->getUnit()) ||
+			!coalesce_can_add(m_Gathering.nCommands, m_Gathering.NextLBA, m_Gathering.Bytes, extended_address(extLBA), Bytes, m_nMaxTransferSize) )
+			return FALSE;
+	}
+	else
+	{
+		m_Gathering.Bytes = 0;
+		m_Gathering.NextLBA = extended_address(extLBA);
+		m_fCoalesceExpired = FALSE;
+	}
+	
+	m_Gathering.apCommands[m_Gathering.nCommands++] = pCommand;
+	m_Gathering.Bytes += Bytes;
+	m_Gathering.NextLBA += Bytes/kATADefaultSectorSize;
+	
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Turn the gathered writes into a single transfer carried by the first of them, and return that command
+ ---------------------------------------------------------------------------*/
+IOATABusCommand* AOE_CONTROLLER_NAME::finish_gathering(void)
+{
+	IOMemoryDescriptor* apBuffers[MAX_COALESCED_WRITES];
+	struct CoalescedWrite* pMerged;
+	IOATABusCommand* pPrimary;
+	IOExtendedLBA* extLBA;
+	int n;
+	
+	if ( m_fCoalesceTimerRunning )
+	{
+		m_pCoalesceTimer->cancelTimeout();
+		m_fCoalesceTimerRunning = FALSE;
+	}
+	
+	pPrimary = m_Gathering.apCommands[0];
+	
+	if ( 1==m_Gathering.nCommands )
+	{
+		m_Gathering.nCommands = 0;
+		return pPrimary;
+	}
+	
+	// There's never more merged transfers in flight than commands, so there's always a free one
+	pMerged = NULL;
+	for (n=0; n<numberof(m_aCoalesced); n++)
+		if ( 0==m_aCoalesced[n].nCommands )
+		{
+			pMerged = &m_aCoalesced[n];
+			break;
+		}
+	
+	for (n=0; n<m_Gathering.nCommands; n++)
+		apBuffers[n] = m_Gathering.apCommands[n]->getBuffer();
+	
+	m_Gathering.pBuffer = pMerged ? IOMultiMemoryDescriptor::withDescriptors(apBuffers, m_Gathering.nCommands, kIODirectionOut, false) : NULL;
+	
+	if ( NULL==m_Gathering.pBuffer )
+	{
+		debugError("[%d.%d] Unable to merge %d writes, sending them separately\n", m_target.nShelf, m_target.nSlot, m_Gathering.nCommands);
+		m_nUnmergedWrites = 1;
+		return pPrimary;
+	}
+	
+	extLBA = pPrimary->getExtendedLBA();
+	
+	m_Gathering.pOriginalBuffer = pPrimary->getBuffer();
+	m_Gathering.OriginalByteCount = pPrimary->getByteCount();
+	m_Gathering.OriginalSectors = extLBA->getSectorCount16();
+	
+	pPrimary->setBuffer(m_Gathering.pBuffer);
+	pPrimary->setByteCount(m_Gathering.Bytes);
+	extLBA->setSectorCount16(m_Gathering.Bytes/kATADefaultSectorSize);
+	
+	debugVerbose("[%d.%d] Merged %d writes into a transfer of %d sectors\n", m_target.nShelf, m_target.nSlot, m_Gathering.nCommands, extLBA->getSectorCount16());
+	m_pProvider->add_coalesced_writes(m_Gathering.nCommands);
+	
+	*pMerged = m_Gathering;
+	m_Gathering.nCommands = 0;
+	
+	return pPrimary;
+}
+
+
+
+bool AOE_CONTROLLER_NAME::start_coalesce_timer(void)
+{
+	if ( m_fCoalesceTimerRunning )
+		return TRUE;
+	
+	if ( NULL==m_pCoalesceTimer )
+	{
+		if ( NULL==getWorkLoop() )
+			return FALSE;
+		
+		m_pCoalesceTimer = IOTimerEventSource::timerEventSource(this, CoalesceTimer);
+		
+		if ( m_pCoalesceTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(m_pCoalesceTimer)) )
+			CLEAN_RELEASE(m_pCoalesceTimer);
+		
+		if ( NULL==m_pCoalesceTimer )
+		{
+			debugError("[%d.%d] Unable to create the coalescing timer, writes will only be merged if they're already queued\n", m_target.nShelf, m_target.nSlot);
+			return FALSE;
+		}
+	}
+	
+	m_fCoalesceTimerRunning = TRUE;
+	m_pCoalesceTimer->setTimeoutUS(m_nWriteCoalesce_us);
+	
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The gathered writes have waited long enough, send them with whatever they've picked up
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::CoalesceTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	
+	if ( pThis )
+	{
+		pThis->m_fCoalesceTimerRunning = FALSE;
+		pThis->m_fCoalesceExpired = TRUE;
+		pThis->dispatchNext();
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * If the current command carried merged writes, give it its own buffer back and complete the others with it.
+ * The data went out in order, so whatever was transferred is shared out from the first command on.
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::complete_coalesced_writes(IOReturn commandResult)
+{
+	struct CoalescedWrite* pMerged;
+	IOATABusCommand* pCommand;
+	IOByteCount Transferred, Bytes;
+	UInt8 Status, Error;
+	int n;
+	
+	if ( NULL==_currentCommand )
+		return;
+	
+	pMerged = NULL;
+	for (n=0; n<numberof(m_aCoalesced); n++)
+		if ( m_aCoalesced[n].nCommands && (m_aCoalesced[n].apCommands[0]==_currentCommand) )
+		{
+			pMerged = &m_aCoalesced[n];
+			break;
+		}
+	
+	if ( NULL==pMerged )
+		return;
+	
+	Transferred = _currentCommand->getActualTransfer();
+	Status = _currentCommand->getEndStatusReg();
+	Error = _currentCommand->getEndErrorReg();
+	
+	_currentCommand->setBuffer(pMerged->pOriginalBuffer);
+	_currentCommand->setByteCount(pMerged->OriginalByteCount);
+	_currentCommand->getExtendedLBA()->setSectorCount16(pMerged->OriginalSectors);
+	
+	Bytes = MIN(Transferred, pMerged->OriginalByteCount);
+	_currentCommand->setActualTransfer(Bytes);
+	Transferred -= Bytes;
+	
+	// These never went through the base class, so they're completed the same way it would
+	for (n=1; n<pMerged->nCommands; n++)
+	{
+		pCommand = pMerged->apCommands[n];
+		
+		Bytes = MIN(Transferred, pCommand->getByteCount());
+		pCommand->setActualTransfer(Bytes);
+		Transferred -= Bytes;
+		
+		pCommand->setEndResult(Status, Error);
+		pCommand->state = IOATAController::kATADone;
+		pCommand->setResult(commandResult);
+		pCommand->executeCallback();
+	}
+	
+	CLEAN_RELEASE(pMerged->pBuffer);
+	pMerged->nCommands = 0;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Complete the writes that are still being gathered (and the command that's waiting behind them)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::flush_coalesced_writes(IOReturn err)
+{
+	IOATABusCommand* apCommands[MAX_COALESCED_WRITES+1];
+	int n, nCommands;
+	
+	if ( m_fCoalesceTimerRunning )
+	{
+		m_pCoalesceTimer->cancelTimeout();
+		m_fCoalesceTimerRunning = FALSE;
+	}
+	
+	// Take a copy, completing a command may queue another
+	nCommands = 0;
+	for (n=m_nUnmergedWrites; n<m_Gathering.nCommands; n++)
+		apCommands[nCommands++] = m_Gathering.apCommands[n];
+	if ( m_pLookahead )
+		apCommands[nCommands++] = m_pLookahead;
+	
+	m_Gathering.nCommands = 0;
+	m_nUnmergedWrites = 0;
+	m_pLookahead = NULL;
+	
+	for (n=0; n<nCommands; n++)
+	{
+		apCommands[n]->state = IOATAController::kATADone;
+		apCommands[n]->setResult(err);
+		apCommands[n]->executeCallback();
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set how long writes wait for adjacent writes to merge with (0 disables coalescing)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::set_write_coalesce(int nWindow_us)
+{
+	m_nWriteCoalesce_us = MIN(MAX(nWindow_us, 0), MAX_WRITE_COALESCE_US);
+	
+	debug("[%d.%d] Write coalescing window set to %dus\n", m_target.nShelf, m_target.nSlot, m_nWriteCoalesce_us);
+}
+
+
+
+
+void AOE_CONTROLLER_NAME::set_flush_mode(int nMode)
+{
+	m_nFlushMode = nMode;
+	
+	debug("[%d.%d] Flush mode set to %d\n", m_target.nShelf, m_target.nSlot, m_nFlushMode);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Choose the nub published for the target. This has to be set before attach_device, a target that's
+ * already attached keeps the nub it has
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::set_publish_mode(int nMode)
+{
+	m_nPublishMode = nMode;
+	
+	debug("[%d.%d] Publish mode set to %d\n", m_target.nShelf, m_target.nSlot, m_nPublishMode);
+}
+
+
+
+
+#pragma mark -
+#pragma mark Read-ahead
+
+/*---------------------------------------------------------------------------
+ * Streaming reads (video, backups) come one at a time, each waiting a full round trip. Once a few reads in a
+ * row have started where the one before ended, we read ahead of them into m_ReadAhead.pBuffer, and the reads
+ * that follow are completed from there. A read for sectors that are still on their way waits for them (and holds
+ * up everything queued behind it, so nothing is reordered).
+ *
+ * Read-ahead is thrown away if anything that could change the disk is taken off the queue, if it's skipped over,
+ * or if some of it doesn't come back (it isn't retransmitted). How far ahead we read doubles with each hit, and
+ * halves each time read-ahead is thrown away without being used.
+ *
+ * Returns TRUE if the read was completed or is waiting for read-ahead.
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::handle_read(IOATABusCommand* pCommand)
+{
+	IOExtendedLBA* extLBA;
+	bool fSequential;
+	int nSectors;
+	UInt64 LBA;
+	
+	if ( (kATAFnExecIO!=pCommand->getOpcode()) || (NULL==pCommand->getBuffer()) || (0!=pCommand->getPosition()) )
+		return FALSE;
+	
+	if ( !(pCommand->getFlags() & mATAFlagIORead) || !(pCommand->getFlags() & mATAFlag48BitLBA) )
+		return FALSE;
+	
+	extLBA = pCommand->getExtendedLBA();
+	if ( (NULL==extLBA) || ((kATAcmdReadExtended!=extLBA->getCommand()) && (kATAcmdReadDMAExtended!=extLBA->getCommand())) )
+		return FALSE;
+	
+	nSectors = pCommand->getByteCount()/kATADefaultSectorSize;
+	if ( (0==nSectors) || (extLBA->getSectorCount16()!=nSectors) )
+		return FALSE;
+	
+	LBA = extended_address(extLBA);
+	fSequential = read_ahead_note_read(&m_ReadAhead.NextLBA, &m_ReadAhead.nSequential, LBA, nSectors);
+	
+	if ( (LBA>=m_ReadAhead.Start) && (LBA+nSectors<=m_ReadAhead.End) )
+	{
+		// Anything before this read has been skipped over
+		release_read_ahead(LBA, FALSE);
+		
+		if ( read_ahead_received(LBA, nSectors) )
+			complete_from_read_ahead(pCommand);
+		else
+			m_ReadAhead.pWaiting = pCommand;
+		
+		send_read_ahead();
+		return TRUE;
+	}
+	
+	// Blocks that are read over and over come from the read cache
+	if ( m_pProvider->read_cache_enabled() && m_pProvider->cache_read(this, LBA, nSectors, pCommand->getBuffer()) )
+	{
+		complete_from_memory(pCommand);
+		return TRUE;
+	}
+	
+	if ( fSequential && (m_ReadAhead.nSequential>=READ_AHEAD_TRIGGER) )
+	{
+		m_pProvider->add_read_ahead_statistics(0, 1, 0);
+		send_read_ahead();
+	}
+	
+	note_cache_fill(pCommand);
+	return FALSE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Anything that isn't a plain read (or a command without data) could change what's on the disk
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::alters_data(IOATABusCommand* pCommand)
+{
+	return (kATAFnExecIO!=pCommand->getOpcode()) || (pCommand->getFlags() & mATAFlagIOWrite);
+}
+
+
+
+bool AOE_CONTROLLER_NAME::writes_in_flight(void)
+{
+	int n;
+	
+	if ( _currentCommand && (_currentCommand->getFlags() & mATAFlagIOWrite) )
+		return TRUE;
+	
+	for (n=0; n<numberof(m_aQueued); n++)
+		if ( m_aQueued[n].pCommand && (m_aQueued[n].pCommand->getFlags() & mATAFlagIOWrite) )
+			return TRUE;
+	
+	return FALSE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Read ahead of the client, up to m_ReadAhead.nWindow sectors past its last read. The frames are all sized for
+ * the smallest path so each one can go out on whichever path is next.
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::send_read_ahead(void)
+{
+	struct ReadAheadBatch* pBatch;
+	aoe_atahdr_full* pAoEFullATAHeader;
+	aoe_atahdr* pATAhdr;
+	int n, nSent, nFrameSectors;
+	UInt64 Target, LBA;
+	UInt32 Tag;
+	mbuf_t m;
+	
+	// Don't read anything a write that's on its way could change
+	if ( (m_ReadAhead.nSequential<READ_AHEAD_TRIGGER) || (0==m_nTagSlot) || writes_in_flight() || !m_pProvider->interfaces_active(&m_target) )
+		return;
+	
+	// The client has moved on from what we have
+	if ( (m_ReadAhead.NextLBA<m_ReadAhead.Start) || (m_ReadAhead.NextLBA>m_ReadAhead.End) )
+		discard_read_ahead();
+	
+	if ( NULL==m_ReadAhead.pBuffer )
+	{
+		m_ReadAhead.pBuffer = (UInt8*) IOMalloc(READ_AHEAD_BUFFER_SECTORS*kATADefaultSectorSize);
+		m_ReadAhead.pReceived = (UInt32*) IOMalloc(CHUNK_BITMAP_WORDS(READ_AHEAD_BUFFER_SECTORS)*sizeof(UInt32));
+		
+		if ( (NULL==m_ReadAhead.pBuffer) || (NULL==m_ReadAhead.pReceived) )
+		{
+			debugError("[%d.%d] Unable to allocate the read-ahead buffer\n", m_target.nShelf, m_target.nSlot);
+			
+			if ( m_ReadAhead.pBuffer )
+				IOFree(m_ReadAhead.pBuffer, READ_AHEAD_BUFFER_SECTORS*kATADefaultSectorSize);
+			if ( m_ReadAhead.pReceived )
+				IOFree(m_ReadAhead.pReceived, CHUNK_BITMAP_WORDS(READ_AHEAD_BUFFER_SECTORS)*sizeof(UInt32));
+			m_ReadAhead.pBuffer = NULL;
+			m_ReadAhead.pReceived = NULL;
+			return;
+		}
+		
+		bzero(m_ReadAhead.pReceived, CHUNK_BITMAP_WORDS(READ_AHEAD_BUFFER_SECTORS)*sizeof(UInt32));
+	}
+	
+	if ( m_ReadAhead.Start==m_ReadAhead.End )
+		m_ReadAhead.Start = m_ReadAhead.End = m_ReadAhead.NextLBA;
+	
+	// Only top up once there's a worthwhile amount to fetch
+	Target = read_ahead_target(m_ReadAhead.NextLBA, m_ReadAhead.nWindow, m_ReadAhead.Start, m_ReadAhead.End, m_IdentifiedCapacity);
+	if ( Target==m_ReadAhead.End )
+		return;
+	
+	nFrameSectors = m_nMaxSectorsPerTransfer;
+	for (n=0; n<m_target.nNumberOfInterfaces; n++)
+		if ( m_anPathSectors[n] )
+			nFrameSectors = MIN(nFrameSectors, m_anPathSectors[n]);
+	
+	if ( nFrameSectors<=0 )
+		return;
+	
+	pBatch = &m_ReadAhead.aBatches[m_ReadAhead.nNextBatch];
+	m_ReadAhead.nNextBatch = (m_ReadAhead.nNextBatch+1) % READ_AHEAD_BATCHES;
+	
+	pBatch->StartLBA = m_ReadAhead.End;
+	pBatch->nSectors = Target-m_ReadAhead.End;
+	pBatch->nFrameSectors = nFrameSectors;
+	pBatch->nFrames = 0;
+	pBatch->fLive = TRUE;
+	
+	debugVerbose("[%d.%d] Reading ahead %d sectors from %llu\n", m_target.nShelf, m_target.nSlot, pBatch->nSectors, pBatch->StartLBA);
+	
+	// The tags follow on from each other, a frame that can't be sent is picked up by the timer
+	for (nSent=0; nSent<pBatch->nSectors; nSent+=nFrameSectors)
+	{
+		Tag = m_pProvider->next_tag(m_nTagSlot);
+		if ( 0==pBatch->nFrames )
+			pBatch->BaseTag = Tag;
+		++pBatch->nFrames;
+		
+		if ( 0!=create_mbuf_for_transfer(&m, Tag, TRUE) )
+			continue;
+		pAoEFullATAHeader = MTOD(m, aoe_atahdr_full*);
+		pATAhdr = &(pAoEFullATAHeader->ata);
+		
+		AOE_ATAHEADER_CLEAR(pATAhdr);
+		
+		LBA = pBatch->StartLBA+nSent;
+		pATAhdr->aa_aflags_errfeat = AOE_ATAHEADER_SETAFLAGSFEAT(AOE_AFLAGS_E, 0);
+		pATAhdr->aa_scnt_cmdstat = AOE_ATAHEADER_SETSCNTCMD(MIN(nFrameSectors, pBatch->nSectors-nSent), kATAcmdReadExtended);
+		pATAhdr->aa_lba0_1 = AOE_ATAHEADER_SETLBA01((UInt8)(LBA>>0), (UInt8)(LBA>>8));
+		pATAhdr->aa_lba2_3 = AOE_ATAHEADER_SETLBA23((UInt8)(LBA>>16), (UInt8)(LBA>>24));
+		pATAhdr->aa_lba4_5 = AOE_ATAHEADER_SETLBA45((UInt8)(LBA>>32), (UInt8)(LBA>>40));
+		
+		m_pProvider->send_ata_packet(this, m, Tag, &m_target, m_pProvider->next_interface(&m_target), FALSE);
+	}
+	
+	m_ReadAhead.End = Target;
+	clock_get_uptime(&m_ReadAhead.TimeSent);
+	
+	if ( NULL==m_pReadAheadTimer )
+	{
+		if ( NULL==getWorkLoop() )
+			return;
+		
+		m_pReadAheadTimer = IOTimerEventSource::timerEventSource(this, ReadAheadTimer);
+		
+		if ( m_pReadAheadTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(m_pReadAheadTimer)) )
+			CLEAN_RELEASE(m_pReadAheadTimer);
+		
+		// Without the timer, a lost frame isn't noticed until the read-ahead is thrown away for something else
+		if ( NULL==m_pReadAheadTimer )
+		{
+			debugError("[%d.%d] Unable to create the read-ahead timer\n", m_target.nShelf, m_target.nSlot);
+			return;
+		}
+	}
+	
+	m_pReadAheadTimer->setTimeoutMS(READ_AHEAD_TIMEOUT_MS);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Check if a response is read-ahead, and if so, put it in the buffer
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::handle_read_ahead_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData, UInt32 Tag)
+{
+	struct ReadAheadBatch* pBatch;
+	IOATABusCommand* pCommand;
+	IOByteCount Bytes, Copied, Length;
+	UInt64 LBA, From, To;
+	int n, nFrame, nSectors;
+	mbuf_t ReceivedMBufCont;
+	UInt8* pData;
+	
+	pBatch = NULL;
+	for (n=0; n<READ_AHEAD_BATCHES; n++)
+		if ( m_ReadAhead.aBatches[n].nFrames &&
+			((Tag & ~TAG_SEQUENCE_MASK)==(m_ReadAhead.aBatches[n].BaseTag & ~TAG_SEQUENCE_MASK)) &&
+			(TAG_SEQUENCE_DIFF(Tag, m_ReadAhead.aBatches[n].BaseTag) < m_ReadAhead.aBatches[n].nFrames) )
+		{
+			pBatch = &m_ReadAhead.aBatches[n];
+			break;
+		}
+	
+	if ( NULL==pBatch )
+		return FALSE;
+	
+	nFrame = TAG_SEQUENCE_DIFF(Tag, pBatch->BaseTag);
+	LBA = pBatch->StartLBA + nFrame*pBatch->nFrameSectors;
+	nSectors = MIN(pBatch->nFrameSectors, pBatch->nSectors - nFrame*pBatch->nFrameSectors);
+	Bytes = nSectors*kATADefaultSectorSize;
+	
+	if ( !pBatch->fLive )
+	{
+		m_pProvider->add_read_ahead_statistics(0, 0, Bytes);
+		return TRUE;
+	}
+	
+	if ( AOE_ATAHEADER_GETSTAT(pATAHeader) & mATAError )
+	{
+		debugWarn("[%d.%d] Target returned an error to read-ahead at %llu\n", m_target.nShelf, m_target.nSlot, LBA);
+		discard_read_ahead();
+		
+		if ( m_ReadAhead.pReleased )
+			dispatchNext();
+		return TRUE;
+	}
+	
+	// Only the part the client hasn't moved past is kept
+	From = MAX(LBA, m_ReadAhead.Start);
+	To = MIN(LBA+nSectors, m_ReadAhead.End);
+	
+	if ( From>=To )
+	{
+		m_pProvider->add_read_ahead_statistics(0, 0, Bytes);
+		return TRUE;
+	}
+	
+	// Copy the data across (the same way completeDataRead does)
+	ReceivedMBufCont = pMBufData ? mbuf_next(*pMBufData) : NULL;
+	pData = (UInt8*) &pATAHeader->aa_Data[0];
+	Length = MIN(m_unReceivedATADataSize, Bytes);
+	Copied = 0;
+	
+	for (;;)
+	{
+		copy_to_read_ahead((LBA % READ_AHEAD_BUFFER_SECTORS)*kATADefaultSectorSize + Copied, pData, Length);
+		Copied += Length;
+		
+		if ( (NULL==ReceivedMBufCont) || (Copied>=Bytes) )
+			break;
+		
+		pData = MTOD(ReceivedMBufCont, UInt8*);
+		Length = MIN(mbuf_len(ReceivedMBufCont), Bytes-Copied);
+		ReceivedMBufCont = mbuf_next(ReceivedMBufCont);
+	}
+	
+	if ( Copied<Bytes )
+	{
+		debugError("[%d.%d] Read-ahead response is short (%d of %d bytes)\n", m_target.nShelf, m_target.nSlot, Copied, Bytes);
+		discard_read_ahead();
+		
+		if ( m_ReadAhead.pReleased )
+			dispatchNext();
+		return TRUE;
+	}
+	
+	for (LBA=From; LBA<To; LBA++)
+		CHUNK_SET(m_ReadAhead.pReceived, (int)(LBA % READ_AHEAD_BUFFER_SECTORS));
+	
+	// Complete the read that was waiting for this, and let the commands behind it go
+	pCommand = m_ReadAhead.pWaiting;
+	if ( pCommand )
+	{
+		LBA = extended_address(pCommand->getExtendedLBA());
+		
+		if ( read_ahead_received(LBA, pCommand->getByteCount()/kATADefaultSectorSize) )
+		{
+			m_ReadAhead.pWaiting = NULL;
+			complete_from_read_ahead(pCommand);
+			send_read_ahead();
+			dispatchNext();
+		}
+	}
+	
+	return TRUE;
+}
+
+
+
+void AOE_CONTROLLER_NAME::copy_to_read_ahead(IOByteCount Position, void* pData, IOByteCount Bytes)
+{
+	const IOByteCount Size = READ_AHEAD_BUFFER_SECTORS*kATADefaultSectorSize;
+	IOByteCount First;
+	
+	Position %= Size;
+	First = MIN(Bytes, Size-Position);
+	
+	bcopy(pData, m_ReadAhead.pBuffer+Position, First);
+	if ( Bytes>First )
+		bcopy((UInt8*)pData+First, m_ReadAhead.pBuffer, Bytes-First);
+}
+
+
+
+bool AOE_CONTROLLER_NAME::read_ahead_received(UInt64 LBA, int nSectors)
+{
+	int n;
+	
+	if ( NULL==m_ReadAhead.pReceived )
+		return FALSE;
+	
+	for (n=0; n<nSectors; n++)
+		if ( !CHUNK_IS_SET(m_ReadAhead.pReceived, (int)((LBA+n) % READ_AHEAD_BUFFER_SECTORS)) )
+			return FALSE;
+	
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Free up the read-ahead before LBA. Anything that was received and not used has been wasted.
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::release_read_ahead(UInt64 LBA, bool fUsed)
+{
+	int nSlot, nWasted;
+	
+	LBA = MIN(LBA, m_ReadAhead.End);
+	nWasted = 0;
+	
+	for (; m_ReadAhead.Start<LBA; m_ReadAhead.Start++)
+	{
+		nSlot = (int)(m_ReadAhead.Start % READ_AHEAD_BUFFER_SECTORS);
+		
+		if ( CHUNK_IS_SET(m_ReadAhead.pReceived, nSlot) )
+		{
+			m_ReadAhead.pReceived[nSlot/32] &= ~(1<<(nSlot%32));
+			if ( !fUsed )
+				++nWasted;
+		}
+	}
+	
+	if ( nWasted )
+		m_pProvider->add_read_ahead_statistics(0, 0, nWasted*kATADefaultSectorSize);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Throw away everything that's been read ahead, and ignore the responses still on their way
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::discard_read_ahead(void)
+{
+	UInt64 Start;
+	int n;
+	
+	if ( m_ReadAhead.Start==m_ReadAhead.End )
+		return;
+	
+	Start = m_ReadAhead.Start;
+	release_read_ahead(m_ReadAhead.End, FALSE);
+	
+	for (n=0; n<READ_AHEAD_BATCHES; n++)
+		m_ReadAhead.aBatches[n].fLive = FALSE;
+	
+	debugVerbose("[%d.%d] Read-ahead of %llu-%llu thrown away\n", m_target.nShelf, m_target.nSlot, Start, m_ReadAhead.End);
+	
+	m_ReadAhead.Start = m_ReadAhead.End = 0;
+	m_ReadAhead.nWindow = read_ahead_shrink(m_ReadAhead.nWindow);
+	
+	// A read that was waiting for it has to go to the target after all
+	if ( m_ReadAhead.pWaiting )
+	{
+		m_ReadAhead.pReleased = m_ReadAhead.pWaiting;
+		m_ReadAhead.pWaiting = NULL;
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Copy a read's data out of the read-ahead buffer and complete it (it never went through the base class)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::complete_from_read_ahead(IOATABusCommand* pCommand)
+{
+	const IOByteCount Size = READ_AHEAD_BUFFER_SECTORS*kATADefaultSectorSize;
+	IOByteCount Position, Bytes, First;
+	UInt64 LBA;
+	
+	LBA = extended_address(pCommand->getExtendedLBA());
+	Bytes = pCommand->getByteCount();
+	Position = (LBA % READ_AHEAD_BUFFER_SECTORS)*kATADefaultSectorSize;
+	First = MIN(Bytes, Size-Position);
+	
+	pCommand->getBuffer()->writeBytes(0, m_ReadAhead.pBuffer+Position, First);
+	if ( Bytes>First )
+		pCommand->getBuffer()->writeBytes(First, m_ReadAhead.pBuffer, Bytes-First);
+	
+	release_read_ahead(LBA+Bytes/kATADefaultSectorSize, TRUE);
+	
+	m_ReadAhead.nWindow = read_ahead_grow(m_ReadAhead.nWindow);
+	m_pProvider->add_read_ahead_statistics(1, 0, 0);
+	
+	// Read-ahead is never sent with writes in flight, so it can go straight into the read cache
+	if ( m_pProvider->read_cache_enabled() )
+		m_pProvider->cache_fill(this, LBA, Bytes/kATADefaultSectorSize, pCommand->getBuffer());
+	
+	complete_from_memory(pCommand);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Complete a read whose data has already been copied into its buffer (from read-ahead or the read cache)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::complete_from_memory(IOATABusCommand* pCommand)
+{
+	pCommand->setActualTransfer(pCommand->getByteCount());
+	pCommand->setEndResult(mATADriveReady, 0);
+	pCommand->state = IOATAController::kATADone;
+	pCommand->setResult(kATANoErr);
+	pCommand->executeCallback();
+}
+
+
+
+void AOE_CONTROLLER_NAME::ReadAheadTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	
+	if ( pThis )
+		pThis->check_read_ahead();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Give up on read-ahead that hasn't all come back in time
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::check_read_ahead(void)
+{
+	uint64_t Waited_ms;
+	
+	if ( (m_ReadAhead.Start==m_ReadAhead.End) || read_ahead_received(m_ReadAhead.Start, m_ReadAhead.End-m_ReadAhead.Start) )
+		return;
+	
+	Waited_ms = time_since_now_ms(m_ReadAhead.TimeSent);
+	if ( Waited_ms < READ_AHEAD_TIMEOUT_MS )
+	{
+		m_pReadAheadTimer->setTimeoutMS(READ_AHEAD_TIMEOUT_MS-Waited_ms);
+		return;
+	}
+	
+	debugWarn("[%d.%d] Read-ahead didn't all come back\n", m_target.nShelf, m_target.nSlot);
+	discard_read_ahead();
+	
+	if ( m_ReadAhead.pReleased )
+		dispatchNext();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Complete the reads that are waiting on read-ahead with an error (used when the target goes away)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::cancel_read_ahead(IOReturn err)
+{
+	IOATABusCommand* apCommands[2];
+	int n;
+	
+	discard_read_ahead();
+	
+	m_ReadAhead.NextLBA = 0;
+	m_ReadAhead.nSequential = 0;
+	
+	apCommands[0] = m_ReadAhead.pWaiting;
+	apCommands[1] = m_ReadAhead.pReleased;
+	m_ReadAhead.pWaiting = NULL;
+	m_ReadAhead.pReleased = NULL;
+	
+	for (n=0; n<numberof(apCommands); n++)
+		if ( apCommands[n] )
+		{
+			apCommands[n]->state = IOATAController::kATADone;
+			apCommands[n]->setResult(err);
+			apCommands[n]->executeCallback();
+		}
+}
+
+
+
+
+#pragma mark -
+#pragma mark Read cache
+
+/*---------------------------------------------------------------------------
+ * The read cache itself is shared by all the targets (see "Read cache" in AoEControllerInterface.cpp). The controller
+ * looks reads up in it (handle_read), adds the reads that went to the target once they complete, and drops the blocks
+ * a write is about to change when the write is taken off the queue.
+ *
+ * A read that was in flight when a write was taken off the queue may have read the sectors before the write changed
+ * them, so it isn't added. This is tracked with m_nCacheGeneration rather than by sector, which is simpler and errs
+ * on the side of not caching.
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::note_cache_fill(IOATABusCommand* pCommand)
+{
+	struct CacheFill* pFree;
+	int n;
+	
+	if ( !m_pProvider->read_cache_enabled() )
+		return;
+	
+	// Commands are reused, so an old entry for this one is simply replaced
+	pFree = NULL;
+	for (n=0; n<numberof(m_aCacheFills); n++)
+	{
+		if ( m_aCacheFills[n].pCommand==pCommand )
+		{
+			pFree = &m_aCacheFills[n];
+			break;
+		}
+		
+		if ( (NULL==pFree) && (NULL==m_aCacheFills[n].pCommand) )
+			pFree = &m_aCacheFills[n];
+	}
+	
+	if ( pFree )
+	{
+		pFree->pCommand = pCommand;
+		pFree->nGeneration = m_nCacheGeneration;
+	}
+}
+
+
+
+void AOE_CONTROLLER_NAME::fill_read_cache(IOReturn commandResult)
+{
+	struct CacheFill* pFill;
+	int n;
+	
+	if ( NULL==_currentCommand )
+		return;
+	
+	for (n=0; n<numberof(m_aCacheFills); n++)
+	{
+		pFill = &m_aCacheFills[n];
+		
+		if ( pFill->pCommand!=_currentCommand )
+			continue;
+		
+		pFill->pCommand = NULL;
+		
+		if ( (kATANoErr==commandResult) && (pFill->nGeneration==m_nCacheGeneration) )
+			m_pProvider->cache_fill(this, extended_address(_currentCommand->getExtendedLBA()), _currentCommand->getByteCount()/kATADefaultSectorSize, _currentCommand->getBuffer());
+		break;
+	}
+}
+
+
+
+void AOE_CONTROLLER_NAME::invalidate_read_cache(IOATABusCommand* pCommand)
+{
+	IOExtendedLBA* extLBA;
+	
+	if ( (kATAFnExecIO!=pCommand->getOpcode()) || !(pCommand->getFlags() & mATAFlagIOWrite) )
+		return;
+	
+	++m_nCacheGeneration;
+	
+	if ( !m_pProvider->read_cache_enabled() )
+		return;
+	
+	extLBA = pCommand->getExtendedLBA();
+	
+	// Only the 48-bit writes are followed by sector, anything else clears the whole target
+	if ( (pCommand->getFlags() & mATAFlag48BitLBA) && extLBA && pCommand->getBuffer() &&
+		((kATAcmdWriteExtended==extLBA->getCommand()) || (kATAcmdWriteDMAExtended==extLBA->getCommand())) )
+		m_pProvider->cache_invalidate(this, extended_address(extLBA), pCommand->getByteCount()/kATADefaultSectorSize);
+	else
+		m_pProvider->cache_drop_target(this);
+}
+
+
+
+
+#pragma mark -
+#pragma mark Flushes and write-back
+
+/*---------------------------------------------------------------------------
+ * Unless flushes are answered locally (FLUSH_MODE_FAKE, see send_ata_packet), FLUSH CACHE is sent to the target.
+ * It's a barrier without anything extra here: it isn't queueable, so in queued mode dispatchNext holds it back
+ * until every command in flight has completed, and writes being gathered for coalescing are sent before it.
+ *
+ * In write-back mode, writes are completed as soon as they're sent (see start_write_back) and our copies are
+ * still in flight when the flush comes off the queue, so it waits for them to be acknowledged. A copy that fails
+ * can't be reported on its own command any more. It's logged, and the error is held and returned from the next
+ * flush. Until then every other command fails with it too (see fail_after_write_back), so nothing reads or writes
+ * the target as if the lost write had made it.
+ * The copies are queued commands, so a lost one times out (see check_queued_timeouts) and fails the flush rather
+ * than holding it forever. Write-back only happens in queued mode, with a queue depth of 1 writes are sent as normal.
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::is_flush(IOATABusCommand* pCommand)
+{
+	UInt8 Command;
+	
+	if ( kATAFnExecIO!=pCommand->getOpcode() )
+		return FALSE;
+	
+	Command = ata_command(pCommand);
+	
+	return (kATAcmdFlushCache==Command) || (kATAcmdFlushCacheExtended==Command);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Send a copy of the write and complete the client's command now. Returns FALSE if the write should be sent as normal
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::start_write_back(IOATABusCommand* pCommand)
+{
+	IOBufferMemoryDescriptor* pCopy;
+	IOATABusCommand* pPrevious;
+	IOATABusCommand* pShadow;
+	struct WriteBack* pWriteBack;
+	IOExtendedLBA* extLBA;
+	IOExtendedLBA* shadowLBA;
+	IOByteCount Bytes;
+	int n;
+	
+	if ( (FLUSH_MODE_WRITE_BACK!=m_nFlushMode) || !(pCommand->getFlags() & mATAFlagIOWrite) || !(pCommand->getFlags() & mATAFlag48BitLBA) || (0!=pCommand->getPosition()) )
+		return FALSE;
+	
+	extLBA = pCommand->getExtendedLBA();
+	if ( (NULL==extLBA) || ((kATAcmdWriteExtended!=extLBA->getCommand()) && (kATAcmdWriteDMAExtended!=extLBA->getCommand())) )
+		return FALSE;
+	
+	// There's never more copies in flight than queue slots
+	pWriteBack = NULL;
+	for (n=0; n<numberof(m_aWriteBacks); n++)
+		if ( NULL==m_aWriteBacks[n].pCommand )
+		{
+			pWriteBack = &m_aWriteBacks[n];
+			break;
+		}
+	
+	if ( NULL==pWriteBack )
+		return FALSE;
+	
+	// The client can reuse its buffer as soon as it's told the write is done, so the data is copied
+	Bytes = pCommand->getByteCount();
+	pCopy = IOBufferMemoryDescriptor::withCapacity(Bytes, kIODirectionOut);
+	pShadow = pCopy ? IOATABusCommand::allocateCmd() : NULL;
+	
+	if ( NULL==pShadow )
+	{
+		debugError("[%d.%d] Unable to copy write for write-back, sending it as normal\n", m_target.nShelf, m_target.nSlot);
+		CLEAN_RELEASE(pCopy);
+		return FALSE;
+	}
+	
+	pCommand->getBuffer()->readBytes(0, pCopy->getBytesNoCopy(), Bytes);
+	m_pProvider->add_write_statistics(0, Bytes);
+	
+	pShadow->zeroCommand();
+	pShadow->setOpcode(kATAFnExecIO);
+	pShadow->setFlags(pCommand->getFlags());
+	pShadow->setUnit(pCommand->getUnit());
+	pShadow->setTimeoutMS(pCommand->getTimeoutMS());
+	pShadow->setBuffer(pCopy);
+	pShadow->setPosition(0);
+	pShadow->setByteCount(Bytes);
+	pShadow->setTransferChunkSize(pCommand->getTransferChunkSize());
+	pShadow->setCallbackPtr(&WriteBackDone);
+	pShadow->refCon = (void*) this;
+	
+	shadowLBA = pShadow->getExtendedLBA();
+	shadowLBA->setLBALow16(extLBA->getLBALow16());
+	shadowLBA->setLBAMid16(extLBA->getLBAMid16());
+	shadowLBA->setLBAHigh16(extLBA->getLBAHigh16());
+	shadowLBA->setSectorCount16(extLBA->getSectorCount16());
+	shadowLBA->setFeatures16(extLBA->getFeatures16());
+	shadowLBA->setDevice(extLBA->getDevice());
+	shadowLBA->setCommand(extLBA->getCommand());
+	
+	pWriteBack->pCommand = pShadow;
+	pWriteBack->LBA = extended_address(extLBA);
+	pWriteBack->nSectors = Bytes/kATADefaultSectorSize;
+	++m_nWriteBacks;
+	
+	start_queued_command(pShadow);
+	
+	// Writes merged into this one are completed along with it (complete_coalesced_writes works on the current command)
+	pCommand->setActualTransfer(Bytes);
+	pCommand->setEndResult(mATADriveReady, 0);
+	
+	pPrevious = _currentCommand;
+	_currentCommand = pCommand;
+	complete_coalesced_writes(kATANoErr);
+	_currentCommand = pPrevious;
+	
+	complete_from_memory(pCommand);
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Fail a command taken off the queue if a write-back write has failed and no flush has collected the error yet.
+ * Returns TRUE if the command has been completed
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::fail_after_write_back(IOATABusCommand* pCommand)
+{
+	if ( (kATANoErr==m_WriteBackError) || is_flush(pCommand) )
+		return FALSE;
+	
+	debugVerbose("[%d.%d] Failing command, a write-back write failed (%#x)\n", m_target.nShelf, m_target.nSlot, m_WriteBackError);
+	
+	pCommand->setActualTransfer(0);
+	pCommand->state = IOATAController::kATADone;
+	pCommand->setResult(m_WriteBackError);
+	pCommand->executeCallback();
+	return TRUE;
+}
+
+
+
+bool AOE_CONTROLLER_NAME::overlaps_write_back(IOATABusCommand* pCommand)
+{
+	IOExtendedLBA* extLBA;
+	UInt64 LBA;
+	int n, nSectors;
+	
+	if ( 0==m_nWriteBacks )
+		return FALSE;
+	
+	// If we can't tell which sectors it covers, it waits
+	extLBA = pCommand->getExtendedLBA();
+	if ( !(pCommand->getFlags() & mATAFlag48BitLBA) || (NULL==extLBA) )
+		return TRUE;
+	
+	LBA = extended_address(extLBA);
+	nSectors = pCommand->getByteCount()/kATADefaultSectorSize;
+	
+	for (n=0; n<numberof(m_aWriteBacks); n++)
+		if ( m_aWriteBacks[n].pCommand &&
+			(LBA < m_aWriteBacks[n].LBA+m_aWriteBacks[n].nSectors) &&
+			(m_aWriteBacks[n].LBA < LBA+nSectors) )
+			return TRUE;
+	
+	return FALSE;
+}
+
+
+
+void AOE_CONTROLLER_NAME::WriteBackDone(IOATACommand* pCommand)
+{
+	AOE_CONTROLLER_NAME* pThis = (AOE_CONTROLLER_NAME*) pCommand->refCon;
+	
+	if ( pThis )
+		pThis->write_back_done(pCommand);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * One of our copies has been acknowledged (or failed). The base class has finished with it by now
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::write_back_done(IOATACommand* pCommand)
+{
+	IOMemoryDescriptor* pCopy;
+	int n;
 	
-	return err;
+	for (n=0; n<numberof(m_aWriteBacks); n++)
+		if ( m_aWriteBacks[n].pCommand==pCommand )
+		{
+			// The client was told this write succeeded, so every failure is logged where it can be seen
+			if ( kATANoErr!=pCommand->getResult() )
+			{
+				debugError("[%d.%d] Write-back of %d sectors at LBA %llu failed (%#x), the data is lost\n", m_target.nShelf, m_target.nSlot, m_aWriteBacks[n].nSectors, m_aWriteBacks[n].LBA, pCommand->getResult());
+				if ( kATANoErr==m_WriteBackError )
+					m_WriteBackError = pCommand->getResult();
+			}
+			
+			m_aWriteBacks[n].pCommand = NULL;
+			--m_nWriteBacks;
+			break;
+		}
+	
+	pCopy = pCommand->getBuffer();
+	pCommand->setBuffer(NULL);
+	CLEAN_RELEASE(pCopy);
+	pCommand->release();
 }
 
+
+
+
 /*---------------------------------------------------------------------------
- * Create the double buffer for drive read/writes
+ * Record the arrival of the chunk in m_unReceivedTag. Returns FALSE if the response should be ignored, either
+ * because that chunk has already been received or because it isn't one of this command's chunks
  ---------------------------------------------------------------------------*/
-bool AOE_CONTROLLER_NAME::allocateDoubleBuffer( void )
+bool AOE_CONTROLLER_NAME::mark_chunk_received(void)
 {
-    debug("IOATAController::allocateDoubleBuffer(%d)\n", m_nMaxTransferSize);
+	int nChunk;
 	
-	_doubleBuffer.logicalBuffer = (IOLogicalAddress) IOMallocContiguous(m_nMaxTransferSize, 4096 /*=alignment*/, &_doubleBuffer.physicalBuffer);
+	nChunk = chunk_from_tag(m_unReceivedTag, m_unReadBaseTag, m_nChunks);
 	
-	if( _doubleBuffer.logicalBuffer == 0L)
-		return false;
+	if ( nChunk<0 )
+	{
+		debugError("[%d.%d] Response with tag %#x isn't part of the current command (base tag=%#x, %d chunks)\n", m_target.nShelf, m_target.nSlot, m_unReceivedTag, m_unReadBaseTag, m_nChunks);
+		return FALSE;
+	}
 	
-	_doubleBuffer.bufferSize = m_nMaxTransferSize;
+	if ( NULL==m_pReceivedChunks )
+		return TRUE;
 	
-	return true;
+	if ( CHUNK_IS_SET(m_pReceivedChunks, nChunk) )
+	{
+		debug("[%d.%d] Ignoring duplicate response for chunk %d (tag %#x)\n", m_target.nShelf, m_target.nSlot, nChunk, m_unReceivedTag);
+		m_pProvider->add_duplicate_chunk();
+		return FALSE;
+	}
+	
+	CHUNK_SET(m_pReceivedChunks, nChunk);
+	
+	resend_missing_chunks(nChunk);
+	
+	return TRUE;
 }
 
 
+
 /*---------------------------------------------------------------------------
- * Determine if we're able to send more commands. We only fail this if there
- * are no interfaces available, otherwise, we let the base class handle it
+ * A command's frames go out in tag order, so a chunk that's still missing when the chunk sent
+ * CHUNK_REORDER_THRESHOLD frames after it arrives has most likely been lost. Only those chunks are resent,
+ * each of them once (if a resent frame goes missing as well, the retransmit timer looks after it).
+ * When the frames were spread over several paths, a later frame on a faster path can overtake an earlier one
+ * that isn't lost at all, so that's left to the retransmit timer (a resend also halves the congestion window)
  ---------------------------------------------------------------------------*/
-bool AOE_CONTROLLER_NAME::busCanDispatch( void )
+void AOE_CONTROLLER_NAME::resend_missing_chunks(int nChunk)
 {
-	bool fCanDispatch;
+	UInt32 Tag;
+	int nLost;
 	
-	fCanDispatch = m_pProvider && m_pProvider->interfaces_active(&m_target) && super::busCanDispatch();
-
-
-	debugVerbose("busCanDispatch() - returning %d\n", fCanDispatch);
+	if ( !m_fSinglePath )
+		return;
 	
-	return fCanDispatch;
+	while ( -1!=(nLost=chunk_next_lost(m_pReceivedChunks, &m_nRetryChunk, nChunk)) )
+	{
+		Tag = CHUNK_TAG(m_unReadBaseTag, nLost);
+		
+		debugVerbose("[%d.%d] Chunk %d (tag %#x) is missing but chunk %d has arrived, resending it\n", m_target.nShelf, m_target.nSlot, nLost, Tag, nChunk);
+		m_pProvider->resend_chunk(Tag);
+	}
 }
 
 #pragma mark -
@@ -2238,6 +4654,31 @@ bool AOE_CONTROLLER_NAME::is_extended_command(void)
 }
 
 
+/*---------------------------------------------------------------------------
+ * Get the 48-bit LBA address out of the AoE ordering (lba0/lba3 in the low 16 bits etc.)
+ ---------------------------------------------------------------------------*/
+UInt64 AOE_CONTROLLER_NAME::extended_address(IOExtendedLBA* extLBA)
+{
+	UInt64 lba[6];
+	
+	// Convert address into actual address
+	lba[3] = (extLBA->getLBALow16() & 0xFF00) >> 8;
+	lba[0] = (extLBA->getLBALow16() & 0x00FF);
+	lba[4] = (extLBA->getLBAMid16() & 0xFF00) >> 8;
+	lba[1] = (extLBA->getLBAMid16() & 0x00FF);
+	lba[5] = (extLBA->getLBAHigh16() & 0xFF00) >> 8;
+	lba[2] = (extLBA->getLBAHigh16() & 0x00FF);
+	
+	return	(lba[5]<<40) |
+			(lba[4]<<32) |
+			(lba[3]<<24) |
+			(lba[2]<<16) |
+			(lba[1]<<8) |
+			(lba[0]<<0) ;
+}
+
+
+
 /*---------------------------------------------------------------------------
  * Add offset to LBA address values (48-bit)
  ---------------------------------------------------------------------------*/
@@ -2253,20 +4694,7 @@ void AOE_CONTROLLER_NAME::increment_address(IOExtendedLBA* extLBA, int nInc)
 		UInt16 mbaOrig = extLBA->getLBAMid16();
 		#endif
 
-		// Convert address into actual address
-		lba[3] = (extLBA->getLBALow16() & 0xFF00) >> 8;
-		lba[0] = (extLBA->getLBALow16() & 0x00FF);
-		lba[4] = (extLBA->getLBAMid16() & 0xFF00) >> 8;
-		lba[1] = (extLBA->getLBAMid16() & 0x00FF);
-		lba[5] = (extLBA->getLBAHigh16() & 0xFF00) >> 8;
-		lba[2] = (extLBA->getLBAHigh16() & 0x00FF);
-
-		UInt64 Add =(lba[5]<<40) |
-					(lba[4]<<32) |
-					(lba[3]<<24) |
-					(lba[2]<<16) |
-					(lba[1]<<8) |
-					(lba[0]<<0) ;
+		UInt64 Add = extended_address(extLBA);
 		
 		// Increment address
 		Add += nInc;
@@ -2370,8 +4798,10 @@ int AOE_CONTROLLER_NAME::update_target_info(ifnet_t ifnet_receive, u_char* pTarg
 			clock_get_uptime(&m_time_since_last_comm);
 			ifnet_lladdr_copy_bytes(ifnet_receive, m_target.aaSrcMACAddress[m_target.nNumberOfInterfaces], ETHER_ADDR_LEN);
 			bcopy(pTargetsMACAddress, m_target.aaDestMACAddress[m_target.nNumberOfInterfaces], ETHER_ADDR_LEN);
+			memset(&m_aPathProbe[m_target.nNumberOfInterfaces], 0, sizeof(struct PathProbe));
 			++m_target.nNumberOfInterfaces;
 
+			update_path_sizes();
 			update_interface_property();
 			debugVerbose("Add interface to device's list (%d interfaces currently connected)\n", m_target.nNumberOfInterfaces);
 		}
@@ -2432,14 +4862,17 @@ void AOE_CONTROLLER_NAME::remove_interface(int nInterfaceNumber)
 	// Move the interface at the end of the list to our current position, clear position and reduce the count
 	m_target.aInterfaces[nInterfaceNumber] = m_target.aInterfaces[m_target.nNumberOfInterfaces-1];
 	m_target.aInterfaceNum[nInterfaceNumber] = m_target.aInterfaceNum[m_target.nNumberOfInterfaces-1];
-	bcopy(m_target.aaSrcMACAddress[nInterfaceNumber], m_target.aaSrcMACAddress[m_target.nNumberOfInterfaces-1], ETHER_ADDR_LEN);
-	bcopy(m_target.aaDestMACAddress[nInterfaceNumber], m_target.aaDestMACAddress[m_target.nNumberOfInterfaces-1], ETHER_ADDR_LEN);
+	bcopy(m_target.aaSrcMACAddress[m_target.nNumberOfInterfaces-1], m_target.aaSrcMACAddress[nInterfaceNumber], ETHER_ADDR_LEN);
+	bcopy(m_target.aaDestMACAddress[m_target.nNumberOfInterfaces-1], m_target.aaDestMACAddress[nInterfaceNumber], ETHER_ADDR_LEN);
 	
 	m_target.aInterfaces[m_target.nNumberOfInterfaces-1] = 0;
 	m_target.aInterfaceNum[m_target.nNumberOfInterfaces-1] = 0;
 	memset(m_target.aaSrcMACAddress[m_target.nNumberOfInterfaces-1], 0, ETHER_ADDR_LEN);
 	memset(m_target.aaDestMACAddress[m_target.nNumberOfInterfaces-1], 0, ETHER_ADDR_LEN);
+	m_aPathProbe[nInterfaceNumber] = m_aPathProbe[m_target.nNumberOfInterfaces-1];
+	memset(&m_aPathProbe[m_target.nNumberOfInterfaces-1], 0, sizeof(struct PathProbe));
 	--m_target.nNumberOfInterfaces;
+	update_path_sizes();
 	update_interface_property();
 	
 	debugVerbose("remove interface from device's list (%d interfaces currently connected)\n", m_target.nNumberOfInterfaces);
@@ -2494,6 +4927,30 @@ void AOE_CONTROLLER_NAME::attach_device(void)
 		// Doing so any earlier will cause a panic as the protocol service driver will not have all 
 		// the info it needs to attach/
 	}
+
+	// In block storage mode, the ATA nub above is never registered. Block requests are run through it (it
+	// holds the IDENTIFY data and the command gate), but only the block device is published
+	if ( m_pAoEDevice && (PUBLISH_MODE_BLOCK_STORAGE==m_nPublishMode) )
+	{
+		m_pBlockDevice = AOE_BLOCK_DEVICE_NAME::create_block_device(this, m_pAoEDevice, m_target.nShelf, m_target.nSlot);
+
+		if ( m_pBlockDevice && !m_pBlockDevice->attach(this) )
+		{
+			m_pBlockDevice->uninit();
+			CLEAN_RELEASE(m_pBlockDevice);
+		}
+
+		if ( m_pBlockDevice && !m_pBlockDevice->start(this) )
+		{
+			debugError("Trouble starting block device\n");
+			m_pBlockDevice->detach(this);
+			m_pBlockDevice->uninit();
+			CLEAN_RELEASE(m_pBlockDevice);
+		}
+
+		if ( NULL==m_pBlockDevice )
+			debugError("[%d.%d] Unable to create block device, publishing the ATA device instead\n", m_target.nShelf, m_target.nSlot);
+	}
 }
 
 
@@ -2541,7 +4998,7 @@ int AOE_CONTROLLER_NAME::send_identify(void)
 	debugVerbose("AOE_CONTROLLER_NAME::send_identify\n");
 	
 	// Initialise our mbuf
-	Tag = m_pProvider->next_tag();
+	Tag = m_pProvider->next_tag(m_nTagSlot);
 	if ( 0!=create_mbuf_for_transfer(&m, Tag, TRUE) )
 		return -1;
 	pAoEFullATAHeader = MTOD(m, aoe_atahdr_full*);
@@ -2566,14 +5023,292 @@ int AOE_CONTROLLER_NAME::send_identify(void)
 
 
 /*---------------------------------------------------------------------------
- * Adjust the transfer size
+ * Adjust the transfer size. This is called when the MTU of an interface may have changed, the frame size of
+ * each path is worked out again from its own interface (nMTU is only used for an interface that doesn't report one).
+ * As the link may have changed, every path is probed again as well
  ---------------------------------------------------------------------------*/
 void AOE_CONTROLLER_NAME::set_mtu_size(int nMTU)
 {
+	int n;
+	
 	m_MTU = nMTU;
-	m_nMaxSectorsPerTransfer = COUNT_SECTORS_FROM_MTU(m_MTU);
+	
+	for (n=0; n<numberof(m_aPathProbe); n++)
+		m_aPathProbe[n].State = PROBE_NEEDED;
+	
+	update_path_sizes();
+	schedule_path_probes();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Work out the frame size for each path to the target. Until a path has been probed, its frames are kept to
+ * what a standard ethernet frame can carry (see run_path_probes)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::update_path_sizes(void)
+{
+	int n, nSectors;
+	
+	m_nMaxSectorsPerTransfer = 0;
+	
+	for (n=0; n<numberof(m_anPathSectors); n++)
+	{
+		nSectors = path_limit(n);
+		
+		if ( n < m_target.nNumberOfInterfaces )
+		{
+			if ( PROBE_DONE==m_aPathProbe[n].State )
+				nSectors = MIN(nSectors, m_aPathProbe[n].nVerifiedSectors);
+			else
+				nSectors = MIN(nSectors, PROBE_BASE_SECTORS);
+		}
+		
+		m_anPathSectors[n] = nSectors;
+		
+		if ( n < m_target.nNumberOfInterfaces )
+		{
+			m_nMaxSectorsPerTransfer = MAX(m_nMaxSectorsPerTransfer, m_anPathSectors[n]);
+			debug("[%d.%d] Path %d (en%d) is using %d sectors per transfer\n", m_target.nShelf, m_target.nSlot, n, m_target.aInterfaceNum[n], m_anPathSectors[n]);
+		}
+	}
+	
+	if ( 0==m_nMaxSectorsPerTransfer )
+		m_nMaxSectorsPerTransfer = m_anPathSectors[0];
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The largest frame a path could take. This is limited by the MTU of the interface the path goes
+ * out on and by the sector count the target advertised in its config response
+ ---------------------------------------------------------------------------*/
+int AOE_CONTROLLER_NAME::path_limit(int nPath)
+{
+	UInt32 MTU;
+	int nSectors;
+	
+	MTU = 0;
+	if ( (nPath < m_target.nNumberOfInterfaces) && m_target.aInterfaces[nPath] )
+		MTU = ifnet_mtu(m_target.aInterfaces[nPath]);
+	if ( 0==MTU )
+		MTU = m_MTU;
+	
+	nSectors = COUNT_SECTORS_FROM_MTU(MTU);
+	if ( m_nTargetMaxSectors )
+		nSectors = MIN(nSectors, m_nTargetMaxSectors);
+	
+	// The AoE sector count is a single byte
+	return MIN(MAX(nSectors, 1), 0xFF);
+}
+
+
+
+#pragma mark -
+#pragma mark Path probing
+
+/*---------------------------------------------------------------------------
+ * A jumbo capable interface doesn't mean the switches between us and the target will pass jumbo frames.
+ * If they don't, the frames just disappear, so each path is probed before anything larger than a
+ * standard frame is sent on it. The probes are reads of the first sectors of the disk, starting at the standard
+ * size and doubling up to the path's limit. The path settles on the largest one that makes it back.
+ *
+ * The probes are run from a timer so they always go out on the work loop (link events can arrive from elsewhere)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::schedule_path_probes(void)
+{
+	int n;
+	
+	for (n=0; n<m_target.nNumberOfInterfaces; n++)
+		if ( PROBE_NEEDED==m_aPathProbe[n].State )
+			break;
+	
+	if ( n==m_target.nNumberOfInterfaces )
+		return;
+	
+	if ( NULL==m_pProbeTimer )
+	{
+		// We can't probe until we've been started
+		if ( NULL==getWorkLoop() )
+			return;
+		
+		m_pProbeTimer = IOTimerEventSource::timerEventSource(this, ProbeTimer);
+		
+		if ( m_pProbeTimer && (kIOReturnSuccess!=getWorkLoop()->addEventSource(m_pProbeTimer)) )
+			CLEAN_RELEASE(m_pProbeTimer);
+		
+		if ( NULL==m_pProbeTimer )
+		{
+			debugError("[%d.%d] Unable to create the probe timer, paths will use standard frames\n", m_target.nShelf, m_target.nSlot);
+			return;
+		}
+	}
+	
+	m_pProbeTimer->setTimeoutMS(0);
+}
+
+
+
+void AOE_CONTROLLER_NAME::ProbeTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_NAME, pOwner);
+	
+	if ( pThis )
+		pThis->run_path_probes();
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Start probing new paths and give up on probes that haven't come back
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_NAME::run_path_probes(void)
+{
+	struct PathProbe* pProbe;
+	bool fRunning;
+	int n;
+	
+	fRunning = FALSE;
+	
+	for (n=0; n<m_target.nNumberOfInterfaces; n++)
+	{
+		pProbe = &m_aPathProbe[n];
+		
+		switch ( pProbe->State )
+		{
+			case PROBE_NEEDED:
+				if ( !m_pProvider->interface_active(&m_target, n) )
+					break;
+				
+				pProbe->State = PROBE_RUNNING;
+				pProbe->nVerifiedSectors = 0;
+				pProbe->nProbeSectors = MIN(PROBE_BASE_SECTORS, path_limit(n));
+				pProbe->nAttempts = 0;
+				send_path_probe(n);
+				break;
+			case PROBE_RUNNING:
+				if ( time_since_now_ms(pProbe->TimeSent) < PROBE_TIMEOUT_MS )
+					break;
+				
+				if ( ++pProbe->nAttempts < PROBE_ATTEMPTS )
+				{
+					debugVerbose("[%d.%d] Probe of %d sectors on path %d was lost, trying again\n", m_target.nShelf, m_target.nSlot, pProbe->nProbeSectors, n);
+					send_path_probe(n);
+				}
+				else
+				{
+					debug("[%d.%d] Probes of %d sectors on path %d aren't getting through\n", m_target.nShelf, m_target.nSlot, pProbe->nProbeSectors, n);
+					finish_path_probe(n);
+				}
+				break;
+			case PROBE_DONE:
+				break;
+		}
+		
+		if ( PROBE_RUNNING==pProbe->State )
+			fRunning = TRUE;
+	}
+	
+	if ( fRunning && m_pProbeTimer )
+		m_pProbeTimer->setTimeoutMS(PROBE_TIMEOUT_MS);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Send a probe out a path. It isn't retransmitted, a lost probe is what we're looking for
+ ---------------------------------------------------------------------------*/
+int AOE_CONTROLLER_NAME::send_path_probe(int nPath)
+{
+	struct PathProbe* pProbe;
+	aoe_atahdr_full* pAoEFullATAHeader;
+	aoe_atahdr* pATAhdr;
+	mbuf_t m;
+	
+	pProbe = &m_aPathProbe[nPath];
+	
+	// The timer tries again if this fails
+	clock_get_uptime(&pProbe->TimeSent);
+	pProbe->Tag = m_pProvider->next_tag(m_nTagSlot);
+	
+	if ( 0!=create_mbuf_for_transfer(&m, pProbe->Tag, TRUE) )
+		return -1;
+	pAoEFullATAHeader = MTOD(m, aoe_atahdr_full*);
+	pATAhdr = &(pAoEFullATAHeader->ata);
+	
+	AOE_ATAHEADER_CLEAR(pATAhdr);
+	
+	// Read from the start of the disk (LBA 0)
+	pATAhdr->aa_aflags_errfeat = AOE_ATAHEADER_SETAFLAGSFEAT(AOE_AFLAGS_E, 0);
+	pATAhdr->aa_scnt_cmdstat = AOE_ATAHEADER_SETSCNTCMD(pProbe->nProbeSectors, kATAcmdReadExtended);
+	
+	debugVerbose("[%d.%d] Probing path %d with %d sectors (tag=%#x)\n", m_target.nShelf, m_target.nSlot, nPath, pProbe->nProbeSectors, pProbe->Tag);
+	
+	return m_pProvider->send_ata_packet(this, m, pProbe->Tag, &m_target, nPath, FALSE);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Check if a response is one of our probes. A probe that made it back moves its path on to the next size
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_NAME::handle_probe_response(aoe_atahdr_rd* pATAHeader, UInt32 Tag)
+{
+	struct PathProbe* pProbe;
+	int n;
+	
+	for (n=0; n<m_target.nNumberOfInterfaces; n++)
+		if ( (PROBE_RUNNING==m_aPathProbe[n].State) && (Tag==m_aPathProbe[n].Tag) )
+			break;
+	
+	if ( n==m_target.nNumberOfInterfaces )
+		return FALSE;
+	
+	pProbe = &m_aPathProbe[n];
+	
+	if ( AOE_ATAHEADER_GETSTAT(pATAHeader) & mATAError )
+	{
+		// The target wouldn't do the read, so this size can't be tested. Nothing larger than what has already made it
+		// through is trusted (finish_path_probe falls back to a standard frame if nothing has)
+		debugWarn("[%d.%d] Target returned an error to a probe of %d sectors on path %d\n", m_target.nShelf, m_target.nSlot, pProbe->nProbeSectors, n);
+		
+		finish_path_probe(n);
+		return TRUE;
+	}
+	
+	pProbe->nVerifiedSectors = pProbe->nProbeSectors;
+	
+	if ( pProbe->nProbeSectors >= path_limit(n) )
+	{
+		finish_path_probe(n);
+	}
+	else
+	{
+		pProbe->nProbeSectors = MIN(2*pProbe->nProbeSectors, path_limit(n));
+		pProbe->nAttempts = 0;
+		send_path_probe(n);
+	}
+	
+	return TRUE;
+}
 
-	debug("[%d.%d] Adjusting transfer sizes based on MTU of: %d bytes (%d sectors per transfer)\n", m_target.nShelf, m_target.nSlot, nMTU, m_nMaxSectorsPerTransfer);
+
+
+void AOE_CONTROLLER_NAME::finish_path_probe(int nPath)
+{
+	struct PathProbe* pProbe;
+	
+	pProbe = &m_aPathProbe[nPath];
+	
+	// If not even a standard frame got through, there's nothing better to go on
+	if ( 0==pProbe->nVerifiedSectors )
+		pProbe->nVerifiedSectors = MIN(PROBE_BASE_SECTORS, path_limit(nPath));
+	
+	pProbe->State = PROBE_DONE;
+	
+	debug("[%d.%d] Path %d (en%d) settled on %d sectors per transfer\n", m_target.nShelf, m_target.nSlot, nPath, m_target.aInterfaceNum[nPath], pProbe->nVerifiedSectors);
+	
+	update_path_sizes();
 }
 
 
@@ -2668,20 +5403,6 @@ IOReturn AOE_CONTROLLER_NAME::enqueueCommand( IOATABusCommand* command)
 	return super::enqueueCommand(command);
 }
 
-IOATABusCommand* AOE_CONTROLLER_NAME::dequeueFirstCommand( void )
-{
-	debugVerbose("AOE_CONTROLLER_NAME::  - super::dequeueFirstCommand\n");
-
-	return super::dequeueFirstCommand();	
-}
-
-IOReturn AOE_CONTROLLER_NAME::dispatchNext( void )
-{
-	debugVerbose("AOE_CONTROLLER_NAME::  - super::dispatchNext start\n");
-
-	return super::dispatchNext();
-}
-
 void AOE_CONTROLLER_NAME::executeEventCallouts( ataEventCode event, ataUnitID unit )
 {
 	debugVerbose("AOE_CONTROLLER_NAME:: - super::executeEventCallouts(event=%d, unit=%d)\n", event, unit);
@@ -2689,13 +5410,6 @@ void AOE_CONTROLLER_NAME::executeEventCallouts( ataEventCode event, ataUnitID un
 	super::executeEventCallouts(event, unit);
 }	
 
-void AOE_CONTROLLER_NAME::completeIO( IOReturn commandResult )
-{
-	debugVerbose("AOE_CONTROLLER_NAME::  - super::completeIO start = %ld\n",(long int)commandResult);
-
-	super::completeIO(commandResult);
-}
-
 IOReturn AOE_CONTROLLER_NAME::startTimer( UInt32 inMS)
 {
 	debugVerbose("AOE_CONTROLLER_NAME::  - super::startTimer(%d)\n", inMS);
@@ -15,8 +15,145 @@
 #include <IOKit/ata/IOATAController.h>
 #include "../Shared/AoEcommon.h"
 #include "aoe.h"
+#include "ChunkTracking.h"
+#include "WriteCoalescing.h"
+#include "ReadAheadWindow.h"
 
 class AOE_DEVICE_NAME;
+class AOE_BLOCK_DEVICE_NAME;
+class AOE_CONTROLLER_INTERFACE_NAME;
+class IOTimerEventSource;
+class IOWorkLoop;
+
+// Each path to a target is probed with reads of increasing size, starting from what a standard ethernet frame carries
+#define PROBE_BASE_SECTORS				COUNT_SECTORS_FROM_MTU(ETHERMTU)
+#define PROBE_TIMEOUT_MS				250
+#define PROBE_ATTEMPTS					2				// A size is only given up on after this many probes of it are lost
+
+// Received ATA responses wait here for the target's work loop. Past this, frames are dropped and resent
+#define MAX_QUEUED_RESPONSES			512
+
+enum PathProbeState
+{
+	PROBE_NEEDED,						// Not probed since the path was found (or since the last link event)
+	PROBE_RUNNING,
+	PROBE_DONE
+};
+
+struct PathProbe
+{
+	enum PathProbeState	State;
+	int					nVerifiedSectors;		// Largest frame that's made it to the target and back on this path
+	int					nProbeSectors;			// Size of the probe that's out
+	int					nAttempts;
+	UInt32				Tag;
+	uint64_t			TimeSent;
+};
+
+// Keeps a command's client memory wired and mapped. Reads copy straight into it and write frames point into
+// it, so it's held until the command completes (reads) or the last frame pointing into it has been freed (writes).
+// A frame can be freed from any context (eg. the driver's transmit completion), so when that drops the last
+// reference the mapping is passed to its owner to be released on a work loop (see release_mapping_later)
+struct ClientMapping
+{
+	IOMemoryDescriptor*				pDescriptor;
+	IOMemoryMap*					pMap;
+	volatile SInt32					nReferences;
+	AOE_CONTROLLER_INTERFACE_NAME*	pOwner;
+	struct ClientMapping*			pNextReleased;		// On the owner's list of mappings waiting to be released
+};
+
+// State kept for each read/write command running in queued mode. While a response for one of these is being
+// handled, it's loaded into the controller's single-command members so the usual state machine can be used.
+struct QueuedATACommand
+{
+	IOATABusCommand*	pCommand;
+	UInt32				BaseTag;				// Tag of the first frame, the others follow on in sequence
+	int					nFrames;
+	int					nRepliesRequired;
+	UInt8				PreviousWriteStatus;
+	UInt8				PreviousWriteError;
+	struct ClientMapping*	pReadMapping;
+	UInt32*				pReceivedChunks;		// This command's own received-chunk bitmap
+	UInt16*				pChunkOffsets;			// and where each of its chunks starts (in sectors)
+	int					nRetryChunk;
+	bool				fSinglePath;
+	uint64_t			TimeStarted;
+	UInt32				nTimeoutMS;				// The command fails with kATATimeoutErr if it's still running after this
+};
+
+// IOATAController's timer only covers _currentCommand, so queued commands are timed by our own timer instead
+#define QUEUED_DEFAULT_TIMEOUT_MS		(60*1000)		// Used if a command doesn't have a timeout of its own
+#define QUEUED_TIMEOUT_CHECK_MS			1000
+
+// Frames of queued commands that may be in flight at once. Every frame takes a sequence number from the target's tag
+// slot, and the sequence space has to be left room for read-ahead and for a late response not to match a newer frame
+#define QUEUED_MAX_FRAMES				((TAG_SEQUENCE_MASK+1)/2 - READ_AHEAD_BUFFER_SECTORS)
+
+// Write commands to adjacent sectors, sent as one transfer. The first command carries the transfer (its buffer is
+// swapped for one covering all of them), the others are completed along with it.
+struct CoalescedWrite
+{
+	IOATABusCommand*	apCommands[MAX_COALESCED_WRITES];
+	int					nCommands;
+	UInt64				NextLBA;				// Sector following the last command
+	IOByteCount			Bytes;
+	IOMemoryDescriptor*	pOriginalBuffer;		// The first command's own buffer and size, put back when it completes
+	IOByteCount			OriginalByteCount;
+	UInt16				OriginalSectors;
+	IOMemoryDescriptor*	pBuffer;
+};
+
+// In write-back mode, a write is copied into a command of our own which is sent in its place, and the client's command
+// is completed straight away. The copy keeps its queue slot until the target has acknowledged all of it.
+struct WriteBack
+{
+	IOATABusCommand*	pCommand;				// Our copy of the write
+	UInt64				LBA;					// The sectors it covers (its own LBA is moved on as the frames are sent)
+	int					nSectors;
+};
+
+// Read-ahead (see ReadAheadWindow.h for how far ahead is read)
+#define READ_AHEAD_TIMEOUT_MS			100				// Read-ahead isn't retransmitted, if any of it is missing by then it's thrown away
+#define READ_AHEAD_BATCHES				8
+
+// The frames sent for one go at reading ahead (their tags follow on from BaseTag)
+struct ReadAheadBatch
+{
+	UInt32				BaseTag;
+	int					nFrames;
+	int					nFrameSectors;			// All but the last frame are this size
+	int					nSectors;
+	UInt64				StartLBA;
+	bool				fLive;					// Cleared when the read-ahead is thrown away, its responses are then ignored
+};
+
+struct ReadAhead
+{
+	UInt64				NextLBA;				// Where the client's next read is expected to start
+	int					nSequential;			// Number of reads in a row that started where the one before ended
+	int					nWindow;				// How far ahead of the client to read (in sectors)
+	UInt64				Start;					// Sectors held in (or on their way to) the buffer are [Start, End)
+	UInt64				End;
+	UInt8*				pBuffer;				// Sector LBA is kept at (LBA % READ_AHEAD_BUFFER_SECTORS)
+	UInt32*				pReceived;				// One bit for each sector of the buffer
+	struct ReadAheadBatch	aBatches[READ_AHEAD_BATCHES];
+	int					nNextBatch;
+	uint64_t			TimeSent;				// When the last batch went out
+	IOATABusCommand*	pWaiting;				// Read waiting for sectors that are on their way
+	IOATABusCommand*	pReleased;				// Read that stopped waiting, it's sent to the target as normal
+};
+
+// Reads that went to the target are added to the read cache (see AoEControllerInterface.h) when they complete, unless a
+// write was taken off the queue while they were in flight. There can be a read in flight for each queue slot, plus
+// _currentCommand and the command held back by dispatchNext
+#define READ_CACHE_FILLS				(2+MAX_QUEUE_DEPTH)
+
+struct CacheFill
+{
+	IOATABusCommand*	pCommand;
+	UInt32				nGeneration;			// m_nCacheGeneration when the read was taken off the queue
+};
 class AOE_CONTROLLER_INTERFACE_NAME;
 class IOExtendedLBA;
 
@@ -29,13 +166,30 @@ class AOE_CONTROLLER_NAME : public IOATAController
 public:
 	bool init(AOE_CONTROLLER_INTERFACE_NAME* pProvider, int nShelf, int nSlot, ifnet_t ifnet_receive, u_char* pTargetsMACAddress, UInt32 MTU, int m_nMaxTransferSize, int nNumber);
 	void uninit(void);
+	virtual void free(void);
 
+	/*!@function getWorkLoop
+	 @abstract The target's commands, timers and responses all run on the work loop it was given by set_work_loop.
+	 */
+	virtual IOWorkLoop* getWorkLoop() const;
+	void set_work_loop(IOWorkLoop* pWorkLoop);
+	/*!@function lock_target
+	 @abstract Hold the target's work loop gate while calling in from another thread (eg. the service's work loop).
+	 */
+	void lock_target(void);
+	void unlock_target(void);
+	virtual bool start(IOService* provider);
+	/*!@function queue_response
+	 @abstract Hand a received ATA response to the target's work loop. This is called from the interface filter, so the frame is copied.
+	 */
+	bool queue_response(mbuf_t m);
 
 	void registerDiskService(void);
 	void attach_device(void);
 	int is_device(int nShelf, int nSlot);
 	int update_target_info(ifnet_t ifnet_receive, u_char* pTargetsMACAddress, bool fOnline);
 	int ata_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData, UInt32 Tag);
+	int fake_response(void);
 	int target_number(void);
 	void remove_all_interfaces(void);
 	void set_number_sectors(UInt64 Sectors);
@@ -49,6 +203,15 @@ public:
 	
 	int force_packet_send(ForcePacketInfo* pForcedPacketInfo);
 	int is_registered(void) { return m_fRegistered ? 0 : -1; };
+	void set_tag_slot(int nTagSlot) { m_nTagSlot = nTagSlot; };
+	void set_queue_depth(int nQueueDepth);
+	void set_write_coalesce(int nWindow_us);
+	void set_flush_mode(int nMode);
+	void set_publish_mode(int nMode);
+	UInt64 identified_capacity(void) { return m_IdentifiedCapacity; };
+	bool capacity_changed(void) { return m_fCapacityChanged; };
+	int max_transfer_size(void) { return m_nMaxTransferSize; };
+	int tag_slot(void) { return m_nTagSlot; };
 	int connected_to_interface(ifnet_t enetifnet);
 	void set_mtu_size(int nMTU);
 	void device_online(void);
@@ -65,22 +228,95 @@ public:
 #endif
 private:
 	void remove_interface(int nInterfaceNumber);
+	void register_block_device(void);
 	int create_mbuf_for_transfer(mbuf_t* m, UInt32 Tag, bool fATA);
 	void print_mem(UInt8* pMem, int nSize);
 	int append_write_data(mbuf_t* pm);
 	static void cluster_free(caddr_t add, u_int size, caddr_t add2);
+	struct ClientMapping* map_client_buffer(IOMemoryDescriptor* pDescriptor);
+	static void release_client_mapping(struct ClientMapping* pMapping);
+public:
+	static void free_client_mapping(struct ClientMapping* pMapping);
+private:
+	void copy_to_client(IOByteCount Position, void* pData, IOByteCount Bytes);
 	bool is_extended_command(void);
+	UInt64 extended_address(IOExtendedLBA* extLBA);
 	void increment_address(IOExtendedLBA* extLBA, int nInc);
 	void increment_address(ataTaskFile* tfRegs, int nInc);
 	void update_interface_property(void);
-	int attach_ext_to_mbuf(mbuf_t* pm, caddr_t MBufExtData, IOByteCount Size);
+	int attach_ext_to_mbuf(mbuf_t* pm, caddr_t MBufExtData, IOByteCount Size, struct ClientMapping* pMapping = NULL);
+	bool is_queueable(IOATABusCommand* pCommand);
+	bool sequence_space_available(IOATABusCommand* pCommand);
+	UInt8 ata_command(IOATABusCommand* pCommand);
+	void start_queued_command(IOATABusCommand* pCommand);
+	QueuedATACommand* find_queued_command(UInt32 Tag);
+	void load_queued_command(QueuedATACommand* pQueued);
+	void store_queued_command(QueuedATACommand* pQueued);
+	void complete_queued_command(QueuedATACommand* pQueued, IOReturn err);
+	void cancel_queued_commands(IOReturn err);
+	bool start_queue_timer(void);
+	static void QueueTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	void check_queued_timeouts(void);
+	bool mark_chunk_received(void);
+	IOReturn issue_block_transfer(IOExtendedLBA* extLBA, ataTaskFile* tfRegs);
+	void update_path_sizes(void);
+	int path_limit(int nPath);
+	void schedule_path_probes(void);
+	static void ProbeTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	static void FakeResponseTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	static void ReceiveTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	void run_path_probes(void);
+	int send_path_probe(int nPath);
+	bool handle_probe_response(aoe_atahdr_rd* pATAHeader, UInt32 Tag);
+	void finish_path_probe(int nPath);
+	void resend_missing_chunks(int nChunk);
+	IOATABusCommand* next_command(void);
+	bool gather_write(IOATABusCommand* pCommand);
+	IOATABusCommand* finish_gathering(void);
+	bool start_coalesce_timer(void);
+	static void CoalesceTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	void complete_coalesced_writes(IOReturn commandResult);
+	void flush_coalesced_writes(IOReturn err);
+	bool handle_read(IOATABusCommand* pCommand);
+	bool alters_data(IOATABusCommand* pCommand);
+	bool writes_in_flight(void);
+	void send_read_ahead(void);
+	bool handle_read_ahead_response(aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData, UInt32 Tag);
+	void copy_to_read_ahead(IOByteCount Position, void* pData, IOByteCount Bytes);
+	bool read_ahead_received(UInt64 LBA, int nSectors);
+	void release_read_ahead(UInt64 LBA, bool fUsed);
+	void discard_read_ahead(void);
+	void complete_from_read_ahead(IOATABusCommand* pCommand);
+	static void ReadAheadTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	void check_read_ahead(void);
+	void cancel_read_ahead(IOReturn err);
+	void complete_from_memory(IOATABusCommand* pCommand);
+	void note_cache_fill(IOATABusCommand* pCommand);
+	void fill_read_cache(IOReturn commandResult);
+	void invalidate_read_cache(IOATABusCommand* pCommand);
+	bool is_flush(IOATABusCommand* pCommand);
+	bool start_write_back(IOATABusCommand* pCommand);
+	bool overlaps_write_back(IOATABusCommand* pCommand);
+	bool fail_after_write_back(IOATABusCommand* pCommand);
+	static void WriteBackDone(IOATACommand* pCommand);
+	void write_back_done(IOATACommand* pCommand);
 
 
 	AOE_DEVICE_NAME*				m_pAoEDevice;
+	AOE_BLOCK_DEVICE_NAME*			m_pBlockDevice;				// Published in place of m_pAoEDevice in PUBLISH_MODE_BLOCK_STORAGE
+	bool							m_fBlockDeviceRegistered;
+	int								m_nPublishMode;
+	IOWorkLoop*						m_pWorkLoop;				// Shared with the other targets hashed to the same loop
 	AOE_CONTROLLER_INTERFACE_NAME*	m_pProvider;
 	TargetInfo						m_target;
-	UInt32							m_MTU;
-	int								m_nMaxSectorsPerTransfer;
+	UInt32							m_MTU;						// Only used for paths whose interface doesn't report an MTU
+	int								m_nMaxSectorsPerTransfer;	// Largest frame on any of the paths
+	int								m_anPathSectors[MAX_SUPPORTED_ETHERNET_CONNECTIONS];	// Frame size for each path (indexed as m_target.aInterfaces)
+	int								m_nTargetMaxSectors;		// Sector count the target advertised in its config response (0 if unknown)
+	struct PathProbe				m_aPathProbe[MAX_SUPPORTED_ETHERNET_CONNECTIONS];		// Indexed as m_target.aInterfaces
+	IOTimerEventSource*				m_pProbeTimer;
+	int								m_nFramePath;				// Path and size of the frame being built by issueCommand (-1 to let the provider pick)
+	int								m_nFrameSectors;
 	aoe_atahdr_rd*					m_pReceivedATAHeader;
 	UInt32							m_unReceivedATADataSize;
 	bool							m_fExtendedLBA;
@@ -98,6 +334,50 @@ private:
 	ataEventCode					m_ATAState;
 	UInt32							m_nOutstandingIdentTag;
 	UInt64							m_IdentifiedCapacity;
+	bool							m_fCapacityChanged;			// The provider removes us from its own work loop
+	int								m_nTagSlot;
+	QueuedATACommand				m_aQueued[MAX_QUEUE_DEPTH];
+	int								m_nQueued;
+	int								m_nQueueDepth;
+	IOATABusCommand*				m_pDeferredCommand;			// Non read/write command waiting for the queued commands to drain
+	IOTimerEventSource*				m_pQueueTimer;
+	IOTimerEventSource*				m_pFakeResponseTimer;		// Answers commands the target doesn't support (see send_ata_packet)
+	IOTimerEventSource*				m_pReceiveTimer;			// Runs the responses in m_ReceivedFrames on our work loop
+	IOSimpleLock*					m_pReceiveLock;				// Guards m_ReceivedFrames and m_pReceiveTimer, it's taken on the filter thread
+	mbuf_t							m_ReceivedFrames;			// Received responses waiting for the work loop (chained with mbuf_nextpkt)
+	mbuf_t							m_LastReceivedFrame;
+	int								m_nReceivedFrames;
+	bool							m_fQueueTimerRunning;
+	struct ClientMapping*			m_pWriteMapping;			// Client memory of the write command being sent (NULL when using the double buffer)
+	struct ClientMapping*			m_pReadMapping;				// Client memory of the read command being received (NULL to use writeBytes)
+	UInt64							m_ReadBytesCopied;			// Read copies made since the last command completed (handed to the provider then)
+	UInt64							m_ReadCopyTime;
+	UInt32*							m_pChunkBitmaps;			// One received-chunk bitmap for the single command and one for each queued slot
+	UInt16*							m_pChunkOffsetTables;		// The same again for the chunk offsets
+	int								m_nChunkTableSize;			// Most chunks a command can be split into
+	int								m_nChunkBitmapWords;
+	UInt32*							m_pReceivedChunks;			// Bitmap of the command being handled
+	UInt16*							m_pChunkOffsets;			// Chunk offsets of the command being handled
+	int								m_nChunks;					// Number of frames the command being handled was split into
+	int								m_nRetryChunk;				// Chunks before this one have been received or resent
+	bool							m_fSinglePath;				// All of the command's frames went out on the same path
+	int								m_nWriteCoalesce_us;		// How long writes wait for adjacent writes to merge with (0 to disable)
+	struct CoalescedWrite			m_Gathering;				// Writes taken off the queue that are waiting to be merged
+	int								m_nUnmergedWrites;			// If they couldn't be merged, how many have been sent on their own so far
+	IOATABusCommand*				m_pLookahead;				// Command taken off the queue that ended the gathering (it goes next)
+	IOTimerEventSource*				m_pCoalesceTimer;
+	bool							m_fCoalesceTimerRunning;
+	bool							m_fCoalesceExpired;			// The gathered writes have waited long enough
+	struct CoalescedWrite			m_aCoalesced[1+MAX_QUEUE_DEPTH];	// Merged transfers in flight (never more than the commands in flight)
+	bool							m_fInNextCommand;			// Completing a command from next_command can call back into it
+	struct ReadAhead				m_ReadAhead;
+	IOTimerEventSource*				m_pReadAheadTimer;
+	UInt32							m_nCacheGeneration;			// Bumped each time a write is taken off the queue
+	struct CacheFill				m_aCacheFills[READ_CACHE_FILLS];
+	int								m_nFlushMode;
+	struct WriteBack				m_aWriteBacks[MAX_QUEUE_DEPTH];
+	int								m_nWriteBacks;
+	IOReturn						m_WriteBackError;			// First write-back write to fail since the last flush
 	
 	//-------------------------------------------------------------//
 	// The following functions are overrides from IOATAController. //
@@ -138,6 +418,9 @@ protected:
 	virtual void handleTimeout( void );
 	virtual bool allocateDoubleBuffer( void );
 	virtual bool busCanDispatch( void );
+	virtual IOATABusCommand* dequeueFirstCommand( void );
+	virtual IOReturn dispatchNext( void );
+	virtual void completeIO( IOReturn commandResult );
 	
 /////////// THE FOLLOWING OVERIDES ARE JUST FOR DEBUGGING PURPOSES
 #ifdef DEBUGBUILD
@@ -148,10 +431,7 @@ protected:
 								   void *     param2 = 0,
 								   void *     param3 = 0);
 	virtual IOReturn enqueueCommand( IOATABusCommand* command);
-	virtual IOATABusCommand* dequeueFirstCommand( void );
-	virtual IOReturn dispatchNext( void );
 	virtual void executeEventCallouts( ataEventCode event, ataUnitID unit );
-	virtual void completeIO( IOReturn commandResult );
 	virtual IOReturn startTimer( UInt32 inMS);
 	virtual void stopTimer(void);
 	virtual IOReturn handleExecIO( void );
@@ -64,14 +64,46 @@ bool AOE_CONTROLLER_INTERFACE_NAME::init(AOE_KEXT_NAME* pAoEService)
 {
 	debug("AOE_CONTROLLER_INTERFACE_NAME::init\n");
 	bool nRet = super::init(NULL);
+	int n;
 	
 	m_pAoEService = pAoEService;
 	m_fLUNSearchRunning = FALSE;
 	m_pTargetListMutex = IOLockAlloc();
+	memset(m_apTargetWorkLoops, 0, sizeof(m_apTargetWorkLoops));
 	m_TimeUntilTargetOffline_us = DEFAULT_TIME_UNTIL_TARGET_OFFLINE_US;
-	m_pControllerToFakeResponse = NULL;
 	m_nCurrentTag = MIN_TAG;
+	memset(m_apTagSlot, 0, sizeof(m_apTagSlot));
+	memset(m_anTagGeneration, 0, sizeof(m_anTagGeneration));
+	memset(m_anTagSequence, 0, sizeof(m_anTagSequence));
+	m_anTagGeneration[0] = 1;		// Keeps the shared slot's tags from ever being 0
+	m_nTagSlotsInUse = 0;
+	m_nTagSlotFailures = 0;
+	m_Dispatch.ppShelves = NULL;
+	m_Dispatch.nShelves = 0;
 	m_nMaxTransferSize = DEFAULT_MAX_TRANSFER_SIZE;
+	m_nQueueDepth = DEFAULT_QUEUE_DEPTH;
+	m_pStatisticsMutex = IOLockAlloc();
+	m_WriteBytes = 0;
+	m_WriteBytesCopied = 0;
+	m_ReadBytesCopied = 0;
+	m_ReadCopyTime = 0;
+	m_nDuplicateChunks = 0;
+	m_nWriteCoalesce_us = DEFAULT_WRITE_COALESCE_US;
+	m_nFlushMode = DEFAULT_FLUSH_MODE;
+	m_nPublishMode = DEFAULT_PUBLISH_MODE;
+	m_nCoalescedWrites = 0;
+	m_nCoalescedTransfers = 0;
+	m_nReadAheadHits = 0;
+	m_nReadAheadMisses = 0;
+	m_ReadAheadWasted = 0;
+	m_pCacheMutex = IOLockAlloc();
+	read_cache_init(&m_ReadCache);
+	m_nCacheHits = 0;
+	m_nCacheMisses = 0;
+	m_CacheBytesServed = 0;
+	m_pReleaseTimer = NULL;
+	m_pReleaseLock = IOSimpleLockAlloc();
+	m_pReleasedMappings = NULL;
 	
 	m_pControllers = OSArray::withCapacity(2);
 
@@ -105,18 +137,19 @@ bool AOE_CONTROLLER_INTERFACE_NAME::init(AOE_KEXT_NAME* pAoEService)
 			goto Done;
 		}
 		
-		m_pFakeReturnTimer = IOTimerEventSource::timerEventSource(this, (IOTimerEventSource::Action) &AOE_CONTROLLER_INTERFACE_NAME::FakeReturnTimer);
+		m_pReleaseTimer = IOTimerEventSource::timerEventSource(this, (IOTimerEventSource::Action) &AOE_CONTROLLER_INTERFACE_NAME::ReleaseTimer);
 		
-		if ( !m_pFakeReturnTimer )
+		if ( (NULL==m_pReleaseTimer) || (NULL==m_pReleaseLock) )
 		{
-			debugError("Unable to create m_pFakeReturnTimer timerEventSource\n");
+			debugError("Unable to create m_pReleaseTimer timerEventSource\n");
 			nRet = FALSE;
 			goto Done;
 		}
 		
-		if ( pWorkLoop->addEventSource(m_pFakeReturnTimer) != kIOReturnSuccess )
+		if ( pWorkLoop->addEventSource(m_pReleaseTimer) != kIOReturnSuccess )
 		{
-			debugError("Unable to add m_pFakeReturnTimer timerEventSource to work loop\n");
+			debugError("Unable to add m_pReleaseTimer timerEventSource to work loop\n");
+			CLEAN_RELEASE(m_pReleaseTimer);
 			nRet = FALSE;
 			goto Done;
 		}
@@ -137,6 +170,7 @@ void AOE_CONTROLLER_INTERFACE_NAME::uninit(void)
 	OSCollectionIterator* pControllerIterator;
 	AOE_CONTROLLER_NAME* pController;
 	IOWorkLoop* pWorkLoop;
+	int n;
 	
 	debug("AOE_CONTROLLER_INTERFACE_NAME::uninit\n");
 	
@@ -153,32 +187,139 @@ void AOE_CONTROLLER_INTERFACE_NAME::uninit(void)
 		}
 	}
 	
-	if ( m_pFakeReturnTimer )
-	{
-		m_pFakeReturnTimer->cancelTimeout();
-		if ( pWorkLoop )
-		{
-			pWorkLoop->removeEventSource(m_pFakeReturnTimer);
-			CLEAN_RELEASE(m_pFakeReturnTimer);
-		}
-	}
-	
     pControllerIterator = OSCollectionIterator::withCollection(m_pControllers);
     if ( pControllerIterator )
 	{
 		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
 		{
+			pController->lock_target();
 			pController->uninit();
 			pController->terminate();
+			pController->unlock_target();
 		}
 		
 		pControllerIterator->release();
 	}
 	
+	IOLockLock(m_pTargetListMutex);
+	memset(m_apTagSlot, 0, sizeof(m_apTagSlot));
+	free_dispatch();
+	IOLockUnlock(m_pTargetListMutex);
+	
+	IOLockLock(m_pCacheMutex);
+	read_cache_set_size(&m_ReadCache, 0);
+	IOLockUnlock(m_pCacheMutex);
+	IOLockFree(m_pCacheMutex);
+	m_pCacheMutex = NULL;
+	
+	// Release whatever mappings the last frames have given back. Frames still waiting to be sent keep theirs
+	if ( m_pReleaseTimer )
+	{
+		m_pReleaseTimer->cancelTimeout();
+		if ( pWorkLoop )
+			pWorkLoop->removeEventSource(m_pReleaseTimer);
+		CLEAN_RELEASE(m_pReleaseTimer);
+	}
+	release_mappings();
+	if ( m_pReleaseLock )
+		IOSimpleLockFree(m_pReleaseLock);
+	m_pReleaseLock = NULL;
+	
 	m_pControllers->flushCollection();
 	CLEAN_RELEASE(m_pControllers);
 	IOLockFree(m_pTargetListMutex);
 	m_pTargetListMutex = NULL;
+	IOLockFree(m_pStatisticsMutex);
+	m_pStatisticsMutex = NULL;
+	
+	// The controllers hold their own reference until they're freed
+	for (n=0; n<TARGET_WORK_LOOPS; n++)
+		CLEAN_RELEASE(m_apTargetWorkLoops[n]);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The last frame pointing into a write's client memory has been freed. That can happen wherever the mbuf is freed
+ * (often the driver's transmit completion), where unwiring the memory and freeing isn't allowed. The mapping is put
+ * on a list and released from our work loop instead. This is also kept apart from the target's own loop, as the
+ * target may have been removed by the time its last frames are freed
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::release_mapping_later(struct ClientMapping* pMapping)
+{
+	bool fWasEmpty;
+	
+	// We've been shut down, there's no work loop left to hand it to
+	if ( NULL==m_pReleaseLock )
+	{
+		AOE_CONTROLLER_NAME::free_client_mapping(pMapping);
+		return;
+	}
+	
+	IOSimpleLockLock(m_pReleaseLock);
+	fWasEmpty = (NULL==m_pReleasedMappings);
+	pMapping->pNextReleased = m_pReleasedMappings;
+	m_pReleasedMappings = pMapping;
+	IOSimpleLockUnlock(m_pReleaseLock);
+	
+	if ( fWasEmpty && m_pReleaseTimer )
+		m_pReleaseTimer->setTimeoutUS(0);
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::ReleaseTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_CONTROLLER_INTERFACE_NAME* pThis = OSDynamicCast(AOE_CONTROLLER_INTERFACE_NAME, pOwner);
+	
+	if ( pThis )
+		pThis->release_mappings();
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::release_mappings(void)
+{
+	struct ClientMapping* pMapping;
+	struct ClientMapping* pNext;
+	
+	if ( NULL==m_pReleaseLock )
+		return;
+	
+	IOSimpleLockLock(m_pReleaseLock);
+	pMapping = m_pReleasedMappings;
+	m_pReleasedMappings = NULL;
+	IOSimpleLockUnlock(m_pReleaseLock);
+	
+	for (; pMapping; pMapping=pNext)
+	{
+		pNext = pMapping->pNextReleased;
+		AOE_CONTROLLER_NAME::free_client_mapping(pMapping);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Pick the work loop a new target runs on. Each target is tied to one of TARGET_WORK_LOOPS loops by its
+ * shelf/slot, so its commands and responses are serialised while different targets complete in parallel.
+ * Targets without a tag slot of their own all share slot 0's sequence, so they're kept on the first loop
+ ---------------------------------------------------------------------------*/
+
+IOWorkLoop* AOE_CONTROLLER_INTERFACE_NAME::target_work_loop(int nShelf, int nSlot, int nTagSlot)
+{
+	int nLoop;
+	
+	nLoop = (0==nTagSlot) ? 0 : (nShelf*MAX_SLOTS + nSlot) % TARGET_WORK_LOOPS;
+	
+	if ( NULL==m_apTargetWorkLoops[nLoop] )
+	{
+		m_apTargetWorkLoops[nLoop] = IOWorkLoop::workLoop();
+		if ( NULL==m_apTargetWorkLoops[nLoop] )
+			debugError("Unable to create work loop %d, target %d.%d will share the service's work loop\n", nLoop, nShelf, nSlot);
+	}
+	
+	return m_apTargetWorkLoops[nLoop];
 }
 
 
@@ -188,20 +329,153 @@ void AOE_CONTROLLER_INTERFACE_NAME::uninit(void)
 #pragma mark Tag handling
 
 /*---------------------------------------------------------------------------
- * All outgoing aoe packets will get their tag from here
+ * Tags for packets that don't belong to a target (eg. the broadcast config query). These can be asked for
+ * from any thread, so the counter is only moved on atomically
  ---------------------------------------------------------------------------*/
 
 UInt32	AOE_CONTROLLER_INTERFACE_NAME::next_tag()
 {
-	++m_nCurrentTag;
-	m_nCurrentTag = MAX(m_nCurrentTag, MIN_TAG);
-	m_nCurrentTag = MIN(m_nCurrentTag, MAX_TAG);
+	UInt32 OldTag;
+	UInt32 NewTag;
+	
+	do
+	{
+		OldTag = m_nCurrentTag;
+		NewTag = OldTag+1;
+		
+		// Check for wrap around
+		if ( (NewTag<MIN_TAG) || (NewTag>=MAX_TAG) )
+			NewTag = MIN_TAG;
+	} while ( !OSCompareAndSwap(OldTag, NewTag, &m_nCurrentTag) );
+	
+	return NewTag;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Tags for a target's own commands come from its slot, so the response can be routed without searching.
+ * Consecutive calls return consecutive sequence numbers, the read path relies on this to place the data.
+ ---------------------------------------------------------------------------*/
+
+UInt32	AOE_CONTROLLER_INTERFACE_NAME::next_tag(int nTagSlot)
+{
+	// Targets without a slot share slot 0. They all run on the same work loop (see target_work_loop), so like
+	// any other slot, its sequence is only moved on with that loop's gate held
+	if ( (nTagSlot<0) || (nTagSlot>=TAG_SLOTS) )
+		nTagSlot = 0;
+
+	++m_anTagSequence[nTagSlot];
+	
+	return TAG_MAKE(nTagSlot, m_anTagGeneration[nTagSlot], m_anTagSequence[nTagSlot]);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Give a new target its own tag slot. If they're all taken, the target uses slot 0 and its responses are
+ * looked up by shelf/slot instead
+ ---------------------------------------------------------------------------*/
+
+int AOE_CONTROLLER_INTERFACE_NAME::alloc_tag_slot(AOE_CONTROLLER_NAME* pController)
+{
+	int nTagSlot;
+	
+	IOLockLock(m_pTargetListMutex);
+	
+	for (nTagSlot=1; nTagSlot<TAG_SLOTS; nTagSlot++)
+		if ( NULL==m_apTagSlot[nTagSlot] )
+		{
+			m_apTagSlot[nTagSlot] = pController;
+			m_anTagSequence[nTagSlot] = 0;
+			++m_nTagSlotsInUse;
+			pController->set_tag_slot(nTagSlot);
+			IOLockUnlock(m_pTargetListMutex);
+			
+			debugVerbose("Target given tag slot %d (generation %d)\n", nTagSlot, m_anTagGeneration[nTagSlot]);
+			return nTagSlot;
+		}
+	
+	++m_nTagSlotFailures;
+	IOLockUnlock(m_pTargetListMutex);
+	
+	debugError("All %d tag slots are in use, target will share slot 0 and can't run queued commands\n", TAG_SLOTS-1);
+	pController->set_tag_slot(0);
+	return 0;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Release a target's tag slot. The generation is moved on so any responses still in flight for this target
+ * are dropped rather than handed to whichever target is given the slot next
+ ---------------------------------------------------------------------------*/
+
+void AOE_CONTROLLER_INTERFACE_NAME::free_tag_slot(AOE_CONTROLLER_NAME* pController)
+{
+	int nTagSlot;
+	
+	nTagSlot = pController->tag_slot();
+	pController->set_tag_slot(0);
+	
+	if ( (nTagSlot<=0) || (nTagSlot>=TAG_SLOTS) )
+		return;
+	
+	IOLockLock(m_pTargetListMutex);
+	if ( pController==m_apTagSlot[nTagSlot] )
+	{
+		m_apTagSlot[nTagSlot] = NULL;
+		m_anTagGeneration[nTagSlot] = (m_anTagGeneration[nTagSlot]+1) % TAG_GENERATIONS;
+		--m_nTagSlotsInUse;
+	}
+	IOLockUnlock(m_pTargetListMutex);
+}
+
+
+
+
+
+
+#pragma mark -
+#pragma mark Target lookup
+
+/*---------------------------------------------------------------------------
+ * Find the controller for a shelf/slot. This is called for received packets, so it must not allocate.
+ * The table is only changed on our work loop with m_pTargetListMutex held, callers off the work loop must hold it too
+ ---------------------------------------------------------------------------*/
+
+AOE_CONTROLLER_NAME* AOE_CONTROLLER_INTERFACE_NAME::find_controller(int nShelf, int nSlot)
+{
+	return dispatch_find(&m_Dispatch, nShelf, nSlot);
+}
+
+
+
+int AOE_CONTROLLER_INTERFACE_NAME::add_to_dispatch(AOE_CONTROLLER_NAME* pController)
+{
+	TargetInfo* pTargetInfo;
+	
+	pTargetInfo = pController->get_target_info();
+	
+	return dispatch_add(&m_Dispatch, pTargetInfo->nShelf, pTargetInfo->nSlot, pController);
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::remove_from_dispatch(AOE_CONTROLLER_NAME* pController)
+{
+	TargetInfo* pTargetInfo;
 	
-	// Check for wrap around
-	if ( m_nCurrentTag==MAX_TAG )
-		m_nCurrentTag = MIN_TAG;
+	pTargetInfo = pController->get_target_info();
 	
-	return m_nCurrentTag;
+	dispatch_remove(&m_Dispatch, pTargetInfo->nShelf, pTargetInfo->nSlot, pController);
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::free_dispatch(void)
+{
+	dispatch_free(&m_Dispatch);
 }
 
 
@@ -282,49 +556,118 @@ errno_t AOE_CONTROLLER_INTERFACE_NAME::aoe_search(ifnet_t ifnet)
 #pragma mark config command parsing
 
 /*---------------------------------------------------------------------------
- * Handle the reception of a received ata packet
+ * Find the target an ATA response is for, retained so it can't go away while the response is passed on. NULL if
+ * it isn't one of ours (or has since been removed). This isn't only called on our work loop, so it holds m_pTargetListMutex
  ---------------------------------------------------------------------------*/
-int AOE_CONTROLLER_INTERFACE_NAME::aoe_ata_receive(aoe_header* pAoEFullHeader, aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData)
+AOE_CONTROLLER_NAME* AOE_CONTROLLER_INTERFACE_NAME::find_response_target(aoe_header* pAoEFullHeader)
 {
-	bool fFoundDevice;
+	AOE_CONTROLLER_NAME* pController;
 	int nMajor;
 	int nMinor;
+	UInt32 Tag;
+	int nTagSlot;
 	
 	nMajor = AOE_HEADER_GETMAJOR(pAoEFullHeader);
 	nMinor = AOE_HEADER_GETMINOR(pAoEFullHeader);
+	Tag = AOE_HEADER_GETTAG(pAoEFullHeader);
+	
+	IOLockLock(m_pTargetListMutex);
+	
+	// Tags from a target's own slot take us straight to the controller
+	nTagSlot = TAG_GET_SLOT(Tag);
+	if ( (0==(Tag & (TAG_USER_MASK|TAG_BROADCAST_MASK))) && (0!=nTagSlot) )
+	{
+		pController = m_apTagSlot[nTagSlot];
+		
+		if ( (NULL==pController) || (TAG_GET_GENERATION(Tag)!=m_anTagGeneration[nTagSlot]) )
+		{
+			IOLockUnlock(m_pTargetListMutex);
+			debugVerbose("Dropping ATA response for a target that has since been removed (tag=%#x)\n", Tag);
+			return NULL;
+		}
+		
+		if ( 0!=pController->is_device(nMajor, nMinor) )
+		{
+			IOLockUnlock(m_pTargetListMutex);
+			debugError("ATA response from %d.%d doesn't match the target that sent tag %#x\n", nMajor, nMinor, Tag);
+			return NULL;
+		}
+	}
+	else
+		pController = find_controller(nMajor, nMinor);
+	
+	if ( pController )
+		pController->retain();
+	
+	IOLockUnlock(m_pTargetListMutex);
+	
+	return pController;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Pass an ATA response from the interface filter to its target's work loop. Returns FALSE if the target can't take
+ * it, the service then handles it on its own command gate as it does for every other frame
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_INTERFACE_NAME::queue_ata_response(aoe_header* pAoEFullHeader, mbuf_t m)
+{
+	AOE_CONTROLLER_NAME* pController;
+	bool fQueued;
+	
+	pController = find_response_target(pAoEFullHeader);
+	if ( NULL==pController )
+		return FALSE;
+	
+	fQueued = pController->queue_response(m);
+	pController->release();
+	
+	return fQueued;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * A target's work loop has taken a response off its queue. The service does its request bookkeeping and then
+ * passes it back to aoe_ata_receive, still on the target's work loop
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::ata_response_received(mbuf_t* pMBufData)
+{
+	m_pAoEService->ata_response_received(pMBufData);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Handle the reception of a received ata packet
+ * This is called on the target's own work loop for the responses it queued, or on the service's command gate for any
+ * that couldn't be queued. Either way the response is handled with the target's gate held
+ ---------------------------------------------------------------------------*/
+int AOE_CONTROLLER_INTERFACE_NAME::aoe_ata_receive(aoe_header* pAoEFullHeader, aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData)
+{
+	AOE_CONTROLLER_NAME* pController;
 	
 	//---------------------------------------------------------//
 	// Send the ATA command back to the appropriate Controller //
 	//---------------------------------------------------------//
 	
-	OSCollectionIterator* pControllerIterator;
-	AOE_CONTROLLER_NAME* pController;
-	
-	fFoundDevice = FALSE;
-	pControllerIterator = OSCollectionIterator::withCollection(m_pControllers);
-    if ( pControllerIterator )
+	pController = find_response_target(pAoEFullHeader);
+	if ( pController )
 	{
-		// Iterate through list, looking for our ID
-		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
-			if ( 0==pController->is_device(nMajor, nMinor) )
-			{
-				fFoundDevice = TRUE;
-				debugVerbose("ATA command received for device %d.%d\n", nMajor, nMinor);
-				
-				// send command on to our device
-				pController->ata_response(pATAHeader, pMBufData, AOE_HEADER_GETTAG(pAoEFullHeader));
-			}
+		debugVerbose("ATA command received for device %d.%d\n", AOE_HEADER_GETMAJOR(pAoEFullHeader), AOE_HEADER_GETMINOR(pAoEFullHeader));
 		
-		pControllerIterator->release();
+		// send command on to our device (unless it was removed while we waited for the gate)
+		pController->lock_target();
+		if ( !pController->isInactive() )
+			pController->ata_response(pATAHeader, pMBufData, AOE_HEADER_GETTAG(pAoEFullHeader));
+		pController->unlock_target();
+		pController->release();
 	}
 	else
 	{
-		debugError("Unable to iterate through controller list\n");
-	}
-	
-	// err if we didn't find the device in our list
-	if ( !fFoundDevice )
+		// err if we didn't find the device in our list
 		debugError("Received an ATA command from a device that wasn't registered\n");
+	}
 	
 	return 0;
 }
@@ -338,11 +681,10 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_ata_receive(aoe_header* pAoEFullHeader, a
  ---------------------------------------------------------------------------*/
 int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, struct ether_header* pEHeader, aoe_header* pAoEFullHeader, aoe_cfghdr_rd* pCfgHeader, mbuf_t* pMBufData)
 {
-	OSCollectionIterator* pControllerIterator;
 	AOE_CONTROLLER_NAME* pController;
-	bool fFoundDevice;
 	int nMajor;
 	int nMinor;
+	int nRet;
 	
 	nMajor = AOE_HEADER_GETMAJOR(pAoEFullHeader);
 	nMinor = AOE_HEADER_GETMINOR(pAoEFullHeader);
@@ -360,48 +702,33 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, str
 	//																				 //
 	// (NOTE: this is based on the Shelf/Slot number rather than the MAC address)	 //
 	//-------------------------------------------------------------------------------//
-	fFoundDevice = FALSE;
-	pControllerIterator = OSCollectionIterator::withCollection(m_pControllers);
-    if ( pControllerIterator )
+	pController = find_controller(nMajor, nMinor);
+	if ( pController )
 	{
-		// Iterate through list, looking for our ID
-		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
-			if ( 0==pController->is_device(nMajor, nMinor) )
+		debugVerbose("AoE cmd received for device %d.%d\n", nMajor, nMinor);
+		
+		// Update with info
+		pController->lock_target();
+		pController->handle_aoe_cmd(ifnet_receive, pCfgHeader, pMBufData);
+		pController->update_target_info(ifnet_receive, pEHeader->ether_shost, TRUE);
+		pController->unlock_target();
+		
+		// Remove the target if the device no longer belongs to us
+		if ( 0 != pController->cstring_is_ours(m_pAoEService->get_com_cstring()) )
+		{
+			if ( 0 == pController->is_registered() )
 			{
-				fFoundDevice = TRUE;
-				debugVerbose("AoE cmd received for device %d.%d\n", nMajor, nMinor);
-				
-				// Update with info
-				pController->handle_aoe_cmd(ifnet_receive, pCfgHeader, pMBufData);
-				pController->update_target_info(ifnet_receive, pEHeader->ether_shost, TRUE);
-				
-				// Remove the target if the device no longer belongs to us
-				if ( 0 != pController->cstring_is_ours(m_pAoEService->get_com_cstring()) )
-				{
-					if ( 0 == pController->is_registered() )
-					{
-						debugWarn("We have lost our device, removing target\n");
-						remove_target(pController->target_number());
-						
-						// Return now in case the iterator is invalid
-						pControllerIterator->release();
-						return 0;
-					}
-				}
+				debugWarn("We have lost our device, removing target\n");
+				remove_target(pController->target_number());
 			}
-		
-		pControllerIterator->release();
-	}
-	else
-	{
-		debugError("Unable to iterate through controller list\n");
+		}
 	}
 	
 	//------------------------------------------------------//
 	// If we didn't find the device in the list, add it now //
 	//------------------------------------------------------//
 	
-	if ( !fFoundDevice )
+	else
 	{
 		// Creating the new controller
 		debugVerbose("creating new controller for this device\n");
@@ -414,13 +741,26 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, str
 			return -1;
 		}
 		
-		pController->init(this, nMajor, nMinor, ifnet_receive, pEHeader->ether_shost, m_pAoEService->get_mtu(), m_nMaxTransferSize, get_next_target_number() );
+		if ( !pController->init(this, nMajor, nMinor, ifnet_receive, pEHeader->ether_shost, m_pAoEService->get_mtu(), m_nMaxTransferSize, get_next_target_number()) )
+		{
+			debugError("Trouble initialising pController\n");
+			CLEAN_RELEASE(pController);
+			return -1;
+		}
+		
+		alloc_tag_slot(pController);
+		pController->set_queue_depth(m_nQueueDepth);
+		pController->set_write_coalesce(m_nWriteCoalesce_us);
+		pController->set_flush_mode(m_nFlushMode);
+		pController->set_publish_mode(m_nPublishMode);
+		pController->set_work_loop(target_work_loop(nMajor, nMinor, pController->tag_slot()));
 		
 		// Run the rest in the timeout, and exit now.
 		
 		if ( !pController->attach(this) )
 		{
 			debugError("Trouble attaching pController\n");
+			free_tag_slot(pController);
 			CLEAN_RELEASE(pController);
 			return -1;
 		}
@@ -429,6 +769,24 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, str
 		{
 			debugError("Trouble starting pController\n");
 			pController->detach(this);
+			free_tag_slot(pController);
+			CLEAN_RELEASE(pController);
+			return -1;
+		}
+		
+		// Responses can't be routed to a target that isn't in the dispatch table, so don't keep one that couldn't be added
+		IOLockLock(m_pTargetListMutex);
+		nRet = add_to_dispatch(pController);
+		IOLockUnlock(m_pTargetListMutex);
+		
+		if ( 0!=nRet )
+		{
+			debugError("Trouble adding target %d.%d to the dispatch table\n", nMajor, nMinor);
+			free_tag_slot(pController);
+			pController->lock_target();
+			pController->uninit();
+			pController->terminate();
+			pController->unlock_target();
 			CLEAN_RELEASE(pController);
 			return -1;
 		}
@@ -436,8 +794,10 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, str
 		m_pControllers->setObject(pController);
 		
 		// Update with info
+		pController->lock_target();
 		pController->update_target_info(ifnet_receive, pEHeader->ether_shost, TRUE);
 		pController->handle_aoe_cmd(ifnet_receive, pCfgHeader, pMBufData);
+		pController->unlock_target();
 		
 		// Attach the device now, it wont be available until we register the disk
 		
@@ -466,69 +826,46 @@ int AOE_CONTROLLER_INTERFACE_NAME::aoe_config_receive(ifnet_t ifnet_receive, str
 
 
 
+#pragma mark -
+#pragma mark target online/offline
+
 /*---------------------------------------------------------------------------
- * This timer is called to fake an ATA response. It's used for commands that are not supported by the
- * AoE specification, but are required for higher level drivers (ATA protocol)
+ * Check for any downed targets, removing the device from the system if it has gone down
  ---------------------------------------------------------------------------*/
-void AOE_CONTROLLER_INTERFACE_NAME::FakeReturnTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+void AOE_CONTROLLER_INTERFACE_NAME::check_down_targets()
 {
-	AOE_CONTROLLER_INTERFACE_NAME* pAC = OSDynamicCast(AOE_CONTROLLER_INTERFACE_NAME, pOwner);
+	AOE_CONTROLLER_NAME* pController;
+	int nIndex;
 	
-	debug("AOE_CONTROLLER_INTERFACE_NAME::FakeReturnTimer\n");
-	if ( pAC )
+	// Walk backwards by index so removing a target doesn't skip the next one (and there's no iterator to allocate)
+	for (nIndex=m_pControllers->getCount()-1; nIndex>=0; nIndex--)
 	{
-		aoe_atahdr_rd ATAHeader;
-		
-		AOE_ATAHEADER_CLEAR(&ATAHeader);
-		ATAHeader.aa_scnt_cmdstat = 0x40<<8;			// Just requires the DRDY bit to be set high in the status register
+		pController = OSDynamicCast(AOE_CONTROLLER_NAME, m_pControllers->getObject(nIndex));
+		if ( NULL==pController )
+			continue;
 		
-		if ( pAC->m_pControllerToFakeResponse )
-			pAC->m_pControllerToFakeResponse->ata_response(&ATAHeader, NULL, 0);
+		if ( pController->capacity_changed() )
+		{
+			debugWarn("Target %d changed capacity, removing it\n", pController->target_number());
+			remove_target(pController->target_number());
+		}
+		else if ( time_since_now_us(pController->time_since_last_comm()) >= m_TimeUntilTargetOffline_us )
+		{
+			debugVerbose("Target %d now OFFLINE. Hasn't been seen for %lums\n", pController->target_number(), time_since_now_ms(pController->time_since_last_comm()));
+			remove_target(pController->target_number());
+		}
 		else
-			debugError("m_pControllerToFakeResponse not initialised\n");
+		{
+			debugVerbose("Target %d still ONLINE. Last spoke to target %lums ago...\n", pController->target_number(), time_since_now_ms(pController->time_since_last_comm()));
+		}
 	}
 }
 
 
-
-
-#pragma mark -
-#pragma mark target online/offline
-
 /*---------------------------------------------------------------------------
- * Check for any downed targets, removing the device from the system if it has gone down
+ * Force all targets to send identify command
  ---------------------------------------------------------------------------*/
-void AOE_CONTROLLER_INTERFACE_NAME::check_down_targets()
-{
-	OSCollectionIterator* pControllerIterator;
-	AOE_CONTROLLER_NAME* pController;
-	
-	pControllerIterator = OSCollectionIterator::withCollection(m_pControllers);
-    if ( pControllerIterator )
-	{
-		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
-			if ( time_since_now_us(pController->time_since_last_comm()) >= m_TimeUntilTargetOffline_us )
-			{
-				debugVerbose("Target %d now OFFLINE. Hasn't been seen for %lums\n", pController->target_number(), time_since_now_ms(pController->time_since_last_comm()));
-				remove_target(pController->target_number());
-				
-				// The iterator may be invalid now, we just break and catch any other down targets the next time...
-				break;
-			}
-			else
-			{
-				debugVerbose("Target %d still ONLINE. Last spoke to target %lums ago...\n", pController->target_number(), time_since_now_ms(pController->time_since_last_comm()));
-			}
-		
-		pControllerIterator->release();
-	}	
-}
-
-
-/*---------------------------------------------------------------------------
- * Force all targets to send identify command
- ---------------------------------------------------------------------------*/
-void AOE_CONTROLLER_INTERFACE_NAME::identify_all_targets()
+void AOE_CONTROLLER_INTERFACE_NAME::identify_all_targets()
 {
 	OSCollectionIterator* pControllerIterator;
 	AOE_CONTROLLER_NAME* pController;
@@ -537,7 +874,11 @@ void AOE_CONTROLLER_INTERFACE_NAME::identify_all_targets()
     if ( pControllerIterator )
 	{
 		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
+		{
+			pController->lock_target();
 			pController->send_identify();
+			pController->unlock_target();
+		}
 
 		pControllerIterator->release();
 	}	
@@ -647,6 +988,14 @@ debug("AOE_CONTROLLER_INTERFACE_NAME::remove_target(%d)\n", nNumber);
 			{
 				debug("Removing target: %d\n", nCount);
 				
+				// Stop routing responses to it
+				free_tag_slot(pController);
+				IOLockLock(m_pTargetListMutex);
+				remove_from_dispatch(pController);
+				IOLockUnlock(m_pTargetListMutex);
+				
+				pController->lock_target();
+				
 				// Cause any current commands to exit (and return an error)
 				pController->cancel_command(FALSE);
 				
@@ -656,6 +1005,7 @@ debug("AOE_CONTROLLER_INTERFACE_NAME::remove_target(%d)\n", nNumber);
 				// Begin teardown
 				pController->uninit();
 				pController->terminate();
+				pController->unlock_target();
 				m_pControllers->removeObject(nCount);
 				fFound = TRUE;
 				break;
@@ -701,7 +1051,9 @@ int AOE_CONTROLLER_INTERFACE_NAME::cancel_commands_on_interface(ifnet_t enetifne
 				debug("Cancelling command on target %d.%d\n", pController->get_target_info()->nShelf, pController->get_target_info()->nSlot);
 				
 				// Cause any current commands to exit (and return an error)
+				pController->lock_target();
 				pController->cancel_command(FALSE);
+				pController->unlock_target();
 				break;
 			}
 		}
@@ -730,7 +1082,11 @@ int AOE_CONTROLLER_INTERFACE_NAME::set_targets_cstring(int nDevice, const char*
 		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
 			if ( nDevice==pController->target_number() )
 			{
-				if ( 0==pController->set_config_string(pszConfigString, nLength) )
+				pController->lock_target();
+				nRet = pController->set_config_string(pszConfigString, nLength);
+				pController->unlock_target();
+				
+				if ( 0==nRet )
 				{
 					debug("Setting config string on device %d\n", nDevice);
 					
@@ -795,42 +1151,26 @@ bool AOE_CONTROLLER_INTERFACE_NAME::interfaces_active(TargetInfo* pTargetInfo)
  ---------------------------------------------------------------------------*/
 int AOE_CONTROLLER_INTERFACE_NAME::force_packet_send(ForcePacketInfo* pForcedPacketInfo)
 {
-	bool fFoundDevice;
 	int nShelf;
 	int nSlot;
-	
-	OSCollectionIterator* pControllerIterator;
 	AOE_CONTROLLER_NAME* pController;
 	
 	nShelf = pForcedPacketInfo->nShelf;
 	nSlot = pForcedPacketInfo->nSlot;
 	
-	fFoundDevice = FALSE;
-	pControllerIterator = OSCollectionIterator::withCollection(m_pControllers);
-    if ( pControllerIterator )
+	pController = find_controller(nShelf, nSlot);
+	if ( pController )
 	{
-		// Iterate through list, looking for our ID
-		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
-		{
-			if ( 0==pController->is_device(nShelf, nSlot) )
-			{
-				fFoundDevice = TRUE;
-				
-				// send command on to our device
-				pController->force_packet_send(pForcedPacketInfo);
-			}
-		}
-		
-		pControllerIterator->release();
+		// send command on to our device
+		pController->lock_target();
+		pController->force_packet_send(pForcedPacketInfo);
+		pController->unlock_target();
 	}
 	else
 	{
-		debugError("Unable to iterate through controller list\n");
-	}
-	
-	// err if we didn't find the device in our list
-	if ( !fFoundDevice )
+		// err if we didn't find the device in our list
 		debugError("Device %d.%d not found, unable to send packet\n", nShelf, nSlot);
+	}
 	
 	return 0;
 }
@@ -846,11 +1186,11 @@ int AOE_CONTROLLER_INTERFACE_NAME::force_packet_send(ForcePacketInfo* pForcedPac
  * Send an mbuf packet through an interface
  * This routine adds the appropriate ethernet header to the packet based on the interfaces that
  * are available for a particular target
- * It also handles load-balancing by alternating the interfaces that each packet is sent out on
+ * It also handles load-balancing by alternating the interfaces that each packet is sent out on (unless the
+ * sender has already picked the interface, see next_interface)
  ---------------------------------------------------------------------------*/
-int AOE_CONTROLLER_INTERFACE_NAME::send_packet(mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo)
+int AOE_CONTROLLER_INTERFACE_NAME::send_packet(mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo, int nInterfaceNumber, bool fRetransmit)
 {
-	int nInterfaceNumber;
 	struct ether_header* eh;
 	errno_t result;
 	
@@ -879,24 +1219,64 @@ int AOE_CONTROLLER_INTERFACE_NAME::send_packet(mbuf_t m, UInt32 Tag, TargetInfo*
 		return -1;
 	}
 	
+	// The sender may have already picked the path (and sized the frame for it)
+	if ( (nInterfaceNumber<0) || (nInterfaceNumber>=pTargetInfo->nNumberOfInterfaces) || !m_pAoEService->interface_active(pTargetInfo, nInterfaceNumber) )
+		nInterfaceNumber = next_interface(pTargetInfo);
+
+	if ( nInterfaceNumber<0 )
+	{
+		debugError("No active interface to the device. Dropping mbuf\n");
+		mbuf_freem(m);
+		return -1;
+	}
+
+	//debugVerbose("Sending on interface %d (%d enabled)\n", nInterfaceNumber, pTargetInfo->nNumberOfInterfaces);
+
+	// Send to the mac address of the appropriate target (based on the interface we are sending out on)
+	bcopy(pTargetInfo->aaDestMACAddress[nInterfaceNumber], eh->ether_dhost, sizeof(eh->ether_dhost));
+	
+	return m_pAoEService->send_packet_on_interface(pTargetInfo->aInterfaces[nInterfaceNumber], Tag, m, TARGET_NUMBER(pTargetInfo->nShelf, pTargetInfo->nSlot), fRetransmit);	
+}
+
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Pick the interface the next frame to a target goes out on. Returns -1 if none of them are active
+ ---------------------------------------------------------------------------*/
+int AOE_CONTROLLER_INTERFACE_NAME::next_interface(TargetInfo* pTargetInfo)
+{
+	int nInterfaceNumber;
+	int n;
+	
+	if ( (NULL==pTargetInfo) || (0==pTargetInfo->nNumberOfInterfaces) )
+		return -1;
+	
 	//~~~~~~~~~~~~~~~~//
 	// Load balancing //
 	//~~~~~~~~~~~~~~~~//
 	
 	// If multiple interfaces are available for a target, we alternate the interface we send on (provided they are enabled)
-	do
+	for (n=0; n<pTargetInfo->nNumberOfInterfaces; n++)
 	{
 		nInterfaceNumber = (pTargetInfo->nLastSentInterface+1) % pTargetInfo->nNumberOfInterfaces;
 		pTargetInfo->nLastSentInterface = nInterfaceNumber;
+		
+		if ( m_pAoEService->interface_active(pTargetInfo, nInterfaceNumber) )
+			return nInterfaceNumber;
 	}
-	while ( !m_pAoEService->interface_active(pTargetInfo, nInterfaceNumber) );
+	
+	return -1;
+}
 
-	//debugVerbose("Sending on interface %d (%d enabled)\n", nInterfaceNumber, pTargetInfo->nNumberOfInterfaces);
 
-	// Send to the mac address of the appropriate target (based on the interface we are sending out on)
-	bcopy(pTargetInfo->aaDestMACAddress[nInterfaceNumber], eh->ether_dhost, sizeof(eh->ether_dhost));
+bool AOE_CONTROLLER_INTERFACE_NAME::interface_active(TargetInfo* pTargetInfo, int nInterfaceNumber)
+{
+	if ( (NULL==pTargetInfo) || (nInterfaceNumber<0) || (nInterfaceNumber>=pTargetInfo->nNumberOfInterfaces) )
+		return FALSE;
 	
-	return m_pAoEService->send_packet_on_interface(pTargetInfo->aInterfaces[nInterfaceNumber], Tag, m, pTargetInfo->nShelf);	
+	return m_pAoEService->interface_active(pTargetInfo, nInterfaceNumber);
 }
 
 
@@ -921,7 +1301,7 @@ int AOE_CONTROLLER_INTERFACE_NAME::send_aoe_packet(AOE_CONTROLLER_NAME* pSender,
 /*---------------------------------------------------------------------------
  * This function pre-processes outgoing commands so we can "fake" responses that aren't supported by the AoE targets
  ---------------------------------------------------------------------------*/
-int AOE_CONTROLLER_INTERFACE_NAME::send_ata_packet(AOE_CONTROLLER_NAME* pSender, mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo)
+int AOE_CONTROLLER_INTERFACE_NAME::send_ata_packet(AOE_CONTROLLER_NAME* pSender, mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo, int nInterfaceNumber, bool fRetransmit)
 {
 	aoe_atahdr_full* pAoEFullATAHeader;
 	aoe_header*	pAoEHeader;
@@ -935,23 +1315,22 @@ int AOE_CONTROLLER_INTERFACE_NAME::send_ata_packet(AOE_CONTROLLER_NAME* pSender,
 	
 	debug("Outgoing command is %#x (FEAT=%#x) [TAG=%#x]\n", AOE_ATAHEADER_GETSTAT(pATAhdr), AOE_ATAHEADER_GETERR(pATAhdr), Tag);
 	
-	// Some of the commands are handled without sending it to the target
+	// Some of the commands are handled without sending it to the target (flushes only go to the target when asked to)
 	if (	(AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdSetFeatures) ||
 		(AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdSleep) ||
-		(AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdFlushCache) ||
-		(AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdFlushCacheExtended) )
+		((FLUSH_MODE_FAKE==m_nFlushMode) && (AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdFlushCache)) ||
+		((FLUSH_MODE_FAKE==m_nFlushMode) && (AOE_ATAHEADER_GETSTAT(pATAhdr)==kATAcmdFlushCacheExtended)) )
 	{
 		debug("Faking command response for outgoing command (%#x)\n", AOE_ATAHEADER_GETSTAT(pATAhdr));
-		m_pControllerToFakeResponse = pSender;
 		
 		// Free mbuf as there's no need for it anymore
 		mbuf_freem(m);
 		
-		// Run the reset in the timeout, and exit now.
-		return m_pFakeReturnTimer->setTimeout((UInt32)0.0);
+		// The sender answers itself from its own work loop (several targets can be doing this at once)
+		return pSender->fake_response();
 	}
 	
-	return send_packet(m, Tag, pTargetInfo);
+	return send_packet(m, Tag, pTargetInfo, nInterfaceNumber, fRetransmit);
 }
 
 
@@ -991,7 +1370,11 @@ void AOE_CONTROLLER_INTERFACE_NAME::reenable_controllers(void)
 	{
 		// Iterate through list, enabling each controller
 		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
+		{
+			pController->lock_target();
 			pController->device_online();
+			pController->unlock_target();
+		}
 		
 		pControllerIterator->release();
 	}
@@ -1027,13 +1410,13 @@ void AOE_CONTROLLER_INTERFACE_NAME::StateUpdateTimer(OSObject* pOwner, IOTimerEv
 
 
 /*---------------------------------------------------------------------------
- * Configure particular interface/shelf with a maximum outstanding count (determined by the "Buffer Count")
+ * Configure particular interface/target with a maximum outstanding count (determined by the "Buffer Count")
  ---------------------------------------------------------------------------*/
-void AOE_CONTROLLER_INTERFACE_NAME::set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding)
+void AOE_CONTROLLER_INTERFACE_NAME::set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding)
 {
 	// Just pass it up to the main service
 	if ( m_pAoEService )
-		m_pAoEService->set_max_outstanding(ifref, nShelf, nMaxOutstanding);
+		m_pAoEService->set_max_outstanding(ifref, nTarget, nMaxOutstanding);
 }
 
 
@@ -1048,6 +1431,225 @@ void AOE_CONTROLLER_INTERFACE_NAME::set_max_transfer_size(int nMaxTransferSize)
 }
 
 
+/*---------------------------------------------------------------------------
+ * Set the number of commands each target can have outstanding (for new and existing Controllers)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::set_queue_depth(int nQueueDepth)
+{
+	AOE_CONTROLLER_NAME* pController;
+	int nIndex;
+	
+	debug("Setting queue depth to %d\n", nQueueDepth);
+	
+	m_nQueueDepth = nQueueDepth;
+	
+	if ( (FLUSH_MODE_WRITE_BACK==m_nFlushMode) && (m_nQueueDepth<=1) )
+		debugWarn("Write-back needs a queue depth above 1, writes will complete when the target acknowledges them\n");
+	
+	for (nIndex=0; nIndex<m_pControllers->getCount(); nIndex++)
+	{
+		pController = OSDynamicCast(AOE_CONTROLLER_NAME, m_pControllers->getObject(nIndex));
+		if ( pController )
+		{
+			pController->lock_target();
+			pController->set_queue_depth(nQueueDepth);
+			pController->unlock_target();
+		}
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set how long writes wait for adjacent writes to merge with (for new and existing Controllers)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::set_write_coalesce(int nWindow_us)
+{
+	AOE_CONTROLLER_NAME* pController;
+	int nIndex;
+	
+	debug("Setting write coalescing window to %dus\n", nWindow_us);
+	
+	m_nWriteCoalesce_us = nWindow_us;
+	
+	for (nIndex=0; nIndex<m_pControllers->getCount(); nIndex++)
+	{
+		pController = OSDynamicCast(AOE_CONTROLLER_NAME, m_pControllers->getObject(nIndex));
+		if ( pController )
+		{
+			pController->lock_target();
+			pController->set_write_coalesce(nWindow_us);
+			pController->unlock_target();
+		}
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set how FLUSH CACHE is handled (for new and existing Controllers)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::set_flush_mode(int nMode)
+{
+	AOE_CONTROLLER_NAME* pController;
+	int nIndex;
+	
+	if ( (nMode<FLUSH_MODE_FAKE) || (nMode>FLUSH_MODE_WRITE_BACK) )
+	{
+		debugError("Unknown flush mode %d, flushes will be answered locally\n", nMode);
+		nMode = FLUSH_MODE_FAKE;
+	}
+	
+	debug("Setting flush mode to %d\n", nMode);
+	
+	m_nFlushMode = nMode;
+	
+	if ( (FLUSH_MODE_WRITE_BACK==m_nFlushMode) && (m_nQueueDepth<=1) )
+		debugWarn("Write-back needs a queue depth above 1, writes will complete when the target acknowledges them\n");
+	
+	for (nIndex=0; nIndex<m_pControllers->getCount(); nIndex++)
+	{
+		pController = OSDynamicCast(AOE_CONTROLLER_NAME, m_pControllers->getObject(nIndex));
+		if ( pController )
+		{
+			pController->lock_target();
+			pController->set_flush_mode(nMode);
+			pController->unlock_target();
+		}
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set what's published for targets found from now on (the ones already attached keep their nub)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::set_publish_mode(int nMode)
+{
+	if ( (nMode<PUBLISH_MODE_ATA) || (nMode>PUBLISH_MODE_BLOCK_STORAGE) )
+	{
+		debugError("Unknown publish mode %d, targets will be published as ATA devices\n", nMode);
+		nMode = PUBLISH_MODE_ATA;
+	}
+	
+	debug("Setting publish mode to %d\n", nMode);
+	
+	m_nPublishMode = nMode;
+}
+
+
+/*---------------------------------------------------------------------------
+ * Keep track of how much write data goes out and how much of it had to be copied to get there
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::add_write_statistics(IOByteCount Written, IOByteCount Copied)
+{
+	IOLockLock(m_pStatisticsMutex);
+	m_WriteBytes += Written;
+	m_WriteBytesCopied += Copied;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_write_statistics(uint64_t* pWritten, uint64_t* pCopied)
+{
+	IOLockLock(m_pStatisticsMutex);
+	*pWritten = m_WriteBytes;
+	*pCopied = m_WriteBytesCopied;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Keep track of what it costs to get read data into client buffers (controllers add theirs as commands complete)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::add_read_copy_statistics(UInt64 Bytes, UInt64 Time)
+{
+	IOLockLock(m_pStatisticsMutex);
+	m_ReadBytesCopied += Bytes;
+	m_ReadCopyTime += Time;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_read_copy_statistics(uint64_t* pBytes, uint64_t* pNS)
+{
+	IOLockLock(m_pStatisticsMutex);
+	*pBytes = m_ReadBytesCopied;
+	absolutetime_to_nanoseconds(m_ReadCopyTime, pNS);
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Resend a single frame of a read/write command that the controller thinks has been lost
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::resend_chunk(UInt32 Tag)
+{
+	if ( m_pAoEService )
+		m_pAoEService->resend_chunk(Tag);
+}
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::add_duplicate_chunk(void)
+{
+	OSIncrementAtomic((volatile SInt32*) &m_nDuplicateChunks);
+}
+
+
+uint32_t AOE_CONTROLLER_INTERFACE_NAME::get_duplicate_chunks(void)
+{
+	return m_nDuplicateChunks;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Count the writes that were sent as part of a larger transfer (nWrites includes the one it was merged into)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::add_coalesced_writes(int nWrites)
+{
+	IOLockLock(m_pStatisticsMutex);
+	m_nCoalescedWrites += nWrites-1;
+	++m_nCoalescedTransfers;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_coalesce_statistics(uint32_t* pWrites, uint32_t* pTransfers)
+{
+	IOLockLock(m_pStatisticsMutex);
+	*pWrites = m_nCoalescedWrites;
+	*pTransfers = m_nCoalescedTransfers;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Keep track of how well the controllers' read-ahead is doing
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::add_read_ahead_statistics(int nHits, int nMisses, IOByteCount Wasted)
+{
+	IOLockLock(m_pStatisticsMutex);
+	m_nReadAheadHits += nHits;
+	m_nReadAheadMisses += nMisses;
+	m_ReadAheadWasted += Wasted;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_read_ahead_statistics(uint32_t* pHits, uint32_t* pMisses, uint64_t* pWasted)
+{
+	IOLockLock(m_pStatisticsMutex);
+	*pHits = m_nReadAheadHits;
+	*pMisses = m_nReadAheadMisses;
+	*pWasted = m_ReadAheadWasted;
+	IOLockUnlock(m_pStatisticsMutex);
+}
+
+
 /*---------------------------------------------------------------------------
  * Set MTU size used for existing Controllers
  ---------------------------------------------------------------------------*/
@@ -1063,7 +1665,11 @@ void AOE_CONTROLLER_INTERFACE_NAME::adjust_mtu_sizes(int nMTU)
 	{
 		// Iterate through list, adjusting size of each controller
 		while (pController = OSDynamicCast(AOE_CONTROLLER_NAME, pControllerIterator->getNextObject()))
+		{
+			pController->lock_target();
 			pController->set_mtu_size(nMTU);
+			pController->unlock_target();
+		}
 		
 		pControllerIterator->release();
 	}
@@ -1071,3 +1677,176 @@ void AOE_CONTROLLER_INTERFACE_NAME::adjust_mtu_sizes(int nMTU)
 
 
 
+
+#pragma mark -
+#pragma mark Read cache
+
+/*---------------------------------------------------------------------------
+ * Set the memory used for caching reads. The blocks of all the targets share this budget. 0 frees the cache
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::set_read_cache_size(int nSize_MB)
+{
+	nSize_MB = MAX(0, MIN(nSize_MB, MAX_READ_CACHE_MB));
+	
+	debug("Setting read cache size to %dMB\n", nSize_MB);
+	
+	IOLockLock(m_pCacheMutex);
+	
+	if ( !read_cache_set_size(&m_ReadCache, (nSize_MB*1024*1024)/READ_CACHE_BLOCK_SIZE) )
+		debugError("Unable to allocate the read cache\n");
+	
+	IOLockUnlock(m_pCacheMutex);
+}
+
+
+
+bool AOE_CONTROLLER_INTERFACE_NAME::read_cache_enabled(void)
+{
+	return m_ReadCache.nMaxBlocks>0;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Copy the sectors into pBuffer if they're all in the cache. Returns FALSE (and copies nothing) if any are missing
+ ---------------------------------------------------------------------------*/
+bool AOE_CONTROLLER_INTERFACE_NAME::cache_read(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors, IOMemoryDescriptor* pBuffer)
+{
+	struct CacheBlock* pBlock;
+	UInt64 Block, From, To;
+	
+	if ( nSectors<=0 )
+		return FALSE;
+	
+	IOLockLock(m_pCacheMutex);
+	
+	if ( 0==m_ReadCache.nMaxBlocks )
+	{
+		IOLockUnlock(m_pCacheMutex);
+		return FALSE;
+	}
+	
+	for (Block=LBA/READ_CACHE_BLOCK_SECTORS; Block<=(LBA+nSectors-1)/READ_CACHE_BLOCK_SECTORS; Block++)
+	{
+		pBlock = read_cache_find(&m_ReadCache, pController, Block);
+		
+		if ( (NULL==pBlock) || (NULL==pBlock->pData) )
+		{
+			++m_nCacheMisses;
+			IOLockUnlock(m_pCacheMutex);
+			return FALSE;
+		}
+	}
+	
+	for (Block=LBA/READ_CACHE_BLOCK_SECTORS; Block<=(LBA+nSectors-1)/READ_CACHE_BLOCK_SECTORS; Block++)
+	{
+		pBlock = read_cache_find(&m_ReadCache, pController, Block);
+		
+		From = MAX(LBA, Block*READ_CACHE_BLOCK_SECTORS);
+		To = MIN(LBA+nSectors, (Block+1)*READ_CACHE_BLOCK_SECTORS);
+		
+		pBuffer->writeBytes((From-LBA)*kATADefaultSectorSize, pBlock->pData+(From-Block*READ_CACHE_BLOCK_SECTORS)*kATADefaultSectorSize, (To-From)*kATADefaultSectorSize);
+		
+		read_cache_touch(&m_ReadCache, pBlock);
+	}
+	
+	++m_nCacheHits;
+	m_CacheBytesServed += nSectors*kATADefaultSectorSize;
+	
+	IOLockUnlock(m_pCacheMutex);
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Add the sectors that have just been read to the cache. Only whole blocks are kept
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::cache_fill(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors, IOMemoryDescriptor* pBuffer)
+{
+	struct CacheBlock* pBlock;
+	UInt64 Block;
+	UInt8* pData;
+	
+	IOLockLock(m_pCacheMutex);
+	
+	for (Block=(LBA+READ_CACHE_BLOCK_SECTORS-1)/READ_CACHE_BLOCK_SECTORS; m_ReadCache.nMaxBlocks && (Block<(LBA+nSectors)/READ_CACHE_BLOCK_SECTORS); Block++)
+	{
+		pBlock = read_cache_find(&m_ReadCache, pController, Block);
+		
+		if ( pBlock && pBlock->pData )
+			continue;
+		
+		pData = read_cache_add(&m_ReadCache, pController, Block);
+		if ( NULL==pData )
+			break;
+		
+		pBuffer->readBytes((Block*READ_CACHE_BLOCK_SECTORS-LBA)*kATADefaultSectorSize, pData, READ_CACHE_BLOCK_SIZE);
+	}
+	
+	IOLockUnlock(m_pCacheMutex);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Drop any cached blocks that a write to these sectors makes out of date
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::cache_invalidate(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors)
+{
+	struct CacheBlock* pBlock;
+	UInt64 Block;
+	
+	if ( nSectors<=0 )
+		return;
+	
+	IOLockLock(m_pCacheMutex);
+	
+	for (Block=LBA/READ_CACHE_BLOCK_SECTORS; m_ReadCache.pHash && (Block<=(LBA+nSectors-1)/READ_CACHE_BLOCK_SECTORS); Block++)
+	{
+		pBlock = read_cache_find(&m_ReadCache, pController, Block);
+		
+		if ( pBlock && pBlock->pData )
+			read_cache_remove(&m_ReadCache, pBlock);
+	}
+	
+	IOLockUnlock(m_pCacheMutex);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Drop everything cached for a target (the controller is going away, or it was written in a way we can't follow)
+ ---------------------------------------------------------------------------*/
+void AOE_CONTROLLER_INTERFACE_NAME::cache_drop_target(AOE_CONTROLLER_NAME* pController)
+{
+	IOLockLock(m_pCacheMutex);
+	read_cache_drop_target(&m_ReadCache, pController);
+	IOLockUnlock(m_pCacheMutex);
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_read_cache_statistics(StatisticsInfo* pStats)
+{
+	IOLockLock(m_pCacheMutex);
+	pStats->nCacheHits = m_nCacheHits;
+	pStats->nCacheMisses = m_nCacheMisses;
+	pStats->nCacheBytesServed = m_CacheBytesServed;
+	pStats->nCacheBytesUsed = (UInt64)(m_ReadCache.anBlocks[CACHE_A1IN]+m_ReadCache.anBlocks[CACHE_AM])*READ_CACHE_BLOCK_SIZE;
+	pStats->nCacheBytesBudget = (UInt64)m_ReadCache.nMaxBlocks*READ_CACHE_BLOCK_SIZE;
+	IOLockUnlock(m_pCacheMutex);
+}
+
+
+
+void AOE_CONTROLLER_INTERFACE_NAME::get_tag_slot_statistics(uint32_t* pInUse, uint32_t* pFailures)
+{
+	IOLockLock(m_pTargetListMutex);
+	*pInUse = m_nTagSlotsInUse;
+	*pFailures = m_nTagSlotFailures;
+	IOLockUnlock(m_pTargetListMutex);
+}
+
+
+
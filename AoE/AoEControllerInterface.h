@@ -11,13 +11,22 @@
 #define __AOE_CONTROLLER_INTERFACE_H__
 
 #include <IOKit/IOService.h>
+#include <sys/queue.h>
 #include "../Shared/AoEcommon.h"
 #include "aoe.h"
+#include "DispatchTable.h"
+#include "ReadCache.h"
 
 class AOE_KEXT_NAME;
 class AOE_DEVICE_NAME;
 class AOE_CONTROLLER_NAME;
 class OSArray;
+class IOMemoryDescriptor;
+class IOWorkLoop;
+struct ClientMapping;
+
+// Targets are spread over this many work loops (by shelf/slot), so responses for different targets complete in parallel
+#define TARGET_WORK_LOOPS						8
 
 class AOE_CONTROLLER_INTERFACE_NAME : public IOService
 {
@@ -29,22 +38,52 @@ public:
 	
 	int aoe_config_receive(ifnet_t ifnet_receive, struct ether_header* pEHeader, aoe_header* pAoEFullHeader, aoe_cfghdr_rd* pCfgHeader, mbuf_t* pMBufData);
 	int aoe_ata_receive(aoe_header* pAoEFullHeader, aoe_atahdr_rd* pATAHeader, mbuf_t* pMBufData);
+	bool queue_ata_response(aoe_header* pAoEFullHeader, mbuf_t m);
+	void release_mapping_later(struct ClientMapping* pMapping);
+	void ata_response_received(mbuf_t* pMBufData);
 	int force_packet_send(ForcePacketInfo* pForcedPacketInfo);
 
 	void check_down_targets(void);
 	UInt32	next_tag();
+	UInt32	next_tag(int nTagSlot);
 
 	void start_lun_search(bool fRun);
 	int	number_of_targets(void);
 	TargetInfo* get_target_info(int nNumber);
 	int set_targets_cstring(int nDevice, const char* pszConfigString, int nLength);
 	
-	int send_ata_packet(AOE_CONTROLLER_NAME* pSender, mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo);
+	int send_ata_packet(AOE_CONTROLLER_NAME* pSender, mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo, int nInterfaceNumber = -1, bool fRetransmit = TRUE);
+	int next_interface(TargetInfo* pTargetInfo);
+	bool interface_active(TargetInfo* pTargetInfo, int nInterfaceNumber);
 	int send_aoe_packet(AOE_CONTROLLER_NAME* pSender, mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo);
 	
-	void set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding);
+	void set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding);
 	void set_max_transfer_size(int nMaxTransferSize);
+	void set_queue_depth(int nQueueDepth);
+	void set_write_coalesce(int nWindow_us);
+	void set_flush_mode(int nMode);
+	void set_publish_mode(int nMode);
+	void add_write_statistics(IOByteCount Written, IOByteCount Copied);
+	void get_write_statistics(uint64_t* pWritten, uint64_t* pCopied);
+	void add_read_copy_statistics(UInt64 Bytes, UInt64 Time);
+	void get_read_copy_statistics(uint64_t* pBytes, uint64_t* pNS);
+	void resend_chunk(UInt32 Tag);
+	void add_duplicate_chunk(void);
+	uint32_t get_duplicate_chunks(void);
+	void add_coalesced_writes(int nWrites);
+	void get_coalesce_statistics(uint32_t* pWrites, uint32_t* pTransfers);
+	void add_read_ahead_statistics(int nHits, int nMisses, IOByteCount Wasted);
+	void get_read_ahead_statistics(uint32_t* pHits, uint32_t* pMisses, uint64_t* pWasted);
+	void set_read_cache_size(int nSize_MB);
+	bool read_cache_enabled(void);
+	bool cache_read(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors, IOMemoryDescriptor* pBuffer);
+	void cache_fill(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors, IOMemoryDescriptor* pBuffer);
+	void cache_invalidate(AOE_CONTROLLER_NAME* pController, UInt64 LBA, int nSectors);
+	void cache_drop_target(AOE_CONTROLLER_NAME* pController);
+	void get_read_cache_statistics(StatisticsInfo* pStats);
+	void get_tag_slot_statistics(uint32_t* pInUse, uint32_t* pFailures);
 	int remove_target(int nNumber);
+	IOWorkLoop* target_work_loop(int nShelf, int nSlot, int nTagSlot);
 
 	void fake_device_attach(void);
 	errno_t aoe_search(ifnet_t ifnet);
@@ -57,19 +96,55 @@ public:
 
 private:
 	static void StateUpdateTimer(OSObject *owner, IOTimerEventSource *sender);
-	static void FakeReturnTimer(OSObject *owner, IOTimerEventSource *sender);
-	int send_packet(mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo);
+	static void ReleaseTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	void release_mappings(void);
+	int send_packet(mbuf_t m, UInt32 Tag, TargetInfo* pTargetInfo, int nInterfaceNumber = -1, bool fRetransmit = TRUE);
+	int alloc_tag_slot(AOE_CONTROLLER_NAME* pController);
+	void free_tag_slot(AOE_CONTROLLER_NAME* pController);
+	AOE_CONTROLLER_NAME* find_controller(int nShelf, int nSlot);
+	AOE_CONTROLLER_NAME* find_response_target(aoe_header* pAoEFullHeader);
+	int add_to_dispatch(AOE_CONTROLLER_NAME* pController);
+	void remove_from_dispatch(AOE_CONTROLLER_NAME* pController);
+	void free_dispatch(void);
 
 	OSArray*						m_pControllers;
 	IOTimerEventSource*				m_pStateUpdateTimer;
-	IOTimerEventSource*				m_pFakeReturnTimer;
+	IOTimerEventSource*				m_pReleaseTimer;					// Releases the client mappings on m_pReleasedMappings
+	IOSimpleLock*					m_pReleaseLock;						// Protects m_pReleasedMappings, it's taken wherever an mbuf is freed
+	struct ClientMapping*			m_pReleasedMappings;
 	bool							m_fLUNSearchRunning;
-	IOLock*							m_pTargetListMutex;
+	IOLock*							m_pTargetListMutex;					// Protects the tag slots and dispatch table, ATA responses look targets up off our work loop
+	IOWorkLoop*						m_apTargetWorkLoops[TARGET_WORK_LOOPS];	// Created as targets are found
 	UInt64							m_TimeUntilTargetOffline_us;
-	AOE_CONTROLLER_NAME*			m_pControllerToFakeResponse;
-	UInt32							m_nCurrentTag;
+	volatile UInt32					m_nCurrentTag;						// Only changed atomically (see next_tag)
+	AOE_CONTROLLER_NAME*			m_apTagSlot[TAG_SLOTS];				// Controller that owns each tag slot (not retained, m_pControllers holds the reference)
+	UInt32							m_anTagGeneration[TAG_SLOTS];
+	UInt32							m_anTagSequence[TAG_SLOTS];
+	UInt32							m_nTagSlotsInUse;
+	UInt32							m_nTagSlotFailures;					// Targets that were created when every slot was taken
+	struct DispatchTable			m_Dispatch;							// Controllers by (shelf, slot)
 	AOE_KEXT_NAME*					m_pAoEService;
 	int								m_nMaxTransferSize;
+	int								m_nQueueDepth;
+	IOLock*							m_pStatisticsMutex;					// Protects the statistics counters, they're updated from every target's work loop
+	UInt64							m_WriteBytes;
+	UInt64							m_WriteBytesCopied;
+	UInt64							m_ReadBytesCopied;
+	UInt64							m_ReadCopyTime;						// In absolute time units
+	UInt32							m_nDuplicateChunks;
+	int								m_nWriteCoalesce_us;
+	int								m_nFlushMode;
+	int								m_nPublishMode;
+	UInt32							m_nCoalescedWrites;
+	UInt32							m_nCoalescedTransfers;
+	UInt32							m_nReadAheadHits;
+	UInt32							m_nReadAheadMisses;
+	UInt64							m_ReadAheadWasted;
+	IOLock*							m_pCacheMutex;						// Protects everything below (the controllers run on their own work loops)
+	struct ReadCache				m_ReadCache;
+	UInt32							m_nCacheHits;
+	UInt32							m_nCacheMisses;
+	UInt64							m_CacheBytesServed;
 };
 
 #endif	//__AOE_CONTROLLER_INTERFACE_H__
@@ -55,6 +55,7 @@ __END_DECLS
 #define	RTO_MAX_NS								(10*1000*1000)
 #define MAX_RETRANSMIT_TIMEOUT_US				(5*1000)
 #define MAX_TIMEOUT_BEFORE_DROP_US				(60*1000*1000)
+#define RETRANSMIT_WHEEL_TICK_NS				(250*1000)
 
 #define IDLE_DELAY_US							(5*1000*1000)
 
@@ -62,9 +63,9 @@ __END_DECLS
 //			gate will already open and thus it shouldn't be necessary to block when receiving
 //			However, forcing this is required to ensure user commands don't interfere with
 //			commands that are being received.
-//			It may be possible to remove this, but more critical sections would have to be added to the code
+//			ATA responses don't use it, they're queued for the work loop of the target they're for
+//			(see aoe_incoming). This only serialises config responses and the target list
 #define USE_CG_FOR_INCOMING_PACKETS
-#define TRIGGER_RETRANSMIT_WHEN_TX_COMPLETE
 
 //#define NO_FLOW_CONTROL
 #define DEBUG_RETRANSMIT
@@ -74,6 +75,17 @@ __END_DECLS
 #define super IOService
 OSDefineMetaClassAndStructors(AOE_KEXT_NAME, IOService)
 
+static UInt64 current_time_ns(void)
+{
+	uint64_t CurrentTime;
+	uint64_t current_nano;
+
+	clock_get_uptime(&CurrentTime);
+	absolutetime_to_nanoseconds(CurrentTime, &current_nano);
+
+	return current_nano;
+}
+
 
 #pragma mark -
 #pragma mark Standard IOService handling
@@ -124,6 +136,7 @@ bool AOE_KEXT_NAME::start(IOService *provider)
 {
 	IOWorkLoop* pWorkLoop;
     bool res;
+	int n;
 	
     debugVerbose("Starting\n");
 
@@ -143,11 +156,17 @@ bool AOE_KEXT_NAME::start(IOService *provider)
 	set_ui_controller(this);
 	filter_init();
 
-	m_pSentQueueMutex = IOLockAlloc();
-	m_pToSendQueueMutex = IOLockAlloc();
+	m_pRequestMutex = IOLockAlloc();
 	m_pGeneralMutex = IOLockAlloc();
 	m_pszOurCString = (char*) IOMalloc(MAX_CONFIG_STRING_LENGTH);
 
+	if ( !pool_init(sizeof(struct PktRequest)) )
+	{
+		debugError("Unable to allocate queue records\n");
+		res = FALSE;
+		goto Fail;
+	}
+
 	m_pAoEControllerInterface = new AOE_CONTROLLER_INTERFACE_NAME;
 	
 	if ( (m_pAoEControllerInterface==NULL) || !m_pAoEControllerInterface->init(this) )
@@ -177,9 +196,20 @@ bool AOE_KEXT_NAME::start(IOService *provider)
 	m_nScaledRTTvar = 0;
 	m_nNumUnexpectedResponses = 0;
 	m_nNumRetransmits = 0;
-	
-	TAILQ_INIT(&m_sent_queue);
-	TAILQ_INIT(&m_to_send_queue);
+	m_nTransmitBudget = DEFAULT_TRANSMIT_BUDGET;
+	
+	for (n=0; n<numberof(m_aSendQueue); n++)
+		TAILQ_INIT(&m_aSendQueue[n]);
+	TAILQ_INIT(&m_resend_queue);
+	m_nReadyInterfaces = 0;
+	m_nNextInterface = 0;
+	m_nChunkResends = 0;
+	for (n=0; n<SENT_HASH_SIZE; n++)
+		LIST_INIT(&m_aRequestHash[n]);
+	for (n=0; n<RETRANSMIT_WHEEL_SLOTS; n++)
+		LIST_INIT(&m_aRetransmitWheel[n]);
+	m_nRetransmitWheelTick = current_time_ns()/RETRANSMIT_WHEEL_TICK_NS;
+	m_RetransmitDeadline_ns = 0;
 	
 	// Setup timers
 	pWorkLoop = getWorkLoop();
@@ -239,6 +269,24 @@ bool AOE_KEXT_NAME::start(IOService *provider)
 			goto Fail;
 		}
 		m_pIdleTimer->disable();		
+
+		// Initialise pool timer
+		m_pPoolTimer = IOTimerEventSource::timerEventSource(this, (IOTimerEventSource::Action) &AOE_KEXT_NAME::PoolTimer);
+		
+		if ( !m_pPoolTimer )
+		{
+			debugError("Unable to create timerEventSource\n");
+			res = FALSE;
+			goto Fail;
+		}
+		
+		if ( pWorkLoop->addEventSource(m_pPoolTimer) != kIOReturnSuccess )
+		{
+			debugError("Unable to add timerEventSource to work loop\n");
+			res = FALSE;
+			goto Fail;
+		}
+		m_pPoolTimer->disable();
 		
 		// Initialise the command gate
 		m_pCmdGate = IOCommandGate::commandGate(this);
@@ -268,8 +316,7 @@ Fail:
 void AOE_KEXT_NAME::stop(IOService *provider)
 {
 	IOWorkLoop* pWorkLoop;
-	struct SentPktQueue*	pSent_queue_item;
-	struct ToSendPktQueue*	pToSend_queue_item;
+	int n;
 
     debugVerbose("Stopping...\n");
 
@@ -300,6 +347,13 @@ void AOE_KEXT_NAME::stop(IOService *provider)
 			CLEAN_RELEASE(m_pIdleTimer);
 		}
 		
+		if ( m_pPoolTimer )
+		{
+			m_pPoolTimer->cancelTimeout();
+			pWorkLoop->removeEventSource(m_pPoolTimer);
+			CLEAN_RELEASE(m_pPoolTimer);
+		}
+		
 		// Remove Command gate from our work loop
 		if ( m_pCmdGate )
 		{
@@ -322,33 +376,18 @@ void AOE_KEXT_NAME::stop(IOService *provider)
 		CLEAN_RELEASE(m_pAoEControllerInterface);
 	}
 	
-	// Empty any data we may have in our sent queue
-	debugVerbose("Empty sent queue...\n");
-	IOLockLock(m_pSentQueueMutex);
-	while ( !TAILQ_EMPTY(&m_sent_queue) )
-	{
-		// get the next item on the input side queue
-		pSent_queue_item = TAILQ_FIRST(&m_sent_queue);
-		remove_from_queue(pSent_queue_item);
-	}
-	IOLockUnlock(m_pSentQueueMutex);
+	// Drop any requests we still have, it's too late to send them now
+	debugVerbose("Empty request queues...\n");
+	IOLockLock(m_pRequestMutex);
+	for (n=0; n<SENT_HASH_SIZE; n++)
+		while ( !LIST_EMPTY(&m_aRequestHash[n]) )
+			remove_request(LIST_FIRST(&m_aRequestHash[n]));
+	IOLockUnlock(m_pRequestMutex);
 
-	debugVerbose("Empty send queue...\n");
-	IOLockLock(m_pToSendQueueMutex);
-	while ( !TAILQ_EMPTY(&m_to_send_queue) )
-	{
-		// get the next item on the input side queue
-		pToSend_queue_item = TAILQ_FIRST(&m_to_send_queue);
-		// Free the mbuf as it's too late to send now
-		mbuf_freem(pToSend_queue_item->mbuf);
-		remove_from_queue(pToSend_queue_item);
-	}
-	IOLockUnlock(m_pToSendQueueMutex);
+	pool_uninit();
 	
-	IOLockFree(m_pSentQueueMutex);
-	m_pSentQueueMutex = NULL;
-	IOLockFree(m_pToSendQueueMutex);
-	m_pToSendQueueMutex = NULL;
+	IOLockFree(m_pRequestMutex);
+	m_pRequestMutex = NULL;
 	IOLockFree(m_pGeneralMutex);
 	m_pGeneralMutex = NULL;
 
@@ -388,6 +427,7 @@ void AOE_KEXT_NAME::cg_enable_interface(OSObject* owner, void* arg0, void* arg1,
 {
 	AOE_KEXT_NAME* pOwner;
 	int* pnEthernetNumber;
+	kern_return_t retval;
 
 	debug("cg_enable_interface\n");
 	
@@ -400,7 +440,12 @@ void AOE_KEXT_NAME::cg_enable_interface(OSObject* owner, void* arg0, void* arg1,
 		return;
 	}	
 
-	if ( KERN_SUCCESS==pOwner->m_pInterfaces->enable_interface(*pnEthernetNumber) )
+	// Enabling the interface resets its window, which is only changed with the request mutex held
+	IOLockLock(pOwner->m_pRequestMutex);
+	retval = pOwner->m_pInterfaces->enable_interface(*pnEthernetNumber);
+	IOLockUnlock(pOwner->m_pRequestMutex);
+
+	if ( KERN_SUCCESS==retval )
 	{
 		// Adjust MTU size of all the interfaces already connected
 		pOwner->m_pAoEControllerInterface->adjust_mtu_sizes(pOwner->get_mtu());
@@ -432,10 +477,6 @@ void AOE_KEXT_NAME::cg_disable_interface(OSObject* owner, void* arg0, void* arg1
 {
 	AOE_KEXT_NAME* pOwner;
 	int* pnEthernetNumber;
-	struct ToSendPktQueue*	pToSend_queue_tmp;
-	struct ToSendPktQueue*	pToSend_queue_item;
-	struct SentPktQueue*	pSent_queue_item;
-	struct SentPktQueue*	pSent_queue_tmp;
 	ifnet_t Interface;
 
 	debug("cg_disable_interface\n");
@@ -457,32 +498,10 @@ void AOE_KEXT_NAME::cg_disable_interface(OSObject* owner, void* arg0, void* arg1
 	Interface = pOwner->m_pInterfaces->get_nth_interface(*pnEthernetNumber);
 	pOwner->m_pInterfaces->interface_disconnected(*pnEthernetNumber);
 
-	debugVerbose("Purging send queue for this interface\n");
-	IOLockLock(pOwner->m_pToSendQueueMutex);
-	TAILQ_FOREACH_SAFE(pToSend_queue_item, &pOwner->m_to_send_queue, q_next, pToSend_queue_tmp)
-	{
-		if ( pToSend_queue_item && (1!=pOwner->m_pInterfaces->is_used(pToSend_queue_item->if_sent)) )
-		{
-			debug("\tremoving from queue...\n");
-			pOwner->remove_from_queue(pToSend_queue_item);
-		}
-	}
-	IOLockUnlock(pOwner->m_pToSendQueueMutex);
-
-	debugVerbose("Purging sent queue for this interface\n");
-	IOLockLock(pOwner->m_pSentQueueMutex);
-	TAILQ_FOREACH_SAFE(pSent_queue_item, &pOwner->m_sent_queue, q_next, pSent_queue_tmp)
-	{
-		if ( pSent_queue_item && (1!=pOwner->m_pInterfaces->is_used(pSent_queue_item->if_sent)) )
-		{
-			debugVerbose("\tremoving from queue...\n");
-			pOwner->remove_from_queue(pSent_queue_item);
-		}
-	}
-	IOLockUnlock(pOwner->m_pSentQueueMutex);
-
-	if ( pSent_queue_item )
-		*pSent_queue_item->pOutstandingCount = 0;
+	debugVerbose("Purging requests for this interface\n");
+	IOLockLock(pOwner->m_pRequestMutex);
+	pOwner->purge_requests(TRUE);
+	IOLockUnlock(pOwner->m_pRequestMutex);
 
 	// Re-enable timers now that we've cleared our queues for the interface
 	// If there is nothing to do, they'll just exit anyway, but we need to make
@@ -585,6 +604,76 @@ int AOE_KEXT_NAME::set_user_window(int nMaxSize)
 }
 
 
+int AOE_KEXT_NAME::set_transmit_budget(int nFrames)
+{
+	// We always send at least one frame per pass, otherwise nothing would ever go out
+	m_nTransmitBudget = MAX(nFrames, 1);
+
+	return 0;
+}
+
+
+int AOE_KEXT_NAME::set_queue_depth(int nQueueDepth)
+{
+	if ( m_pAoEControllerInterface )
+		m_pAoEControllerInterface->set_queue_depth(nQueueDepth);
+	
+	return (m_pAoEControllerInterface!=NULL) ? 0 : -1;
+}
+
+
+int AOE_KEXT_NAME::set_write_coalesce(int nWindow_us)
+{
+	if ( m_pAoEControllerInterface )
+		m_pAoEControllerInterface->set_write_coalesce(nWindow_us);
+	
+	return (m_pAoEControllerInterface!=NULL) ? 0 : -1;
+}
+
+
+int AOE_KEXT_NAME::set_read_cache_size(int nSize_MB)
+{
+	if ( m_pAoEControllerInterface )
+		m_pAoEControllerInterface->set_read_cache_size(nSize_MB);
+	
+	return (m_pAoEControllerInterface!=NULL) ? 0 : -1;
+}
+
+
+int AOE_KEXT_NAME::set_flush_mode(int nMode)
+{
+	if ( m_pAoEControllerInterface )
+		m_pAoEControllerInterface->set_flush_mode(nMode);
+	
+	return (m_pAoEControllerInterface!=NULL) ? 0 : -1;
+}
+
+
+int AOE_KEXT_NAME::set_publish_mode(int nMode)
+{
+	if ( m_pAoEControllerInterface )
+		m_pAoEControllerInterface->set_publish_mode(nMode);
+	
+	return (m_pAoEControllerInterface!=NULL) ? 0 : -1;
+}
+
+
+int AOE_KEXT_NAME::set_congestion_control(int nEthernetNumber, int nStrategy)
+{
+	int nRet;
+	
+	if ( NULL==m_pInterfaces )
+		return -1;
+
+	// The window is only ever changed with the request mutex held
+	IOLockLock(m_pRequestMutex);
+	nRet = m_pInterfaces->set_congestion_control(nEthernetNumber, nStrategy);
+	IOLockUnlock(m_pRequestMutex);
+	
+	return nRet;
+}
+
+
 
 
 
@@ -602,14 +691,27 @@ int AOE_KEXT_NAME::set_user_window(int nMaxSize)
  * http://developer.apple.com/documentation/DeviceDrivers/Conceptual/IOKitFundamentals/HandlingEvents/chapter_8_section_3.html
  *
  * Calling this with through the command gate ensures single threaded access in the driver.
- * We could make this even more multi-threaded by considering a separate work loop for each ATAController.
+ * ATA responses are the exception. Each target runs on its own work loop (one of TARGET_WORK_LOOPS, chosen by
+ * shelf/slot). The filter thread only queues a copy of the response for that loop, which then runs cg_aoe_incoming
+ * with its gate held (see ata_response_received), so responses for different targets are completed in parallel.
+ * All that's shared between them is the request list and the congestion window, which stay under m_pRequestMutex,
+ * and the RTT estimate under m_pGeneralMutex. Responses that can't be queued are handled on our command gate.
  * 
  ---------------------------------------------------------------------------*/
 int AOE_KEXT_NAME::aoe_incoming(ifnet_t ifp, struct ether_header* pEHeader, mbuf_t* pMBufData)
 {
+	aoe_header* pAoEFullHeader;
+	
+	pAoEFullHeader = (pMBufData && *pMBufData) ? MTOD(*pMBufData, aoe_header*) : NULL;
+	
 #ifndef USE_CG_FOR_INCOMING_PACKETS
 	cg_aoe_incoming((OSObject*)this, (void*) ifp, (void*) pEHeader, (void*) pMBufData, 0);
 #else
+	// ATA responses go on to their target's work loop
+	if ( pAoEFullHeader && (AOE_ATA_COMMAND==AOE_HEADER_GETCMD(pAoEFullHeader)) && (AOE_HEADER_GETFLAG(pAoEFullHeader)&AOE_FLAG_RESPONSE) )
+		if ( m_pAoEControllerInterface && m_pAoEControllerInterface->queue_ata_response(pAoEFullHeader, *pMBufData) )
+			return 0;
+	
 	// Here, the actual processing is handled on the command gate
 	m_pCmdGate->runAction( (IOCommandGate::Action) 
 							&AOE_KEXT_NAME::cg_aoe_incoming,
@@ -626,8 +728,23 @@ int AOE_KEXT_NAME::aoe_incoming(ifnet_t ifp, struct ether_header* pEHeader, mbuf
 
 
 
+/*---------------------------------------------------------------------------
+ * An ATA response queued by aoe_incoming has reached the front of its target's work loop. It's handled just as if it
+ * had come through our command gate, but with the target's gate held instead. Only ATA responses come this way, so
+ * the interface and ethernet header (which only config responses use) aren't kept
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::ata_response_received(mbuf_t* pMBufData)
+{
+	cg_aoe_incoming((OSObject*)this, NULL, NULL, (void*) pMBufData, 0);
+}
+
+
+
+
+
 /*---------------------------------------------------------------------------
  * Static function called by the internal IOCommandGate object to handle a runAction() request invoked by aoe_incoming().
+ * ATA responses are run from their target's work loop instead (see ata_response_received)
  ---------------------------------------------------------------------------*/
 void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, void* arg2, void* /*arg3*/)
 {
@@ -635,14 +752,15 @@ void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, voi
 	ifnet_t ifp;
 	struct ether_header* pEHeader;
 	mbuf_t* pMBufData;
-	struct SentPktQueue* pTlq;
-	struct SentPktQueue* pTlqNext;
+	struct PktRequest* pTlq;
+	ifnet_t ifSent;
+	int nTarget;
 	aoe_header* pAoEFullHeader;
 	aoe_cfghdr_rd* pCfgHeader;
 	aoe_atahdr_rd* pATAHeader;
 	UInt32		IncomingPacketTag;
 	bool		fPacketFound;
-	int			nPrevCWND;
+	uint64_t	RTT_ns;
 	
 	debug("cg_aoe_incoming-ININININININININ\n");
 
@@ -678,65 +796,57 @@ void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, voi
 	fPacketFound = FALSE;
 	if ( AOE_HEADER_GETFLAG(pAoEFullHeader)&AOE_FLAG_RESPONSE )
 	{
-		IOLockLock(pThis->m_pSentQueueMutex);
-		//debugVerbose("&&&&Iterating over our queue for tag: %#x\n", IncomingPacketTag);
-		for (pTlq = TAILQ_FIRST(&pThis->m_sent_queue); pTlq != NULL; pTlq = pTlqNext)
-		{
-			// get the next element pointer before we potentially corrupt it
-			pTlqNext = TAILQ_NEXT(pTlq, q_next);
-
-			//if ( pTlq )
-			//	debugVerbose("&&&&Queued packet has tag: %#x\n", pTlq->Tag);
+		IOLockLock(pThis->m_pRequestMutex);
 
-			// Check that the incoming packet is the same as this one
-			if ( pTlq && (pTlq->Tag==IncomingPacketTag) )
+		// Check that the incoming packet is one we're waiting on (a request that hasn't gone out yet can't have a response)
+		pTlq = pThis->find_request(IncomingPacketTag);
+		if ( pTlq && (REQUEST_QUEUED!=pTlq->State) )
+		{
+			// Update the number of outstanding commands
+			if ( pTlq->pOutstandingCount )
 			{
-				//debugVerbose("&&&&Found the packet with tag: %#x\n", pTlq->Tag);
-
-				// Update the number of outstanding commands
-				if ( pTlq->pOutstandingCount )
+				if ( !pTlq->fPacketHasBeenRetransmit )
 				{
-					if ( !pTlq->fPacketHasBeenRetransmit )
-						OSDecrementAtomic(pTlq->pOutstandingCount);
-					else
-						debug("Not decrementing outstanding count as this packet was retransmit\n");
-
-					debugVerbose("RCV-Outstanding replies on this interface=%d (TAG=%#x)\n", *pTlq->pOutstandingCount, pTlq->Tag);
-
-					// Quick check for validity
-					if ( *pTlq->pOutstandingCount<0 )
-					{
-						debugError("Invalid Outstanding count. Resetting to zero\n");
-						*pTlq->pOutstandingCount = 0;
-					}
+					OSDecrementAtomic(pTlq->pOutstandingCount);
+					if ( pTlq->pTargetOutstandingCount && (*pTlq->pTargetOutstandingCount>0) )
+						OSDecrementAtomic(pTlq->pTargetOutstandingCount);
 				}
+				else
+					debug("Not decrementing outstanding count as this packet was retransmit\n");
 
-				// Calculate the round trip time (rtt)
-				if ( !pTlq->fPacketHasBeenRetransmit )
-					pThis->update_rto(time_since_now_ns(pTlq->TimeSent));
-				
-				// We're done with this packet now
-				pThis->remove_from_queue(pTlq);
-				
-				//---------------------------------//
-				// Slow Start / Congestion control //
-				//---------------------------------//
+				debugVerbose("RCV-Outstanding replies on this interface=%d (TAG=%#x)\n", *pTlq->pOutstandingCount, pTlq->Tag);
 
-				nPrevCWND = pThis->m_pInterfaces->get_cwnd(pTlq->if_sent);
-				
-				if ( nPrevCWND < pThis->m_pInterfaces->get_ssthresh(pTlq->if_sent) )
-					pThis->m_pInterfaces->grow_cwnd(pTlq->if_sent, 1, 0);	// Exponential growth  (cwnd+=1)
-				else
-					pThis->m_pInterfaces->grow_cwnd(pTlq->if_sent, 0, 1);	// Fractional growth (cwnd+=1/cwnd)
-				
-				fPacketFound = TRUE;
-				break;
+				// Quick check for validity
+				if ( *pTlq->pOutstandingCount<0 )
+				{
+					debugError("Invalid Outstanding count. Resetting to zero\n");
+					*pTlq->pOutstandingCount = 0;
+				}
+			}
+
+			// Calculate the round trip time (rtt). A resent frame's response can't be matched to either send, so no sample is taken
+			RTT_ns = 0;
+			if ( !pTlq->fPacketHasBeenRetransmit )
+			{
+				RTT_ns = time_since_now_ns(pTlq->TimeSent);
+				pThis->update_rto(RTT_ns);
 			}
-			//else
-				//if ( pTlq )
-				//	debugVerbose("&&&&Nope, that ain't it. On to the next one.\n");
+			
+			// We're done with this request now (keep the interface and target, the record is freed here)
+			// NOTE: If the request was waiting to be resent, this also takes it off the resend queue
+			ifSent = pTlq->if_sent;
+			nTarget = (int) pTlq->nTarget;
+			pThis->remove_request(pTlq);
+			
+			//--------------------//
+			// Congestion control //
+			//--------------------//
+
+			pThis->m_pInterfaces->on_ack(ifSent, nTarget, RTT_ns);
+			
+			fPacketFound = TRUE;
 		}
-		IOLockUnlock(pThis->m_pSentQueueMutex);
+		IOLockUnlock(pThis->m_pRequestMutex);
 	}
 	else
 	{
@@ -774,7 +884,7 @@ void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, voi
 				debugError("AoE protocol error on packet %#x (Error %d - Unknown error)\n", IncomingPacketTag, AOE_HEADER_GETERR(pAoEFullHeader));
 				break;
 		}
-		++pThis->m_nNumUnexpectedResponses;
+		OSIncrementAtomic((volatile SInt32*) &pThis->m_nNumUnexpectedResponses);
 		return;
 	}
 
@@ -821,7 +931,7 @@ void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, voi
 			}
 			default :
 				// Silently ignore AoE commands and command responses that are unrecognised vendor extensions
-				++pThis->m_nNumUnexpectedResponses;
+				OSIncrementAtomic((volatile SInt32*) &pThis->m_nNumUnexpectedResponses);
 				break;
 		}
 
@@ -836,11 +946,11 @@ void AOE_KEXT_NAME::cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, voi
 	else
 	{
 		debugVerbose("Dropping incoming packet with tag %#x as it's not found in our sent queue.\n", IncomingPacketTag);
-		++pThis->m_nNumUnexpectedResponses;
+		OSIncrementAtomic((volatile SInt32*) &pThis->m_nNumUnexpectedResponses);
 	}
 
 	// Since we have more room in our window, send more data if we have more to send
-	if ( fPacketFound && !TAILQ_EMPTY(&pThis->m_to_send_queue) )
+	if ( fPacketFound && pThis->m_nReadyInterfaces )
 		pThis->enable_transmit_timer();
 
 	debug("cg_aoe_incoming-OUTOUTOUTOUTOUTOUTOUTOUT\n");
@@ -1033,11 +1143,11 @@ bool AOE_KEXT_NAME::interface_active(TargetInfo* pTargetInfo, int nInterfaceNumb
 
 /*---------------------------------------------------------------------------
  * Set/get values for a particular interface.
- * The max outstanding can also be set for a particular interface/shelf (ie. buffer count)
+ * The max outstanding can also be set for a particular interface/target (ie. buffer count)
  ---------------------------------------------------------------------------*/
-void AOE_KEXT_NAME::set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding)
+void AOE_KEXT_NAME::set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding)
 {
-	m_pInterfaces->set_max_outstanding(ifref, nShelf, nMaxOutstanding);
+	m_pInterfaces->set_max_outstanding(ifref, nTarget, nMaxOutstanding);
 }
 
 int AOE_KEXT_NAME::get_outstanding(ifnet_t ifref)
@@ -1093,30 +1203,26 @@ UInt64 AOE_KEXT_NAME::get_max_timeout_before_drop(void)
 
 
 /*---------------------------------------------------------------------------
- * Resend a packet. This takes an old item from the sent queue and replaces it on the send queue
+ * Resend a packet. The request moves from in-flight to retransmit-pending and is placed on the resend queue,
+ * which the transmit timer empties before anything else. (NOTE: the request lock should be held at this point)
  ---------------------------------------------------------------------------*/
-void AOE_KEXT_NAME::resend_packet(struct SentPktQueue* pSent_queue_item)
+void AOE_KEXT_NAME::resend_packet(struct PktRequest* pRequest)
 {
-	mbuf_t	mbuf_to_send;
-	
-	if ( pSent_queue_item )
+	if ( pRequest )
 	{
 		// Increase the next timeout
-		pSent_queue_item->RetransmitTime_us = MIN(2*pSent_queue_item->RetransmitTime_us, MAX_RETRANSMIT_TIMEOUT_US);
+		pRequest->RetransmitTime_us = MIN(2*pRequest->RetransmitTime_us, MAX_RETRANSMIT_TIMEOUT_US);
 
-		debug("\t\tRESEND PACKET with TAG=%#x and updating timeout to %luus\n", pSent_queue_item->Tag, pSent_queue_item->RetransmitTime_us);
+		debug("\t\tRESEND PACKET with TAG=%#x and updating timeout to %luus\n", pRequest->Tag, pRequest->RetransmitTime_us);
 
-		// Update Time (again, we set this to zero so it gets updated when it's actually sent from the send queue)
-		pSent_queue_item->TimeSent = 0;
-		
 		// This packet is an anomoly, exclude the packet from RTT calculations
-		pSent_queue_item->fPacketHasBeenRetransmit = TRUE;
+		pRequest->fPacketHasBeenRetransmit = TRUE;
 
-		// Make another copy of the mbuf before we lose it in the output routine
-		mbuf_dup(pSent_queue_item->first_mbuf, MBUF_WAITOK, &mbuf_to_send);
-		
 		// resend immediately
-		add_to_send_queue(pSent_queue_item->if_sent, pSent_queue_item->Tag, mbuf_to_send, pSent_queue_item->nShelf, pSent_queue_item->pOutstandingCount, TRUE /*immediate send*/);
+		remove_from_retransmit_wheel(pRequest);
+		pRequest->State = REQUEST_RETRANSMIT_PENDING;
+		TAILQ_INSERT_TAIL(&m_resend_queue, pRequest, q_next);
+		enable_transmit_timer(0);
 		
 		// Increment the retransmit count if we have previously found at least one target
 		if ( m_pAoEControllerInterface && (m_pAoEControllerInterface->number_of_targets() > 0) )
@@ -1127,45 +1233,183 @@ void AOE_KEXT_NAME::resend_packet(struct SentPktQueue* pSent_queue_item)
 
 
 
+/*---------------------------------------------------------------------------
+ * Resend a frame now rather than waiting for it to time out. This is used when a controller has seen
+ * later frames of the same command come back, so the frame has most likely been lost. As the frames after
+ * it are getting through, the window is halved rather than closed and the timeout isn't backed off.
+ ---------------------------------------------------------------------------*/
+errno_t AOE_KEXT_NAME::resend_chunk(UInt32 Tag)
+{
+	struct PktRequest*	pRequest;
+	uint64_t			RetransmitTime_us;
+	errno_t				result;
+
+	result = ENOENT;
+	
+	IOLockLock(m_pRequestMutex);
+
+	// Only frames still waiting on a response are resent, anything queued or already being resent will go out anyway
+	pRequest = find_request(Tag);
+	if ( pRequest && (REQUEST_IN_FLIGHT==pRequest->State) && pRequest->RetransmitTime_us )
+	{
+		debug("Resending frame with TAG=%#x as later frames have been received\n", Tag);
+
+		// See RetransmitTimer for why the outstanding count only decrements once
+		if ( !pRequest->fPacketHasBeenRetransmit && pRequest->pOutstandingCount )
+		{
+			OSDecrementAtomic(pRequest->pOutstandingCount);
+			if ( pRequest->pTargetOutstandingCount )
+				OSDecrementAtomic(pRequest->pTargetOutstandingCount);
+		}
+
+		m_pInterfaces->on_loss(pRequest->if_sent, (int) pRequest->nTarget);
+
+		RetransmitTime_us = pRequest->RetransmitTime_us;
+		resend_packet(pRequest);
+		pRequest->RetransmitTime_us = RetransmitTime_us;
+
+		++m_nChunkResends;
+		result = 0;
+	}
+
+	IOLockUnlock(m_pRequestMutex);
+
+	return result;
+}
+
+
+
+
 
 
 #pragma mark -
 #pragma mark Timer handling
 
 /*---------------------------------------------------------------------------
- * Starts the retransmit timer. This is called after every transmit.
- * There are two ways of handling this:
- * TRIGGER_RETRANSMIT_WHEN_TX_COMPLETE	- Restart the timer every time we're called
- * not above							- Leave time in place
- *
- * The latter method will call retransmit more often, and sticks closer to the RTO values when retransmitting
- * The first method (the default) isn't as aggressive and holds off retransmits slightly while there are a lot
- * of transmits occuring. This often avoids unnecessary retransmits and thus is slightly faster
+ * (Re)starts the retransmit timer for the earliest packet waiting on the retransmit wheel.
+ * This is only needed after the timer has been disabled from outside the timer itself (eg. when an
+ * interface is removed). Normal transmits arm the timer through add_to_retransmit_wheel
  ---------------------------------------------------------------------------*/
 void AOE_KEXT_NAME::enable_retransmit_timer(void)
 {
+	IOLockLock(m_pRequestMutex);
+	m_RetransmitDeadline_ns = 0;
+	arm_retransmit_timer(next_retransmit_deadline());
+	IOLockUnlock(m_pRequestMutex);
+}
+
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Arm the retransmit timer for the given deadline. The timer is only touched if the deadline is earlier than
+ * the one it's already armed for, so a stream of transmits doesn't keep disabling/re-arming the timer.
+ * (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::arm_retransmit_timer(UInt64 Deadline_ns)
+{
+	UInt64 Now_ns;
 	UInt64 lDelay;
 
-	lDelay = get_rto_us();
+	if ( 0==Deadline_ns )
+		return;
+
+	if ( m_RetransmitDeadline_ns && (m_RetransmitDeadline_ns<=Deadline_ns) )
+		return;
+
+	m_RetransmitDeadline_ns = Deadline_ns;
+
+	Now_ns = current_time_ns();
+	lDelay = (Deadline_ns>Now_ns) ? CONVERT_NS_TO_US(Deadline_ns-Now_ns) : 0;
 
 #ifdef DEBUG_RETRANSMIT
 	debug("Setting retransmit timer with %luus delay\n", lDelay);
-#endif	
-	
-#ifdef TRIGGER_RETRANSMIT_WHEN_TX_COMPLETE
-	// Restart out retransmit timer
+#endif
+
 	if ( m_pRetransmitTimer->isEnabled() )
 		m_pRetransmitTimer->disable();
 
 	m_pRetransmitTimer->enable();
 	m_pRetransmitTimer->setTimeoutUS(lDelay);
-#else
-	if ( !m_pRetransmitTimer->isEnabled() )
+}
+
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Place a packet that has just been sent on the retransmit wheel. The deadline is based on the time it was
+ * sent and its current retransmit timeout. Packets that aren't retransmit are still given a deadline (the current RTO)
+ * so they are eventually dropped. (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::add_to_retransmit_wheel(struct PktRequest* pRequest)
+{
+	uint64_t TimeSent_ns;
+	UInt64 Timeout_us;
+
+	remove_from_retransmit_wheel(pRequest);
+
+	absolutetime_to_nanoseconds(pRequest->TimeSent, &TimeSent_ns);
+	Timeout_us = pRequest->RetransmitTime_us ? pRequest->RetransmitTime_us : get_rto_us();
+
+	pRequest->Deadline_ns = TimeSent_ns + Timeout_us*1000;
+	LIST_INSERT_HEAD(&m_aRetransmitWheel[(pRequest->Deadline_ns/RETRANSMIT_WHEEL_TICK_NS)%RETRANSMIT_WHEEL_SLOTS], pRequest, q_wheel);
+
+	arm_retransmit_timer(pRequest->Deadline_ns);
+}
+
+void AOE_KEXT_NAME::remove_from_retransmit_wheel(struct PktRequest* pRequest)
+{
+	// It's assumed this function is called WITH the lock set
+	if ( pRequest->Deadline_ns )
 	{
-		m_pRetransmitTimer->enable();
-		m_pRetransmitTimer->setTimeoutUS(lDelay);
+		LIST_REMOVE(pRequest, q_wheel);
+		pRequest->Deadline_ns = 0;
 	}
-#endif
+}
+
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Find the earliest deadline on the retransmit wheel (or 0 if the wheel is empty).
+ * Starting from where the wheel last stopped, the first slot holding a packet for that revolution has the
+ * earliest deadline. Packets more than a revolution away are only used if nothing closer is found.
+ * (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+UInt64 AOE_KEXT_NAME::next_retransmit_deadline(void)
+{
+	struct PktRequest*		pRequest;
+	UInt64					nTick;
+	UInt64					Earliest_ns;
+	UInt64					Later_ns;
+	int						n;
+
+	Later_ns = 0;
+
+	for (n=0; n<RETRANSMIT_WHEEL_SLOTS; n++)
+	{
+		nTick = m_nRetransmitWheelTick+n;
+		Earliest_ns = 0;
+
+		LIST_FOREACH(pRequest, &m_aRetransmitWheel[nTick%RETRANSMIT_WHEEL_SLOTS], q_wheel)
+		{
+			if ( nTick>=(pRequest->Deadline_ns/RETRANSMIT_WHEEL_TICK_NS) )
+			{
+				if ( (0==Earliest_ns) || (pRequest->Deadline_ns<Earliest_ns) )
+					Earliest_ns = pRequest->Deadline_ns;
+			}
+			else if ( (0==Later_ns) || (pRequest->Deadline_ns<Later_ns) )
+				Later_ns = pRequest->Deadline_ns;
+		}
+
+		if ( Earliest_ns )
+			return Earliest_ns;
+	}
+
+	return Later_ns;
 }
 
 
@@ -1200,23 +1444,22 @@ void AOE_KEXT_NAME::enable_transmit_timer(int nDelaySend_us /*=?*/)
 
 /*---------------------------------------------------------------------------
  * Actually handle any transmits.
- * If the slow-start/congestion control allows it, this iterates over our send queue
- * sending packets. To avoid holding up our event source, we only transmit a single packet
- * in this function. If there are packets remaining after sending, it re-enables the transmit
- * timer at the end of the function. This gives the receive routine a chance to actually receive
- * packets 
+ * Anything waiting on the resend queue goes out first. Then the interfaces take turns (round robin) sending the
+ * packet at the head of their own send queue, provided the slow-start/congestion control allows it. Only interfaces in
+ * m_nReadyInterfaces have anything to send, so a full or idle interface costs us nothing. Every packet the windows allow is
+ * sent in the one pass, up to m_nTransmitBudget packets. If we run out of budget with packets remaining, it re-enables the
+ * transmit timer at the end of the function. This gives the receive routine a chance to actually receive
+ * packets. (When the windows are full, the next response re-enables the timer)
  ---------------------------------------------------------------------------*/
 void AOE_KEXT_NAME::TransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 {
 	AOE_KEXT_NAME*			pThis;
-	struct ToSendPktQueue*	pToSend_queue_tmp;
-	struct ToSendPktQueue*	pToSend_queue_item;
-	int						nOutstanding;
-	int						nCWND;
-	int						nMaxForThisShelf;
+	struct PktRequest*		pToSend_queue_item;
 	bool					fMoreToSend;
-	int						nMaxoutstanding;
-	UInt64					IdleTime_us;
+	int						nSent;
+	int						nInterface;
+	int						nCredit;
+	int						n;
 	
 	pThis = OSDynamicCast(AOE_KEXT_NAME, pOwner);
 	
@@ -1228,105 +1471,77 @@ void AOE_KEXT_NAME::TransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 	pSender->disable();
 
 	fMoreToSend = FALSE;
+	nSent = 0;
 
 	if ( pThis )
 	{
-		IOLockLock(pThis->m_pToSendQueueMutex);
+		IOLockLock(pThis->m_pRequestMutex);
 
-		// Quickly iterate over our queue to see if any packets need to be sent immediately
-		TAILQ_FOREACH_SAFE(pToSend_queue_item, &pThis->m_to_send_queue, q_next, pToSend_queue_tmp)
+		// Retransmits are sent immediately (they're already accounted for in the window)
+		while ( !TAILQ_EMPTY(&pThis->m_resend_queue) )
 		{
-			if ( pToSend_queue_item && pToSend_queue_item->fSendImmediately )
-			{
-				debug("Sending packet (tag=%#x) immediately\n", pToSend_queue_item->Tag);
+			pToSend_queue_item = TAILQ_FIRST(&pThis->m_resend_queue);
+			debug("Sending packet (tag=%#x) immediately\n", pToSend_queue_item->Tag);
 
-				pThis->send_packet_from_queue(pToSend_queue_item);
-			}
+			pThis->transmit_request(pToSend_queue_item);
 		}
 		
-		
-		TAILQ_FOREACH_SAFE(pToSend_queue_item, &pThis->m_to_send_queue, q_next, pToSend_queue_tmp)
+		while ( pThis->m_nReadyInterfaces )
 		{
-			if ( pToSend_queue_item )
-			{
-				//---------------------------------//
-				// Slow Start / Congestion control //
-				//---------------------------------//
-#ifndef NO_FLOW_CONTROL
-				IdleTime_us = time_since_now_us(pThis->m_pInterfaces->get_time_since_last_send(pToSend_queue_item->if_sent));
-				nOutstanding = pThis->get_outstanding(pToSend_queue_item->if_sent);
+			//---------------------------------//
+			// Slow Start / Congestion control //
+			//---------------------------------//
 
-				// Disable idle handling as it's hurting performance
-				#if 0	
-				if ( (nOutstanding==0) && (IdleTime_us > pThis->get_rto_us()) )
-				{
-					#ifdef DEBUG_TRANSMIT
-					debugVerbose("\tInterface was idle, resetting CWND=1\n");
-					#endif
-
-					pThis->m_pInterfaces->set_cwnd(pToSend_queue_item->if_sent, 1);
-					pThis->m_pInterfaces->set_ssthresh(pToSend_queue_item->if_sent, 1);
-				}
-				#endif
+			// Find the next interface (after the last one we sent on) with both a packet and room in its window
+			pToSend_queue_item = NULL;
+			for (n=0; n<numberof(pThis->m_aSendQueue); n++)
+			{
+				nInterface = (pThis->m_nNextInterface+n) % numberof(pThis->m_aSendQueue);
 
-				nCWND = pThis->m_pInterfaces->get_cwnd(pToSend_queue_item->if_sent);
-				nMaxForThisShelf = pThis->m_pInterfaces->get_max_outstanding(pToSend_queue_item->if_sent, pToSend_queue_item->nShelf);
+				if ( 0==(pThis->m_nReadyInterfaces & (1<<nInterface)) )
+					continue;
 
-				nMaxoutstanding = MIN(nCWND, nMaxForThisShelf);
-				nMaxoutstanding = MIN(nMaxoutstanding,  pThis->m_pInterfaces->m_nMaxUserWindow);
+#ifndef NO_FLOW_CONTROL
+				nCredit = pThis->m_pInterfaces->get_send_credit(nInterface, TAILQ_FIRST(&pThis->m_aSendQueue[nInterface])->nTarget);
 
-				// Figure out if we can actually send this packet
 				#ifdef DEBUG_TRANSMIT
-				debugVerbose("\tinterface=%#x -[%d.*] -- current outstanding=%d ... nMaxoutstanding=MIN(nCWND=%d, nMaxForThisShelf=%d, UserWindow=%d)=%d [%s]\n", pToSend_queue_item->if_sent, pToSend_queue_item->nShelf, nOutstanding, nCWND, nMaxForThisShelf, pThis->m_pInterfaces->m_nMaxUserWindow, nMaxoutstanding, (nOutstanding>=nMaxoutstanding)?"NOT SENDING":"SENDING");
+				debugVerbose("\tinterface=%d -- current outstanding=%d, window has room for %d [%s]\n", nInterface, pThis->get_outstanding(pThis->m_pInterfaces->get_nth_interface(nInterface)), nCredit, (nCredit<=0)?"NOT SENDING":"SENDING");
 				#endif
 
-				if ( 1!=pThis->m_pInterfaces->is_used(pToSend_queue_item->if_sent) )			// NOTE "is_used" returns 0 for not used, 1 for used and -1 for error
-				{
-					debugError("Interface is disabled and there are still packets in the send queue\n");
-					
-					// This shouldn't occur, but TODO: empty any outstanding packets
-				}
+				// We are too busy right now on this interface...
+				if ( nCredit<=0 )
+					continue;
+#endif	//NO_FLOW_CONTROL
 
-				if ( nOutstanding>=nMaxoutstanding )
-				{
-					// We are too busy right now...
-#ifdef DEBUG_TRANSMIT
-					debugVerbose("\tnot sending packet with tag %#x\n", pToSend_queue_item->Tag);
-#endif
+				pToSend_queue_item = TAILQ_FIRST(&pThis->m_aSendQueue[nInterface]);
+				break;
+			}
 
-					// Check if we should bother iterating through the rest of the loop
-					if ( 0==pThis->m_pInterfaces->all_full(nMaxoutstanding) )
-					{
+			if ( NULL==pToSend_queue_item )
+			{
 #ifdef DEBUG_TRANSMIT
-						debugVerbose("\tNo more interfaces have data to send.\n");
+				debugVerbose("\tNo more interfaces have room to send.\n");
 #endif
-						break;
-					}
-					
-					// Otherwise, keep iterating, other interfaces may have packets to send
-					continue;
-				}
+				break;
+			}
 
-				// Make a note if we still need to send more packets (this will call the timer again)
-				if ( nOutstanding<nMaxoutstanding )
-					fMoreToSend = TRUE;
+			pThis->m_nNextInterface = (nInterface+1) % numberof(pThis->m_aSendQueue);
+			pThis->transmit_request(pToSend_queue_item);
 
-#else
-				// Force a check of the queue
+			// Make a note if we still need to send more packets (this will call the timer again)
+			if ( ++nSent>=pThis->m_nTransmitBudget )
+			{
 				fMoreToSend = TRUE;
-#endif	//NO_FLOW_CONTROL
-
-				pThis->send_packet_from_queue(pToSend_queue_item);
 				break;
 			}
 		}
-		IOLockUnlock(pThis->m_pToSendQueueMutex);
+		IOLockUnlock(pThis->m_pRequestMutex);
 	}
 	else
 		debugError("Unable to find AOE_KEXT_NAME\n");
 
 	// Send again if queue is not empty and we know we are still within the window
-	if ( fMoreToSend && !TAILQ_EMPTY(&pThis->m_to_send_queue) )
+	if ( fMoreToSend && pThis->m_nReadyInterfaces )
 		pThis->enable_transmit_timer();
 
 #ifdef DEBUG_TRANSMIT
@@ -1339,82 +1554,62 @@ void AOE_KEXT_NAME::TransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 
 
 /*---------------------------------------------------------------------------
- * This should only be called from the transmit timer (NOTE: the sent queue should be locked at this point)
- * It locates the packet in the sent queue and updates the time that it was actually sent. It also increases
- * the outstanding count (provided it isn't a resend)
+ * This should only be called from the transmit timer (NOTE: the request lock should be held at this point)
+ * It takes a queued or retransmit-pending request off its queue, outputs the frame and moves the request
+ * to in-flight. It also increases the outstanding count (provided it isn't a resend)
  ---------------------------------------------------------------------------*/
-void AOE_KEXT_NAME::send_packet_from_queue(struct ToSendPktQueue* pToSend_queue_item)
+void AOE_KEXT_NAME::transmit_request(struct PktRequest* pRequest)
 {
-	struct SentPktQueue*	pSent_queue_item;
-	struct SentPktQueue*	pTlqNext;
-	bool					fInSentQueue;
-	
-	fInSentQueue = FALSE;
+	mbuf_t	mbuf_to_send;
+	bool	fFirstSend;
 
 	//----------------------//
 	// Begin sending packet //
 	//----------------------//
 
-	// Locate our tag in the sent queue so we can update the timer
+	fFirstSend = (REQUEST_QUEUED==pRequest->State);
+	unqueue_request(pRequest);
 
-	//debugVerbose("&&&&Iterating over our sent queue for tag: %#x\n", pToSend_queue_item->Tag);
-	IOLockLock(m_pSentQueueMutex);
-	for (pSent_queue_item = TAILQ_FIRST(&m_sent_queue); pSent_queue_item != NULL; pSent_queue_item = pTlqNext)
+	if ( !pRequest->TimeFirstSent )
 	{
-		// get the next element pointer before we potentially corrupt it
-		pTlqNext = TAILQ_NEXT(pSent_queue_item, q_next);
-		
-		if ( pSent_queue_item && (pSent_queue_item->Tag==pToSend_queue_item->Tag) )
-		{
-			fInSentQueue = TRUE;
-			
-			if ( !pSent_queue_item->TimeFirstSent )
-			{
-				clock_get_uptime(&pSent_queue_item->TimeFirstSent);
-				pSent_queue_item->TimeSent = pSent_queue_item->TimeFirstSent;
-			}
-			else
-				clock_get_uptime(&pSent_queue_item->TimeSent);
-			break;
-		}
+		clock_get_uptime(&pRequest->TimeFirstSent);
+		pRequest->TimeSent = pRequest->TimeFirstSent;
 	}
-	
-	if ( fInSentQueue )
+	else
+		clock_get_uptime(&pRequest->TimeSent);
+
+	// Watch for retransmit
+	pRequest->State = REQUEST_IN_FLIGHT;
+	add_to_retransmit_wheel(pRequest);
+
+	// Provided we aren't resending the packet, increment the outstanding count on the interface.
+	if ( fFirstSend )
 	{
-		// Provided we aren't sending the packet immediately, increment the outstanding count on the interface.
-		if ( !pToSend_queue_item->fSendImmediately )
-			OSIncrementAtomic(pToSend_queue_item->pOutstandingCount);
-		else
-			debug("\tNot incrementing outstanding count as we're sending the packet immediately\n");
-		
-		debugVerbose("\tOutputting packet with tag %#x on (ifnet=%#x)\n", pToSend_queue_item->Tag, pToSend_queue_item->if_sent);
-		
-		// Update time
-		m_pInterfaces->update_time_since_last_send(pToSend_queue_item->if_sent);
-		
-		// Finally...we send the data...
-		ifnet_output_raw(pToSend_queue_item->if_sent, PF_INET, pToSend_queue_item->mbuf);
-		
-		// Watch for retransmit
-		enable_retransmit_timer();
-
-		// If this isn't a broadcast, kick the idle watchdog
-		if ( !(pToSend_queue_item->Tag&TAG_BROADCAST_MASK) )
-			enable_idle_timer(pToSend_queue_item->if_sent);
+		OSIncrementAtomic(pRequest->pOutstandingCount);
+		if ( pRequest->pTargetOutstandingCount )
+			OSIncrementAtomic(pRequest->pTargetOutstandingCount);
 	}
 	else
-	{
-		debugVerbose("Transmit packet (tag=%#x) not in sent queue\n", pToSend_queue_item->Tag);
-		// NOTE: A packet can only be in the send queue and not in the sent queue if a packet is retransmit after a timeout
-		// and the packet is received before the actual transmit occurs
-		// In this case, we dont bother sending, just remove it from the queue...
-
-		// NOTE: Shouldn't need to free here
-		//mbuf_freem(pToSend_queue_item->mbuf);
-	}
+		debug("\tNot incrementing outstanding count as we're resending the packet\n");
+	
+	debugVerbose("\tOutputting packet with tag %#x on (ifnet=%#x)\n", pRequest->Tag, pRequest->if_sent);
+	
+	// Update time
+	m_pInterfaces->update_time_since_last_send(pRequest->if_sent);
 	
-	remove_from_queue(pToSend_queue_item);
-	IOLockUnlock(m_pSentQueueMutex);
+	// Finally...we send the data...
+	// We lose the mbuf in the output routine, so we send another reference to the frame and keep ours for retransmits.
+	// mbuf_copym only copies the small header mbuf, the payload clusters are shared (they're reference counted) rather than
+	// copied like mbuf_dup would. Neither we nor the output routine modify the payload after this point.
+	// If we can't make the reference, the request is left in flight and the retransmit timer sends it again
+	if ( 0==mbuf_copym(pRequest->mbuf, 0, MBUF_COPYALL, MBUF_WAITOK, &mbuf_to_send) )
+		ifnet_output_raw(pRequest->if_sent, PF_INET, mbuf_to_send);
+	else
+		debugError("Unable to copy packet with tag %#x for transmit\n", pRequest->Tag);
+
+	// If this isn't a broadcast, kick the idle watchdog
+	if ( !(pRequest->Tag&TAG_BROADCAST_MASK) )
+		enable_idle_timer(pRequest->if_sent);
 }
 
 
@@ -1460,8 +1655,13 @@ void AOE_KEXT_NAME::IdleTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 	debug("@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
 #endif
 
+	// Responses change the window from the targets' work loops, so this can't rely on being on our own loop
 	if ( pThis && pThis->m_pInterfaces )
+	{
+		IOLockLock(pThis->m_pRequestMutex);
 		pThis->m_pInterfaces->reset_if_idle(IDLE_DELAY_US);
+		IOLockUnlock(pThis->m_pRequestMutex);
+	}
 }
 
 
@@ -1470,13 +1670,19 @@ void AOE_KEXT_NAME::IdleTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 
 /*---------------------------------------------------------------------------
  * Handle any retransmissions (if necessary)
+ * Only the wheel slots that have come due since the last time we ran are visited, so the cost here depends
+ * on the number of packets that have timed out rather than the number of packets in flight.
  ---------------------------------------------------------------------------*/
 void AOE_KEXT_NAME::RetransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender)
 {
-	AOE_KEXT_NAME*			pThis;
-	struct SentPktQueue*	pSent_queue_tmp;
-	struct SentPktQueue*	pSent_queue_item;
-	bool					fHaveAdjustedCWND;
+	AOE_KEXT_NAME*					pThis;
+	struct PktRequest*				pSent_queue_tmp;
+	struct PktRequest*				pSent_queue_item;
+	struct PktRequestListHeadStruct	DueQueue;
+	UInt64							Now_ns;
+	UInt64							nTick;
+	UInt64							nCurrentTick;
+	bool							fHaveAdjustedCWND;
 	
 	pThis = OSDynamicCast(AOE_KEXT_NAME, pOwner);
 	fHaveAdjustedCWND = FALSE;
@@ -1485,124 +1691,103 @@ void AOE_KEXT_NAME::RetransmitTimer(OSObject* pOwner, IOTimerEventSource* pSende
 	debug("RetransmitTimer FIRED%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%!!\n");
 #endif
 	
-	// Allow the re-transmit timer to be called again. This is done at the beginning because resend_packet will re-arm the timer
+	// Allow the re-transmit timer to be called again. This is done at the beginning because we re-arm the timer at the end
 	pSender->disable();
 	
 	if ( pThis )
 	{
-		IOLockLock(pThis->m_pSentQueueMutex);
-		
-		TAILQ_FOREACH_SAFE(pSent_queue_item, &pThis->m_sent_queue, q_next, pSent_queue_tmp)
+		LIST_INIT(&DueQueue);
+
+		IOLockLock(pThis->m_pRequestMutex);
+		pThis->m_RetransmitDeadline_ns = 0;
+
+		//----------------------------------------//
+		// Collect the packets that have come due //
+		//----------------------------------------//
+		Now_ns = current_time_ns();
+		nCurrentTick = Now_ns/RETRANSMIT_WHEEL_TICK_NS;
+
+		// We never need to look at more than one revolution of the wheel
+		nTick = pThis->m_nRetransmitWheelTick;
+		if ( nCurrentTick-nTick >= RETRANSMIT_WHEEL_SLOTS )
+			nTick = nCurrentTick-RETRANSMIT_WHEEL_SLOTS+1;
+
+		for (; nTick<=nCurrentTick; nTick++)
 		{
-			if ( pSent_queue_item )
+			LIST_FOREACH_SAFE(pSent_queue_item, &pThis->m_aRetransmitWheel[nTick%RETRANSMIT_WHEEL_SLOTS], q_wheel, pSent_queue_tmp)
 			{
-				// Firelog seems to have an issue with having both of these commands on the same line.
-				#ifdef DEBUG_RETRANSMIT
-				if ( pSent_queue_item->TimeFirstSent && pSent_queue_item->TimeSent )
-				{
-					debug("\tPacket with tag %#x is %luus old  ", pSent_queue_item->Tag, time_since_now_us(pSent_queue_item->TimeSent));
-					debugShort("(first sent %luus ago)\n", time_since_now_us(pSent_queue_item->TimeFirstSent));
-				}
-				else
-				{
-					//debug("\tPacket with tag %#x hasn't been sent yet...", pSent_queue_item->Tag);
-					//debugShort("(first sent=%luus) ", time_since_now_us(pSent_queue_item->TimeFirstSent));
-					//debugShort("(time sent=%luus)\n", time_since_now_us(pSent_queue_item->TimeSent));
+				// Packets due on a later revolution share this slot, they are left where they are
+				if ( pSent_queue_item->Deadline_ns > Now_ns )
+					continue;
 
-					if ( TAILQ_EMPTY(&pThis->m_to_send_queue) )
-						debugError("\tPacket with tag %#x hasn't been sent yet....To Send queue is empty\n", pSent_queue_item->Tag);
-				}
+				pThis->remove_from_retransmit_wheel(pSent_queue_item);
+				LIST_INSERT_HEAD(&DueQueue, pSent_queue_item, q_wheel);
+			}
+		}
+		pThis->m_nRetransmitWheelTick = nCurrentTick;
+
+		//---------------------------------//
+		// Drop or retransmit each of them //
+		//---------------------------------//
+		LIST_FOREACH_SAFE(pSent_queue_item, &DueQueue, q_wheel, pSent_queue_tmp)
+		{
+			// Firelog seems to have an issue with having both of these commands on the same line.
+			#ifdef DEBUG_RETRANSMIT
+			debug("\tPacket with tag %#x is %luus old  ", pSent_queue_item->Tag, time_since_now_us(pSent_queue_item->TimeSent));
+			debugShort("(first sent %luus ago)\n", time_since_now_us(pSent_queue_item->TimeFirstSent));
+			#endif
+
+			// Since we're dropping or resending this packet, we decrement the number of commands outstanding
+			// NOTE:	Even if we receive a response from the packet, the outstanding count will not decrement again because
+			//			it's only decremented if the packet hasn't been retransmit.
+			if ( !pSent_queue_item->fPacketHasBeenRetransmit )
+			{
+				OSDecrementAtomic(pSent_queue_item->pOutstandingCount);
+				if ( pSent_queue_item->pTargetOutstandingCount )
+					OSDecrementAtomic(pSent_queue_item->pTargetOutstandingCount);
+			}
+			else
+				debug("\tNot decrementing outstanding count as the packet has already been resent\n");
+			debugVerbose("\tOutstanding count = %d\n", *pSent_queue_item->pOutstandingCount);
+
+			// Check that the packet should be re-transmit
+			if ( 0==pSent_queue_item->RetransmitTime_us )
+			{
+				#ifdef DEBUG_RETRANSMIT
+				debug("\t\tPacket timed out, but doesn't require re-transmit...DROPPING PACKET\n");
+				#endif
+				pThis->remove_request(pSent_queue_item);
+			}
+			else if ( time_since_now_us(pSent_queue_item->TimeFirstSent) > pThis->get_max_timeout_before_drop() )
+			{
+				#ifdef DEBUG_RETRANSMIT
+				debug("\t\tTOO LONG!! DROPPING PACKET\n");
 				#endif
+				pThis->remove_request(pSent_queue_item);
+			}
+			else
+			{
+				//--------------------//
+				// Congestion control //
+				//--------------------//
 
-				// Check that the packet should be re-transmit
-				if ( pSent_queue_item->RetransmitTime_us )
+				if ( !fHaveAdjustedCWND )	// NOTE: We only adjust the window once during this timeout
 				{
-					// NOTE: A packet is immediately placed in the sent queue prior to it being actualy sent.
-					// This check ensures we dont retransmit or drop it before it's actually sent
-					if ( pSent_queue_item->TimeFirstSent && pSent_queue_item->TimeSent )
-					{
-						if ( time_since_now_us(pSent_queue_item->TimeFirstSent) > pThis->get_max_timeout_before_drop() )
-						{
-							#ifdef DEBUG_RETRANSMIT
-							debug("\t\tTOO LONG!! DROPPING PACKET\n");
-							#endif
-							pThis->remove_from_queue(pSent_queue_item);
-
-							// Since we're dropping this packet and removing it from the queue, we decrement the number of commands outstanding
-							// NOTE:	Even if we receive a response from the packet, the outstanding count will not decrement again because
-							//			it's only decremented if the response is found in the sent queue
-
-							if ( !pSent_queue_item->fPacketHasBeenRetransmit )
-								OSDecrementAtomic(pSent_queue_item->pOutstandingCount);
-							else
-								debug("\tNot decrementing outstanding count as the packet has already been resent\n");
-							debugVerbose("\tOutstanding count = %d\n", *pSent_queue_item->pOutstandingCount);
-						}
-						else
-						{
-							if ( time_since_now_us(pSent_queue_item->TimeSent) > pSent_queue_item->RetransmitTime_us )
-							{
-								//---------------------------------//
-								// Slow Start / Congestion control //
-								//---------------------------------//
-
-								// Since we've timed out, we exponentially decrease our slow start threshold (ssthresh)
-								if ( !fHaveAdjustedCWND )	// NOTE: We only adjust the window once during this timeout
-								{
-									int nPrevCWND = pThis->m_pInterfaces->get_cwnd(pSent_queue_item->if_sent);
-									int nSSThresh = MAX(nPrevCWND/2, 1);
-									pThis->m_pInterfaces->set_ssthresh(pSent_queue_item->if_sent, nSSThresh);
-									pThis->m_pInterfaces->set_cwnd(pSent_queue_item->if_sent, 1);
-									debugVerbose("\tAdjusting cwnd to %d and ssthresh to %d (cwnd was %d)\n", pThis->m_pInterfaces->get_cwnd(pSent_queue_item->if_sent), nSSThresh, nPrevCWND);
-
-									fHaveAdjustedCWND = TRUE;
-								}
-
-								// During a retransmit, we still decrement the outstanding count. Retransmit packets (on reception) do NOT decrement the count
-								// NOTE: We still have to make sure we dont decrement the count if the packet has already been retransmit
-								if ( !pSent_queue_item->fPacketHasBeenRetransmit )
-									OSDecrementAtomic(pSent_queue_item->pOutstandingCount);
-								else
-									debug("\tNot decrementing outstanding count as the packet has already been resent\n");
-
-								#ifdef DEBUG_RETRANSMIT
-								debug("\t\tRetransmitTime_us = %luus\n", pSent_queue_item->RetransmitTime_us);
-								#endif
-								IOLockUnlock(pThis->m_pSentQueueMutex);
-								pThis->resend_packet(pSent_queue_item);
-								IOLockLock(pThis->m_pSentQueueMutex);
-							}
-							else
-							{
-								#ifdef DEBUG_RETRANSMIT
-								debug("\t\t not retransmitting yet as - RetransmitTime_us = %luus\n", pSent_queue_item->RetransmitTime_us);
-								#endif
-							}
-						}
-					}
-				}
-				else
-				{
-					#ifdef DEBUG_RETRANSMIT
-					debug("\t\tPacket timed out, but doesn't require re-transmit...DROPPING PACKET\n");
-					#endif
-					pThis->remove_from_queue(pSent_queue_item);
-					
-					if ( !pSent_queue_item->fPacketHasBeenRetransmit )
-						OSDecrementAtomic(pSent_queue_item->pOutstandingCount);
-					else
-						debug("\tNot decrementing outstanding count as the packet has already been resent\n");
-
-					debugVerbose("\tOutstanding count = %d\n", *pSent_queue_item->pOutstandingCount);
+					pThis->m_pInterfaces->on_timeout(pSent_queue_item->if_sent, (int) pSent_queue_item->nTarget);
+					fHaveAdjustedCWND = TRUE;
 				}
+
+				#ifdef DEBUG_RETRANSMIT
+				debug("\t\tRetransmitTime_us = %luus\n", pSent_queue_item->RetransmitTime_us);
+				#endif
+				pThis->resend_packet(pSent_queue_item);
 			}
 		}
+
+		// Wait for whatever is due next (resent packets are put back on the wheel when they're actually sent)
+		pThis->arm_retransmit_timer(pThis->next_retransmit_deadline());
 		
-		// If the tail isn't empty, we re-enable the re-transmit timer (unless it was already armed in resend_packet).
-		if ( !TAILQ_EMPTY(&pThis->m_sent_queue) )
-			pThis->enable_retransmit_timer();
-		
-		IOLockUnlock(pThis->m_pSentQueueMutex);
+		IOLockUnlock(pThis->m_pRequestMutex);
 	}
 	else
 		debugError("Unable to find AOE_KEXT_NAME\n");
@@ -1621,13 +1806,15 @@ void AOE_KEXT_NAME::RetransmitTimer(OSObject* pOwner, IOTimerEventSource* pSende
 /*---------------------------------------------------------------------------
  * This is an interface for sending packets. Called from our controller interface
  * Additional info is passed on the function, although that sort of data is in the mbuf, it saves us searching around for it.
+ * The packet isn't sent immediately, but a request is placed on our send queue - ready to go. The transmit timer handles
+ * the actual transmission. This allows us to exit the function and send the actual data at a later time.
+ * NOTE: The mbuf is owned by the request from here on (and is consumed if we fail)
  ---------------------------------------------------------------------------*/
-errno_t AOE_KEXT_NAME::send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nShelf, bool fRetransmit /*=TRUE*/)
+errno_t AOE_KEXT_NAME::send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nTarget, bool fRetransmit /*=TRUE*/)
 {
-	struct SentPktQueue*	pSent_queue_item;
-	struct ToSendPktQueue*	pToSend_queue_item;
-	struct ToSendPktQueue*	pToSend_queue_tmp;
+	struct PktRequest*		pRequest;
 	struct ether_header*	eh;
+	int						nInterface;
 	errno_t	result;
 
 	// Before we start, check the interface is still in use...
@@ -1639,16 +1826,9 @@ errno_t AOE_KEXT_NAME::send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t
 		mbuf_freem(m);
 		
 		// Check if any additional packets have made their way on to the send queue, and if so, remove them
-		IOLockLock(m_pToSendQueueMutex);
-		TAILQ_FOREACH_SAFE(pToSend_queue_item, &m_to_send_queue, q_next, pToSend_queue_tmp)
-		{
-			if ( pToSend_queue_item && (1!=m_pInterfaces->is_used(pToSend_queue_item->if_sent)) )
-			{
-				debug("\tremoving additional packet from queue...\n");
-				remove_from_queue(pToSend_queue_item);
-			}
-		}
-		IOLockUnlock(m_pToSendQueueMutex);
+		IOLockLock(m_pRequestMutex);
+		purge_requests(FALSE);
+		IOLockUnlock(m_pRequestMutex);
 
 		return -1;
 	}
@@ -1657,122 +1837,347 @@ errno_t AOE_KEXT_NAME::send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t
 	// setup the sender MAC address based on the interface we are connected to
 	eh = MTOD(m,struct ether_header*);
 	if ( NULL==eh )
+	{
+		mbuf_freem(m);
 		return -1;
+	}
 
 	result = ifnet_lladdr_copy_bytes(ifp, eh->ether_shost, sizeof(eh->ether_shost));
 	
 	if (result != 0)
 	{
 		debugError("ifnet_lladdr_copy_bytes failed\n");
+		mbuf_freem(m);
 		return result;
 	}
 
-	// Before we send, we place a copy of the mbuf in our sent queue. This will be used to track dropped packets and calculate timings
-	pSent_queue_item = (struct SentPktQueue*) IOMalloc(sizeof(struct SentPktQueue));
-	if ( pSent_queue_item )
+	// The interface indexes its send queue, so it has to be one of ours
+	nInterface = m_pInterfaces->get_interface_number(ifp);
+	if ( (nInterface<0) || (nInterface>=numberof(m_aSendQueue)) )
 	{
-		memset(pSent_queue_item, 0, sizeof(struct SentPktQueue));
-		
-		result = mbuf_dup(m, MBUF_WAITOK, &pSent_queue_item->first_mbuf);
-		pSent_queue_item->Tag = Tag;
-		pSent_queue_item->RetransmitTime_us = fRetransmit ? get_rto_us() : 0;
-		pSent_queue_item->if_sent = ifp;
-		pSent_queue_item->fPacketHasBeenRetransmit = FALSE;
-		pSent_queue_item->nShelf = nShelf;
-		
-		// NOTE:	We keep a pointer to the outstanding count in the sent queue so we can decrement the correct count when the tag returns
-		//			It may not be safe to assume that the tag will return on the same interface that it was sent on.
-		pSent_queue_item->pOutstandingCount =  m_pInterfaces->get_ptr_outstanding(ifp);
-		
-		// Force transmit times to zero so we know to update them when the packet is actually sent
-		pSent_queue_item->TimeSent = pSent_queue_item->TimeFirstSent = 0;
-		
-		IOLockLock(m_pSentQueueMutex);
-		TAILQ_INSERT_TAIL(&m_sent_queue, pSent_queue_item, q_next);
-		IOLockUnlock(m_pSentQueueMutex);
-
-		//debugVerbose("Placing mbuf with tag %#x in out sent queue\n", Tag);
+		debugError("Interface isn't in our list. Dropping packet...\n");
+		mbuf_freem(m);
+		return -1;
 	}
-	else
+
+	// The request holds on to the mbuf until we're done with the tag. This will be used to track dropped packets and calculate timings
+	// If the pool has run dry, the sender fails the command and it's retried once the pool timer has grown the pool
+	pRequest = (struct PktRequest*) pool_alloc();
+	if ( NULL==pRequest )
 	{
-		debugError("Error - failed to allocate memory for sent item queue.\n");
+		debugError("Error - no queue records left for request.\n");
+		mbuf_freem(m);
+		return ENOMEM;
 	}
+
+	pRequest->mbuf = m;
+	pRequest->Tag = Tag;
+	pRequest->RetransmitTime_us = fRetransmit ? get_rto_us() : 0;
+	pRequest->if_sent = ifp;
+	pRequest->nInterface = nInterface;
+	pRequest->fPacketHasBeenRetransmit = FALSE;
+	pRequest->nTarget = nTarget;
+	pRequest->State = REQUEST_QUEUED;
+	
+	// NOTE:	We keep a pointer to the outstanding count in the request so we can decrement the correct count when the tag returns
+	//			It may not be safe to assume that the tag will return on the same interface that it was sent on.
+	pRequest->pOutstandingCount =  m_pInterfaces->get_ptr_outstanding(ifp);
+	pRequest->pTargetOutstandingCount = m_pInterfaces->get_ptr_target_outstanding(ifp, nTarget);
+	
+	// Force transmit times to zero so we know to update them when the packet is actually sent
+	pRequest->TimeSent = pRequest->TimeFirstSent = 0;
 	
-	return add_to_send_queue(ifp, Tag, m, nShelf, pSent_queue_item->pOutstandingCount, FALSE);
+	IOLockLock(m_pRequestMutex);
+	queue_request(pRequest);
+	IOLockUnlock(m_pRequestMutex);
+
+	//debugVerbose("Placing request with tag %#x in send queue for interface %d\n", Tag, pRequest->nInterface);
+
+	enable_transmit_timer(0);
+	
+	return 0;
 }
 
 
 
 
 /*---------------------------------------------------------------------------
- * Dont send the packet immediately, but place it on our queue - ready to go
- * The timer is enabled to handle the actual transmission. This allows us to exit the function and send the actual data at a later time
+ * Place a new request on its interface's send queue and index it by tag. (NOTE: the request lock should be held at this point)
  ---------------------------------------------------------------------------*/
-errno_t AOE_KEXT_NAME::add_to_send_queue(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nShelf, SInt32* pOutstandingCount, bool fSendImmediately, int nDelaySend_us /*= 0*/)
+void AOE_KEXT_NAME::queue_request(struct PktRequest* pRequest)
 {
-	struct ToSendPktQueue*	pSend_queue_item;
-	
-	// Before we send, we place a copy of the mbuf in our sent queue. This will be used to track dropped packets and calculate timings
-	pSend_queue_item = (struct ToSendPktQueue*) IOMalloc(sizeof(struct ToSendPktQueue));
-	
-	if ( pSend_queue_item )
+	LIST_INSERT_HEAD(&m_aRequestHash[SENT_HASH(pRequest->Tag)], pRequest, q_hash);
+	TAILQ_INSERT_TAIL(&m_aSendQueue[pRequest->nInterface], pRequest, q_next);
+	m_nReadyInterfaces |= (1<<pRequest->nInterface);
+}
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Locate a request from its tag. This only looks at the tag's hash bucket, so the cost
+ * doesn't depend on the number of packets in flight. (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+struct PktRequest* AOE_KEXT_NAME::find_request(UInt32 Tag)
+{
+	struct PktRequest*	pRequest;
+
+	LIST_FOREACH(pRequest, &m_aRequestHash[SENT_HASH(Tag)], q_hash)
+		if ( pRequest->Tag==Tag )
+			return pRequest;
+
+	return NULL;
+}
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Remove a request once we're done with it, whatever state it's in. It's taken off the queue it's waiting on
+ * and the record goes back to the pool. (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::remove_request(struct PktRequest* pRequest)
+{
+	if ( NULL==pRequest )
 	{
-		memset(pSend_queue_item, 0, sizeof(struct ToSendPktQueue));
-		
-		pSend_queue_item->Tag = Tag;
-		pSend_queue_item->if_sent = ifp;
-		pSend_queue_item->mbuf = m;
-		pSend_queue_item->pOutstandingCount = pOutstandingCount;
-		pSend_queue_item->nShelf = nShelf;
-		pSend_queue_item->fSendImmediately = fSendImmediately;
-		
-		IOLockLock(m_pToSendQueueMutex);
-		TAILQ_INSERT_TAIL(&m_to_send_queue, pSend_queue_item, q_next);
-		IOLockUnlock(m_pToSendQueueMutex);
+		debugError("Invalid request\n");
+		return;
 	}
-	
-	enable_transmit_timer(nDelaySend_us);
-	
-	return 0;
+
+	switch ( pRequest->State )
+	{
+		case REQUEST_QUEUED :
+		case REQUEST_RETRANSMIT_PENDING :
+			unqueue_request(pRequest);
+			break;
+		case REQUEST_IN_FLIGHT :
+			remove_from_retransmit_wheel(pRequest);
+			break;
+		default :
+			debugError("Request with tag %#x is already done\n", pRequest->Tag);
+			return;
+	}
+
+	LIST_REMOVE(pRequest, q_hash);
+	mbuf_freem(pRequest->mbuf);
+	pRequest->State = REQUEST_DONE;
+	pool_free(pRequest);
 }
 
 
 
 
 /*---------------------------------------------------------------------------
- * Remove sent of "to send" items from the queue. These are called after we're done with the item in the queue
+ * Take a queued request off its interface's send queue (or a retransmit-pending one off the resend queue).
+ * An interface stops being ready once its send queue is empty. (NOTE: the request lock should be held at this point)
  ---------------------------------------------------------------------------*/
-void AOE_KEXT_NAME::remove_from_queue(struct SentPktQueue* pSent_queue_item)
+void AOE_KEXT_NAME::unqueue_request(struct PktRequest* pRequest)
 {
-	// It's assumed this function is called WITH the lock set
-	if ( pSent_queue_item )
+	if ( REQUEST_QUEUED==pRequest->State )
 	{
-		TAILQ_REMOVE(&m_sent_queue, pSent_queue_item, q_next);
-		IOLockUnlock(m_pSentQueueMutex);
-		mbuf_freem(pSent_queue_item->first_mbuf);
-		IOFree(pSent_queue_item, sizeof(struct SentPktQueue));
-		IOLockLock(m_pSentQueueMutex);
+		TAILQ_REMOVE(&m_aSendQueue[pRequest->nInterface], pRequest, q_next);
+		if ( TAILQ_EMPTY(&m_aSendQueue[pRequest->nInterface]) )
+			m_nReadyInterfaces &= ~(1<<pRequest->nInterface);
 	}
 	else
+		TAILQ_REMOVE(&m_resend_queue, pRequest, q_next);
+}
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Remove any requests that are on interfaces we are no longer using. Requests that are in flight are only
+ * removed if fInFlight is set (their outstanding count is given back). (NOTE: the request lock should be held at this point)
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::purge_requests(bool fInFlight)
+{
+	struct PktRequest*	pRequest;
+	struct PktRequest*	pRequest_tmp;
+	int n;
+
+	for (n=0; n<SENT_HASH_SIZE; n++)
+		LIST_FOREACH_SAFE(pRequest, &m_aRequestHash[n], q_hash, pRequest_tmp)
+		{
+			if ( 1==m_pInterfaces->is_used(pRequest->if_sent) )
+				continue;
+
+			if ( REQUEST_IN_FLIGHT==pRequest->State )
+			{
+				if ( !fInFlight )
+					continue;
+
+				if ( !pRequest->fPacketHasBeenRetransmit && (*pRequest->pOutstandingCount>0) )
+					OSDecrementAtomic(pRequest->pOutstandingCount);
+				if ( !pRequest->fPacketHasBeenRetransmit && pRequest->pTargetOutstandingCount && (*pRequest->pTargetOutstandingCount>0) )
+					OSDecrementAtomic(pRequest->pTargetOutstandingCount);
+			}
+
+			debugVerbose("\tremoving request with tag %#x...\n", pRequest->Tag);
+			remove_request(pRequest);
+		}
+}
+
+
+
+
+#pragma mark -
+#pragma mark Queue record pool
+
+/*---------------------------------------------------------------------------
+ * Setup the pool with enough records to get us going. Records are rounded up so they stay pointer aligned
+ ---------------------------------------------------------------------------*/
+bool AOE_KEXT_NAME::pool_init(UInt32 nRecordSize)
+{
+	int n;
+
+	memset(&m_Pool, 0, sizeof(m_Pool));
+	m_Pool.nRecordSize = (nRecordSize+sizeof(void*)-1) & ~(sizeof(void*)-1);
+
+	m_Pool.pLock = IOSimpleLockAlloc();
+	if ( NULL==m_Pool.pLock )
+		return FALSE;
+
+	for (n=0; n<POOL_INITIAL_CHUNKS; n++)
+		if ( !pool_grow() )
+			return FALSE;
+
+	return TRUE;
+}
+
+void AOE_KEXT_NAME::pool_uninit(void)
+{
+	struct PoolChunk* pChunk;
+
+	if ( m_Pool.nFree!=m_Pool.nRecords )
+		debugError("%d queue records still in use\n", m_Pool.nRecords-m_Pool.nFree);
+
+	while ( m_Pool.pChunks )
 	{
-		debugError("Invalid queue item\n");
+		pChunk = m_Pool.pChunks;
+		m_Pool.pChunks = pChunk->pNext;
+		IOFree(pChunk, pChunk->nSize);
 	}
+
+	if ( m_Pool.pLock )
+		IOSimpleLockFree(m_Pool.pLock);
+
+	memset(&m_Pool, 0, sizeof(m_Pool));
 }
 
-void AOE_KEXT_NAME::remove_from_queue(struct ToSendPktQueue* pToSend_queue_item)
+
+
+
+/*---------------------------------------------------------------------------
+ * Add another chunk of records to the free list. This allocates memory so it's never used on the send path,
+ * only at startup and from the pool timer
+ ---------------------------------------------------------------------------*/
+bool AOE_KEXT_NAME::pool_grow(void)
 {
-	// It's assumed this function is called WITH the lock set
-	if ( pToSend_queue_item )
+	struct PoolChunk*	pChunk;
+	struct PoolRecord*	pRecord;
+	UInt8*				pRecords;
+	UInt32				nSize;
+	int					n;
+
+	nSize = sizeof(struct PoolChunk) + m_Pool.nRecordSize*POOL_RECORDS_PER_CHUNK;
+
+	pChunk = (struct PoolChunk*) IOMalloc(nSize);
+	if ( NULL==pChunk )
+	{
+		debugError("Unable to grow queue record pool\n");
+		IOSimpleLockLock(m_Pool.pLock);
+		++m_Pool.nAllocFailures;
+		IOSimpleLockUnlock(m_Pool.pLock);
+		return FALSE;
+	}
+
+	pChunk->nSize = nSize;
+	pRecords = (UInt8*) (pChunk+1);
+
+	IOSimpleLockLock(m_Pool.pLock);
+	pChunk->pNext = m_Pool.pChunks;
+	m_Pool.pChunks = pChunk;
+
+	for (n=0; n<POOL_RECORDS_PER_CHUNK; n++)
 	{
-		TAILQ_REMOVE(&m_to_send_queue, pToSend_queue_item, q_next);
-		IOLockUnlock(m_pToSendQueueMutex);
-		IOFree(pToSend_queue_item, sizeof(struct ToSendPktQueue));
-		IOLockLock(m_pToSendQueueMutex);
+		pRecord = (struct PoolRecord*) (pRecords + n*m_Pool.nRecordSize);
+		pRecord->pNext = m_Pool.pFreeList;
+		m_Pool.pFreeList = pRecord;
+	}
+
+	m_Pool.nRecords += POOL_RECORDS_PER_CHUNK;
+	m_Pool.nFree += POOL_RECORDS_PER_CHUNK;
+	IOSimpleLockUnlock(m_Pool.pLock);
+
+	debugVerbose("Queue record pool grown to %d records\n", m_Pool.nRecords);
+	return TRUE;
+}
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Take a (zeroed) record from the pool. The pool has its own lock, so this can be called with or without the
+ * request lock held. When we start running low, the pool timer is kicked so the pool is grown on the work loop.
+ * This never allocates, if the timer hasn't kept up we return NULL and the send fails
+ ---------------------------------------------------------------------------*/
+void* AOE_KEXT_NAME::pool_alloc(void)
+{
+	struct PoolRecord*	pRecord;
+	bool				fLow;
+
+	IOSimpleLockLock(m_Pool.pLock);
+	pRecord = m_Pool.pFreeList;
+	if ( pRecord )
+	{
+		m_Pool.pFreeList = pRecord->pNext;
+		--m_Pool.nFree;
+		m_Pool.nHighWater = MAX(m_Pool.nHighWater, m_Pool.nRecords-m_Pool.nFree);
 	}
 	else
+		++m_Pool.nEmpty;
+
+	fLow = (m_Pool.nFree<POOL_LOW_WATER);
+	IOSimpleLockUnlock(m_Pool.pLock);
+
+	if ( fLow && m_pPoolTimer && !m_pPoolTimer->isEnabled() )
 	{
-		debugError("Invalid queue item\n");
+		m_pPoolTimer->enable();
+		m_pPoolTimer->setTimeoutUS(0);
 	}
+
+	if ( pRecord )
+		memset(pRecord, 0, m_Pool.nRecordSize);
+
+	return pRecord;
+}
+
+void AOE_KEXT_NAME::pool_free(void* pRecord)
+{
+	IOSimpleLockLock(m_Pool.pLock);
+	((struct PoolRecord*) pRecord)->pNext = m_Pool.pFreeList;
+	m_Pool.pFreeList = (struct PoolRecord*) pRecord;
+	++m_Pool.nFree;
+	IOSimpleLockUnlock(m_Pool.pLock);
+}
+
+
+
+
+/*---------------------------------------------------------------------------
+ * Grow the pool (from the work loop) once it has dropped below the low water mark
+ ---------------------------------------------------------------------------*/
+void AOE_KEXT_NAME::PoolTimer(OSObject* pOwner, IOTimerEventSource* pSender)
+{
+	AOE_KEXT_NAME*			pThis;
+	
+	pThis = OSDynamicCast(AOE_KEXT_NAME, pOwner);
+
+	pSender->disable();
+
+	if ( pThis && (pThis->m_Pool.nFree<POOL_LOW_WATER) )
+		pThis->pool_grow();
 }
 
 
@@ -1798,6 +2203,40 @@ errno_t AOE_KEXT_NAME::get_error_info(ErrorInfo* pEInfo)
 
 
 
+/*---------------------------------------------------------------------------
+ * User interface to obtain our internal statistics (used to size the kext for large deployments)
+ ---------------------------------------------------------------------------*/
+errno_t AOE_KEXT_NAME::get_statistics(StatisticsInfo* pStats)
+{
+	memset(pStats, 0, sizeof(StatisticsInfo));
+
+	IOSimpleLockLock(m_Pool.pLock);
+	pStats->nPoolRecords = m_Pool.nRecords;
+	pStats->nPoolInUse = m_Pool.nRecords-m_Pool.nFree;
+	pStats->nPoolHighWater = m_Pool.nHighWater;
+	pStats->nPoolEmpty = m_Pool.nEmpty;
+	pStats->nPoolAllocFailures = m_Pool.nAllocFailures;
+	IOSimpleLockUnlock(m_Pool.pLock);
+
+	pStats->nChunkResends = m_nChunkResends;
+
+	if ( m_pAoEControllerInterface )
+	{
+		m_pAoEControllerInterface->get_write_statistics(&pStats->nWriteBytes, &pStats->nWriteBytesCopied);
+		m_pAoEControllerInterface->get_read_copy_statistics(&pStats->nReadBytesCopied, &pStats->nReadCopyNS);
+		pStats->nDuplicateChunks = m_pAoEControllerInterface->get_duplicate_chunks();
+		m_pAoEControllerInterface->get_coalesce_statistics(&pStats->nCoalescedWrites, &pStats->nCoalescedTransfers);
+		m_pAoEControllerInterface->get_read_ahead_statistics(&pStats->nReadAheadHits, &pStats->nReadAheadMisses, &pStats->nReadAheadWasted);
+		m_pAoEControllerInterface->get_read_cache_statistics(pStats);
+		m_pAoEControllerInterface->get_tag_slot_statistics(&pStats->nTagSlotsInUse, &pStats->nTagSlotFailures);
+	}
+
+	return 0;
+}
+
+
+
+
 #pragma mark -
 #pragma mark C interface functions
 
@@ -1925,6 +2364,19 @@ extern "C" int c_get_error_info(void* pController, ErrorInfo* pEInfo)
 	return retval;	
 }
 
+extern "C" int c_get_statistics(void* pController, StatisticsInfo* pStats)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->get_statistics(pStats);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;	
+}
+
 extern "C" int c_get_payload_size(void* pController, UInt32* pPayloadSize)
 {
 	kern_return_t	retval = KERN_FAILURE;
@@ -2005,4 +2457,102 @@ extern "C" int c_set_user_window(void* pController, int nMaxSize)
 }
 
 
+extern "C" int c_set_transmit_budget(void* pController, int nFrames)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_transmit_budget(nFrames);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_queue_depth(void* pController, int nQueueDepth)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_queue_depth(nQueueDepth);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_write_coalesce(void* pController, int nWindow_us)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_write_coalesce(nWindow_us);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_read_cache_size(void* pController, int nSize_MB)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_read_cache_size(nSize_MB);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_flush_mode(void* pController, int nMode)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_flush_mode(nMode);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_publish_mode(void* pController, int nMode)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_publish_mode(nMode);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
+extern "C" int c_set_congestion_control(void* pController, int nEthernetNumber, int nStrategy)
+{
+	kern_return_t	retval = KERN_FAILURE;
+	
+	AOE_KEXT_NAME* pAoEService = (AOE_KEXT_NAME*) pController;
+	if ( pAoEService )
+		retval = pAoEService->set_congestion_control(nEthernetNumber, nStrategy);
+	else
+		debugError("Controller not defined\n");
+	
+	return retval;
+}
+
+
 
@@ -19,40 +19,80 @@
 #include <sys/queue.h>
 #include "EInterfaces.h"
 
-// SentPktQueue is the structure which describes the packets sent (or about to be sent) on a particular interface
-struct SentPktQueue
+// PktRequest describes a single AoE request (one per tag) from the time it's handed to us until its response arrives or it's dropped.
+// A request moves through the states:  QUEUED -> IN_FLIGHT -> (RETRANSMIT_PENDING -> IN_FLIGHT ...) -> DONE
+// The request is owned by the service and everything in it is protected by m_pRequestMutex.
+enum PktRequestState
 {
-	TAILQ_ENTRY(SentPktQueue)	q_next;		// queued entries
-	mbuf_t						first_mbuf;
+	REQUEST_QUEUED,						// Waiting in the send queue for room in the window
+	REQUEST_IN_FLIGHT,					// Sent and waiting for a response (or a timeout from the retransmit wheel)
+	REQUEST_RETRANSMIT_PENDING,			// Timed out and waiting in the resend queue to go out again
+	REQUEST_DONE						// Response received or dropped. The record is about to go back to the pool
+};
+
+struct PktRequest
+{
+	TAILQ_ENTRY(PktRequest)		q_next;		// entries in the interface's send queue (QUEUED) or the resend queue (RETRANSMIT_PENDING)
+	LIST_ENTRY(PktRequest)		q_hash;		// entries sharing the same tag hash bucket
+	LIST_ENTRY(PktRequest)		q_wheel;	// entries sharing the same retransmit wheel slot (IN_FLIGHT)
+	mbuf_t						mbuf;		// The frame. Each transmit outputs a reference to it (the payload isn't copied)
 	ifnet_t						if_sent;
+	int							nInterface;	// Index of if_sent in our interfaces (selects the send queue)
 	uint64_t					TimeSent;
 	uint64_t					TimeFirstSent;
 	uint64_t					RetransmitTime_us;
+	uint64_t					Deadline_ns;	// When the packet is next due for retransmit (0 when it isn't on the wheel)
 	UInt32						Tag;
-	UInt32						nShelf;
+	UInt32						nTarget;	// TARGET_NUMBER of the shelf.slot it's going to (-1 for broadcasts)
+	enum PktRequestState		State;
 	bool						fPacketHasBeenRetransmit;
 
 	SInt32*						pOutstandingCount;
+	SInt32*						pTargetOutstandingCount;	// The target's count on that interface (NULL for broadcasts)
 };
 
-// ToSendPktQueue is the structure which describes the packets soon to be sent on a particular interface
-// NOTE:	When an item is in the Send queue, it is also actually in the Sent queue.
-//			When the packet is actually sent, it updates the sent queue values: TimeSent and TimeFirstSent.
-struct ToSendPktQueue
-{
-	TAILQ_ENTRY(ToSendPktQueue)	q_next;		// queued entries
-	mbuf_t						mbuf;
-	ifnet_t						if_sent;
-	UInt32						Tag;
-	UInt32						nShelf;
-	UInt32						fSendImmediately;
 
-	SInt32*						pOutstandingCount;
+TAILQ_HEAD(PktRequestQueueHeadStruct, PktRequest);
+LIST_HEAD(PktRequestListHeadStruct, PktRequest);
+
+// Requests are indexed by tag (see SENT_HASH) so responses can be matched without walking any queue.
+
+// Packets that have actually gone out are also placed on a timing wheel according to their retransmit deadline.
+// The wheel spans RETRANSMIT_WHEEL_SLOTS*RETRANSMIT_WHEEL_TICK_NS (see AoEService.cpp) which is longer than the
+// largest retransmit timeout, so a slot normally only holds packets due in that tick.
+#define RETRANSMIT_WHEEL_SLOTS					64
+
+// Request records come from a pool owned by the service rather than an IOMalloc/IOFree for
+// every packet. Records are carved out of larger chunks. Freed records are kept on a free list and never returned
+// to the system until the service stops. When the free list runs low, another chunk is added from the pool timer.
+// The send path never allocates, a send that finds the free list empty fails
+#define POOL_RECORDS_PER_CHUNK					256
+#define POOL_INITIAL_CHUNKS						2
+#define POOL_LOW_WATER							(POOL_RECORDS_PER_CHUNK/4)
+
+struct PoolRecord
+{
+	struct PoolRecord*			pNext;
 };
 
+struct PoolChunk
+{
+	struct PoolChunk*			pNext;
+	UInt32						nSize;
+};
 
-TAILQ_HEAD(SentPktQueueHeadStruct, SentPktQueue);
-TAILQ_HEAD(ToSendPktQueueHeadStruct, ToSendPktQueue);
+struct RecordPool
+{
+	struct PoolRecord*			pFreeList;
+	struct PoolChunk*			pChunks;
+	IOSimpleLock*				pLock;
+	UInt32						nRecordSize;
+	UInt32						nRecords;
+	UInt32						nFree;
+	UInt32						nHighWater;
+	UInt32						nEmpty;				// Sends that failed as the free list was empty
+	UInt32						nAllocFailures;		// Chunks the pool timer couldn't allocate
+};
 
 class AOE_CONTROLLER_INTERFACE_NAME;
 
@@ -74,25 +114,28 @@ public:
 	errno_t set_targets_cstring(ConfigString* CStringInfo);
 	
 	// Flow control
-	errno_t send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nShelf, bool fRetransmit = TRUE);
-	void resend_packet(struct SentPktQueue* pSent_queue_item);
+	errno_t send_packet_on_interface(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nTarget, bool fRetransmit = TRUE);
+	void resend_packet(struct PktRequest* pRequest);
+	errno_t resend_chunk(UInt32 Tag);
 	void update_rto(uint64_t rtt);
 	UInt64 get_rto_us(void);
 	UInt64 get_max_timeout_before_drop(void);
 	
 	// General helper functions
-	void remove_from_queue(struct SentPktQueue* pSent_queue_item);
-	void remove_from_queue(struct ToSendPktQueue* pToSend_queue_item);
+	struct PktRequest* find_request(UInt32 Tag);
+	void remove_request(struct PktRequest* pRequest);
 
 	int get_outstanding(ifnet_t ifref);
-	void set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding);
+	void set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding);
 	const char* get_com_cstring(void) { return m_pszOurCString; };
 	
 	// Only called by c_functions
 	int aoe_incoming(ifnet_t ifp, struct ether_header* pEHeader, mbuf_t* pMBufData);
+	void ata_response_received(mbuf_t* pMBufData);
 	void interface_reconnected(int nEthernetNumber, ifnet_t enetifnet);
 	void interface_disconnected(int nEthernetNumber);
 	errno_t get_error_info(ErrorInfo* pEInfo);
+	errno_t get_statistics(StatisticsInfo* pStats);
 	UInt32 get_mtu(void);
 	UInt32 get_sector_count(void);
 	int get_payload_size(UInt32* pPayloadSize);
@@ -102,7 +145,13 @@ public:
 	int set_our_cstring(const char* pszOurCString);
 	int set_max_transfer_size(int nMaxSize);
 	int set_user_window(int nMaxSize);
-	void send_packet_from_queue(struct ToSendPktQueue* pToSend_queue_item);
+	int set_transmit_budget(int nFrames);
+	int set_queue_depth(int nQueueDepth);
+	int set_write_coalesce(int nWindow_us);
+	int set_read_cache_size(int nSize_MB);
+	int set_flush_mode(int nMode);
+	int set_publish_mode(int nMode);
+	int set_congestion_control(int nEthernetNumber, int nStrategy);
 	bool interfaces_active(TargetInfo* pTargetInfo);
 	bool interface_active(TargetInfo* pTargetInfo, int nInterfaceNumber);
 public:
@@ -111,6 +160,7 @@ private:
 	static void RetransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender);
 	static void TransmitTimer(OSObject* pOwner, IOTimerEventSource* pSender);
 	static void IdleTimer(OSObject* pOwner, IOTimerEventSource* pSender);
+	static void PoolTimer(OSObject* pOwner, IOTimerEventSource* pSender);
 
 	static void cg_aoe_incoming(OSObject* owner, void* arg0, void* arg1, void*   arg2, void* /*arg3*/);
 	static void cg_force_packet(OSObject* owner, void* arg0, void* arg1, void* arg2, void* /*arg3*/);
@@ -118,18 +168,36 @@ private:
 	static void cg_enable_interface(OSObject* owner, void* arg0, void* arg1, void* arg2, void* /*arg3*/);
 	static void cg_disable_interface(OSObject* owner, void* arg0, void* arg1, void* arg2, void* /*arg3*/);
 	void enable_retransmit_timer(void);
+	void transmit_request(struct PktRequest* pRequest);
+	void unqueue_request(struct PktRequest* pRequest);
+	void queue_request(struct PktRequest* pRequest);
+	void purge_requests(bool fInFlight);
+	void add_to_retransmit_wheel(struct PktRequest* pRequest);
+	void remove_from_retransmit_wheel(struct PktRequest* pRequest);
+	UInt64 next_retransmit_deadline(void);
+	void arm_retransmit_timer(UInt64 Deadline_ns);
 	void enable_idle_timer(ifnet_t ifref);
 	void enable_transmit_timer(int nDelaySend_us = 3);
-	errno_t add_to_send_queue(ifnet_t ifp, UInt32 Tag, mbuf_t m, int nShelf, SInt32* pOutstandingCount, bool fSendImmediately, int nDelaySend_us = 0);
+	bool pool_init(UInt32 nRecordSize);
+	void pool_uninit(void);
+	bool pool_grow(void);
+	void* pool_alloc(void);
+	void pool_free(void* pRecord);
 
 	char*							m_pszOurCString;
 	EInterfaces*					m_pInterfaces;
 	IOService*						m_pAoEService;
 	AOE_CONTROLLER_INTERFACE_NAME*	m_pAoEControllerInterface;
-	struct SentPktQueueHeadStruct	m_sent_queue;
-	struct ToSendPktQueueHeadStruct	m_to_send_queue;
-	IOLock*							m_pSentQueueMutex;
-	IOLock*							m_pToSendQueueMutex;
+	struct PktRequestQueueHeadStruct	m_aSendQueue[MAX_SUPPORTED_ETHERNET_CONNETIONS];
+	UInt32							m_nReadyInterfaces;		// Bit n is set when m_aSendQueue[n] isn't empty
+	int								m_nNextInterface;		// Where the transmit timer's round robin starts next
+	UInt32							m_nChunkResends;
+	struct PktRequestQueueHeadStruct	m_resend_queue;
+	struct PktRequestListHeadStruct	m_aRequestHash[SENT_HASH_SIZE];
+	struct PktRequestListHeadStruct	m_aRetransmitWheel[RETRANSMIT_WHEEL_SLOTS];
+	UInt64							m_nRetransmitWheelTick;
+	UInt64							m_RetransmitDeadline_ns;
+	IOLock*							m_pRequestMutex;
 	IOLock*							m_pGeneralMutex;
 	UInt64							m_nRTO_ns;
 	int								m_nScaledRTTavg;
@@ -138,7 +206,10 @@ private:
 	IOTimerEventSource*				m_pRetransmitTimer;
 	IOTimerEventSource*				m_pTransmitTimer;
 	IOTimerEventSource*				m_pIdleTimer;
+	IOTimerEventSource*				m_pPoolTimer;
+	struct RecordPool				m_Pool;
 	IOCommandGate*					m_pCmdGate;
+	int								m_nTransmitBudget;
 
 	int								m_nNumUnexpectedResponses;
 	int								m_nNumRetransmits;
@@ -158,12 +229,20 @@ __private_extern__ void c_interface_reconnected(void* pController, int nEthernet
 __private_extern__ int c_update_target(void* pController, int* pnNumberOfTargets);
 __private_extern__ int c_get_target_info(void* pController, int nDevice, TargetInfo* pTargetData);
 __private_extern__ int c_get_error_info(void* pController, ErrorInfo* pEInfo);
+__private_extern__ int c_get_statistics(void* pController, StatisticsInfo* pStats);
 __private_extern__ int c_get_payload_size(void* pController, UInt32* pPayloadSize);
 __private_extern__ int c_force_packet(void* pController, ForcePacketInfo* pForcedPacketInfo);
 __private_extern__ int c_set_targets_cstring(void* pController, ConfigString* pCStringInfo);
 __private_extern__ int c_set_ourcstring(void* pController, char* pszCStringInfo);
 __private_extern__ int c_set_max_transfer_size(void* pController, int nMaxSize);
 __private_extern__ int c_set_user_window(void* pController, int nMaxSize);
+__private_extern__ int c_set_transmit_budget(void* pController, int nFrames);
+__private_extern__ int c_set_queue_depth(void* pController, int nQueueDepth);
+__private_extern__ int c_set_write_coalesce(void* pController, int nWindow_us);
+__private_extern__ int c_set_read_cache_size(void* pController, int nSize_MB);
+__private_extern__ int c_set_flush_mode(void* pController, int nMode);
+__private_extern__ int c_set_publish_mode(void* pController, int nMode);
+__private_extern__ int c_set_congestion_control(void* pController, int nEthernetNumber, int nStrategy);
 
 #endif
 
@@ -117,6 +117,7 @@ static int aoeinterface_get(kern_ctl_ref ctl_ref, u_int32_t unit, void *unitinfo
 	int			nData;
 	TargetInfo	Target;
 	ErrorInfo	EInfo;
+	StatisticsInfo	SInfo;
 	int			error = 0;
 	size_t		valsize;
 	void*		pBuf = 0;
@@ -200,6 +201,16 @@ static int aoeinterface_get(kern_ctl_ref ctl_ref, u_int32_t unit, void *unitinfo
 			pBuf = &EInfo;
 			break;
 		}
+		case AOEINTERFACE_GET_STATISTICS :
+		{
+			if ( sizeof(StatisticsInfo) != *len )
+				debugError("Unexpected size\n");
+
+			valsize = min(sizeof(StatisticsInfo), *len);
+			c_get_statistics(g_pController, &SInfo);
+			pBuf = &SInfo;
+			break;
+		}
 		case AOEINTERFACE_GET_PAYLOAD_SIZE :
 		{
 			if ( sizeof(UInt32) != *len )
@@ -318,6 +329,18 @@ static int aoeinterface_set(kern_ctl_ref ctl_ref, u_int32_t unit, void *unitinfo
 			
 			c_set_user_window(g_pController, g_PreferenceData.nUserBlockCountWindow);
 
+			c_set_transmit_budget(g_pController, g_PreferenceData.nTransmitBudget);
+
+			c_set_queue_depth(g_pController, g_PreferenceData.nQueueDepth);
+
+			c_set_write_coalesce(g_pController, g_PreferenceData.nWriteCoalesce_us);
+
+			c_set_read_cache_size(g_pController, g_PreferenceData.nReadCache_MB);
+
+			c_set_flush_mode(g_pController, g_PreferenceData.nFlushMode);
+
+			c_set_publish_mode(g_pController, g_PreferenceData.nPublishMode);
+
 			c_set_ourcstring(g_pController, (char*)g_PreferenceData.aszComputerConfigString);
 
 			// Now that we've modified the interfaces, check for any change in the connected targets
@@ -368,6 +391,21 @@ static int aoeinterface_set(kern_ctl_ref ctl_ref, u_int32_t unit, void *unitinfo
 			c_set_targets_cstring(g_pController, pConfigStringInfo);
 			break;
 		}
+		case AOEINTERFACE_SET_CONGESTION_CONTROL:
+		{
+			CongestionControlInfo* pCCInfo = (CongestionControlInfo*)pData;
+
+			if ( len < sizeof(CongestionControlInfo) )
+			{
+				debugError("AOEINTERFACE_SET_CONGESTION_CONTROL: Size of input is incorrect (was=%d)\n", len);
+				nError = EINVAL;
+				break;
+			}
+
+			if ( 0!=c_set_congestion_control(g_pController, pCCInfo->nEthernetNumber, pCCInfo->nStrategy) )
+				nError = EINVAL;
+			break;
+		}
 		default:
 		{
 			nError = ENOTSUP;
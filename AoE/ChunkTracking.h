@@ -0,0 +1,66 @@
+/*
+ *  ChunkTracking.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __CHUNKTRACKING_H__
+#define __CHUNKTRACKING_H__
+
+#include <libkern/OSTypes.h>
+#include "../Shared/AoEcommon.h"
+
+// A chunk that's still missing when the chunk sent this many frames after it arrives is taken as lost and resent.
+// Only done for commands whose frames all went out on one path, paths with different latencies reorder frames anyway
+#define CHUNK_REORDER_THRESHOLD			3
+
+// Received-chunk bitmaps (one bit for each frame of a command)
+#define CHUNK_BITMAP_WORDS(nChunks)		(((nChunks)+31)/32)
+#define CHUNK_IS_SET(pBitmap, n)		((pBitmap)[(n)/32] & (1U<<((n)%32)))
+#define CHUNK_SET(pBitmap, n)			((pBitmap)[(n)/32] |= (1U<<((n)%32)))
+
+// The tag of chunk n of a command. Only the sequence number moves on, wrapping within its own bits
+#define CHUNK_TAG(BaseTag, n)			(((BaseTag) & ~TAG_SEQUENCE_MASK) | (((BaseTag)+(n)) & TAG_SEQUENCE_MASK))
+
+
+
+/*---------------------------------------------------------------------------
+ * The chunk of the command with base tag BaseTag that Tag belongs to, or -1 if it isn't one of the command's nChunks
+ * chunks (its slot or generation differs, or its sequence number is past the end of the command)
+ ---------------------------------------------------------------------------*/
+static inline int chunk_from_tag(UInt32 Tag, UInt32 BaseTag, int nChunks)
+{
+	int nChunk;
+
+	if ( (Tag & ~TAG_SEQUENCE_MASK)!=(BaseTag & ~TAG_SEQUENCE_MASK) )
+		return -1;
+
+	nChunk = TAG_SEQUENCE_DIFF(Tag, BaseTag);
+
+	return (nChunk<nChunks) ? nChunk : -1;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * A command's frames go out in tag order, so once chunk nChunk has arrived any chunk CHUNK_REORDER_THRESHOLD or more
+ * before it that's still missing has most likely been lost. Returns the next of those to resend and moves
+ * *pnRetryChunk past it, or -1 when there are no more. Each chunk is only given once
+ ---------------------------------------------------------------------------*/
+static inline int chunk_next_lost(const UInt32* pReceived, int* pnRetryChunk, int nChunk)
+{
+	int nLost;
+
+	while ( *pnRetryChunk+CHUNK_REORDER_THRESHOLD <= nChunk )
+	{
+		nLost = (*pnRetryChunk)++;
+		if ( !CHUNK_IS_SET(pReceived, nLost) )
+			return nLost;
+	}
+
+	return -1;
+}
+
+#endif		//__CHUNKTRACKING_H__
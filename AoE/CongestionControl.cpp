@@ -0,0 +1,253 @@
+/*
+ *  CongestionControl.cpp
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "CongestionControl.h"
+#include "EInterface.h"
+#include "debug.h"
+#include "../Shared/AoEcommon.h"
+
+#define DELAY_CC_ALPHA				2		// The window grows while fewer frames than this are queued at the target
+#define DELAY_CC_BETA				4		// The window shrinks while more frames than this are queued
+#define DELAY_CC_BASE_RTT_ROUNDS	256		// The base RTT is retaken this often so it can follow a target that's got slower
+#define DELAY_CC_PROBE_CWND			2		// Window used while the base RTT is retaken, small enough to empty the target's queue
+
+#pragma mark -
+#pragma mark Slow start
+
+void SlowStartCongestionControl::reset(EInterface* pInterface)
+{
+	pInterface->set_cwnd(1);
+	pInterface->m_nSSThresh = pInterface->get_max_outstanding_all_shelves()/2;
+}
+
+
+void SlowStartCongestionControl::on_ack(EInterface* pInterface, int /*nTarget*/, UInt64 /*RTT_ns*/)
+{
+	if ( pInterface->m_nCwd < pInterface->m_nSSThresh )
+		pInterface->grow_cwnd(1, 0);	// Exponential growth  (cwnd+=1)
+	else
+		pInterface->grow_cwnd(0, 1);	// Fractional growth (cwnd+=1/cwnd)
+}
+
+
+void SlowStartCongestionControl::on_loss(EInterface* pInterface, int /*nTarget*/)
+{
+	// The frames after it are getting through, so the window is halved rather than closed
+	pInterface->m_nSSThresh = MAX(pInterface->m_nCwd/2, 1U);
+	pInterface->set_cwnd(pInterface->m_nSSThresh);
+}
+
+
+void SlowStartCongestionControl::on_timeout(EInterface* pInterface, int /*nTarget*/)
+{
+	// Since we've timed out, we exponentially decrease our slow start threshold (ssthresh)
+	pInterface->m_nSSThresh = MAX(pInterface->m_nCwd/2, 1U);
+	pInterface->set_cwnd(1);
+}
+
+
+void SlowStartCongestionControl::on_idle(EInterface* pInterface)
+{
+	reset(pInterface);
+}
+
+
+
+#pragma mark -
+#pragma mark Delay based
+
+void DelayCongestionControl::reset(EInterface* pInterface)
+{
+	struct TargetWindow* pWindow;
+	int nTarget;
+
+	for (nTarget=0; NULL!=(pWindow=pInterface->find_target_window(&nTarget)); nTarget++)
+		reset_window(pInterface, nTarget, pWindow);
+}
+
+
+
+void DelayCongestionControl::reset_window(EInterface* pInterface, int nTarget, struct TargetWindow* pWindow)
+{
+	// Slow start is ended by the queueing delay rather than a guess at ssthresh
+	pWindow->nCwd = 1;
+	pWindow->nSSThresh = pInterface->get_max_oustanding(nTarget);
+	pWindow->nBaseRTT_ns = 0;
+	pWindow->nBaseRTTRounds = 0;
+	pWindow->nProbeAcks = 0;
+	start_round(pWindow);
+}
+
+
+
+void DelayCongestionControl::on_ack(EInterface* pInterface, int nTarget, UInt64 RTT_ns)
+{
+	struct TargetWindow* pWindow;
+
+	// Without a trustworthy sample there's nothing to learn from this response
+	pWindow = pInterface->get_target_window(nTarget);
+	if ( (0==RTT_ns) || (NULL==pWindow) )
+		return;
+
+	if ( (0==pWindow->nBaseRTT_ns) || (RTT_ns < pWindow->nBaseRTT_ns) )
+		pWindow->nBaseRTT_ns = RTT_ns;
+
+	if ( (0==pWindow->nRoundMinRTT_ns) || (RTT_ns < pWindow->nRoundMinRTT_ns) )
+		pWindow->nRoundMinRTT_ns = RTT_ns;
+
+	if ( pWindow->nProbeAcks )
+	{
+		if ( 0==--pWindow->nProbeAcks )
+			end_probe(pWindow);
+		return;
+	}
+
+	// During slow start, the window grows by one for each response (doubling each round) until a queue builds
+	if ( pWindow->nCwd < pWindow->nSSThresh )
+		pWindow->nCwd = MIN(pWindow->nCwd+1, (UInt32)pInterface->get_max_oustanding(nTarget));
+
+	if ( ++pWindow->nRoundAcks >= pWindow->nRoundLength )
+		end_round(pInterface, nTarget, pWindow);
+}
+
+
+
+void DelayCongestionControl::on_loss(EInterface* pInterface, int nTarget)
+{
+	struct TargetWindow* pWindow;
+
+	pWindow = pInterface->get_target_window(nTarget);
+	if ( NULL==pWindow )
+		return;
+
+	// Any cut is taken from the window we had before a probe
+	if ( pWindow->nProbeAcks )
+	{
+		pWindow->nCwd = pWindow->nProbeCwnd;
+		pWindow->nProbeAcks = 0;
+	}
+
+	// A frame was lost before any delay showed, so the target's buffers are smaller than the estimate allowed for
+	pWindow->nSSThresh = MAX((pWindow->nCwd*3)/4, 1U);
+	pWindow->nCwd = pWindow->nSSThresh;
+	start_round(pWindow);
+}
+
+
+
+void DelayCongestionControl::on_timeout(EInterface* pInterface, int nTarget)
+{
+	struct TargetWindow* pWindow;
+
+	pWindow = pInterface->get_target_window(nTarget);
+	if ( NULL==pWindow )
+		return;
+
+	// Any cut is taken from the window we had before a probe
+	if ( pWindow->nProbeAcks )
+	{
+		pWindow->nCwd = pWindow->nProbeCwnd;
+		pWindow->nProbeAcks = 0;
+	}
+
+	// Halve the window rather than closing it, as the delay estimate will take it down further if the queue's still there
+	pWindow->nSSThresh = MAX(pWindow->nCwd/2, 1U);
+	pWindow->nCwd = pWindow->nSSThresh;
+	start_round(pWindow);
+}
+
+
+
+void DelayCongestionControl::on_idle(EInterface* pInterface)
+{
+	reset(pInterface);
+}
+
+
+
+void DelayCongestionControl::start_round(struct TargetWindow* pWindow)
+{
+	pWindow->nRoundMinRTT_ns = 0;
+	pWindow->nRoundAcks = 0;
+	pWindow->nRoundLength = pWindow->nCwd;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Adjust a target's window once a round trip using the number of frames that are queued at the target:
+ *		queued = cwnd * (RTT - BaseRTT) / RTT
+ * which is the difference between the expected and actual rates (as in TCP Vegas) expressed in frames.
+ ---------------------------------------------------------------------------*/
+void DelayCongestionControl::end_round(EInterface* pInterface, int nTarget, struct TargetWindow* pWindow)
+{
+	uint64_t	RoundRTT_ns;
+	UInt32		nQueued;
+
+	RoundRTT_ns = pWindow->nRoundMinRTT_ns;
+
+	if ( RoundRTT_ns )
+	{
+		nQueued = (UInt32)((pWindow->nCwd * (RoundRTT_ns - pWindow->nBaseRTT_ns)) / RoundRTT_ns);
+
+		if ( pWindow->nCwd < pWindow->nSSThresh )
+		{
+			// Leave slow start as soon as a queue starts to build, giving back some of the last round's growth
+			if ( nQueued > DELAY_CC_ALPHA )
+			{
+				pWindow->nCwd = MAX(pWindow->nCwd - pWindow->nCwd/8, 1U);
+				pWindow->nSSThresh = pWindow->nCwd;
+			}
+		}
+		else if ( nQueued < DELAY_CC_ALPHA )
+			pWindow->nCwd = MIN(pWindow->nCwd+1, (UInt32)pInterface->get_max_oustanding(nTarget));
+		else if ( nQueued > DELAY_CC_BETA )
+		{
+			// ssthresh follows the window down, otherwise on_ack would take it straight back up in slow start
+			pWindow->nCwd = MAX(pWindow->nCwd-1, 1U);
+			pWindow->nSSThresh = pWindow->nCwd;
+		}
+
+		debugVerbose("\tDelay CC: target %d.%d RTT=%luus base=%luus queued=%d cwnd now %d\n", TARGET_NUMBER_SHELF(nTarget), TARGET_NUMBER_SLOT(nTarget), CONVERT_NS_TO_US(RoundRTT_ns), CONVERT_NS_TO_US(pWindow->nBaseRTT_ns), nQueued, pWindow->nCwd);
+
+		// The base RTT can only fall, so it's periodically retaken in case the path or target has slowed
+		if ( ++pWindow->nBaseRTTRounds >= DELAY_CC_BASE_RTT_ROUNDS )
+		{
+			start_probe(pWindow);
+			return;
+		}
+	}
+
+	start_round(pWindow);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Retake the base RTT. An RTT taken with our own frames queued at the target is too high, and taking it as the
+ * base lets the window (and the queue) grow a little more each time. So the window is closed right down until the
+ * frames that were outstanding have been answered, and the lowest RTT seen over that time is the new base
+ ---------------------------------------------------------------------------*/
+void DelayCongestionControl::start_probe(struct TargetWindow* pWindow)
+{
+	pWindow->nProbeCwnd = pWindow->nCwd;
+	pWindow->nProbeAcks = pWindow->nCwd + DELAY_CC_PROBE_CWND;
+	pWindow->nCwd = MIN(pWindow->nCwd, (UInt32)DELAY_CC_PROBE_CWND);
+	pWindow->nBaseRTTRounds = 0;
+	start_round(pWindow);
+}
+
+
+
+void DelayCongestionControl::end_probe(struct TargetWindow* pWindow)
+{
+	pWindow->nBaseRTT_ns = pWindow->nRoundMinRTT_ns;
+	pWindow->nCwd = pWindow->nProbeCwnd;
+	start_round(pWindow);
+}
@@ -0,0 +1,99 @@
+/*
+ *  CongestionControl.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+
+#ifndef __CONGESTIONCONTROL_H__
+#define __CONGESTIONCONTROL_H__
+
+#include <sys/types.h>
+#include "../Shared/AoEcommon.h"
+
+class EInterface;
+struct TargetWindow;
+
+// A congestion control strategy manages the window of the interfaces that use it. That's either a single window for the
+// interface (m_nCwd) or, for strategies that are per_target(), a window for each target the interface reaches (so a slow
+// target can't hold back the others). The strategies only hold the algorithm, anything they need to remember is kept in
+// the EInterface (and its TargetWindows) so one strategy can drive every interface.
+// All of these are called with the service's request mutex held. Responses arrive on the targets' work loops and the
+// timers and user interface run on the service's, so the mutex is the only thing serialising changes to the window.
+class CongestionControl
+{
+public:
+	virtual ~CongestionControl() {};
+
+	virtual const char* name(void) = 0;
+	/*!@function per_target
+	 @abstract Whether the strategy keeps a window for each target rather than one for the interface.
+	 */
+	virtual bool per_target(void) { return false; };
+
+	/*!@function reset
+	 @abstract The interface has just been enabled or switched to this strategy.
+	 */
+	virtual void reset(EInterface* pInterface) = 0;
+	/*!@function on_ack
+	 @abstract A response has come back from target nTarget (see TARGET_NUMBER). RTT_ns is 0 if the frame had been resent, as the sample can't be trusted.
+	 */
+	virtual void on_ack(EInterface* pInterface, int nTarget, UInt64 RTT_ns) = 0;
+	/*!@function on_loss
+	 @abstract A frame to nTarget is being resent early because the frames after it have been answered.
+	 */
+	virtual void on_loss(EInterface* pInterface, int nTarget) = 0;
+	/*!@function on_timeout
+	 @abstract A frame to nTarget timed out. This is called once for each pass of the retransmit timer.
+	 */
+	virtual void on_timeout(EInterface* pInterface, int nTarget) = 0;
+	/*!@function on_idle
+	 @abstract Nothing has been sent for a while, so what we knew about the path is out of date.
+	 */
+	virtual void on_idle(EInterface* pInterface) = 0;
+};
+
+
+
+// The original algorithm. The window doubles each round trip until it reaches ssthresh (slow start) and then grows by
+// one frame each round trip. A timeout halves ssthresh and closes the window, a lost frame halves both.
+class SlowStartCongestionControl : public CongestionControl
+{
+public:
+	virtual const char* name(void) { return "slow start"; };
+	virtual void reset(EInterface* pInterface);
+	virtual void on_ack(EInterface* pInterface, int nTarget, UInt64 RTT_ns);
+	virtual void on_loss(EInterface* pInterface, int nTarget);
+	virtual void on_timeout(EInterface* pInterface, int nTarget);
+	virtual void on_idle(EInterface* pInterface);
+};
+
+
+
+// Vegas style control. Once a round trip, the number of frames queued at the target is estimated from how far the
+// round's lowest RTT is above the lowest RTT ever seen (the base RTT). The window grows while fewer than
+// DELAY_CC_ALPHA frames are queued and shrinks when more than DELAY_CC_BETA are, so it backs off as the target's
+// buffers fill rather than waiting for them to overflow. Loss and timeouts only cut the window rather than closing it.
+// Queueing delay belongs to a target, so each target has its own window, capped at that target's buffer count.
+class DelayCongestionControl : public CongestionControl
+{
+public:
+	virtual const char* name(void) { return "delay"; };
+	virtual bool per_target(void) { return true; };
+	virtual void reset(EInterface* pInterface);
+	virtual void on_ack(EInterface* pInterface, int nTarget, UInt64 RTT_ns);
+	virtual void on_loss(EInterface* pInterface, int nTarget);
+	virtual void on_timeout(EInterface* pInterface, int nTarget);
+	virtual void on_idle(EInterface* pInterface);
+
+private:
+	void reset_window(EInterface* pInterface, int nTarget, struct TargetWindow* pWindow);
+	void start_round(struct TargetWindow* pWindow);
+	void end_round(EInterface* pInterface, int nTarget, struct TargetWindow* pWindow);
+	void start_probe(struct TargetWindow* pWindow);
+	void end_probe(struct TargetWindow* pWindow);
+};
+
+#endif		//__CONGESTIONCONTROL_H__
@@ -0,0 +1,151 @@
+/*
+ *  DispatchTable.cpp
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "DispatchTable.h"
+#include "debug.h"
+#include "../Shared/AoEcommon.h"
+
+/*---------------------------------------------------------------------------
+ * Enter a controller into the table. The shelf index is grown to the next power of two that covers the shelf,
+ * so targets numbered from 0 upwards only cause a handful of reallocations. Returns -1 if it can't be added
+ ---------------------------------------------------------------------------*/
+int dispatch_add(struct DispatchTable* pTable, int nShelf, int nSlot, AOE_CONTROLLER_NAME* pController)
+{
+	struct ShelfDispatch** ppNewIndex;
+	struct ShelfDispatch* pShelf;
+	struct SlotDispatch* pRange;
+	int nNewSize;
+	
+	if ( (nShelf<0) || (nShelf>=MAX_SHELFS) || (nSlot<0) || (nSlot>=MAX_SLOTS) )
+		return -1;
+	
+	if ( nShelf>=pTable->nShelves )
+	{
+		nNewSize = MAX(pTable->nShelves, 16);
+		while ( nNewSize<=nShelf )
+			nNewSize *= 2;
+		nNewSize = MIN(nNewSize, MAX_SHELFS);
+		
+		ppNewIndex = (struct ShelfDispatch**) IOMalloc(nNewSize*sizeof(struct ShelfDispatch*));
+		if ( NULL==ppNewIndex )
+		{
+			debugError("Unable to grow the shelf dispatch table to %d shelves\n", nNewSize);
+			return -1;
+		}
+		
+		bzero(ppNewIndex, nNewSize*sizeof(struct ShelfDispatch*));
+		if ( pTable->ppShelves )
+		{
+			bcopy(pTable->ppShelves, ppNewIndex, pTable->nShelves*sizeof(struct ShelfDispatch*));
+			IOFree(pTable->ppShelves, pTable->nShelves*sizeof(struct ShelfDispatch*));
+		}
+		
+		pTable->ppShelves = ppNewIndex;
+		pTable->nShelves = nNewSize;
+	}
+	
+	pShelf = pTable->ppShelves[nShelf];
+	if ( NULL==pShelf )
+	{
+		pShelf = (struct ShelfDispatch*) IOMalloc(sizeof(struct ShelfDispatch));
+		if ( NULL==pShelf )
+		{
+			debugError("Unable to allocate the dispatch table for shelf %d\n", nShelf);
+			return -1;
+		}
+		
+		bzero(pShelf, sizeof(struct ShelfDispatch));
+		pTable->ppShelves[nShelf] = pShelf;
+	}
+	
+	pRange = pShelf->apRanges[nSlot>>DISPATCH_RANGE_SHIFT];
+	if ( NULL==pRange )
+	{
+		pRange = (struct SlotDispatch*) IOMalloc(sizeof(struct SlotDispatch));
+		if ( NULL==pRange )
+		{
+			debugError("Unable to allocate the dispatch table for target %d.%d\n", nShelf, nSlot);
+			
+			// Don't leave a shelf table behind that nothing will free
+			if ( 0==pShelf->nTargets )
+			{
+				pTable->ppShelves[nShelf] = NULL;
+				IOFree(pShelf, sizeof(struct ShelfDispatch));
+			}
+			return -1;
+		}
+		
+		bzero(pRange, sizeof(struct SlotDispatch));
+		pShelf->apRanges[nSlot>>DISPATCH_RANGE_SHIFT] = pRange;
+	}
+	
+	if ( NULL==pRange->apSlot[nSlot & (DISPATCH_RANGE_SLOTS-1)] )
+	{
+		++pRange->nTargets;
+		++pShelf->nTargets;
+	}
+	pRange->apSlot[nSlot & (DISPATCH_RANGE_SLOTS-1)] = pController;
+	
+	return 0;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Take a controller out of the table (if it's still the one there), freeing its range of slots and its shelf's table
+ * once they're empty
+ ---------------------------------------------------------------------------*/
+void dispatch_remove(struct DispatchTable* pTable, int nShelf, int nSlot, AOE_CONTROLLER_NAME* pController)
+{
+	struct ShelfDispatch* pShelf;
+	struct SlotDispatch* pRange;
+	
+	if ( (NULL==pController) || (pController!=dispatch_find(pTable, nShelf, nSlot)) )
+		return;
+	
+	pShelf = pTable->ppShelves[nShelf];
+	pRange = pShelf->apRanges[nSlot>>DISPATCH_RANGE_SHIFT];
+	pRange->apSlot[nSlot & (DISPATCH_RANGE_SLOTS-1)] = NULL;
+	
+	if ( 0==--pRange->nTargets )
+	{
+		pShelf->apRanges[nSlot>>DISPATCH_RANGE_SHIFT] = NULL;
+		IOFree(pRange, sizeof(struct SlotDispatch));
+	}
+	
+	if ( 0==--pShelf->nTargets )
+	{
+		pTable->ppShelves[nShelf] = NULL;
+		IOFree(pShelf, sizeof(struct ShelfDispatch));
+	}
+}
+
+
+
+void dispatch_free(struct DispatchTable* pTable)
+{
+	int nShelf, nRange;
+	
+	if ( NULL==pTable->ppShelves )
+		return;
+	
+	for (nShelf=0; nShelf<pTable->nShelves; nShelf++)
+		if ( pTable->ppShelves[nShelf] )
+		{
+			for (nRange=0; nRange<DISPATCH_RANGES; nRange++)
+				if ( pTable->ppShelves[nShelf]->apRanges[nRange] )
+					IOFree(pTable->ppShelves[nShelf]->apRanges[nRange], sizeof(struct SlotDispatch));
+			
+			IOFree(pTable->ppShelves[nShelf], sizeof(struct ShelfDispatch));
+		}
+	
+	IOFree(pTable->ppShelves, pTable->nShelves*sizeof(struct ShelfDispatch*));
+	pTable->ppShelves = NULL;
+	pTable->nShelves = 0;
+}
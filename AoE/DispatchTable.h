@@ -0,0 +1,69 @@
+/*
+ *  DispatchTable.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __DISPATCHTABLE_H__
+#define __DISPATCHTABLE_H__
+
+#include <sys/types.h>
+#include "../Shared/AoEcommon.h"
+#include "aoe.h"
+
+class AOE_CONTROLLER_NAME;
+
+// Controllers are found from a response's (shelf, slot) through an index of shelves, each holding its slots in ranges of
+// DISPATCH_RANGE_SLOTS. The shelf index is grown as higher shelves are found, and a shelf's table and each range of its
+// slots are only allocated when the first target in them is found. So a target on a shelf of its own costs a few
+// hundred bytes rather than a table of every slot. Lookups never allocate, so they can be made for every received packet
+#define DISPATCH_RANGE_SHIFT		4
+#define DISPATCH_RANGE_SLOTS		(1<<DISPATCH_RANGE_SHIFT)
+#define DISPATCH_RANGES				(MAX_SLOTS/DISPATCH_RANGE_SLOTS)
+
+// Third level of the table
+struct SlotDispatch
+{
+	int						nTargets;
+	AOE_CONTROLLER_NAME*	apSlot[DISPATCH_RANGE_SLOTS];
+};
+
+// Second level of the table
+struct ShelfDispatch
+{
+	int						nTargets;
+	struct SlotDispatch*	apRanges[DISPATCH_RANGES];
+};
+
+struct DispatchTable
+{
+	struct ShelfDispatch**	ppShelves;				// Indexed by shelf
+	int						nShelves;
+};
+
+int dispatch_add(struct DispatchTable* pTable, int nShelf, int nSlot, AOE_CONTROLLER_NAME* pController);
+void dispatch_remove(struct DispatchTable* pTable, int nShelf, int nSlot, AOE_CONTROLLER_NAME* pController);
+void dispatch_free(struct DispatchTable* pTable);
+
+
+
+static inline AOE_CONTROLLER_NAME* dispatch_find(struct DispatchTable* pTable, int nShelf, int nSlot)
+{
+	struct ShelfDispatch* pShelf;
+	struct SlotDispatch* pRange;
+	
+	if ( (nShelf<0) || (nShelf>=pTable->nShelves) || (nSlot<0) || (nSlot>=MAX_SLOTS) )
+		return NULL;
+	
+	pShelf = pTable->ppShelves[nShelf];
+	if ( NULL==pShelf )
+		return NULL;
+	
+	pRange = pShelf->apRanges[nSlot>>DISPATCH_RANGE_SHIFT];
+	
+	return pRange ? pRange->apSlot[nSlot & (DISPATCH_RANGE_SLOTS-1)] : NULL;
+}
+
+#endif		//__DISPATCHTABLE_H__
@@ -9,6 +9,7 @@
 #include <IOKit/IOLib.h>
 #include <string.h>
 #include "EInterface.h"
+#include "debug.h"
 #include "../Shared/AoEcommon.h"
 
 EInterface::EInterface()
@@ -18,33 +19,215 @@ EInterface::EInterface()
 	m_nOutstandingCount = 0;
 	m_nCwd = 1;
 	m_nCwdFractional = 0;
+	m_pCongestionControl = NULL;
+	m_nCongestionControl = DEFAULT_CONGESTION_CONTROL;
 	m_TimeSinceLastSend = 0;
 	m_nMinimumMaxOutstanding = DEFAULT_CONGESTION_WINDOW;
 	m_nSSThresh = m_nMinimumMaxOutstanding/2;
 
-	memset(m_anMaxOutstanding, 0, sizeof(m_anMaxOutstanding));
+	memset((void*) m_appTargetWindowDirs, 0, sizeof(m_appTargetWindowDirs));
 }
 
 
 EInterface::~EInterface()
 {
+	int nDir, nLeaf;
+	
+	for (nDir=0; nDir<TARGET_WINDOW_DIRS; nDir++)
+		if ( m_appTargetWindowDirs[nDir] )
+		{
+			for (nLeaf=0; nLeaf<TARGET_WINDOW_DIR_SIZE; nLeaf++)
+				if ( m_appTargetWindowDirs[nDir][nLeaf] )
+					IOFree(m_appTargetWindowDirs[nDir][nLeaf], TARGET_WINDOW_LEAF_SIZE*sizeof(struct TargetWindow));
+			
+			IOFree((void*) m_appTargetWindowDirs[nDir], TARGET_WINDOW_DIR_SIZE*sizeof(struct TargetWindow*));
+			m_appTargetWindowDirs[nDir] = NULL;
+		}
 }
 
-#warning use OSArray or something to avoid pre-allocating all this memory
-void EInterface::set_max_oustanding(int nShelf, int nMaxOutstanding)
+void EInterface::set_max_oustanding(int nTarget, int nMaxOutstanding)
 {
-	m_anMaxOutstanding[nShelf] = nMaxOutstanding;
+	struct TargetWindow* pWindow;
 	
-	// Update the minimum value for all shelves
+	// Update the minimum value for all targets
 	m_nMinimumMaxOutstanding = MIN(m_nMinimumMaxOutstanding, nMaxOutstanding);
+	
+	// The target can be sent to from now on, so it needs a window
+	pWindow = create_target_window(nTarget);
+	if ( NULL==pWindow )
+	{
+		debugError("Unable to allocate the window for target %d.%d, it will only be limited by the interface's window\n", TARGET_NUMBER_SHELF(nTarget), TARGET_NUMBER_SLOT(nTarget));
+		return;
+	}
+	
+	pWindow->nMaxOutstanding = nMaxOutstanding;
+	if ( !pWindow->fInUse )
+	{
+		pWindow->nCwd = 1;
+		pWindow->nSSThresh = nMaxOutstanding;
+		pWindow->nRoundLength = 1;
+		pWindow->fInUse = TRUE;
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The (possibly unused) window of a target, allocating its directory and leaf if they aren't there yet. They're only
+ * published once they've been cleared, as they're looked up without a lock (if two targets race to create the same
+ * one, the loser's copy is thrown away)
+ ---------------------------------------------------------------------------*/
+struct TargetWindow* EInterface::create_target_window(int nTarget)
+{
+	struct TargetWindow* volatile* ppDir;
+	struct TargetWindow* pLeaf;
+	
+	if ( (nTarget<0) || (nTarget>=MAX_TARGET_NUMBERS) )
+		return NULL;
+	
+	if ( NULL==m_appTargetWindowDirs[TARGET_WINDOW_DIR(nTarget)] )
+	{
+		ppDir = (struct TargetWindow* volatile*) IOMalloc(TARGET_WINDOW_DIR_SIZE*sizeof(struct TargetWindow*));
+		if ( NULL==ppDir )
+			return NULL;
+		
+		bzero((void*) ppDir, TARGET_WINDOW_DIR_SIZE*sizeof(struct TargetWindow*));
+		if ( !OSCompareAndSwapPtr(NULL, (void*) ppDir, (void* volatile*) &m_appTargetWindowDirs[TARGET_WINDOW_DIR(nTarget)]) )
+			IOFree((void*) ppDir, TARGET_WINDOW_DIR_SIZE*sizeof(struct TargetWindow*));
+	}
+	ppDir = m_appTargetWindowDirs[TARGET_WINDOW_DIR(nTarget)];
+	
+	if ( NULL==ppDir[TARGET_WINDOW_LEAF(nTarget)] )
+	{
+		pLeaf = (struct TargetWindow*) IOMalloc(TARGET_WINDOW_LEAF_SIZE*sizeof(struct TargetWindow));
+		if ( NULL==pLeaf )
+			return NULL;
+		
+		bzero(pLeaf, TARGET_WINDOW_LEAF_SIZE*sizeof(struct TargetWindow));
+		if ( !OSCompareAndSwapPtr(NULL, pLeaf, (void* volatile*) &ppDir[TARGET_WINDOW_LEAF(nTarget)]) )
+			IOFree(pLeaf, TARGET_WINDOW_LEAF_SIZE*sizeof(struct TargetWindow));
+	}
+	
+	return &ppDir[TARGET_WINDOW_LEAF(nTarget)][TARGET_WINDOW_INDEX(nTarget)];
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The window kept for a target, NULL if it hasn't told us its buffer count (or nTarget is a broadcast)
+ ---------------------------------------------------------------------------*/
+struct TargetWindow* EInterface::get_target_window(int nTarget)
+{
+	struct TargetWindow* volatile* ppDir;
+	struct TargetWindow* pLeaf;
+	
+	if ( (nTarget<0) || (nTarget>=MAX_TARGET_NUMBERS) )
+		return NULL;
+	
+	ppDir = m_appTargetWindowDirs[TARGET_WINDOW_DIR(nTarget)];
+	if ( NULL==ppDir )
+		return NULL;
+	
+	pLeaf = ppDir[TARGET_WINDOW_LEAF(nTarget)];
+	if ( (NULL==pLeaf) || !pLeaf[TARGET_WINDOW_INDEX(nTarget)].fInUse )
+		return NULL;
+	
+	return &pLeaf[TARGET_WINDOW_INDEX(nTarget)];
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * For walking every target's window: returns the first one in use from target *pnTarget on, and moves *pnTarget to
+ * its number (NULL once there are no more). Directories and leaves that were never allocated are skipped over whole
+ ---------------------------------------------------------------------------*/
+struct TargetWindow* EInterface::find_target_window(int* pnTarget)
+{
+	struct TargetWindow* volatile* ppDir;
+	struct TargetWindow* pLeaf;
+	int nTarget;
+	
+	for (nTarget=*pnTarget; nTarget<MAX_TARGET_NUMBERS; nTarget++)
+	{
+		ppDir = m_appTargetWindowDirs[TARGET_WINDOW_DIR(nTarget)];
+		if ( NULL==ppDir )
+		{
+			nTarget |= TARGET_WINDOW_DIR_TARGETS-1;
+			continue;
+		}
+		
+		pLeaf = ppDir[TARGET_WINDOW_LEAF(nTarget)];
+		if ( NULL==pLeaf )
+		{
+			nTarget |= TARGET_WINDOW_LEAF_SIZE-1;
+			continue;
+		}
+		
+		if ( pLeaf[TARGET_WINDOW_INDEX(nTarget)].fInUse )
+		{
+			*pnTarget = nTarget;
+			return &pLeaf[TARGET_WINDOW_INDEX(nTarget)];
+		}
+	}
+	
+	return NULL;
+}
+
+
+
+void EInterface::clear_target_outstanding(void)
+{
+	struct TargetWindow* pWindow;
+	int nTarget;
+	
+	for (nTarget=0; NULL!=(pWindow=find_target_window(&nTarget)); nTarget++)
+		pWindow->nOutstanding = 0;
 }
 
-int EInterface::get_max_oustanding(int nShelf)
+/*---------------------------------------------------------------------------
+ * The target's buffer count. A target without a window (its window couldn't be allocated) gets the smallest of them all
+ ---------------------------------------------------------------------------*/
+int EInterface::get_max_oustanding(int nTarget)
 {
-	return m_anMaxOutstanding[nShelf];
+	struct TargetWindow* pWindow;
+	
+	pWindow = get_target_window(nTarget);
+	
+	return pWindow ? (int) pWindow->nMaxOutstanding : get_max_outstanding_all_shelves();
 }
 
 int EInterface::get_max_outstanding_all_shelves(void)
 {
 	return m_nMinimumMaxOutstanding;
 }
+
+
+/*---------------------------------------------------------------------------
+ * Force a cwnd value
+ ---------------------------------------------------------------------------*/
+void EInterface::set_cwnd(UInt32 nCwd)
+{
+	m_nCwd = MAX(nCwd, 1U);
+	m_nCwdFractional = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+ * Adjust the cwnd and handle any fractional component
+ ---------------------------------------------------------------------------*/
+void EInterface::grow_cwnd(int nIntegerGrowth, int nFractionalGrowth)
+{
+	int nPrevCwnd = m_nCwd;
+
+	m_nCwd += nIntegerGrowth;
+	m_nCwdFractional += nFractionalGrowth;
+
+	// Check if fractional part has "rolled over"
+	if ( m_nCwdFractional >= m_nCwd )
+	{
+		m_nCwd += m_nCwdFractional/nPrevCwnd;
+		m_nCwdFractional = m_nCwdFractional % nPrevCwnd;
+	}
+
+	debug("\tcwnd=%d + %d.%d -> %d.%d\n", nPrevCwnd, nIntegerGrowth, nFractionalGrowth, m_nCwd, m_nCwdFractional);
+}
@@ -14,15 +14,53 @@
 #include <sys/types.h>
 #include "aoe.h"
 
+class CongestionControl;
+
+// What's known about each target (shelf.slot, see TARGET_NUMBER) on an interface. The frames outstanding to each one are
+// always counted, the rest is used by strategies that keep a window per target (CongestionControl::per_target).
+// Targets are looked up through a three-level table: a directory for each range of TARGET_WINDOW_DIR_TARGETS targets,
+// holding the leaves of TARGET_WINDOW_LEAF_SIZE windows. Only the leaves of targets that have answered a config
+// query, and the directories they're in, take any memory.
+#define TARGET_WINDOW_LEAF_SHIFT		4
+#define TARGET_WINDOW_LEAF_SIZE			(1<<TARGET_WINDOW_LEAF_SHIFT)
+#define TARGET_WINDOW_DIR_SHIFT			10
+#define TARGET_WINDOW_DIR_SIZE			(1<<TARGET_WINDOW_DIR_SHIFT)
+#define TARGET_WINDOW_DIR_TARGETS		(TARGET_WINDOW_DIR_SIZE*TARGET_WINDOW_LEAF_SIZE)
+#define TARGET_WINDOW_DIRS				(MAX_TARGET_NUMBERS/TARGET_WINDOW_DIR_TARGETS)
+#define TARGET_WINDOW_DIR(nTarget)		((nTarget)>>(TARGET_WINDOW_DIR_SHIFT+TARGET_WINDOW_LEAF_SHIFT))
+#define TARGET_WINDOW_LEAF(nTarget)		(((nTarget)>>TARGET_WINDOW_LEAF_SHIFT) & (TARGET_WINDOW_DIR_SIZE-1))
+#define TARGET_WINDOW_INDEX(nTarget)	((nTarget) & (TARGET_WINDOW_LEAF_SIZE-1))
+
+struct TargetWindow
+{
+	bool		fInUse;						// Set once the target's buffer count is known
+	SInt32		nOutstanding;
+	UInt32		nMaxOutstanding;			// The target's buffer count
+	UInt32		nCwd;
+	UInt32		nSSThresh;
+	uint64_t	nBaseRTT_ns;				// Lowest RTT seen, taken to be the RTT with nothing queued at the target
+	uint64_t	nRoundMinRTT_ns;			// Lowest RTT seen this round
+	UInt32		nRoundAcks;					// Responses seen this round
+	UInt32		nRoundLength;				// The round ends after this many responses (the cwnd when it started)
+	UInt32		nBaseRTTRounds;				// Rounds since nBaseRTT_ns was last refreshed
+	UInt32		nProbeAcks;					// While the base RTT is being retaken, the responses still to come (0 otherwise)
+	UInt32		nProbeCwnd;					// and the window to go back to afterwards
+};
+
 class EInterface
 {
 public:
 	EInterface();
 	~EInterface();
 
-	void set_max_oustanding(int nShelf, int nMaxOutstanding);
-	int get_max_oustanding(int nShelf);
+	void set_max_oustanding(int nTarget, int nMaxOutstanding);
+	int get_max_oustanding(int nTarget);
 	int get_max_outstanding_all_shelves(void);
+	void set_cwnd(UInt32 nCwd);
+	void grow_cwnd(int nIntegerGrowth, int nFractionalGrowth);
+	struct TargetWindow* get_target_window(int nTarget);
+	struct TargetWindow* find_target_window(int* pnTarget);
+	void clear_target_outstanding(void);
 
 public:
 	bool		m_fEnabled;
@@ -31,12 +69,16 @@ public:
 	UInt32		m_nSSThresh;
 	UInt32		m_nCwd;
 	UInt32		m_nCwdFractional;
+	CongestionControl*	m_pCongestionControl;		// Owned by EInterfaces
+	int			m_nCongestionControl;
 	
 	uint64_t	m_TimeSinceLastSend;
 
 private:
-	UInt32		m_anMaxOutstanding[MAX_SHELFS];
+	struct TargetWindow* create_target_window(int nTarget);
+
 	UInt32		m_nMinimumMaxOutstanding;
+	struct TargetWindow* volatile* volatile	m_appTargetWindowDirs[TARGET_WINDOW_DIRS];	// Each directory covers TARGET_WINDOW_DIR_TARGETS targets
 };
 
 #endif		//__EINTERFACE_H__
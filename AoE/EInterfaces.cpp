@@ -24,10 +24,21 @@ __END_DECLS
 
 EInterfaces::EInterfaces(IOService *pProvider)
 {
+	int n;
+	
 	m_nInterfacesInUse = 0;
 	m_Min_MTU = 0;
 	m_pProvider = pProvider;
 	m_nMaxUserWindow = DEFAULT_CONGESTION_WINDOW;
+	
+	m_apCongestionControl[CONGESTION_CONTROL_SLOW_START] = new SlowStartCongestionControl;
+	m_apCongestionControl[CONGESTION_CONTROL_DELAY] = new DelayCongestionControl;
+	
+	for(n=0; n<numberof(m_aInterfaces); n++)
+	{
+		m_aInterfaces[n].m_nCongestionControl = DEFAULT_CONGESTION_CONTROL;
+		m_aInterfaces[n].m_pCongestionControl = m_apCongestionControl[DEFAULT_CONGESTION_CONTROL];
+	}
 }
 
 
@@ -40,6 +51,13 @@ EInterfaces::~EInterfaces()
 		if ( m_aInterfaces[n].m_fEnabled )
 			ifnet_release(m_aInterfaces[n].m_ifnet);
 		m_aInterfaces[n].m_fEnabled = FALSE;
+		m_aInterfaces[n].m_pCongestionControl = NULL;
+	}
+	
+	for(n=0; n<numberof(m_apCongestionControl); n++)
+	{
+		delete m_apCongestionControl[n];
+		m_apCongestionControl[n] = NULL;
 	}
 }
 
@@ -50,30 +68,30 @@ EInterfaces::~EInterfaces()
  * Most of these functions are passed a particular ifref and we have to search for the interface to get/set the appropriate info
  ---------------------------------------------------------------------------*/
 
-void EInterfaces::set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding)
+void EInterfaces::set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding)
 {
 	int n;
 	
 	// Iterate over all our interfaces looking for ifref
 	for(n=0; n<numberof(m_aInterfaces); n++)
 		if ( ifref==m_aInterfaces[n].m_ifnet )
-			m_aInterfaces[n].set_max_oustanding(nShelf, nMaxOutstanding);
+			m_aInterfaces[n].set_max_oustanding(nTarget, nMaxOutstanding);
 }
 
-int EInterfaces::get_max_outstanding(ifnet_t ifref, int nShelf)
+int EInterfaces::get_max_outstanding(ifnet_t ifref, int nTarget)
 {
 	int n;
 	
-	if ( nShelf>=0 )
+	if ( nTarget>=0 )
 	{
 		// Iterate over all our interfaces looking for ifref
 		for(n=0; n<numberof(m_aInterfaces); n++)
 			if ( ifref==m_aInterfaces[n].m_ifnet )
-				return m_aInterfaces[n].get_max_oustanding(nShelf);	
+				return m_aInterfaces[n].get_max_oustanding(nTarget);	
 	}
 	else
 	{
-		// If nShelf<0, it's a broadcast, so we take the min of all shelves for that interface
+		// If nTarget<0, it's a broadcast, so we take the min of all targets for that interface
 		for(n=0; n<numberof(m_aInterfaces); n++)
 			if ( ifref==m_aInterfaces[n].m_ifnet )
 				return m_aInterfaces[n].get_max_outstanding_all_shelves();
@@ -146,82 +164,81 @@ int EInterfaces::update_time_since_last_send(ifnet_t ifref)
 }
 
 
-/*---------------------------------------------------------------------------
- * Force a cwnd value
- ---------------------------------------------------------------------------*/
-int EInterfaces::set_cwnd(ifnet_t ifref, int nCwd)
+int EInterfaces::get_ssthresh(ifnet_t ifref)
 {
 	int n;
 	
 	// Iterate over all our interfaces looking for ifref
 	for(n=0; n<numberof(m_aInterfaces); n++)
 		if ( ifref==m_aInterfaces[n].m_ifnet )
-		{
-			m_aInterfaces[n].m_nCwd = nCwd;
-			m_aInterfaces[n].m_nCwdFractional = 0;
-			return 0;
-		}
+			return m_aInterfaces[n].m_nSSThresh;
 	
 	return -1;
 }
 
-
 /*---------------------------------------------------------------------------
- * Adjust the cwnd and handle any fractional component
+ * Pass congestion events on to the strategy that's managing the interface's window
  ---------------------------------------------------------------------------*/
-int EInterfaces::grow_cwnd(ifnet_t ifref, int nIntegerGrowth, int nFractionalGrowth)
+void EInterfaces::on_ack(ifnet_t ifref, int nTarget, UInt64 RTT_ns)
 {
 	int n;
 	
-	// Iterate over all our interfaces looking for ifref
-	for(n=0; n<numberof(m_aInterfaces); n++)
-		if ( ifref==m_aInterfaces[n].m_ifnet )
-		{
-			int nPrevCwnd = m_aInterfaces[n].m_nCwd;
-			int nPrevCwdFractional = m_aInterfaces[n].m_nCwdFractional;
-
-			m_aInterfaces[n].m_nCwd += nIntegerGrowth;
-			m_aInterfaces[n].m_nCwdFractional += nFractionalGrowth;
+	n = get_interface_number(ifref);
+	if ( (n>=0) && m_aInterfaces[n].m_pCongestionControl )
+		m_aInterfaces[n].m_pCongestionControl->on_ack(&m_aInterfaces[n], nTarget, RTT_ns);
+}
 
-			// Check if fractional part has "rolled over"
-			if ( m_aInterfaces[n].m_nCwdFractional >= m_aInterfaces[n].m_nCwd )
-			{
-				m_aInterfaces[n].m_nCwd += m_aInterfaces[n].m_nCwdFractional/nPrevCwnd;
-				m_aInterfaces[n].m_nCwdFractional = m_aInterfaces[n].m_nCwdFractional % nPrevCwnd;
-			}
 
-			debug("\tcwnd=%d.%d + %d.%d = %d.%d\n", nPrevCwnd, nPrevCwdFractional, nIntegerGrowth, nFractionalGrowth, m_aInterfaces[n].m_nCwd, m_aInterfaces[n].m_nCwdFractional);
-			return 0;
-		}
+void EInterfaces::on_loss(ifnet_t ifref, int nTarget)
+{
+	int n;
 	
-	return -1;
+	n = get_interface_number(ifref);
+	if ( (n>=0) && m_aInterfaces[n].m_pCongestionControl )
+		m_aInterfaces[n].m_pCongestionControl->on_loss(&m_aInterfaces[n], nTarget);
 }
 
-int EInterfaces::get_ssthresh(ifnet_t ifref)
+
+void EInterfaces::on_timeout(ifnet_t ifref, int nTarget)
 {
 	int n;
 	
-	// Iterate over all our interfaces looking for ifref
-	for(n=0; n<numberof(m_aInterfaces); n++)
-		if ( ifref==m_aInterfaces[n].m_ifnet )
-			return m_aInterfaces[n].m_nSSThresh;
-	
-	return -1;
+	n = get_interface_number(ifref);
+	if ( (n>=0) && m_aInterfaces[n].m_pCongestionControl )
+	{
+		m_aInterfaces[n].m_pCongestionControl->on_timeout(&m_aInterfaces[n], nTarget);
+		debugVerbose("\tAdjusting cwnd to %d and ssthresh to %d on interface %d\n", m_aInterfaces[n].m_nCwd, m_aInterfaces[n].m_nSSThresh, n);
+	}
 }
 
-int EInterfaces::set_ssthresh(ifnet_t ifref, int nSSThresh)
+
+
+/*---------------------------------------------------------------------------
+ * Change the strategy managing an interface's window. The window starts again from the new strategy's reset()
+ ---------------------------------------------------------------------------*/
+int EInterfaces::set_congestion_control(int nEthernetNumber, int nStrategy)
 {
-	int n;
+	if ( (nEthernetNumber<0) || (nEthernetNumber>=numberof(m_aInterfaces)) )
+	{
+		debugError("Invalid ethernet port %d\n", nEthernetNumber);
+		return -1;
+	}
 	
-	// Iterate over all our interfaces looking for ifref
-	for(n=0; n<numberof(m_aInterfaces); n++)
-		if ( ifref==m_aInterfaces[n].m_ifnet )
-		{
-			m_aInterfaces[n].m_nSSThresh = nSSThresh;
-			return 0;
-		}
+	if ( (nStrategy<0) || (nStrategy>=CONGESTION_CONTROL_STRATEGIES) || (NULL==m_apCongestionControl[nStrategy]) )
+	{
+		debugError("Unknown congestion control strategy %d\n", nStrategy);
+		return -1;
+	}
 	
-	return -1;
+	m_aInterfaces[nEthernetNumber].m_nCongestionControl = nStrategy;
+	m_aInterfaces[nEthernetNumber].m_pCongestionControl = m_apCongestionControl[nStrategy];
+	
+	if ( m_aInterfaces[nEthernetNumber].m_fEnabled )
+		m_aInterfaces[nEthernetNumber].m_pCongestionControl->reset(&m_aInterfaces[nEthernetNumber]);
+	
+	debug("en%d is now using %s congestion control\n", nEthernetNumber, m_apCongestionControl[nStrategy]->name());
+	
+	return 0;
 }
 
 /*---------------------------------------------------------------------------
@@ -246,6 +263,59 @@ int EInterfaces::all_full(int nMax)
 }
 
 
+/*---------------------------------------------------------------------------
+ * Return our index for ifref (this is also its ethernet number), or -1 if it isn't one of ours
+ ---------------------------------------------------------------------------*/
+int EInterfaces::get_interface_number(ifnet_t ifref)
+{
+	int n;
+	
+	// Iterate over all our interfaces looking for ifref
+	for(n=0; n<numberof(m_aInterfaces); n++)
+		if ( ifref==m_aInterfaces[n].m_ifnet )
+			return n;
+	
+	return -1;
+}
+
+
+/*---------------------------------------------------------------------------
+ * Return how many more packets can be outstanding on the interface for a given target (<=0 if the window is full)
+ * The window is the smallest of the cwnd, the target's buffer count and the user's window. With a strategy that keeps
+ * a window per target, the target's own window and outstanding count are used, and the user's window caps the interface.
+ * Unlike most of the functions here, the interface is passed by index so there's no searching
+ ---------------------------------------------------------------------------*/
+int EInterfaces::get_send_credit(int nInterface, int nTarget)
+{
+	struct TargetWindow* pWindow;
+	int nMaxOutstanding;
+	
+	if ( (nInterface<0) || (nInterface>=numberof(m_aInterfaces)) || !m_aInterfaces[nInterface].m_fEnabled )
+		return 0;
+
+	if ( m_aInterfaces[nInterface].m_pCongestionControl && m_aInterfaces[nInterface].m_pCongestionControl->per_target() )
+	{
+		pWindow = m_aInterfaces[nInterface].get_target_window(nTarget);
+		if ( pWindow )
+		{
+			nMaxOutstanding = MIN((int)pWindow->nCwd, m_aInterfaces[nInterface].get_max_oustanding(nTarget));
+			return MIN(nMaxOutstanding - pWindow->nOutstanding, m_nMaxUserWindow - m_aInterfaces[nInterface].m_nOutstandingCount);
+		}
+	}
+
+	// If nTarget<0, it's a broadcast, so we take the min of all targets for that interface
+	if ( nTarget>=0 )
+		nMaxOutstanding = m_aInterfaces[nInterface].get_max_oustanding(nTarget);
+	else
+		nMaxOutstanding = m_aInterfaces[nInterface].get_max_outstanding_all_shelves();
+
+	nMaxOutstanding = MIN((int)m_aInterfaces[nInterface].m_nCwd, nMaxOutstanding);
+	nMaxOutstanding = MIN(nMaxOutstanding, m_nMaxUserWindow);
+
+	return nMaxOutstanding - m_aInterfaces[nInterface].m_nOutstandingCount;
+}
+
+
 SInt32* EInterfaces::get_ptr_outstanding(ifnet_t ifref)
 {
 	int nInterfaceNum;
@@ -264,6 +334,24 @@ SInt32* EInterfaces::get_ptr_outstanding(ifnet_t ifref)
 	return &m_aInterfaces[nInterfaceNum].m_nOutstandingCount;
 }
 
+
+/*---------------------------------------------------------------------------
+ * The count of frames outstanding to one target on an interface (NULL for broadcasts and targets we have no window for)
+ ---------------------------------------------------------------------------*/
+SInt32* EInterfaces::get_ptr_target_outstanding(ifnet_t ifref, int nTarget)
+{
+	struct TargetWindow* pWindow;
+	int n;
+	
+	n = get_interface_number(ifref);
+	if ( n<0 )
+		return NULL;
+	
+	pWindow = m_aInterfaces[n].get_target_window(nTarget);
+	
+	return pWindow ? &pWindow->nOutstanding : NULL;
+}
+
 ifnet_t EInterfaces::get_nth_interface(int n)
 {
 	for(/**/; n<numberof(m_aInterfaces); n++)
@@ -294,8 +382,8 @@ int EInterfaces::reset_if_idle(UInt64 TimeOut)
 				debug("RESETTING IDLE LINK on interface %d\n", n);
 
 				// Reset values
-				set_cwnd(m_aInterfaces[n].m_ifnet, 1);
-				set_ssthresh(m_aInterfaces[n].m_ifnet, m_aInterfaces[n].get_max_outstanding_all_shelves()/2);
+				if ( m_aInterfaces[n].m_pCongestionControl )
+					m_aInterfaces[n].m_pCongestionControl->on_idle(&m_aInterfaces[n]);
 				
 				// Since the link is idle, we would expect the number of outstanding commands to be zero. If it isn't
 				// something has gone wrong and we reset it to prevent commands not being sent again
@@ -304,6 +392,7 @@ int EInterfaces::reset_if_idle(UInt64 TimeOut)
 					debugError("Outstanding count is not zero, but the interface is idle. Resetting to prevent deadlock\n");
 					m_aInterfaces[n].m_nOutstandingCount = 0;
 				}
+				m_aInterfaces[n].clear_target_outstanding();
 			}
 		}
 
@@ -352,9 +441,10 @@ kern_return_t EInterfaces::enable_interface(int nEthernetNumber)
 	m_aInterfaces[nEthernetNumber].m_fEnabled = TRUE;
 	
 	// Reset our CC/SS parameters
-	set_cwnd(m_aInterfaces[nEthernetNumber].m_ifnet, 1);
-	set_ssthresh(m_aInterfaces[nEthernetNumber].m_ifnet, m_aInterfaces[nEthernetNumber].get_max_outstanding_all_shelves()/2);
+	if ( m_aInterfaces[nEthernetNumber].m_pCongestionControl )
+		m_aInterfaces[nEthernetNumber].m_pCongestionControl->reset(&m_aInterfaces[nEthernetNumber]);
 	m_aInterfaces[nEthernetNumber].m_nOutstandingCount = 0;
+	m_aInterfaces[nEthernetNumber].clear_target_outstanding();
 
 	debug("enable_interface(%d), %d interface(s) now in use\n", nEthernetNumber, m_nInterfacesInUse);
 
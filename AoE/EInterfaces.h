@@ -13,6 +13,7 @@
 #include <sys/kernel_types.h>
 #include <sys/types.h>
 #include "EInterface.h"
+#include "CongestionControl.h"
 #include "aoe.h"
 #include "../Shared/AoEcommon.h"
 
@@ -24,13 +25,16 @@ public:
 
 	int get_outstanding(ifnet_t ifref);
 	int set_outstanding(ifnet_t ifref, int nOutstanding);
-	void set_max_outstanding(ifnet_t ifref, int nShelf, int nMaxOutstanding);
-	int get_max_outstanding(ifnet_t ifref, int nShelf);
+	void set_max_outstanding(ifnet_t ifref, int nTarget, int nMaxOutstanding);
+	int get_max_outstanding(ifnet_t ifref, int nTarget);
 	int get_cwnd(ifnet_t ifref);	
-	int set_cwnd(ifnet_t ifref, int nCwd);
-	int grow_cwnd(ifnet_t ifref, int nIntegerGrowth, int nFractionalGrowth);
 	int get_ssthresh(ifnet_t ifref);
-	int set_ssthresh(ifnet_t ifref, int nSsthresh);
+
+	// Congestion control, these are passed on to the interface's strategy
+	void on_ack(ifnet_t ifref, int nTarget, UInt64 RTT_ns);
+	void on_loss(ifnet_t ifref, int nTarget);
+	void on_timeout(ifnet_t ifref, int nTarget);
+	int set_congestion_control(int nEthernetNumber, int nStrategy);
 
 	int update_time_since_last_send(ifnet_t ifref);
 	uint64_t get_time_since_last_send(ifnet_t ifref);
@@ -40,11 +44,14 @@ public:
 	void interface_reconnected(int nEthernetNumber, ifnet_t enetifnet);
 	int interface_disconnected(int nEthernetNumber);
 	SInt32* get_ptr_outstanding(ifnet_t ifref);
+	SInt32* get_ptr_target_outstanding(ifnet_t ifref, int nTarget);
 	ifnet_t get_nth_interface(int n);
 
 	int set_user_max_window(int nMaxSize);
 	int all_full(int nMax);
 	int is_used(ifnet_t ifref);
+	int get_interface_number(ifnet_t ifref);
+	int get_send_credit(int nInterface, int nTarget);
 	
 	int reset_if_idle(UInt64 TimeOut);
 
@@ -56,6 +63,7 @@ private:
 	void recalculate_mtu(void);
 	
 	EInterface			m_aInterfaces[MAX_SUPPORTED_ETHERNET_CONNETIONS];
+	CongestionControl*	m_apCongestionControl[CONGESTION_CONTROL_STRATEGIES];	// Indexed by CONGESTION_CONTROL_xxx
 	int					m_nInterfacesInUse;
 
 	UInt32				m_Min_MTU;
@@ -0,0 +1,72 @@
+/*
+ *  ReadAheadWindow.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __READAHEADWINDOW_H__
+#define __READAHEADWINDOW_H__
+
+#include <libkern/OSTypes.h>
+#include "../Shared/AoEcommon.h"
+
+// Sequential reads are followed by reads of the sectors after them (into a buffer of READ_AHEAD_BUFFER_SECTORS).
+// How far ahead starts at READ_AHEAD_MIN_SECTORS, doubles with each hit and halves each time read-ahead is thrown away.
+#define READ_AHEAD_BUFFER_SECTORS		1024
+#define READ_AHEAD_MIN_SECTORS			64
+#define READ_AHEAD_TRIGGER				2				// Reads in a row that carry on from the one before
+
+
+
+/*---------------------------------------------------------------------------
+ * Note a read of nSectors at LBA. Returns TRUE if it started where the one before ended
+ ---------------------------------------------------------------------------*/
+static inline bool read_ahead_note_read(UInt64* pNextLBA, int* pnSequential, UInt64 LBA, int nSectors)
+{
+	bool fSequential;
+	
+	fSequential = (LBA==*pNextLBA);
+	*pnSequential = fSequential ? *pnSequential+1 : 0;
+	*pNextLBA = LBA+nSectors;
+	
+	return fSequential;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Where the read-ahead held in [Start, End) should be taken up to, nWindow sectors past the client's next read but
+ * no further than the buffer (or the disk, if its Capacity is known) allows. Returns End if it isn't worth topping
+ * up yet, which is until at least half a window can be fetched
+ ---------------------------------------------------------------------------*/
+static inline UInt64 read_ahead_target(UInt64 NextLBA, int nWindow, UInt64 Start, UInt64 End, UInt64 Capacity)
+{
+	UInt64 Target;
+	
+	Target = MIN(NextLBA+nWindow, Start+READ_AHEAD_BUFFER_SECTORS);
+	if ( Capacity )
+		Target = MIN(Target, Capacity);
+	
+	if ( (Target<=End) || ((End>Start) && (Target-End < (UInt64)nWindow/2)) )
+		return End;
+	
+	return Target;
+}
+
+
+
+static inline int read_ahead_grow(int nWindow)
+{
+	return MIN(2*nWindow, READ_AHEAD_BUFFER_SECTORS);
+}
+
+
+
+static inline int read_ahead_shrink(int nWindow)
+{
+	return MAX(nWindow/2, READ_AHEAD_MIN_SECTORS);
+}
+
+#endif		//__READAHEADWINDOW_H__
@@ -0,0 +1,241 @@
+/*
+ *  ReadCache.cpp
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "ReadCache.h"
+#include "debug.h"
+#include "../Shared/AoEcommon.h"
+
+static bool read_cache_make_room(struct ReadCache* pCache, int nBlocks);
+static void read_cache_free_all(struct ReadCache* pCache);
+
+void read_cache_init(struct ReadCache* pCache)
+{
+	int n;
+	
+	pCache->pHash = NULL;
+	for (n=0; n<CACHE_QUEUES; n++)
+	{
+		TAILQ_INIT(&pCache->aQueues[n]);
+		pCache->anBlocks[n] = 0;
+	}
+	pCache->nMaxBlocks = 0;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Set the number of blocks that can be cached. A smaller budget gives back the memory straight away, and 0 frees
+ * the cache altogether. Returns FALSE if the cache can't be allocated (it's left disabled)
+ ---------------------------------------------------------------------------*/
+bool read_cache_set_size(struct ReadCache* pCache, int nMaxBlocks)
+{
+	int n;
+	
+	if ( nMaxBlocks<=0 )
+	{
+		pCache->nMaxBlocks = 0;
+		read_cache_free_all(pCache);
+		return TRUE;
+	}
+	
+	if ( NULL==pCache->pHash )
+	{
+		pCache->pHash = (struct CacheBlockListHeadStruct*) IOMalloc(READ_CACHE_HASH_SIZE*sizeof(struct CacheBlockListHeadStruct));
+		
+		if ( NULL==pCache->pHash )
+		{
+			pCache->nMaxBlocks = 0;
+			return FALSE;
+		}
+		
+		for (n=0; n<READ_CACHE_HASH_SIZE; n++)
+			LIST_INIT(&pCache->pHash[n]);
+	}
+	
+	pCache->nMaxBlocks = nMaxBlocks;
+	read_cache_make_room(pCache, 0);
+	
+	return TRUE;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The target's block, NULL if it isn't known. A block on A1out is known but has no data
+ ---------------------------------------------------------------------------*/
+struct CacheBlock* read_cache_find(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block)
+{
+	struct CacheBlock* pBlock;
+	
+	if ( NULL==pCache->pHash )
+		return NULL;
+	
+	LIST_FOREACH(pBlock, &pCache->pHash[READ_CACHE_HASH(pController, Block)], q_hash)
+		if ( (pBlock->Block==Block) && (pBlock->pController==pController) )
+			return pBlock;
+	
+	return NULL;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Note that a block's data has been used. Only blocks on Am are kept in order of use, A1in stays a FIFO
+ ---------------------------------------------------------------------------*/
+void read_cache_touch(struct ReadCache* pCache, struct CacheBlock* pBlock)
+{
+	if ( CACHE_AM==pBlock->Queue )
+	{
+		TAILQ_REMOVE(&pCache->aQueues[CACHE_AM], pBlock, q_next);
+		TAILQ_INSERT_HEAD(&pCache->aQueues[CACHE_AM], pBlock, q_next);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Make room for the target's block and return the buffer its READ_CACHE_BLOCK_SIZE bytes are to be copied into.
+ * A block remembered on A1out goes straight on to Am, any other goes on A1in. Returns NULL if the block already has
+ * its data, or if there's no room or memory for it
+ ---------------------------------------------------------------------------*/
+UInt8* read_cache_add(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block)
+{
+	struct CacheBlock* pBlock;
+	UInt8* pData;
+	
+	pBlock = read_cache_find(pCache, pController, Block);
+	if ( pBlock && pBlock->pData )
+		return NULL;
+	
+	if ( !read_cache_make_room(pCache, 1) )
+		return NULL;
+	
+	// make_room may have dropped the block from A1out
+	pBlock = read_cache_find(pCache, pController, Block);
+	
+	pData = (UInt8*) IOMalloc(READ_CACHE_BLOCK_SIZE);
+	if ( NULL==pData )
+		return NULL;
+	
+	if ( pBlock )
+	{
+		// It's been read before, so it goes straight on to Am
+		TAILQ_REMOVE(&pCache->aQueues[CACHE_A1OUT], pBlock, q_next);
+		--pCache->anBlocks[CACHE_A1OUT];
+		pBlock->Queue = CACHE_AM;
+	}
+	else
+	{
+		pBlock = (struct CacheBlock*) IOMalloc(sizeof(struct CacheBlock));
+		if ( NULL==pBlock )
+		{
+			IOFree(pData, READ_CACHE_BLOCK_SIZE);
+			return NULL;
+		}
+		
+		pBlock->pController = pController;
+		pBlock->Block = Block;
+		pBlock->Queue = CACHE_A1IN;
+		LIST_INSERT_HEAD(&pCache->pHash[READ_CACHE_HASH(pController, Block)], pBlock, q_hash);
+	}
+	
+	pBlock->pData = pData;
+	TAILQ_INSERT_HEAD(&pCache->aQueues[pBlock->Queue], pBlock, q_next);
+	++pCache->anBlocks[pBlock->Queue];
+	
+	return pData;
+}
+
+
+
+void read_cache_remove(struct ReadCache* pCache, struct CacheBlock* pBlock)
+{
+	TAILQ_REMOVE(&pCache->aQueues[pBlock->Queue], pBlock, q_next);
+	--pCache->anBlocks[pBlock->Queue];
+	LIST_REMOVE(pBlock, q_hash);
+	
+	if ( pBlock->pData )
+		IOFree(pBlock->pData, READ_CACHE_BLOCK_SIZE);
+	IOFree(pBlock, sizeof(struct CacheBlock));
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Drop every block of a target, including those remembered on A1out
+ ---------------------------------------------------------------------------*/
+void read_cache_drop_target(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController)
+{
+	struct CacheBlock* pBlock;
+	struct CacheBlock* pNext;
+	int n;
+	
+	for (n=0; n<CACHE_QUEUES; n++)
+		for (pBlock=TAILQ_FIRST(&pCache->aQueues[n]); pBlock; pBlock=pNext)
+		{
+			pNext = TAILQ_NEXT(pBlock, q_next);
+			if ( pBlock->pController==pController )
+				read_cache_remove(pCache, pBlock);
+		}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Free blocks until another nBlocks will fit in the budget. Blocks leaving A1in are remembered on A1out
+ ---------------------------------------------------------------------------*/
+static bool read_cache_make_room(struct ReadCache* pCache, int nBlocks)
+{
+	struct CacheBlock* pBlock;
+	
+	if ( nBlocks>pCache->nMaxBlocks )
+		return FALSE;
+	
+	while ( pCache->anBlocks[CACHE_A1IN]+pCache->anBlocks[CACHE_AM]+nBlocks > pCache->nMaxBlocks )
+	{
+		if ( (pCache->anBlocks[CACHE_A1IN] > pCache->nMaxBlocks/READ_CACHE_A1IN_SHARE) || TAILQ_EMPTY(&pCache->aQueues[CACHE_AM]) )
+		{
+			pBlock = TAILQ_LAST(&pCache->aQueues[CACHE_A1IN], CacheBlockQueueHeadStruct);
+			
+			TAILQ_REMOVE(&pCache->aQueues[CACHE_A1IN], pBlock, q_next);
+			--pCache->anBlocks[CACHE_A1IN];
+			
+			IOFree(pBlock->pData, READ_CACHE_BLOCK_SIZE);
+			pBlock->pData = NULL;
+			pBlock->Queue = CACHE_A1OUT;
+			
+			TAILQ_INSERT_HEAD(&pCache->aQueues[CACHE_A1OUT], pBlock, q_next);
+			++pCache->anBlocks[CACHE_A1OUT];
+		}
+		else
+		{
+			read_cache_remove(pCache, TAILQ_LAST(&pCache->aQueues[CACHE_AM], CacheBlockQueueHeadStruct));
+		}
+	}
+	
+	while ( pCache->anBlocks[CACHE_A1OUT] > pCache->nMaxBlocks/READ_CACHE_A1OUT_SHARE )
+		read_cache_remove(pCache, TAILQ_LAST(&pCache->aQueues[CACHE_A1OUT], CacheBlockQueueHeadStruct));
+	
+	return TRUE;
+}
+
+
+
+static void read_cache_free_all(struct ReadCache* pCache)
+{
+	int n;
+	
+	for (n=0; n<CACHE_QUEUES; n++)
+		while ( !TAILQ_EMPTY(&pCache->aQueues[n]) )
+			read_cache_remove(pCache, TAILQ_FIRST(&pCache->aQueues[n]));
+	
+	if ( pCache->pHash )
+		IOFree(pCache->pHash, READ_CACHE_HASH_SIZE*sizeof(struct CacheBlockListHeadStruct));
+	pCache->pHash = NULL;
+}
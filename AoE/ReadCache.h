@@ -0,0 +1,69 @@
+/*
+ *  ReadCache.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __READCACHE_H__
+#define __READCACHE_H__
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <IOKit/ata/IOATATypes.h>
+#include "../Shared/AoEcommon.h"
+#include "aoe.h"
+
+class AOE_CONTROLLER_NAME;
+
+// The read cache holds sectors read from any target, in blocks of READ_CACHE_BLOCK_SECTORS. Blocks are replaced using 2Q:
+// a block read for the first time goes on the A1in FIFO, and is only promoted to the Am LRU if it's read again after
+// leaving A1in (which is remembered by keeping its key, without the data, on A1out). A long sequential read can only
+// push out the blocks on A1in, so it doesn't flush the blocks that are in regular use.
+#define READ_CACHE_BLOCK_SECTORS				8
+#define READ_CACHE_BLOCK_SIZE					(READ_CACHE_BLOCK_SECTORS*kATADefaultSectorSize)
+#define READ_CACHE_HASH_SIZE					4096		// NOTE: Must be a power of two
+#define READ_CACHE_HASH(pController, Block)		((((uintptr_t)(pController)>>4) ^ (uintptr_t)(Block) ^ (uintptr_t)((Block)>>12)) & (READ_CACHE_HASH_SIZE-1))
+#define READ_CACHE_A1IN_SHARE					4			// A1in holds 1/4 of the blocks
+#define READ_CACHE_A1OUT_SHARE					2			// and A1out remembers up to half as many blocks again
+
+enum CacheQueue
+{
+	CACHE_A1IN,
+	CACHE_AM,
+	CACHE_A1OUT,
+	CACHE_QUEUES
+};
+
+struct CacheBlock
+{
+	TAILQ_ENTRY(CacheBlock)		q_next;			// entries on the same 2Q queue (most recently added/used first)
+	LIST_ENTRY(CacheBlock)		q_hash;			// entries sharing the same hash bucket
+	AOE_CONTROLLER_NAME*		pController;	// The target the block was read from
+	UInt64						Block;			// LBA/READ_CACHE_BLOCK_SECTORS
+	enum CacheQueue				Queue;
+	UInt8*						pData;			// NULL on A1out
+};
+
+TAILQ_HEAD(CacheBlockQueueHeadStruct, CacheBlock);
+LIST_HEAD(CacheBlockListHeadStruct, CacheBlock);
+
+// The blocks and queues. None of the functions below lock, the caller serialises them
+struct ReadCache
+{
+	struct CacheBlockListHeadStruct*	pHash;				// Allocated while the cache is enabled
+	struct CacheBlockQueueHeadStruct	aQueues[CACHE_QUEUES];
+	int									anBlocks[CACHE_QUEUES];
+	int									nMaxBlocks;			// Budget in blocks (0 when the cache is disabled)
+};
+
+void read_cache_init(struct ReadCache* pCache);
+bool read_cache_set_size(struct ReadCache* pCache, int nMaxBlocks);
+struct CacheBlock* read_cache_find(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block);
+void read_cache_touch(struct ReadCache* pCache, struct CacheBlock* pBlock);
+UInt8* read_cache_add(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block);
+void read_cache_remove(struct ReadCache* pCache, struct CacheBlock* pBlock);
+void read_cache_drop_target(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController);
+
+#endif		//__READCACHE_H__
@@ -0,0 +1,48 @@
+/*
+ *  WriteCoalescing.h
+ *  AoE
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ */
+
+#ifndef __WRITECOALESCING_H__
+#define __WRITECOALESCING_H__
+
+#include <libkern/OSTypes.h>
+#include <IOKit/ata/IOATATypes.h>
+
+// Most write commands that are merged into a single transfer
+#define MAX_COALESCED_WRITES			16
+
+// A merged transfer is sent as one 48-bit command, whose sector count is 16 bits
+#define MAX_COALESCED_SECTORS			0xFFFF
+
+
+
+/*---------------------------------------------------------------------------
+ * Whether a write of Bytes at LBA can be added to nCommands gathered writes that cover GatheredBytes and end just
+ * before NextLBA. It has to follow straight on from them, and the transfer can't grow past MaxTransferSize
+ ---------------------------------------------------------------------------*/
+static inline bool coalesce_can_add(int nCommands, UInt64 NextLBA, UInt64 GatheredBytes, UInt64 LBA, UInt64 Bytes, UInt64 MaxTransferSize)
+{
+	if ( 0==nCommands )
+		return TRUE;
+	
+	return (LBA==NextLBA) &&
+		(nCommands<MAX_COALESCED_WRITES) &&
+		(GatheredBytes+Bytes<=MaxTransferSize) &&
+		((GatheredBytes+Bytes)/kATADefaultSectorSize<=MAX_COALESCED_SECTORS);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Whether there's room for anything more to be added to the gathered writes, so it's worth waiting for it
+ ---------------------------------------------------------------------------*/
+static inline bool coalesce_has_room(int nCommands, UInt64 GatheredBytes, UInt64 MaxTransferSize)
+{
+	return (nCommands<MAX_COALESCED_WRITES) && (GatheredBytes<MaxTransferSize) && (GatheredBytes/kATADefaultSectorSize<MAX_COALESCED_SECTORS);
+}
+
+#endif		//__WRITECOALESCING_H__
@@ -47,6 +47,12 @@ __END_DECLS
 #define MAX_CONFIG_STRING_LENGTH			1024
 #define MAX_SHELFS							(0xFFFF+1)
 #define MAX_SLOTS							(0xFF+1)
+#define MAX_TARGET_NUMBERS					(MAX_SHELFS*MAX_SLOTS)
+
+// A target (shelf.slot) as a single number, for tables kept per target rather than per shelf
+#define TARGET_NUMBER(nShelf, nSlot)		((nShelf)*MAX_SLOTS + (nSlot))
+#define TARGET_NUMBER_SHELF(nTarget)		((nTarget)/MAX_SLOTS)
+#define TARGET_NUMBER_SLOT(nTarget)			((nTarget)%MAX_SLOTS)
 
 #define	BYTES_IN_AOE_HEADER					(sizeof(aoe_atahdr_full)+sizeof(struct ether_header))
 
@@ -159,6 +159,11 @@ int AoEDriverInterface::set_config_string(ConfigString* pCStringInfo)
 	return set_command(AOEINTERFACE_SET_CONFIG_STRING, pCStringInfo, sizeof(ConfigString));
 }
 
+int AoEDriverInterface::set_congestion_control(CongestionControlInfo* pCCInfo)
+{
+	return set_command(AOEINTERFACE_SET_CONGESTION_CONTROL, pCCInfo, sizeof(CongestionControlInfo));
+}
+
 #pragma mark -
 #pragma mark get_commands
 
@@ -184,6 +189,11 @@ int AoEDriverInterface::get_error_info(ErrorInfo* pErrInfo)
 	return get_command(AOEINTERFACE_GET_ERROR_INFO, pErrInfo, sizeof(ErrorInfo));
 }
 
+int AoEDriverInterface::get_statistics(StatisticsInfo* pStats)
+{
+	return get_command(AOEINTERFACE_GET_STATISTICS, pStats, sizeof(StatisticsInfo));
+}
+
 int AoEDriverInterface::get_payload_size(UInt32* pPayload)
 {
 	return get_command(AOEINTERFACE_GET_PAYLOAD_SIZE, pPayload, sizeof(UInt32));
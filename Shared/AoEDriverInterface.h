@@ -27,8 +27,10 @@ public:
 	int count_targets(int* pnTargets);
 	int get_target_info(int nTarget, TargetInfo* pTargetInfo);
 	int get_error_info(ErrorInfo* pErrInfo);
+	int get_statistics(StatisticsInfo* pStats);
 	int get_payload_size(UInt32* pPayload);
 	int set_config_string(ConfigString* pCStringInfo);
+	int set_congestion_control(CongestionControlInfo* pCCInfo);
 
 	int enable_logging(int* pnEnableLogging);
 	int force_packet_send(ForcePacketInfo* pPacketInfo);
@@ -36,7 +36,13 @@ enum AoEInterfaceCommands
 	AOEINTERFACE_GET_PAYLOAD_SIZE,
 	
 	// Set the config string
-	AOEINTERFACE_SET_CONFIG_STRING
+	AOEINTERFACE_SET_CONFIG_STRING,
+
+	// Gets the kext's internal statistics (returns: StatisticsInfo)
+	AOEINTERFACE_GET_STATISTICS,
+
+	// Choose how an interface's congestion window is managed (passes: CongestionControlInfo)
+	AOEINTERFACE_SET_CONGESTION_CONTROL
 };
 
 #endif //__AOE_INTERFACE_COMMANDS_H__
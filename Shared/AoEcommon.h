@@ -54,8 +54,35 @@ __END_DECLS
 #define TAG_USER_MASK							0x80000000
 #define TAG_BROADCAST_MASK						0x40000000
 
+// The remaining 30 bits are split into a namespace per target: [slot:12][generation:4][sequence:14]
+// The slot lets a response be routed straight to its target, and the generation is bumped each time a slot
+// is reused so responses meant for a previous target in that slot can be dropped. Slot 0 isn't given to a
+// target, it's shared by the targets that didn't get a slot. The sequence only has to cover the frames one
+// target has in flight (the controller holds back queued commands that would need more, see dispatchNext)
+#define TAG_SLOT_SHIFT							18
+#define TAG_SLOT_MASK							0x3FFC0000
+#define TAG_GENERATION_SHIFT					14
+#define TAG_GENERATION_MASK						0x0003C000
+#define TAG_SEQUENCE_MASK						0x00003FFF
+
+#define TAG_SLOTS								((TAG_SLOT_MASK>>TAG_SLOT_SHIFT)+1)
+#define TAG_GENERATIONS							((TAG_GENERATION_MASK>>TAG_GENERATION_SHIFT)+1)
+
+#define TAG_GET_SLOT(Tag)						(((Tag)&TAG_SLOT_MASK)>>TAG_SLOT_SHIFT)
+#define TAG_GET_GENERATION(Tag)					(((Tag)&TAG_GENERATION_MASK)>>TAG_GENERATION_SHIFT)
+#define TAG_MAKE(Slot, Generation, Sequence)	((((Slot)<<TAG_SLOT_SHIFT)&TAG_SLOT_MASK) | (((Generation)<<TAG_GENERATION_SHIFT)&TAG_GENERATION_MASK) | ((Sequence)&TAG_SEQUENCE_MASK))
+
+// Number of tags between two tags from the same slot (handles the sequence wrapping)
+#define TAG_SEQUENCE_DIFF(Tag, BaseTag)			(((Tag)-(BaseTag))&TAG_SEQUENCE_MASK)
+
+// Outstanding requests are indexed by tag so responses can be matched without walking any queue.
+// Tags are handed out sequentially, so the low bits alone spread well. The upper half is folded in so
+// broadcast/user tags don't all land in the same bucket. NOTE: SENT_HASH_SIZE must be a power of two
+#define SENT_HASH_SIZE							1024
+#define SENT_HASH(Tag)							(((Tag) ^ ((Tag)>>16)) & (SENT_HASH_SIZE-1))
+
 #define MIN_TAG									1
-#define MAX_TAG									(TAG_BROADCAST_MASK-1)
+#define MAX_TAG									((1<<TAG_SLOT_SHIFT)-1)
 
 //-----------//
 // anomalies //
@@ -95,6 +122,9 @@ __END_DECLS
 #define AOE_DEVICE_NAME						net_corvus_aoe_device
 #define AOE_DEVICE_NAME_Q					"net_corvus_aoe_device"
 
+#define AOE_BLOCK_DEVICE_NAME				net_corvus_aoe_block_device
+#define AOE_BLOCK_DEVICE_NAME_Q				"net_corvus_aoe_block_device"
+
 //------------//
 // properties //
 //------------//
@@ -127,6 +157,44 @@ __END_DECLS
 
 #define DEFAULT_CONGESTION_WINDOW				128
 
+// Maximum number of frames the kext's transmit timer sends in a single pass (before giving receive a turn)
+#define DEFAULT_TRANSMIT_BUDGET					32
+
+// Number of read/write commands each target can have outstanding at once (1 is the original one-at-a-time behaviour)
+#define DEFAULT_QUEUE_DEPTH						1
+#define MAX_QUEUE_DEPTH							32
+
+// How long (in microseconds) a write is held back waiting for writes to the sectors that follow it (0 disables coalescing).
+// Off unless it's turned on with aoed -W, the wait adds to the latency of every lone write
+#define DEFAULT_WRITE_COALESCE_US				0
+#define MAX_WRITE_COALESCE_US					1000
+
+// Memory (in MB) shared by all targets for caching the sectors read from them (0 disables the read cache)
+#define DEFAULT_READ_CACHE_MB					0
+#define MAX_READ_CACHE_MB						1024
+
+// How FLUSH CACHE is handled. The original behaviour answers it locally without telling the target. In the other modes
+// it's sent on to the target once every write before it has been acknowledged, and in write-back mode writes are
+// also completed as soon as they've been sent.
+// WARNING: Write-back mode is unsafe. A write the client has been told succeeded can still fail. The failure is
+// logged and every command after it fails until the next flush, but the data in that write is lost
+#define FLUSH_MODE_FAKE							0
+#define FLUSH_MODE_BARRIER						1
+#define FLUSH_MODE_WRITE_BACK					2		// UNSAFE, see above. Only takes effect with a queue depth above 1
+#define DEFAULT_FLUSH_MODE						FLUSH_MODE_FAKE
+
+// What's published for each target. The ATA device is matched by IOATABlockStorageDriver, the block storage device is
+// matched by IOBlockStorageDriver directly and sends its requests straight to the controller's queue
+#define PUBLISH_MODE_ATA						0
+#define PUBLISH_MODE_BLOCK_STORAGE				1
+#define DEFAULT_PUBLISH_MODE					PUBLISH_MODE_ATA
+
+// How each interface's congestion window is managed. This is chosen for each interface while the kext is running
+#define CONGESTION_CONTROL_SLOW_START			0		// Slow start and AIMD, the window closes on a timeout
+#define CONGESTION_CONTROL_DELAY				1		// Vegas style, the window follows the queueing delay seen in the RTT
+#define CONGESTION_CONTROL_STRATEGIES			2
+#define DEFAULT_CONGESTION_CONTROL				CONGESTION_CONTROL_SLOW_START
+
 //-------------------//
 // Shared Structures //
 //-------------------//
@@ -139,6 +207,12 @@ typedef struct _AoEPreferencesStruct
 	uint32_t nNumberOfPorts;
 	uint32_t nMaxTransferSize;
 	uint32_t nUserBlockCountWindow;
+	uint32_t nTransmitBudget;
+	uint32_t nQueueDepth;
+	uint32_t nWriteCoalesce_us;
+	uint32_t nReadCache_MB;
+	uint32_t nFlushMode;
+	uint32_t nPublishMode;
 	uint32_t anEnabledPorts[MAX_SUPPORTED_ETHERNET_CONNECTIONS];
 	uint8_t aszComputerConfigString[MAX_CONFIG_STRING_LENGTH];
 } AoEPreferencesStruct;
@@ -168,6 +242,48 @@ typedef struct _ErrorInfo
 	int		nRetransmits;
 } ErrorInfo;
 
+typedef struct _StatisticsInfo
+{
+	// Queue record pool
+	uint32_t	nPoolRecords;			// Number of records allocated in the pool
+	uint32_t	nPoolInUse;				// Number of records currently in use
+	uint32_t	nPoolHighWater;			// Largest number of records in use at once
+	uint32_t	nPoolEmpty;				// Number of sends that failed because the pool had run out
+	uint32_t	nPoolAllocFailures;		// Number of times the pool couldn't be grown
+
+	// Write path
+	uint64_t	nWriteBytes;			// Bytes of write data sent to targets
+	uint64_t	nWriteBytesCopied;		// Bytes of write data copied on the way out (zero when frames point straight at the client's memory)
+
+	// Read path
+	uint64_t	nReadBytesCopied;		// Bytes of read data copied from responses into client buffers
+	uint64_t	nReadCopyNS;			// Time spent making those copies
+
+	// Chunk tracking
+	uint32_t	nChunkResends;			// Number of read/write frames resent early because later frames of the same command had arrived
+	uint32_t	nDuplicateChunks;		// Number of read/write responses ignored because that chunk had already been received
+
+	// Write coalescing
+	uint32_t	nCoalescedWrites;		// Number of write commands that were sent as part of an earlier, adjacent write
+	uint32_t	nCoalescedTransfers;	// Number of transfers those writes were merged into
+
+	// Read-ahead
+	uint32_t	nReadAheadHits;			// Number of reads completed from data that had been read ahead
+	uint32_t	nReadAheadMisses;		// Number of reads in a sequential stream that had to go to the target
+	uint64_t	nReadAheadWasted;		// Bytes read ahead that were thrown away without being used
+
+	// Read cache
+	uint32_t	nCacheHits;				// Number of reads completed from the read cache
+	uint32_t	nCacheMisses;			// Number of reads that had to go to the target while the cache was enabled
+	uint64_t	nCacheBytesServed;		// Bytes returned from the read cache
+	uint64_t	nCacheBytesUsed;		// Bytes currently held in the read cache
+	uint64_t	nCacheBytesBudget;		// Most the read cache can hold
+
+	// Tag slots
+	uint32_t	nTagSlotsInUse;			// Number of targets with a tag slot of their own
+	uint32_t	nTagSlotFailures;		// Number of targets that found every slot taken (they share slot 0 and are all run on one work loop)
+} StatisticsInfo;
+
 	
 typedef struct _ForcePacketInfo
 {
@@ -189,4 +305,10 @@ typedef struct _ConfigString
 	char		pszConfig[MAX_CONFIG_STRING_LENGTH];
 } ConfigString;
 
+typedef struct _CongestionControlInfo
+{
+	uint32_t	nEthernetNumber;		// ie. 0 for en0
+	uint32_t	nStrategy;				// CONGESTION_CONTROL_xxx
+} CongestionControlInfo;
+
 #endif		//__AOECOMMON_H__
@@ -25,6 +25,12 @@
 #define SETTINGS_AVAILABLEPORTS		"AvailablePorts"
 #define SETTINGS_TRANSFER_SIZE		"TransferSize"
 #define SETTINGS_USER_BLOCK_COUNT	"MaxUserBlockCount"
+#define SETTINGS_TRANSMIT_BUDGET	"TransmitBudget"
+#define SETTINGS_QUEUE_DEPTH		"QueueDepth"
+#define SETTINGS_WRITE_COALESCE		"WriteCoalesce"
+#define SETTINGS_READ_CACHE			"ReadCache"
+#define SETTINGS_FLUSH_MODE			"FlushMode"
+#define SETTINGS_PUBLISH_MODE		"PublishMode"
 
 // Actual path of our property list
 static CFStringRef g_SettingsFileName = CFSTR("/Library/Preferences/net.corvus.AoEd.plist");
@@ -79,6 +85,36 @@ int PreferenceLoadSave::store_settings(AoEPreferencesStruct* pPStruct)
 	CFNumberRef nrefBlockCount = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nUserBlockCountWindow);
 	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_USER_BLOCK_COUNT), nrefBlockCount);
 	CFRelease(nrefBlockCount);
+
+	// Transmit budget
+	CFNumberRef nrefTransmitBudget = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nTransmitBudget);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_TRANSMIT_BUDGET), nrefTransmitBudget);
+	CFRelease(nrefTransmitBudget);
+
+	// Queue depth
+	CFNumberRef nrefQueueDepth = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nQueueDepth);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_QUEUE_DEPTH), nrefQueueDepth);
+	CFRelease(nrefQueueDepth);
+
+	// Write coalescing window
+	CFNumberRef nrefWriteCoalesce = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nWriteCoalesce_us);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_WRITE_COALESCE), nrefWriteCoalesce);
+	CFRelease(nrefWriteCoalesce);
+
+	// Read cache size
+	CFNumberRef nrefReadCache = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nReadCache_MB);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_READ_CACHE), nrefReadCache);
+	CFRelease(nrefReadCache);
+
+	// Flush mode
+	CFNumberRef nrefFlushMode = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nFlushMode);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_FLUSH_MODE), nrefFlushMode);
+	CFRelease(nrefFlushMode);
+
+	// Publish mode
+	CFNumberRef nrefPublishMode = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pPStruct->nPublishMode);
+	CFDictionaryAddValue(settingsDict, CFSTR(SETTINGS_PUBLISH_MODE), nrefPublishMode);
+	CFRelease(nrefPublishMode);
 	
 	// Write to the file
 	CFURLRef outURLRef = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, g_SettingsFileName, kCFURLPOSIXPathStyle,false);
@@ -123,6 +159,12 @@ int PreferenceLoadSave::recall_settings(AoEPreferencesStruct* pPStruct)
 	// Set default values in case the load fails:
 	pPStruct->nMaxTransferSize = DEFAULT_MAX_TRANSFER_SIZE;
 	pPStruct->nUserBlockCountWindow = DEFAULT_CONGESTION_WINDOW;
+	pPStruct->nTransmitBudget = DEFAULT_TRANSMIT_BUDGET;
+	pPStruct->nQueueDepth = DEFAULT_QUEUE_DEPTH;
+	pPStruct->nWriteCoalesce_us = DEFAULT_WRITE_COALESCE_US;
+	pPStruct->nReadCache_MB = DEFAULT_READ_CACHE_MB;
+	pPStruct->nFlushMode = DEFAULT_FLUSH_MODE;
+	pPStruct->nPublishMode = DEFAULT_PUBLISH_MODE;
 	pPStruct->nNumberOfPorts = EthDetect.GetNumberOfInterfaces();
 	for (n=0; n<pPStruct->nNumberOfPorts; n++)
 		pPStruct->anEnabledPorts[n] = n;
@@ -214,6 +256,78 @@ int PreferenceLoadSave::recall_settings(AoEPreferencesStruct* pPStruct)
 		{
 			pPStruct->nUserBlockCountWindow = DEFAULT_CONGESTION_WINDOW;
 		}
+
+		// Transmit budget
+		CFNumberRef nrefTransmitBudget;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_TRANSMIT_BUDGET), (CFTypeRef*)&nrefTransmitBudget) )
+		{
+			if ( nrefTransmitBudget )
+				CFNumberGetValue(nrefTransmitBudget, kCFNumberIntType, &pPStruct->nTransmitBudget);
+		}
+		else
+		{
+			pPStruct->nTransmitBudget = DEFAULT_TRANSMIT_BUDGET;
+		}
+
+		// Queue depth
+		CFNumberRef nrefQueueDepth;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_QUEUE_DEPTH), (CFTypeRef*)&nrefQueueDepth) )
+		{
+			if ( nrefQueueDepth )
+				CFNumberGetValue(nrefQueueDepth, kCFNumberIntType, &pPStruct->nQueueDepth);
+		}
+		else
+		{
+			pPStruct->nQueueDepth = DEFAULT_QUEUE_DEPTH;
+		}
+
+		// Write coalescing window
+		CFNumberRef nrefWriteCoalesce;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_WRITE_COALESCE), (CFTypeRef*)&nrefWriteCoalesce) )
+		{
+			if ( nrefWriteCoalesce )
+				CFNumberGetValue(nrefWriteCoalesce, kCFNumberIntType, &pPStruct->nWriteCoalesce_us);
+		}
+		else
+		{
+			pPStruct->nWriteCoalesce_us = DEFAULT_WRITE_COALESCE_US;
+		}
+
+		// Read cache size
+		CFNumberRef nrefReadCache;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_READ_CACHE), (CFTypeRef*)&nrefReadCache) )
+		{
+			if ( nrefReadCache )
+				CFNumberGetValue(nrefReadCache, kCFNumberIntType, &pPStruct->nReadCache_MB);
+		}
+		else
+		{
+			pPStruct->nReadCache_MB = DEFAULT_READ_CACHE_MB;
+		}
+
+		// Flush mode
+		CFNumberRef nrefFlushMode;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_FLUSH_MODE), (CFTypeRef*)&nrefFlushMode) )
+		{
+			if ( nrefFlushMode )
+				CFNumberGetValue(nrefFlushMode, kCFNumberIntType, &pPStruct->nFlushMode);
+		}
+		else
+		{
+			pPStruct->nFlushMode = DEFAULT_FLUSH_MODE;
+		}
+
+		// Publish mode
+		CFNumberRef nrefPublishMode;
+		if ( CFDictionaryGetValueIfPresent(myDict, CFSTR(SETTINGS_PUBLISH_MODE), (CFTypeRef*)&nrefPublishMode) )
+		{
+			if ( nrefPublishMode )
+				CFNumberGetValue(nrefPublishMode, kCFNumberIntType, &pPStruct->nPublishMode);
+		}
+		else
+		{
+			pPStruct->nPublishMode = DEFAULT_PUBLISH_MODE;
+		}
 		
 		// Array of available ports
 		CFArrayRef ArrayPorts;			
@@ -61,6 +61,36 @@ void AoEPreferences::set_user_buffer_size(int nSize)
 	m_PreferenceData.nUserBlockCountWindow = nSize;
 }
 
+void AoEPreferences::set_transmit_budget(int nFrames)
+{
+	m_PreferenceData.nTransmitBudget = nFrames;
+}
+
+void AoEPreferences::set_queue_depth(int nQueueDepth)
+{
+	m_PreferenceData.nQueueDepth = nQueueDepth;
+}
+
+void AoEPreferences::set_write_coalesce(int nWindow_us)
+{
+	m_PreferenceData.nWriteCoalesce_us = nWindow_us;
+}
+
+void AoEPreferences::set_read_cache_size(int nSize_MB)
+{
+	m_PreferenceData.nReadCache_MB = nSize_MB;
+}
+
+void AoEPreferences::set_flush_mode(int nMode)
+{
+	m_PreferenceData.nFlushMode = nMode;
+}
+
+void AoEPreferences::set_publish_mode(int nMode)
+{
+	m_PreferenceData.nPublishMode = nMode;
+}
+
 // Display all the preference on the stdout
 void AoEPreferences::PrintPreferences(void)
 {
@@ -72,6 +102,12 @@ void AoEPreferences::PrintPreferences(void)
 	
 	fprintf(stdout, "Transfer buffers = %dkb\n", m_PreferenceData.nMaxTransferSize);
 	fprintf(stdout, "User Block Count = %d\n", m_PreferenceData.nUserBlockCountWindow);
+	fprintf(stdout, "Transmit budget = %d frames\n", m_PreferenceData.nTransmitBudget);
+	fprintf(stdout, "Queue depth = %d commands\n", m_PreferenceData.nQueueDepth);
+	fprintf(stdout, "Write coalescing window = %dus\n", m_PreferenceData.nWriteCoalesce_us);
+	fprintf(stdout, "Read cache = %dMB\n", m_PreferenceData.nReadCache_MB);
+	fprintf(stdout, "Flush mode = %d\n", m_PreferenceData.nFlushMode);
+	fprintf(stdout, "Publish mode = %d\n", m_PreferenceData.nPublishMode);
 	fprintf(stdout, "Computers config string = \"%s\"\n", m_PreferenceData.aszComputerConfigString);
 }
 
@@ -25,6 +25,12 @@ public:
 	void set_available_ports(int nNumberOfPorts, int* pnPorts);
 	void set_max_outstanding_size(int nSize);
 	void set_user_buffer_size(int nSize);
+	void set_transmit_budget(int nFrames);
+	void set_queue_depth(int nQueueDepth);
+	void set_write_coalesce(int nWindow_us);
+	void set_read_cache_size(int nSize_MB);
+	void set_flush_mode(int nMode);
+	void set_publish_mode(int nMode);
 	void PrintPreferences(void);
 
 	int SetSettingsInKEXT(void);
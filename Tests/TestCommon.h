@@ -0,0 +1,86 @@
+/*
+ *  TestCommon.h
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Checks and timing shared by the host tests and benchmarks. Each program is a single file, so the counters
+ *  can live here.
+ */
+
+#ifndef __TESTCOMMON_H__
+#define __TESTCOMMON_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <libkern/OSTypes.h>
+
+static int g_nChecks = 0;
+static int g_nFailures = 0;
+
+#define CHECK(Condition)																	\
+	do																						\
+	{																						\
+		++g_nChecks;																		\
+		if ( !(Condition) )																	\
+		{																					\
+			++g_nFailures;																	\
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #Condition);			\
+		}																					\
+	} while(0)
+
+#define CHECK_EQUAL(Value, Expected)														\
+	do																						\
+	{																						\
+		long long _nValue = (long long)(Value);												\
+		long long _nExpected = (long long)(Expected);										\
+		++g_nChecks;																		\
+		if ( _nValue!=_nExpected )															\
+		{																					\
+			++g_nFailures;																	\
+			printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #Value, _nValue, _nExpected);	\
+		}																					\
+	} while(0)
+
+static inline int test_result(const char* pszName)
+{
+	printf("%s: %d checks, %d failed\n", pszName, g_nChecks, g_nFailures);
+	return g_nFailures ? 1 : 0;
+}
+
+static inline uint64_t time_now_ns(void)
+{
+	struct timespec Now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (uint64_t)Now.tv_sec*1000000000ULL + Now.tv_nsec;
+}
+
+// Costs are reported in cycles of the CPU's time stamp counter where there is one (on current x86 parts it counts at the
+// nominal clock rate whatever the core is actually running at), and in nanoseconds elsewhere
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define CYCLE_UNITS		"cycles"
+static inline uint64_t cycles_now(void)
+{
+	return __rdtsc();
+}
+#else
+#define CYCLE_UNITS		"ns"
+static inline uint64_t cycles_now(void)
+{
+	return time_now_ns();
+}
+#endif
+
+// Small, repeatable pseudo random numbers (xorshift) so every run of a benchmark does the same work
+static inline UInt32 test_random(UInt32* pState)
+{
+	*pState ^= *pState<<13;
+	*pState ^= *pState>>17;
+	*pState ^= *pState<<5;
+	return *pState;
+}
+
+#endif		//__TESTCOMMON_H__
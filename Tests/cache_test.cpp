@@ -0,0 +1,257 @@
+/*
+ *  cache_test.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  2Q replacement in the read cache: first reads go on the A1in FIFO, blocks read again after leaving it are promoted
+ *  to the Am LRU, and sequential scans only push out A1in
+ */
+
+#include <string.h>
+#include <IOKit/IOLib.h>
+#include "TestCommon.h"
+#include "ReadCache.h"
+
+#define BUDGET					16				// Blocks, so A1in holds 4 and A1out remembers 8
+
+static int g_anTargets[2];
+#define TARGET_A				((AOE_CONTROLLER_NAME*) &g_anTargets[0])
+#define TARGET_B				((AOE_CONTROLLER_NAME*) &g_anTargets[1])
+
+
+
+// Whether the block's data is cached (a block only remembered on A1out isn't)
+static bool cached(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block)
+{
+	struct CacheBlock* pBlock = read_cache_find(pCache, pController, Block);
+	
+	return pBlock && pBlock->pData;
+}
+
+
+
+static enum CacheQueue queue_of(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block)
+{
+	struct CacheBlock* pBlock = read_cache_find(pCache, pController, Block);
+	
+	return pBlock ? pBlock->Queue : CACHE_QUEUES;
+}
+
+
+
+// Read a block as cache_read and cache_fill would: use it if it's there, otherwise add it
+static void read_block(struct ReadCache* pCache, AOE_CONTROLLER_NAME* pController, UInt64 Block)
+{
+	struct CacheBlock* pBlock = read_cache_find(pCache, pController, Block);
+	UInt8* pData;
+	
+	if ( pBlock && pBlock->pData )
+	{
+		read_cache_touch(pCache, pBlock);
+		return;
+	}
+	
+	pData = read_cache_add(pCache, pController, Block);
+	if ( pData )
+		memset(pData, (int)Block, READ_CACHE_BLOCK_SIZE);
+}
+
+
+
+static bool within_budget(struct ReadCache* pCache)
+{
+	return (pCache->anBlocks[CACHE_A1IN]+pCache->anBlocks[CACHE_AM] <= pCache->nMaxBlocks) &&
+		(pCache->anBlocks[CACHE_A1OUT] <= pCache->nMaxBlocks/READ_CACHE_A1OUT_SHARE);
+}
+
+
+
+static void test_disabled(void)
+{
+	struct ReadCache Cache;
+	
+	read_cache_init(&Cache);
+	CHECK(NULL==read_cache_add(&Cache, TARGET_A, 0));
+	CHECK(NULL==read_cache_find(&Cache, TARGET_A, 0));
+	
+	CHECK(read_cache_set_size(&Cache, BUDGET));
+	CHECK(NULL!=read_cache_add(&Cache, TARGET_A, 0));
+	CHECK(NULL==read_cache_add(&Cache, TARGET_A, 0));			// Already has its data
+	
+	CHECK(read_cache_set_size(&Cache, 0));
+	CHECK(NULL==Cache.pHash);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_A1IN]+Cache.anBlocks[CACHE_AM]+Cache.anBlocks[CACHE_A1OUT], 0);
+}
+
+
+
+static void test_a1in_fifo(void)
+{
+	struct ReadCache Cache;
+	UInt64 Block;
+	
+	read_cache_init(&Cache);
+	read_cache_set_size(&Cache, BUDGET);
+	
+	// With nothing on Am, A1in can use the whole budget
+	for (Block=0; Block<BUDGET; Block++)
+		read_block(&Cache, TARGET_A, Block);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_A1IN], BUDGET);
+	
+	// Reading a block on A1in again doesn't promote it, and doesn't save it from the FIFO
+	read_block(&Cache, TARGET_A, 0);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 0), CACHE_A1IN);
+	
+	read_block(&Cache, TARGET_A, BUDGET);
+	CHECK(!cached(&Cache, TARGET_A, 0));
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 0), CACHE_A1OUT);
+	CHECK(cached(&Cache, TARGET_A, 1));
+	
+	// A block read again after leaving A1in is promoted
+	read_block(&Cache, TARGET_A, 0);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 0), CACHE_AM);
+	CHECK(cached(&Cache, TARGET_A, 0));
+	CHECK(within_budget(&Cache));
+	
+	read_cache_set_size(&Cache, 0);
+}
+
+
+
+static void test_scan_resistance(void)
+{
+	struct ReadCache Cache;
+	UInt64 Block;
+	int n, nHotCached, nBad;
+	
+	read_cache_init(&Cache);
+	read_cache_set_size(&Cache, BUDGET);
+	
+	// Blocks 0-5 are read, pushed out of A1in and read again, so they end up on Am
+	for (Block=0; Block<6; Block++)
+		read_block(&Cache, TARGET_A, Block);
+	for (Block=1000; Block<1000+BUDGET; Block++)
+		read_block(&Cache, TARGET_A, Block);
+	for (Block=0; Block<6; Block++)
+		read_block(&Cache, TARGET_A, Block);
+	
+	nHotCached = 0;
+	for (Block=0; Block<6; Block++)
+		nHotCached += (CACHE_AM==queue_of(&Cache, TARGET_A, Block));
+	CHECK_EQUAL(nHotCached, 6);
+	
+	// A long sequential read only ever takes A1in's share, then cycles through it
+	nBad = 0;
+	for (n=0; n<10000; n++)
+	{
+		read_block(&Cache, TARGET_A, 100000+n);
+		nBad += !within_budget(&Cache);
+	}
+	CHECK_EQUAL(nBad, 0);
+	
+	nHotCached = 0;
+	for (Block=0; Block<6; Block++)
+		nHotCached += cached(&Cache, TARGET_A, Block);
+	CHECK_EQUAL(nHotCached, 6);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_AM], 6);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_A1IN], BUDGET-6);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_A1OUT], BUDGET/READ_CACHE_A1OUT_SHARE);
+	
+	read_cache_set_size(&Cache, 0);
+}
+
+
+
+static void test_am_lru(void)
+{
+	struct ReadCache Cache;
+	UInt64 Block;
+	
+	read_cache_init(&Cache);
+	read_cache_set_size(&Cache, 8);								// A1in 2, A1out 4
+	
+	// Blocks 0 and 1 are pushed out of A1in by 8 others and remembered on A1out
+	read_block(&Cache, TARGET_A, 0);
+	read_block(&Cache, TARGET_A, 1);
+	for (Block=100; Block<108; Block++)
+		read_block(&Cache, TARGET_A, Block);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 0), CACHE_A1OUT);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 1), CACHE_A1OUT);
+	CHECK(!cached(&Cache, TARGET_A, 0));
+	
+	// Read again, they're promoted to Am
+	read_block(&Cache, TARGET_A, 0);
+	read_block(&Cache, TARGET_A, 1);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 0), CACHE_AM);
+	CHECK_EQUAL(queue_of(&Cache, TARGET_A, 1), CACHE_AM);
+	CHECK(within_budget(&Cache));
+	
+	// Block 0 is used again, so block 1 is now the least recently used on Am
+	read_block(&Cache, TARGET_A, 0);
+	
+	// A smaller budget takes from A1in while it's over its share...
+	read_cache_set_size(&Cache, 2);
+	CHECK_EQUAL(Cache.anBlocks[CACHE_A1IN], 0);
+	CHECK(cached(&Cache, TARGET_A, 0));
+	CHECK(cached(&Cache, TARGET_A, 1));
+	
+	// ...then from the least recently used end of Am
+	read_cache_set_size(&Cache, 1);
+	CHECK(cached(&Cache, TARGET_A, 0));
+	CHECK(NULL==read_cache_find(&Cache, TARGET_A, 1));
+	CHECK(within_budget(&Cache));
+	
+	read_cache_set_size(&Cache, 0);
+}
+
+
+
+static void test_targets(void)
+{
+	struct ReadCache Cache;
+	UInt64 Block;
+	int nCount;
+	
+	read_cache_init(&Cache);
+	read_cache_set_size(&Cache, BUDGET);
+	
+	// The same block number on two targets are different blocks
+	read_block(&Cache, TARGET_A, 7);
+	CHECK(!cached(&Cache, TARGET_B, 7));
+	read_block(&Cache, TARGET_B, 7);
+	CHECK(cached(&Cache, TARGET_B, 7));
+	CHECK(read_cache_find(&Cache, TARGET_A, 7)!=read_cache_find(&Cache, TARGET_B, 7));
+	
+	// Dropping a target takes all its blocks, including those only remembered on A1out
+	for (Block=0; Block<2*BUDGET; Block++)
+		read_block(&Cache, (Block & 1) ? TARGET_B : TARGET_A, Block);
+	CHECK(Cache.anBlocks[CACHE_A1OUT]>0);
+	
+	read_cache_drop_target(&Cache, TARGET_A);
+	
+	nCount = 0;
+	for (Block=0; Block<2*BUDGET; Block++)
+		nCount += (NULL!=read_cache_find(&Cache, TARGET_A, Block));
+	CHECK_EQUAL(nCount, 0);
+	
+	nCount = 0;
+	for (Block=0; Block<2*BUDGET; Block++)
+		nCount += cached(&Cache, TARGET_B, Block);
+	CHECK(nCount>0);
+	
+	read_cache_set_size(&Cache, 0);
+}
+
+
+
+int main(void)
+{
+	test_disabled();
+	test_a1in_fifo();
+	test_scan_resistance();
+	test_am_lru();
+	test_targets();
+	
+	return test_result("cache_test");
+}
@@ -0,0 +1,529 @@
+/*
+ *  cc_sim.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Runs the congestion control strategies (the driver's own CongestionControl.cpp and EInterface.cpp) against
+ *  simulated targets, one microsecond at a time.
+ *
+ *  Each target serves frames one at a time from a queue of its Buffer Count frames. A frame that arrives to a full
+ *  queue is dropped. Other hosts' frames can share the queue (cross traffic). The host keeps a fixed number of
+ *  read commands of COMMAND_FRAMES frames running on each target, so command latency includes any time the
+ *  frames spent waiting for the window. Responses, early resends, timeouts and the RTO follow the service:
+ *		- a response calls on_ack with its RTT (0 if the frame had been resent)
+ *		- a frame still missing when the frame CHUNK_REORDER_THRESHOLD after it in the same command has been
+ *		  answered is resent and on_loss is called
+ *		- frames past their deadline are resent and on_timeout is called once for each pass of the timer
+ *	The send credit is worked out as EInterfaces::get_send_credit does.
+ */
+
+#include <stdlib.h>
+#include <IOKit/IOLib.h>
+#include "TestCommon.h"
+#include "CongestionControl.h"
+#include "EInterface.h"
+
+#define SIM_DURATION_US				2000000
+#define SIM_WARMUP_US				100000			// Nothing is measured before this
+#define COMMAND_FRAMES				32				// 256KB reads in 8KB frames
+#define COMMANDS_PER_TARGET			4
+#define CHUNK_REORDER_THRESHOLD		3				// As AoEController.h
+
+#define RTO_MIN_US					1000			// As AoEService.cpp
+#define RTO_MAX_US					10000
+
+#define MAX_TARGETS					4
+#define FRAME_RING					16384			// Frames are looked up by sequence number in a ring this long
+#define MAX_QUEUE					512
+#define PIPE_SIZE					65536
+#define CROSS_TRAFFIC				-1				// Frame number of other hosts' frames in a target's queue
+#define MAX_LATENCIES				200000
+
+struct SimTarget
+{
+	// Configuration
+	int			nTargetNumber;			// The targets are slots of one shelf, each with its own window
+	int			nBufferCount;			// Advertised to the host and the length of the target's queue
+	int			nServiceUS;				// Time to serve one frame
+	int			nCrossPerMille;			// Chance of another host's frame arriving each microsecond (in 1/1000)
+
+	// Target state
+	int			anQueue[MAX_QUEUE];		// Frame numbers waiting to be served
+	int			nQueueHead, nQueueLength;
+	int			nServiceLeftUS;
+	int			nServing;
+
+	// Host state
+	struct SimFrame*	pFrames;
+	int			nNextSequence;			// Next frame to hand to the send queue
+	int			nNextToSend;			// Next frame in the send queue
+	uint64_t	NextDeadline;			// No frame times out before this
+	int			anRetryChunk[COMMANDS_PER_TARGET];
+	int			anFramesLeft[COMMANDS_PER_TARGET];
+	int			anCommandSequence[COMMANDS_PER_TARGET];
+	uint64_t	aCommandStart[COMMANDS_PER_TARGET];
+
+	// Results
+	int			nCommandsDone;
+	int			nDrops;
+	int			nLatencies;
+	uint64_t*	pLatencies;
+	uint64_t	QueueSum;
+	uint64_t	CwndSum;
+	uint64_t	nSamples;
+};
+
+struct SimFrame
+{
+	bool		fInFlight;				// Sent and not yet answered
+	bool		fResent;
+	uint64_t	TimeSent;
+	uint64_t	Deadline;
+	int			nCommand;
+};
+
+struct PipeEntry
+{
+	uint64_t	Time;
+	int			nTarget;
+	int			nFrame;
+};
+
+// The network between host and targets. The delay is fixed, so each direction is a FIFO
+struct Pipe
+{
+	struct PipeEntry	aEntries[PIPE_SIZE];
+	int					nHead, nLength;
+};
+
+struct Simulation
+{
+	EInterface*			pInterface;
+	CongestionControl*	pStrategy;
+	int					nMaxUserWindow;
+	int					nOneWayUS;
+	int					nTargets;
+	struct SimTarget	aTargets[MAX_TARGETS];
+	struct Pipe			ToTargets;
+	struct Pipe			ToHost;
+	uint64_t			Now;
+	UInt32				Random;
+	int					nNextTarget;		// The send loop starts here, so a shared window is handed out in turn
+
+	// RTO as AOE_KEXT_NAME::update_rto
+	SInt64				nScaledRTTavg;
+	SInt64				nScaledRTTvar;
+	uint64_t			nRTO_us;
+
+	int					nTimeouts;
+	int					nEarlyResends;
+};
+
+
+
+static void pipe_push(struct Pipe* pPipe, uint64_t Time, int nTarget, int nFrame)
+{
+	struct PipeEntry* pEntry;
+
+	if ( pPipe->nLength>=PIPE_SIZE )
+		return;
+
+	pEntry = &pPipe->aEntries[(pPipe->nHead+pPipe->nLength++)%PIPE_SIZE];
+	pEntry->Time = Time;
+	pEntry->nTarget = nTarget;
+	pEntry->nFrame = nFrame;
+}
+
+
+
+static struct PipeEntry* pipe_due(struct Pipe* pPipe, uint64_t Now)
+{
+	struct PipeEntry* pEntry;
+
+	if ( 0==pPipe->nLength )
+		return NULL;
+
+	pEntry = &pPipe->aEntries[pPipe->nHead];
+	if ( pEntry->Time>Now )
+		return NULL;
+
+	pPipe->nHead = (pPipe->nHead+1)%PIPE_SIZE;
+	--pPipe->nLength;
+	return pEntry;
+}
+
+
+
+static void update_rto(struct Simulation* pSim, uint64_t nRTT_ns)
+{
+	SInt64 nErr;
+
+	nErr = (SInt64)nRTT_ns-pSim->nScaledRTTavg;
+	pSim->nScaledRTTavg += nErr>>3;
+	if ( nErr<0 )
+		nErr = -nErr;
+	nErr -= pSim->nScaledRTTvar;
+	pSim->nScaledRTTvar += nErr>>2;
+
+	pSim->nRTO_us = MIN(MAX((pSim->nScaledRTTavg+(pSim->nScaledRTTvar<<2))/1000, RTO_MIN_US), RTO_MAX_US);
+}
+
+
+
+static int send_credit(struct Simulation* pSim, int nTargetNumber)
+{
+	struct TargetWindow* pWindow;
+	int nMaxOutstanding;
+
+	if ( pSim->pStrategy->per_target() )
+	{
+		pWindow = pSim->pInterface->get_target_window(nTargetNumber);
+		nMaxOutstanding = MIN((int)pWindow->nCwd, pSim->pInterface->get_max_oustanding(nTargetNumber));
+		return MIN(nMaxOutstanding - pWindow->nOutstanding, pSim->nMaxUserWindow - pSim->pInterface->m_nOutstandingCount);
+	}
+
+	nMaxOutstanding = MIN((int)pSim->pInterface->m_nCwd, pSim->pInterface->get_max_oustanding(nTargetNumber));
+	nMaxOutstanding = MIN(nMaxOutstanding, pSim->nMaxUserWindow);
+
+	return nMaxOutstanding - pSim->pInterface->m_nOutstandingCount;
+}
+
+
+
+static void transmit(struct Simulation* pSim, int nTarget, int nSequence)
+{
+	struct SimFrame* pFrame = &pSim->aTargets[nTarget].pFrames[nSequence%FRAME_RING];
+
+	pFrame->TimeSent = pSim->Now;
+	pFrame->Deadline = pSim->Now+pSim->nRTO_us;
+	pSim->aTargets[nTarget].NextDeadline = MIN(pSim->aTargets[nTarget].NextDeadline, pFrame->Deadline);
+	pipe_push(&pSim->ToTargets, pSim->Now+pSim->nOneWayUS, nTarget, nSequence);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * The frame's outstanding count is only given back once, whether it's answered or resent first (as the service does)
+ ---------------------------------------------------------------------------*/
+static void resend(struct Simulation* pSim, int nTarget, int nSequence)
+{
+	struct SimFrame* pFrame = &pSim->aTargets[nTarget].pFrames[nSequence%FRAME_RING];
+
+	if ( !pFrame->fResent )
+	{
+		--pSim->pInterface->m_nOutstandingCount;
+		--pSim->pInterface->get_target_window(pSim->aTargets[nTarget].nTargetNumber)->nOutstanding;
+	}
+
+	pFrame->fResent = TRUE;
+	transmit(pSim, nTarget, nSequence);
+}
+
+
+
+static void start_command(struct Simulation* pSim, int nTarget, int nCommand)
+{
+	struct SimTarget* pTarget = &pSim->aTargets[nTarget];
+	int n;
+
+	pTarget->anCommandSequence[nCommand] = pTarget->nNextSequence;
+	pTarget->anFramesLeft[nCommand] = COMMAND_FRAMES;
+	pTarget->anRetryChunk[nCommand] = 0;
+	pTarget->aCommandStart[nCommand] = pSim->Now;
+
+	for (n=0; n<COMMAND_FRAMES; n++)
+	{
+		pTarget->pFrames[(pTarget->nNextSequence+n)%FRAME_RING].nCommand = nCommand;
+		pTarget->pFrames[(pTarget->nNextSequence+n)%FRAME_RING].fInFlight = FALSE;
+	}
+
+	pTarget->nNextSequence += COMMAND_FRAMES;
+}
+
+
+
+static void receive_response(struct Simulation* pSim, int nTarget, int nSequence)
+{
+	struct SimTarget* pTarget = &pSim->aTargets[nTarget];
+	struct SimFrame* pFrame = &pTarget->pFrames[nSequence%FRAME_RING];
+	uint64_t RTT_ns;
+	int nCommand, nChunk, nBase;
+
+	// A duplicate response for a frame that was resent
+	if ( !pFrame->fInFlight )
+		return;
+
+	pFrame->fInFlight = FALSE;
+	RTT_ns = 0;
+	if ( !pFrame->fResent )
+	{
+		--pSim->pInterface->m_nOutstandingCount;
+		--pSim->pInterface->get_target_window(pTarget->nTargetNumber)->nOutstanding;
+		RTT_ns = (pSim->Now-pFrame->TimeSent)*1000;
+		update_rto(pSim, RTT_ns);
+	}
+
+	pSim->pStrategy->on_ack(pSim->pInterface, pTarget->nTargetNumber, RTT_ns);
+
+	// Frames of the same command that should have arrived before this one are resent early
+	nCommand = pFrame->nCommand;
+	nBase = pTarget->anCommandSequence[nCommand];
+	nChunk = nSequence-nBase;
+	while ( pTarget->anRetryChunk[nCommand]+CHUNK_REORDER_THRESHOLD <= nChunk )
+	{
+		if ( pTarget->pFrames[(nBase+pTarget->anRetryChunk[nCommand])%FRAME_RING].fInFlight && !pTarget->pFrames[(nBase+pTarget->anRetryChunk[nCommand])%FRAME_RING].fResent )
+		{
+			pSim->pStrategy->on_loss(pSim->pInterface, pTarget->nTargetNumber);
+			resend(pSim, nTarget, nBase+pTarget->anRetryChunk[nCommand]);
+			++pSim->nEarlyResends;
+		}
+		++pTarget->anRetryChunk[nCommand];
+	}
+
+	if ( 0==--pTarget->anFramesLeft[nCommand] )
+	{
+		if ( pSim->Now>=SIM_WARMUP_US )
+		{
+			++pTarget->nCommandsDone;
+			if ( pTarget->nLatencies<MAX_LATENCIES )
+				pTarget->pLatencies[pTarget->nLatencies++] = pSim->Now-pTarget->aCommandStart[nCommand];
+		}
+		start_command(pSim, nTarget, nCommand);
+	}
+}
+
+
+
+static void run_targets(struct Simulation* pSim)
+{
+	struct SimTarget* pTarget;
+	struct PipeEntry* pEntry;
+	int n;
+
+	while ( NULL!=(pEntry=pipe_due(&pSim->ToTargets, pSim->Now)) )
+	{
+		pTarget = &pSim->aTargets[pEntry->nTarget];
+		if ( pTarget->nQueueLength>=pTarget->nBufferCount )
+			++pTarget->nDrops;
+		else
+			pTarget->anQueue[(pTarget->nQueueHead+pTarget->nQueueLength++)%MAX_QUEUE] = pEntry->nFrame;
+	}
+
+	for (n=0; n<pSim->nTargets; n++)
+	{
+		pTarget = &pSim->aTargets[n];
+
+		if ( pTarget->nCrossPerMille && ((int)(test_random(&pSim->Random)%1000) < pTarget->nCrossPerMille) && (pTarget->nQueueLength<pTarget->nBufferCount) )
+			pTarget->anQueue[(pTarget->nQueueHead+pTarget->nQueueLength++)%MAX_QUEUE] = CROSS_TRAFFIC;
+
+		if ( pTarget->nServiceLeftUS && (0==--pTarget->nServiceLeftUS) && (CROSS_TRAFFIC!=pTarget->nServing) )
+			pipe_push(&pSim->ToHost, pSim->Now+pSim->nOneWayUS, n, pTarget->nServing);
+
+		if ( (0==pTarget->nServiceLeftUS) && pTarget->nQueueLength )
+		{
+			pTarget->nServing = pTarget->anQueue[pTarget->nQueueHead];
+			pTarget->nQueueHead = (pTarget->nQueueHead+1)%MAX_QUEUE;
+			--pTarget->nQueueLength;
+			pTarget->nServiceLeftUS = pTarget->nServiceUS;
+		}
+	}
+}
+
+
+
+static void run_host(struct Simulation* pSim)
+{
+	struct SimTarget* pTarget;
+	struct PipeEntry* pEntry;
+	struct SimFrame* pFrame;
+	bool fTimedOut, fSent;
+	int n, m, nCommand, nSequence;
+
+	while ( NULL!=(pEntry=pipe_due(&pSim->ToHost, pSim->Now)) )
+		receive_response(pSim, pEntry->nTarget, pEntry->nFrame);
+
+	// Retransmit timer. Only the frames of the running commands can be in flight
+	fTimedOut = FALSE;
+	for (n=0; n<pSim->nTargets; n++)
+	{
+		pTarget = &pSim->aTargets[n];
+		if ( pTarget->NextDeadline>pSim->Now )
+			continue;
+		
+		pTarget->NextDeadline = (uint64_t)-1;
+		for (nCommand=0; nCommand<COMMANDS_PER_TARGET; nCommand++)
+			for (nSequence=pTarget->anCommandSequence[nCommand]; (nSequence<pTarget->anCommandSequence[nCommand]+COMMAND_FRAMES) && (nSequence<pTarget->nNextToSend); nSequence++)
+			{
+				pFrame = &pTarget->pFrames[nSequence%FRAME_RING];
+				if ( !pFrame->fInFlight )
+					continue;
+				
+				if ( pFrame->Deadline<=pSim->Now )
+				{
+					if ( !fTimedOut )
+					{
+						pSim->pStrategy->on_timeout(pSim->pInterface, pTarget->nTargetNumber);
+						++pSim->nTimeouts;
+						fTimedOut = TRUE;
+					}
+					resend(pSim, n, nSequence);
+				}
+				pTarget->NextDeadline = MIN(pTarget->NextDeadline, pFrame->Deadline);
+			}
+	}
+
+	// Send what the window allows, a frame from each target in turn
+	do
+	{
+		fSent = FALSE;
+		for (m=0; m<pSim->nTargets; m++)
+		{
+			n = (pSim->nNextTarget+m)%pSim->nTargets;
+			pTarget = &pSim->aTargets[n];
+			if ( (pTarget->nNextToSend<pTarget->nNextSequence) && (send_credit(pSim, pTarget->nTargetNumber)>0) )
+			{
+				pFrame = &pTarget->pFrames[pTarget->nNextToSend%FRAME_RING];
+				pFrame->fInFlight = TRUE;
+				pFrame->fResent = FALSE;
+				++pSim->pInterface->m_nOutstandingCount;
+				++pSim->pInterface->get_target_window(pTarget->nTargetNumber)->nOutstanding;
+				transmit(pSim, n, pTarget->nNextToSend++);
+				pSim->nNextTarget = (n+1)%pSim->nTargets;
+				fSent = TRUE;
+				break;
+			}
+		}
+	}
+	while ( fSent );
+}
+
+
+
+static int compare_latency(const void* p1, const void* p2)
+{
+	uint64_t n1 = *(const uint64_t*) p1;
+	uint64_t n2 = *(const uint64_t*) p2;
+
+	return (n1<n2) ? -1 : (n1>n2);
+}
+
+
+
+struct TargetConfig
+{
+	int		nBufferCount;
+	int		nServiceUS;
+	int		nCrossPerMille;
+};
+
+/*---------------------------------------------------------------------------
+ * Run one strategy against a set of targets and print a line of results for each target
+ ---------------------------------------------------------------------------*/
+static void simulate(CongestionControl* pStrategy, const struct TargetConfig* pConfigs, int nTargets)
+{
+	struct Simulation* pSim;
+	struct SimTarget* pTarget;
+	uint64_t nMeasuredUS;
+	double Mean;
+	int n, m;
+
+	pSim = (struct Simulation*) calloc(1, sizeof(struct Simulation));
+	pSim->pInterface = new EInterface;
+	pSim->pStrategy = pStrategy;
+	pSim->nMaxUserWindow = DEFAULT_CONGESTION_WINDOW;
+	pSim->nOneWayUS = 25;
+	pSim->nTargets = nTargets;
+	pSim->Random = 0x2545F491;
+	pSim->nRTO_us = RTO_MAX_US;
+
+	for (n=0; n<nTargets; n++)
+	{
+		pTarget = &pSim->aTargets[n];
+		pTarget->nTargetNumber = TARGET_NUMBER(1, n);
+		pTarget->nBufferCount = pConfigs[n].nBufferCount;
+		pTarget->nServiceUS = pConfigs[n].nServiceUS;
+		pTarget->nCrossPerMille = pConfigs[n].nCrossPerMille;
+		pTarget->pFrames = (struct SimFrame*) calloc(FRAME_RING, sizeof(struct SimFrame));
+		pTarget->pLatencies = (uint64_t*) calloc(MAX_LATENCIES, sizeof(uint64_t));
+
+		pSim->pInterface->set_max_oustanding(pTarget->nTargetNumber, pTarget->nBufferCount);
+	}
+
+	pSim->pInterface->m_pCongestionControl = pStrategy;
+	pStrategy->reset(pSim->pInterface);
+
+	for (n=0; n<nTargets; n++)
+		for (m=0; m<COMMANDS_PER_TARGET; m++)
+			start_command(pSim, n, m);
+
+	for (pSim->Now=0; pSim->Now<SIM_DURATION_US; pSim->Now++)
+	{
+		run_targets(pSim);
+		run_host(pSim);
+
+		if ( pSim->Now>=SIM_WARMUP_US )
+			for (n=0; n<nTargets; n++)
+			{
+				pTarget = &pSim->aTargets[n];
+				pTarget->QueueSum += pTarget->nQueueLength;
+				pTarget->CwndSum += pStrategy->per_target() ? pSim->pInterface->get_target_window(pTarget->nTargetNumber)->nCwd : pSim->pInterface->m_nCwd;
+				++pTarget->nSamples;
+			}
+	}
+
+	nMeasuredUS = SIM_DURATION_US-SIM_WARMUP_US;
+	for (n=0; n<nTargets; n++)
+	{
+		pTarget = &pSim->aTargets[n];
+
+		qsort(pTarget->pLatencies, pTarget->nLatencies, sizeof(uint64_t), compare_latency);
+		Mean = 0;
+		for (m=0; m<pTarget->nLatencies; m++)
+			Mean += pTarget->pLatencies[m];
+		Mean = pTarget->nLatencies ? Mean/pTarget->nLatencies : 0;
+
+		printf("  %-10s target %d (%3dus/frame, %3d buffers, %2d%% other hosts): %6.1f MB/s  latency mean %6.2fms p99 %6.2fms  queue %5.1f  cwnd %5.1f  drops %6d\n",
+			   pStrategy->name(), n+1, pTarget->nServiceUS, pTarget->nBufferCount, pTarget->nCrossPerMille*pTarget->nServiceUS/10,
+			   (double)pTarget->nCommandsDone*COMMAND_FRAMES*8192/nMeasuredUS,
+			   Mean/1000, pTarget->nLatencies ? (double)pTarget->pLatencies[(pTarget->nLatencies*99)/100]/1000 : 0.0,
+			   (double)pTarget->QueueSum/pTarget->nSamples, (double)pTarget->CwndSum/pTarget->nSamples, pTarget->nDrops);
+
+		free(pTarget->pFrames);
+		free(pTarget->pLatencies);
+	}
+	printf("  %-10s %d timer passes with timeouts, %d early resends\n", pStrategy->name(), pSim->nTimeouts, pSim->nEarlyResends);
+
+	delete pSim->pInterface;
+	free(pSim);
+}
+
+
+
+static void compare(const char* pszScenario, const struct TargetConfig* pConfigs, int nTargets)
+{
+	SlowStartCongestionControl SlowStart;
+	DelayCongestionControl Delay;
+
+	printf("%s\n", pszScenario);
+	simulate(&SlowStart, pConfigs, nTargets);
+	simulate(&Delay, pConfigs, nTargets);
+	printf("\n");
+}
+
+
+
+int main(void)
+{
+	static const struct TargetConfig Idle[] = { { 64, 16, 0 } };
+	static const struct TargetConfig Shared[] = { { 32, 16, 40 } };
+	static const struct TargetConfig FastAndSlow[] = { { 64, 8, 0 }, { 64, 64, 0 } };
+
+	printf("%d read commands of %d frames kept running on each target, %dus each way on the network\n\n", COMMANDS_PER_TARGET, COMMAND_FRAMES, 25);
+
+	compare("One target, nothing else using it", Idle, numberof(Idle));
+	compare("One target with 32 buffers, other hosts sending to it", Shared, numberof(Shared));
+	compare("A fast and a slow target on the same interface", FastAndSlow, numberof(FastAndSlow));
+
+	return 0;
+}
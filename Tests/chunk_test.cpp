@@ -0,0 +1,172 @@
+/*
+ *  chunk_test.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Received-chunk bitmaps, matching responses to a command's chunks and picking the chunks to resend early
+ */
+
+#include <string.h>
+#include "TestCommon.h"
+#include "ChunkTracking.h"
+
+#define MAX_CHUNKS			256
+
+
+
+static void test_bitmap(void)
+{
+	UInt32 aBitmap[CHUNK_BITMAP_WORDS(MAX_CHUNKS)];
+	int n, nSet;
+	
+	CHECK_EQUAL(CHUNK_BITMAP_WORDS(0), 0);
+	CHECK_EQUAL(CHUNK_BITMAP_WORDS(1), 1);
+	CHECK_EQUAL(CHUNK_BITMAP_WORDS(32), 1);
+	CHECK_EQUAL(CHUNK_BITMAP_WORDS(33), 2);
+	
+	bzero(aBitmap, sizeof(aBitmap));
+	
+	// Each bit is its own, including the top bit of each word
+	CHUNK_SET(aBitmap, 31);
+	CHECK_EQUAL(aBitmap[0], 0x80000000);
+	CHECK_EQUAL(aBitmap[1], 0);
+	CHUNK_SET(aBitmap, 32);
+	CHECK_EQUAL(aBitmap[1], 1);
+	
+	for (n=0; n<MAX_CHUNKS; n+=3)
+		CHUNK_SET(aBitmap, n);
+	
+	nSet = 0;
+	for (n=0; n<MAX_CHUNKS; n++)
+		nSet += (0!=CHUNK_IS_SET(aBitmap, n)) != ((0==n%3) || (31==n) || (32==n));
+	CHECK_EQUAL(nSet, 0);
+}
+
+
+
+static void test_chunk_from_tag(void)
+{
+	UInt32 BaseTag;
+	
+	BaseTag = TAG_MAKE(5, 2, 100);
+	CHECK_EQUAL(chunk_from_tag(BaseTag, BaseTag, 16), 0);
+	CHECK_EQUAL(chunk_from_tag(CHUNK_TAG(BaseTag, 15), BaseTag, 16), 15);
+	
+	// Past the end of the command, or before its start
+	CHECK_EQUAL(chunk_from_tag(CHUNK_TAG(BaseTag, 16), BaseTag, 16), -1);
+	CHECK_EQUAL(chunk_from_tag(CHUNK_TAG(BaseTag, -1), BaseTag, 16), -1);
+	
+	// Another target's command, or an earlier command that used the same slot
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(6, 2, 100), BaseTag, 16), -1);
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(5, 1, 100), BaseTag, 16), -1);
+	CHECK_EQUAL(chunk_from_tag(BaseTag | TAG_USER_MASK, BaseTag, 16), -1);
+	
+	// A command whose sequence numbers wrap
+	BaseTag = TAG_MAKE(5, 2, TAG_SEQUENCE_MASK-1);
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(5, 2, TAG_SEQUENCE_MASK), BaseTag, 4), 1);
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(5, 2, 0), BaseTag, 4), 2);
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(5, 2, 1), BaseTag, 4), 3);
+	CHECK_EQUAL(chunk_from_tag(TAG_MAKE(5, 2, 2), BaseTag, 4), -1);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Deliver the chunks in aOrder, as mark_chunk_received and resend_missing_chunks do, and record what was resent
+ ---------------------------------------------------------------------------*/
+static int deliver(const int* aOrder, int nCount, int* aResent)
+{
+	UInt32 aReceived[CHUNK_BITMAP_WORDS(MAX_CHUNKS)];
+	int n, nRetryChunk, nLost, nResent;
+	
+	bzero(aReceived, sizeof(aReceived));
+	nRetryChunk = 0;
+	nResent = 0;
+	
+	for (n=0; n<nCount; n++)
+	{
+		if ( CHUNK_IS_SET(aReceived, aOrder[n]) )
+			continue;
+		
+		CHUNK_SET(aReceived, aOrder[n]);
+		while ( -1!=(nLost=chunk_next_lost(aReceived, &nRetryChunk, aOrder[n])) )
+			aResent[nResent++] = nLost;
+	}
+	
+	return nResent;
+}
+
+
+
+static void test_resends(void)
+{
+	static const int aInOrder[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	static const int aReordered[] = { 1, 2, 0, 4, 5, 3, 7, 6 };		// Never more than CHUNK_REORDER_THRESHOLD-1 late
+	static const int aLost[] = { 0, 2, 3, 4, 5, 6, 7, 1 };			// 1 is lost, its resend arrives last
+	static const int aTwoLost[] = { 1, 3, 4, 5, 6, 7, 0, 2 };
+	static const int aDuplicate[] = { 1, 2, 3, 3, 3, 4, 0 };		// A duplicate doesn't count as a later chunk
+	int aResent[MAX_CHUNKS];
+	int nResent;
+	
+	CHECK_EQUAL(deliver(aInOrder, numberof(aInOrder), aResent), 0);
+	CHECK_EQUAL(deliver(aReordered, numberof(aReordered), aResent), 0);
+	
+	// The lost chunk is resent once, when the chunk CHUNK_REORDER_THRESHOLD after it arrives
+	nResent = deliver(aLost, numberof(aLost), aResent);
+	CHECK_EQUAL(nResent, 1);
+	CHECK_EQUAL(aResent[0], 1);
+	
+	nResent = deliver(aTwoLost, numberof(aTwoLost), aResent);
+	CHECK_EQUAL(nResent, 2);
+	CHECK_EQUAL(aResent[0], 0);
+	CHECK_EQUAL(aResent[1], 2);
+	
+	nResent = deliver(aDuplicate, numberof(aDuplicate), aResent);
+	CHECK_EQUAL(nResent, 1);
+	CHECK_EQUAL(aResent[0], 0);
+}
+
+
+
+static void test_resend_timing(void)
+{
+	UInt32 aReceived[CHUNK_BITMAP_WORDS(MAX_CHUNKS)];
+	int nRetryChunk;
+	
+	bzero(aReceived, sizeof(aReceived));
+	nRetryChunk = 0;
+	
+	// Chunk 0 is missing. Chunks up to CHUNK_REORDER_THRESHOLD-1 don't give it up...
+	CHUNK_SET(aReceived, CHUNK_REORDER_THRESHOLD-1);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, CHUNK_REORDER_THRESHOLD-1), -1);
+	CHECK_EQUAL(nRetryChunk, 0);
+	
+	// ...the next one does, and only chunk 0 is that far behind
+	CHUNK_SET(aReceived, CHUNK_REORDER_THRESHOLD);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, CHUNK_REORDER_THRESHOLD), 0);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, CHUNK_REORDER_THRESHOLD), -1);
+	CHECK_EQUAL(nRetryChunk, 1);
+	
+	// A chunk far ahead gives up everything missing before it in one go, received chunks are skipped
+	CHUNK_SET(aReceived, MAX_CHUNKS-1);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, MAX_CHUNKS-1), 1);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, MAX_CHUNKS-1), CHUNK_REORDER_THRESHOLD+1);
+	CHECK_EQUAL(chunk_next_lost(aReceived, &nRetryChunk, MAX_CHUNKS-1), CHUNK_REORDER_THRESHOLD+2);
+	CHECK_EQUAL(nRetryChunk, CHUNK_REORDER_THRESHOLD+3);
+	while ( -1!=chunk_next_lost(aReceived, &nRetryChunk, MAX_CHUNKS-1) )
+		;
+	CHECK_EQUAL(nRetryChunk, MAX_CHUNKS-CHUNK_REORDER_THRESHOLD);
+}
+
+
+
+int main(void)
+{
+	test_bitmap();
+	test_chunk_from_tag();
+	test_resends();
+	test_resend_timing();
+	
+	return test_result("chunk_test");
+}
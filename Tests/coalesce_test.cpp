@@ -0,0 +1,151 @@
+/*
+ *  coalesce_test.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Where runs of adjacent writes are split when they're merged into single transfers
+ */
+
+#include "TestCommon.h"
+#include "../Shared/AoEcommon.h"
+#include "WriteCoalescing.h"
+
+#define MAX_TRANSFER_SIZE			(256*1024)		// As DEFAULT_MAX_TRANSFER_SIZE
+#define SECTOR_SIZE					kATADefaultSectorSize
+
+struct Write
+{
+	UInt64		LBA;
+	UInt64		Bytes;
+};
+
+
+
+/*---------------------------------------------------------------------------
+ * Gather the writes as gather_write does and record how many go into each transfer. Returns the number of transfers
+ ---------------------------------------------------------------------------*/
+static int gather(const struct Write* aWrites, int nWrites, UInt64 MaxTransferSize, int* anTransferCommands)
+{
+	UInt64 NextLBA, Bytes;
+	int n, nCommands, nTransfers;
+	
+	nTransfers = 0;
+	nCommands = 0;
+	NextLBA = Bytes = 0;
+	
+	for (n=0; n<nWrites; n++)
+	{
+		if ( !coalesce_can_add(nCommands, NextLBA, Bytes, aWrites[n].LBA, aWrites[n].Bytes, MaxTransferSize) )
+		{
+			anTransferCommands[nTransfers++] = nCommands;
+			nCommands = 0;
+		}
+		
+		if ( 0==nCommands )
+		{
+			Bytes = 0;
+			NextLBA = aWrites[n].LBA;
+		}
+		
+		++nCommands;
+		Bytes += aWrites[n].Bytes;
+		NextLBA += aWrites[n].Bytes/SECTOR_SIZE;
+	}
+	
+	if ( nCommands )
+		anTransferCommands[nTransfers++] = nCommands;
+	
+	return nTransfers;
+}
+
+
+
+static void test_adjacency(void)
+{
+	static const struct Write aSequential[] = { { 100, 4096 }, { 108, 4096 }, { 116, 8192 }, { 132, 512 } };
+	static const struct Write aGap[] = { { 100, 4096 }, { 109, 4096 } };					// One sector apart
+	static const struct Write aOverlap[] = { { 100, 4096 }, { 107, 4096 } };				// Shares a sector
+	static const struct Write aBackwards[] = { { 108, 4096 }, { 100, 4096 } };				// Adjacent, but in the wrong order
+	static const struct Write aRestart[] = { { 0, 4096 }, { 8, 4096 }, { 1000, 4096 }, { 1008, 4096 } };
+	int anTransfers[64];
+	
+	CHECK_EQUAL(gather(aSequential, numberof(aSequential), MAX_TRANSFER_SIZE, anTransfers), 1);
+	CHECK_EQUAL(anTransfers[0], 4);
+	
+	CHECK_EQUAL(gather(aGap, numberof(aGap), MAX_TRANSFER_SIZE, anTransfers), 2);
+	CHECK_EQUAL(gather(aOverlap, numberof(aOverlap), MAX_TRANSFER_SIZE, anTransfers), 2);
+	CHECK_EQUAL(gather(aBackwards, numberof(aBackwards), MAX_TRANSFER_SIZE, anTransfers), 2);
+	
+	CHECK_EQUAL(gather(aRestart, numberof(aRestart), MAX_TRANSFER_SIZE, anTransfers), 2);
+	CHECK_EQUAL(anTransfers[0], 2);
+	CHECK_EQUAL(anTransfers[1], 2);
+	
+	// The first write of a run can always be taken
+	CHECK(coalesce_can_add(0, 0, 0, 12345, MAX_TRANSFER_SIZE, MAX_TRANSFER_SIZE));
+}
+
+
+
+static void test_command_limit(void)
+{
+	struct Write aWrites[2*MAX_COALESCED_WRITES+1];
+	int anTransfers[64];
+	int n;
+	
+	for (n=0; n<(int)numberof(aWrites); n++)
+	{
+		aWrites[n].LBA = n;
+		aWrites[n].Bytes = SECTOR_SIZE;
+	}
+	
+	CHECK_EQUAL(gather(aWrites, numberof(aWrites), MAX_TRANSFER_SIZE, anTransfers), 3);
+	CHECK_EQUAL(anTransfers[0], MAX_COALESCED_WRITES);
+	CHECK_EQUAL(anTransfers[1], MAX_COALESCED_WRITES);
+	CHECK_EQUAL(anTransfers[2], 1);
+	
+	CHECK(coalesce_has_room(MAX_COALESCED_WRITES-1, SECTOR_SIZE, MAX_TRANSFER_SIZE));
+	CHECK(!coalesce_has_room(MAX_COALESCED_WRITES, SECTOR_SIZE, MAX_TRANSFER_SIZE));
+}
+
+
+
+static void test_size_limits(void)
+{
+	static const struct Write aExact[] = { { 0, 128*1024 }, { 256, 128*1024 } };				// Fills the transfer exactly
+	static const struct Write aOver[] = { { 0, 128*1024 }, { 256, 128*1024 }, { 512, 512 } };	// ...and a sector more
+	struct Write aLarge[3];
+	int anTransfers[64];
+	UInt64 MaxTransferSize;
+	
+	CHECK_EQUAL(gather(aExact, numberof(aExact), MAX_TRANSFER_SIZE, anTransfers), 1);
+	CHECK(!coalesce_has_room(2, MAX_TRANSFER_SIZE, MAX_TRANSFER_SIZE));
+	CHECK(coalesce_has_room(2, MAX_TRANSFER_SIZE-SECTOR_SIZE, MAX_TRANSFER_SIZE));
+	
+	CHECK_EQUAL(gather(aOver, numberof(aOver), MAX_TRANSFER_SIZE, anTransfers), 2);
+	CHECK_EQUAL(anTransfers[0], 2);
+	CHECK_EQUAL(anTransfers[1], 1);
+	
+	// A target with a huge transfer size is still held to what a 48-bit sector count can describe
+	MaxTransferSize = 64ULL*1024*1024;
+	aLarge[0].LBA = 0;
+	aLarge[0].Bytes = 0x8000*SECTOR_SIZE;
+	aLarge[1].LBA = 0x8000;
+	aLarge[1].Bytes = 0x7FFF*SECTOR_SIZE;
+	aLarge[2].LBA = 0xFFFF;
+	aLarge[2].Bytes = SECTOR_SIZE;
+	CHECK_EQUAL(gather(aLarge, numberof(aLarge), MaxTransferSize, anTransfers), 2);
+	CHECK_EQUAL(anTransfers[0], 2);
+	CHECK(!coalesce_has_room(2, MAX_COALESCED_SECTORS*SECTOR_SIZE, MaxTransferSize));
+}
+
+
+
+int main(void)
+{
+	test_adjacency();
+	test_command_limit();
+	test_size_limits();
+	
+	return test_result("coalesce_test");
+}
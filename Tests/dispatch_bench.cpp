@@ -0,0 +1,200 @@
+/*
+ *  dispatch_bench.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Times finding the controller for a response's (shelf, slot) with the dispatch table, against walking the list of
+ *  controllers as the driver used to. Also checks the table's adds, removes and lookups of targets that aren't there.
+ */
+
+#include <stdlib.h>
+#include "TestCommon.h"
+#include "DispatchTable.h"
+
+#define MAX_TARGETS					4096
+#define LOOKUPS						1000000
+#define LIST_LOOKUPS				20000
+
+// Stands in for a controller. The table only stores the pointer, the list walk has to ask each one its address
+struct Target
+{
+	int		nShelf;
+	int		nSlot;
+};
+
+static struct Target		g_aTargets[MAX_TARGETS];
+static struct Target*		g_apList[MAX_TARGETS];
+
+
+
+static struct Target* find_in_list(int nTargets, int nShelf, int nSlot)
+{
+	int n;
+	
+	for (n=0; n<nTargets; n++)
+		if ( (g_apList[n]->nShelf==nShelf) && (g_apList[n]->nSlot==nSlot) )
+			return g_apList[n];
+	
+	return NULL;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Place nTargets at random addresses (no two the same). fDense puts them on the lowest shelves, as a single
+ * storage array numbers its targets, otherwise the shelves are spread over the whole range
+ ---------------------------------------------------------------------------*/
+static void place_targets(int nTargets, bool fDense, UInt32* pRandom)
+{
+	int n, m;
+	bool fClash;
+	
+	for (n=0; n<nTargets; n++)
+	{
+		do
+		{
+			if ( fDense )
+			{
+				g_aTargets[n].nShelf = test_random(pRandom)%MAX(1, nTargets/16);
+				g_aTargets[n].nSlot = test_random(pRandom)%16;
+			}
+			else
+			{
+				g_aTargets[n].nShelf = test_random(pRandom)%(MAX_SHELFS-1);
+				g_aTargets[n].nSlot = test_random(pRandom)%(MAX_SLOTS-1);
+			}
+			
+			fClash = FALSE;
+			for (m=0; m<n; m++)
+				if ( (g_aTargets[m].nShelf==g_aTargets[n].nShelf) && (g_aTargets[m].nSlot==g_aTargets[n].nSlot) )
+					fClash = TRUE;
+		}
+		while ( fClash );
+		
+		g_apList[n] = &g_aTargets[n];
+	}
+}
+
+
+
+static bool run(int nTargets, bool fDense)
+{
+	struct DispatchTable Table = { NULL, 0 };
+	struct Target* pTarget;
+	UInt32 Random = 0x9E3779B9;
+	uint64_t Start, TableNS, ListNS;
+	size_t TableBytes;
+	bool fOK = TRUE;
+	int n, nShelf, nRange;
+	
+	place_targets(nTargets, fDense, &Random);
+	
+	for (n=0; n<nTargets; n++)
+		fOK &= (0==dispatch_add(&Table, g_aTargets[n].nShelf, g_aTargets[n].nSlot, (AOE_CONTROLLER_NAME*) &g_aTargets[n]));
+	
+	TableBytes = Table.nShelves*sizeof(struct ShelfDispatch*);
+	for (nShelf=0; nShelf<Table.nShelves; nShelf++)
+		if ( Table.ppShelves[nShelf] )
+		{
+			TableBytes += sizeof(struct ShelfDispatch);
+			for (nRange=0; nRange<DISPATCH_RANGES; nRange++)
+				if ( Table.ppShelves[nShelf]->apRanges[nRange] )
+					TableBytes += sizeof(struct SlotDispatch);
+		}
+	
+	Start = time_now_ns();
+	for (n=0; n<LOOKUPS; n++)
+	{
+		pTarget = &g_aTargets[test_random(&Random)%nTargets];
+		fOK &= ((AOE_CONTROLLER_NAME*) pTarget==dispatch_find(&Table, pTarget->nShelf, pTarget->nSlot));
+	}
+	TableNS = time_now_ns()-Start;
+	
+	Start = time_now_ns();
+	for (n=0; n<LIST_LOOKUPS; n++)
+	{
+		pTarget = &g_aTargets[test_random(&Random)%nTargets];
+		fOK &= (pTarget==find_in_list(nTargets, pTarget->nShelf, pTarget->nSlot));
+	}
+	ListNS = time_now_ns()-Start;
+	
+	printf("%4d targets %-7s table %6.1f ns/lookup (%8lu bytes)   list walk %9.1f ns/lookup%s\n", nTargets, fDense ? "dense" : "sparse",
+		   (double)TableNS/LOOKUPS, (unsigned long)TableBytes, (double)ListNS/LIST_LOOKUPS, fOK ? "" : "   LOOKUP FAILED");
+	
+	dispatch_free(&Table);
+	
+	return fOK;
+}
+
+
+
+static void test_table(void)
+{
+	struct DispatchTable Table = { NULL, 0 };
+	struct Target aTargets[3];
+	
+	CHECK(NULL==dispatch_find(&Table, 0, 0));
+	
+	CHECK_EQUAL(dispatch_add(&Table, 1, 2, (AOE_CONTROLLER_NAME*) &aTargets[0]), 0);
+	CHECK_EQUAL(dispatch_add(&Table, 1, 3, (AOE_CONTROLLER_NAME*) &aTargets[1]), 0);
+	CHECK_EQUAL(dispatch_add(&Table, MAX_SHELFS-1, MAX_SLOTS-1, (AOE_CONTROLLER_NAME*) &aTargets[2]), 0);
+	CHECK_EQUAL(Table.nShelves, MAX_SHELFS);
+	
+	// Addresses that can't exist are refused rather than written outside the table
+	CHECK_EQUAL(dispatch_add(&Table, MAX_SHELFS, 0, (AOE_CONTROLLER_NAME*) &aTargets[0]), -1);
+	CHECK_EQUAL(dispatch_add(&Table, 0, MAX_SLOTS, (AOE_CONTROLLER_NAME*) &aTargets[0]), -1);
+	CHECK_EQUAL(dispatch_add(&Table, -1, 0, (AOE_CONTROLLER_NAME*) &aTargets[0]), -1);
+	CHECK(NULL==dispatch_find(&Table, MAX_SHELFS, 0));
+	CHECK(NULL==dispatch_find(&Table, 1, -1));
+	
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[0]==dispatch_find(&Table, 1, 2));
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[1]==dispatch_find(&Table, 1, 3));
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[2]==dispatch_find(&Table, MAX_SHELFS-1, MAX_SLOTS-1));
+	CHECK(NULL==dispatch_find(&Table, 1, 4));
+	CHECK(NULL==dispatch_find(&Table, 2, 2));
+	
+	// A slot in another range of the same shelf
+	CHECK_EQUAL(dispatch_add(&Table, 1, DISPATCH_RANGE_SLOTS+2, (AOE_CONTROLLER_NAME*) &aTargets[2]), 0);
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[2]==dispatch_find(&Table, 1, DISPATCH_RANGE_SLOTS+2));
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[0]==dispatch_find(&Table, 1, 2));
+	CHECK(NULL==dispatch_find(&Table, 1, DISPATCH_RANGE_SLOTS+3));
+	CHECK(NULL==Table.ppShelves[1]->apRanges[2]);
+	
+	// Only the controller that's there can be removed, and a range and the shelf's table go with their last target
+	dispatch_remove(&Table, 1, 2, (AOE_CONTROLLER_NAME*) &aTargets[1]);
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[0]==dispatch_find(&Table, 1, 2));
+	dispatch_remove(&Table, 1, 2, (AOE_CONTROLLER_NAME*) &aTargets[0]);
+	CHECK(NULL==dispatch_find(&Table, 1, 2));
+	CHECK(NULL!=Table.ppShelves[1]);
+	dispatch_remove(&Table, 1, 3, (AOE_CONTROLLER_NAME*) &aTargets[1]);
+	CHECK(NULL!=Table.ppShelves[1]);
+	CHECK(NULL==Table.ppShelves[1]->apRanges[0]);
+	CHECK((AOE_CONTROLLER_NAME*) &aTargets[2]==dispatch_find(&Table, 1, DISPATCH_RANGE_SLOTS+2));
+	dispatch_remove(&Table, 1, DISPATCH_RANGE_SLOTS+2, (AOE_CONTROLLER_NAME*) &aTargets[2]);
+	CHECK(NULL==Table.ppShelves[1]);
+	
+	dispatch_free(&Table);
+	CHECK(NULL==Table.ppShelves);
+	CHECK_EQUAL(Table.nShelves, 0);
+}
+
+
+
+int main(void)
+{
+	bool fOK = TRUE;
+	int nTargets;
+	
+	test_table();
+	if ( test_result("dispatch table") )
+		return 1;
+	
+	for (nTargets=1; nTargets<=MAX_TARGETS; nTargets*=4)
+	{
+		fOK &= run(nTargets, TRUE);
+		fOK &= run(nTargets, FALSE);
+	}
+	
+	return fOK ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+/*
+ *  read_ahead_test.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  When reads count as sequential, and how far ahead of them is read
+ */
+
+#include "TestCommon.h"
+#include "ReadAheadWindow.h"
+
+
+
+static void test_sequential(void)
+{
+	UInt64 NextLBA;
+	int nSequential;
+	
+	NextLBA = 0;
+	nSequential = 0;
+	
+	// Read-ahead starts once READ_AHEAD_TRIGGER reads in a row have carried on from the one before
+	CHECK(!read_ahead_note_read(&NextLBA, &nSequential, 1000, 8));
+	CHECK_EQUAL(NextLBA, 1008);
+	CHECK(read_ahead_note_read(&NextLBA, &nSequential, 1008, 16));
+	CHECK(nSequential<READ_AHEAD_TRIGGER);
+	CHECK(read_ahead_note_read(&NextLBA, &nSequential, 1024, 8));
+	CHECK(nSequential>=READ_AHEAD_TRIGGER);
+	
+	// A read anywhere else starts the count again, even one that overlaps the last
+	CHECK(!read_ahead_note_read(&NextLBA, &nSequential, 1031, 8));
+	CHECK_EQUAL(nSequential, 0);
+	CHECK(!read_ahead_note_read(&NextLBA, &nSequential, 1040, 8));
+	CHECK_EQUAL(nSequential, 0);
+	CHECK(read_ahead_note_read(&NextLBA, &nSequential, 1048, 8));
+	CHECK_EQUAL(nSequential, 1);
+}
+
+
+
+static void test_target(void)
+{
+	// Nothing held yet: a full window past the client's next read
+	CHECK_EQUAL(read_ahead_target(1000, 128, 1000, 1000, 0), 1128);
+	
+	// The buffer only holds READ_AHEAD_BUFFER_SECTORS from Start
+	CHECK_EQUAL(read_ahead_target(1000+READ_AHEAD_BUFFER_SECTORS-10, READ_AHEAD_BUFFER_SECTORS, 1000, 1000+READ_AHEAD_BUFFER_SECTORS-10, 0), 1000+READ_AHEAD_BUFFER_SECTORS-10);
+	CHECK_EQUAL(read_ahead_target(1500, READ_AHEAD_BUFFER_SECTORS, 1000, 1100, 0), 1000+READ_AHEAD_BUFFER_SECTORS);
+	
+	// ...and nothing past the end of the disk is read
+	CHECK_EQUAL(read_ahead_target(1000, 128, 1000, 1000, 1050), 1050);
+	CHECK_EQUAL(read_ahead_target(1050, 128, 1050, 1050, 1050), 1050);
+	
+	// With read-ahead held, it's only topped up once half a window can be fetched
+	CHECK_EQUAL(read_ahead_target(1010, 128, 1000, 1128, 0), 1128);
+	CHECK_EQUAL(read_ahead_target(1063, 128, 1000, 1128, 0), 1128);
+	CHECK_EQUAL(read_ahead_target(1064, 128, 1000, 1128, 0), 1192);
+	
+	// The client has caught up with (or passed) what's held
+	CHECK_EQUAL(read_ahead_target(1128, 128, 1000, 1128, 0), 1256);
+}
+
+
+
+static void test_window(void)
+{
+	int nWindow, n;
+	
+	// Doubles with each hit up to the buffer size, halves with each discard down to READ_AHEAD_MIN_SECTORS
+	nWindow = READ_AHEAD_MIN_SECTORS;
+	nWindow = read_ahead_grow(nWindow);
+	CHECK_EQUAL(nWindow, 2*READ_AHEAD_MIN_SECTORS);
+	
+	for (n=0; n<20; n++)
+		nWindow = read_ahead_grow(nWindow);
+	CHECK_EQUAL(nWindow, READ_AHEAD_BUFFER_SECTORS);
+	
+	nWindow = read_ahead_shrink(nWindow);
+	CHECK_EQUAL(nWindow, READ_AHEAD_BUFFER_SECTORS/2);
+	
+	for (n=0; n<20; n++)
+		nWindow = read_ahead_shrink(nWindow);
+	CHECK_EQUAL(nWindow, READ_AHEAD_MIN_SECTORS);
+}
+
+
+
+int main(void)
+{
+	test_sequential();
+	test_target();
+	test_window();
+	
+	return test_result("read_ahead_test");
+}
@@ -0,0 +1,202 @@
+/*
+ *  read_copy_bench.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Times getting read responses into a 256KB client buffer, in cycles per KB. completeDataRead used to call
+ *  writeBytes for every mbuf of every response, and writeBytes finds each page it writes by walking the
+ *  descriptor's ranges from the start and looking the page up. copy_to_client copies straight into the mapping
+ *  asyncCommand made of the whole buffer. The descriptor here is a list of ranges over pages scattered through
+ *  memory, and a page lookup is just an array load, so the old path is if anything made to look cheaper than
+ *  it was (there's no page table walk or copypv set up).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "TestCommon.h"
+#include "../Shared/AoEcommon.h"
+
+#define PAGE_BYTES					4096
+#define BUFFER_BYTES				(256*1024)
+#define BUFFER_PAGES				(BUFFER_BYTES/PAGE_BYTES)
+#define PASSES						400
+#define RUNS						5
+#define MAX_SEGMENTS				8
+
+// Stands in for an IOGeneralMemoryDescriptor: ranges of the client's address space, each backed by pages
+struct Range
+{
+	size_t		Length;
+	int			nFirstPage;
+};
+
+struct Descriptor
+{
+	struct Range	aRanges[BUFFER_PAGES];
+	int				nRanges;
+	UInt8*			apPages[BUFFER_PAGES];
+};
+
+// How a response's data arrives: a frame carries nFrameBytes, in an mbuf chain of segments of these sizes
+struct FrameShape
+{
+	const char*		pszName;
+	int				nFrameBytes;
+	int				anSegments[MAX_SEGMENTS];
+};
+
+static const struct FrameShape g_aShapes[] =
+{
+	{ "1KB frames, 1 mbuf",		1024,	{ 1024 } },
+	{ "8KB frames, 5 mbufs",	8192,	{ 2048-60, 2048, 2048, 2048, 60 } },
+};
+
+static UInt8 g_aPagePool[BUFFER_PAGES*2][PAGE_BYTES];
+static UInt8 g_aMapping[BUFFER_BYTES];
+static UInt8 g_aFrame[8192];
+
+
+
+/*---------------------------------------------------------------------------
+ * nRanges ranges covering the buffer, on pages picked at random from a pool twice the size
+ ---------------------------------------------------------------------------*/
+static void make_descriptor(struct Descriptor* pDesc, int nRanges, UInt32* pRandom)
+{
+	bool afUsed[BUFFER_PAGES*2];
+	int n, nPage;
+	
+	memset(afUsed, 0, sizeof(afUsed));
+	for (n=0; n<BUFFER_PAGES; n++)
+	{
+		do
+			nPage = test_random(pRandom)%(BUFFER_PAGES*2);
+		while ( afUsed[nPage] );
+		
+		afUsed[nPage] = TRUE;
+		pDesc->apPages[n] = g_aPagePool[nPage];
+	}
+	
+	pDesc->nRanges = nRanges;
+	for (n=0; n<nRanges; n++)
+	{
+		pDesc->aRanges[n].Length = BUFFER_BYTES/nRanges;
+		pDesc->aRanges[n].nFirstPage = n*(BUFFER_PAGES/nRanges);
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * As writeBytes: every page written is found again from the first range
+ ---------------------------------------------------------------------------*/
+static size_t write_bytes(struct Descriptor* pDesc, size_t Position, const UInt8* pData, size_t Bytes)
+{
+	size_t Offset, Length, Copied;
+	int nRange;
+	UInt8* pPage;
+	
+	Copied = 0;
+	while ( Bytes )
+	{
+		Offset = Position;
+		for (nRange=0; nRange<pDesc->nRanges; nRange++)
+		{
+			if ( Offset<pDesc->aRanges[nRange].Length )
+				break;
+			Offset -= pDesc->aRanges[nRange].Length;
+		}
+		if ( nRange==pDesc->nRanges )
+			break;
+		
+		pPage = pDesc->apPages[pDesc->aRanges[nRange].nFirstPage + Offset/PAGE_BYTES];
+		Length = MIN(Bytes, (size_t)(PAGE_BYTES - Offset%PAGE_BYTES));
+		memcpy(pPage + Offset%PAGE_BYTES, pData, Length);
+		
+		Position += Length;
+		pData += Length;
+		Bytes -= Length;
+		Copied += Length;
+	}
+	
+	return Copied;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * As copy_to_client with the buffer mapped: bound the copy to the mapping and copy
+ ---------------------------------------------------------------------------*/
+static size_t copy_to_mapping(size_t Position, const UInt8* pData, size_t Bytes)
+{
+	Bytes = (Position<BUFFER_BYTES) ? MIN(Bytes, (size_t)(BUFFER_BYTES-Position)) : 0;
+	memcpy(g_aMapping+Position, pData, Bytes);
+	
+	return Bytes;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Cycles per KB to take in a whole buffer of responses, one mbuf at a time. The frames arrive in order, which
+ * is the common case and the cheapest one for the range walk
+ ---------------------------------------------------------------------------*/
+static double run(const struct FrameShape* pShape, struct Descriptor* pDesc, bool fMapped, size_t* pCopied)
+{
+	uint64_t Start;
+	size_t Position;
+	int nPass, nSegment, nOffset;
+	
+	*pCopied = 0;
+	Start = cycles_now();
+	for (nPass=0; nPass<PASSES; nPass++)
+		for (Position=0; Position<BUFFER_BYTES; /**/)
+			for (nSegment=0, nOffset=0; (nSegment<MAX_SEGMENTS) && pShape->anSegments[nSegment]; nSegment++)
+			{
+				if ( fMapped )
+					*pCopied += copy_to_mapping(Position, g_aFrame+nOffset, pShape->anSegments[nSegment]);
+				else
+					*pCopied += write_bytes(pDesc, Position, g_aFrame+nOffset, pShape->anSegments[nSegment]);
+				
+				Position += pShape->anSegments[nSegment];
+				nOffset += pShape->anSegments[nSegment];
+			}
+	
+	return (double)(cycles_now()-Start)*1024/((double)PASSES*BUFFER_BYTES);
+}
+
+
+
+int main(void)
+{
+	static struct Descriptor Desc;
+	const int anRanges[] = { 1, 16, 64 };
+	UInt32 Random = 0x9E3779B9;
+	double WriteBytes, Mapped;
+	size_t Copied, MappedCopied;
+	bool fOK = TRUE;
+	int nShape, nRanges, nRun;
+	
+	memset(g_aFrame, 0xA5, sizeof(g_aFrame));
+	
+	printf("256KB reads, %s per KB copied into the client buffer\n", CYCLE_UNITS);
+	for (nShape=0; nShape<(int)numberof(g_aShapes); nShape++)
+		for (nRanges=0; nRanges<(int)numberof(anRanges); nRanges++)
+		{
+			make_descriptor(&Desc, anRanges[nRanges], &Random);
+			
+			// The best of a few runs, the first of which also warms the caches
+			WriteBytes = Mapped = 1e9;
+			for (nRun=0; nRun<RUNS; nRun++)
+			{
+				WriteBytes = MIN(WriteBytes, run(&g_aShapes[nShape], &Desc, FALSE, &Copied));
+				Mapped = MIN(Mapped, run(&g_aShapes[nShape], &Desc, TRUE, &MappedCopied));
+				fOK &= (Copied==MappedCopied) && (Copied==(size_t)PASSES*BUFFER_BYTES);
+			}
+			
+			printf("  %-20s %2d range(s)   writeBytes per mbuf %7.1f   mapped copy %7.1f%s\n", g_aShapes[nShape].pszName, anRanges[nRanges],
+				   WriteBytes, Mapped, fOK ? "" : "   SHORT COPY");
+		}
+	
+	return fOK ? 0 : 1;
+}
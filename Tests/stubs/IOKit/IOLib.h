@@ -0,0 +1,23 @@
+/*
+ *  IOLib.h
+ *  Tests
+ *
+ *  Stands in for the kernel's header so the driver's pure logic can be built as a normal program.
+ *  Only what the files built by the tests use is here.
+ */
+
+#ifndef __TESTS_IOLIB_H__
+#define __TESTS_IOLIB_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <libkern/OSTypes.h>
+#include <libkern/OSAtomic.h>
+
+#define IOMalloc(Size)			malloc(Size)
+#define IOFree(p, Size)			free(p)
+#define IOLog(args...)			printf(args)
+
+#endif		//__TESTS_IOLIB_H__
@@ -0,0 +1,18 @@
+/*
+ *  IOATATypes.h
+ *  Tests
+ *
+ *  Stands in for the kernel's header so the driver's pure logic can be built as a normal program.
+ */
+
+#ifndef __TESTS_IOATATYPES_H__
+#define __TESTS_IOATATYPES_H__
+
+#include <libkern/OSTypes.h>
+
+enum
+{
+	kATADefaultSectorSize = 512
+};
+
+#endif		//__TESTS_IOATATYPES_H__
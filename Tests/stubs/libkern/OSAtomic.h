@@ -0,0 +1,35 @@
+/*
+ *  OSAtomic.h
+ *  Tests
+ *
+ *  Stands in for the kernel's header so the driver's pure logic can be built as a normal program.
+ *  The kernel's versions are full barriers, as the compiler's __sync builtins are.
+ */
+
+#ifndef __TESTS_OSATOMIC_H__
+#define __TESTS_OSATOMIC_H__
+
+#include <libkern/OSTypes.h>
+
+static inline bool OSCompareAndSwap(UInt32 Old, UInt32 New, volatile UInt32* pValue)
+{
+	return __sync_bool_compare_and_swap(pValue, Old, New);
+}
+
+static inline bool OSCompareAndSwapPtr(void* pOld, void* pNew, void* volatile* ppValue)
+{
+	return __sync_bool_compare_and_swap(ppValue, pOld, pNew);
+}
+
+// Like the kernel's, these return the value from before the change
+static inline SInt32 OSIncrementAtomic(volatile SInt32* pValue)
+{
+	return __sync_fetch_and_add(pValue, 1);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32* pValue)
+{
+	return __sync_fetch_and_sub(pValue, 1);
+}
+
+#endif		//__TESTS_OSATOMIC_H__
@@ -0,0 +1,27 @@
+/*
+ *  OSTypes.h
+ *  Tests
+ *
+ *  Stands in for the kernel's header so the driver's pure logic can be built as a normal program.
+ */
+
+#ifndef __TESTS_OSTYPES_H__
+#define __TESTS_OSTYPES_H__
+
+#include <stdint.h>
+
+typedef uint8_t		UInt8;
+typedef int8_t		SInt8;
+typedef uint16_t	UInt16;
+typedef int16_t		SInt16;
+typedef uint32_t	UInt32;
+typedef int32_t		SInt32;
+typedef uint64_t	UInt64;
+typedef int64_t		SInt64;
+
+#ifndef TRUE
+#define TRUE		1
+#define FALSE		0
+#endif
+
+#endif		//__TESTS_OSTYPES_H__
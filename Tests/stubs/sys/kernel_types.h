@@ -0,0 +1,20 @@
+/*
+ *  kernel_types.h
+ *  Tests
+ *
+ *  Stands in for the kernel's header so the driver's pure logic can be built as a normal program.
+ */
+
+#ifndef __TESTS_KERNEL_TYPES_H__
+#define __TESTS_KERNEL_TYPES_H__
+
+#include <sys/types.h>
+
+typedef struct ifnet*		ifnet_t;
+typedef struct mbuf*		mbuf_t;
+
+#ifndef __private_extern__
+#define __private_extern__	extern
+#endif
+
+#endif		//__TESTS_KERNEL_TYPES_H__
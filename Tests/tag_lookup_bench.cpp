@@ -0,0 +1,168 @@
+/*
+ *  tag_lookup_bench.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Times matching a response's tag to its outstanding request. The service indexes requests by SENT_HASH, before
+ *  that the sent queue was walked from the front. Both are run over the same requests, with tags handed out the way
+ *  the controllers do (a run of sequence numbers in each target's slot).
+ */
+
+#include <stdlib.h>
+#include <sys/queue.h>
+#include "TestCommon.h"
+#include "../Shared/AoEcommon.h"
+
+#define OUTSTANDING_REQUESTS		10000
+#define HASH_LOOKUPS				2000000
+#define LINEAR_LOOKUPS				20000
+
+struct Request
+{
+	TAILQ_ENTRY(Request)	q_next;
+	LIST_ENTRY(Request)		q_hash;
+	UInt32					Tag;
+};
+
+TAILQ_HEAD(RequestQueueHeadStruct, Request);
+LIST_HEAD(RequestListHeadStruct, Request);
+
+static struct Request				g_aRequests[OUTSTANDING_REQUESTS];
+static struct RequestQueueHeadStruct	g_SentQueue;
+static struct RequestListHeadStruct	g_aHash[SENT_HASH_SIZE];
+
+
+
+static struct Request* find_linear(UInt32 Tag)
+{
+	struct Request* pRequest;
+	
+	TAILQ_FOREACH(pRequest, &g_SentQueue, q_next)
+		if ( pRequest->Tag==Tag )
+			return pRequest;
+	
+	return NULL;
+}
+
+
+
+static struct Request* find_hashed(UInt32 Tag)
+{
+	struct Request* pRequest;
+	
+	LIST_FOREACH(pRequest, &g_aHash[SENT_HASH(Tag)], q_hash)
+		if ( pRequest->Tag==Tag )
+			return pRequest;
+	
+	return NULL;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Fill the queues with nTargets' worth of requests. Each target gets its own slot (or they all share slot 0, as the
+ * targets that didn't get a slot do) and a run of consecutive sequence numbers from a random start
+ ---------------------------------------------------------------------------*/
+static void build_requests(int nTargets, bool fSharedSlot, UInt32* pRandom)
+{
+	int nTarget, n, nPerTarget;
+	UInt32 Sequence;
+	
+	TAILQ_INIT(&g_SentQueue);
+	for (n=0; n<SENT_HASH_SIZE; n++)
+		LIST_INIT(&g_aHash[n]);
+	
+	nPerTarget = OUTSTANDING_REQUESTS/nTargets;
+	Sequence = 0;
+	
+	for (n=0; n<OUTSTANDING_REQUESTS; n++)
+	{
+		nTarget = MIN(n/nPerTarget, nTargets-1);
+		if ( fSharedSlot )
+			Sequence = (0==n) ? test_random(pRandom) : Sequence+1;
+		else if ( 0==n%nPerTarget )
+			Sequence = test_random(pRandom);
+		else
+			++Sequence;
+		
+		g_aRequests[n].Tag = fSharedSlot ? TAG_MAKE(0, 0, Sequence) : TAG_MAKE(1+nTarget, (nTarget&(TAG_GENERATIONS-1)), Sequence);
+		TAILQ_INSERT_TAIL(&g_SentQueue, &g_aRequests[n], q_next);
+		LIST_INSERT_HEAD(&g_aHash[SENT_HASH(g_aRequests[n].Tag)], &g_aRequests[n], q_hash);
+	}
+}
+
+
+
+static int longest_chain(void)
+{
+	struct Request* pRequest;
+	int n, nLength, nLongest;
+	
+	nLongest = 0;
+	for (n=0; n<SENT_HASH_SIZE; n++)
+	{
+		nLength = 0;
+		LIST_FOREACH(pRequest, &g_aHash[n], q_hash)
+			++nLength;
+		nLongest = MAX(nLongest, nLength);
+	}
+	
+	return nLongest;
+}
+
+
+
+static bool run(const char* pszName, int nTargets, bool fSharedSlot)
+{
+	struct Request* pRequest;
+	UInt32 Random = 0x12345678;
+	uint64_t Start, HashNS, LinearNS;
+	int n;
+	bool fOK = TRUE;
+	
+	build_requests(nTargets, fSharedSlot, &Random);
+	
+	// Both have to find the same request, otherwise the timings mean nothing
+	for (n=0; n<OUTSTANDING_REQUESTS; n+=97)
+		if ( (find_hashed(g_aRequests[n].Tag)!=&g_aRequests[n]) || (find_linear(g_aRequests[n].Tag)!=&g_aRequests[n]) )
+			fOK = FALSE;
+	
+	Start = time_now_ns();
+	for (n=0; n<HASH_LOOKUPS; n++)
+	{
+		pRequest = find_hashed(g_aRequests[test_random(&Random)%OUTSTANDING_REQUESTS].Tag);
+		fOK &= (NULL!=pRequest);
+	}
+	HashNS = time_now_ns()-Start;
+	
+	Start = time_now_ns();
+	for (n=0; n<LINEAR_LOOKUPS; n++)
+	{
+		pRequest = find_linear(g_aRequests[test_random(&Random)%OUTSTANDING_REQUESTS].Tag);
+		fOK &= (NULL!=pRequest);
+	}
+	LinearNS = time_now_ns()-Start;
+	
+	printf("%-28s hashed %8.1f ns/lookup (longest chain %3d)   sent queue walk %10.1f ns/lookup   %s\n", pszName,
+		   (double)HashNS/HASH_LOOKUPS, longest_chain(), (double)LinearNS/LINEAR_LOOKUPS, fOK ? "" : "LOOKUP FAILED");
+	
+	return fOK;
+}
+
+
+
+int main(void)
+{
+	bool fOK = TRUE;
+	
+	printf("Matching responses against %d outstanding requests\n", OUTSTANDING_REQUESTS);
+	
+	fOK &= run("1 target", 1, FALSE);
+	fOK &= run("16 targets", 16, FALSE);
+	fOK &= run("256 targets", 256, FALSE);
+	fOK &= run("2000 targets", 2000, FALSE);
+	fOK &= run("all in the shared slot", 1, TRUE);
+	
+	return fOK ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+ *  tag_test.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Packing and unpacking of the per-target tag namespaces: [user:1][broadcast:1][slot:12][generation:4][sequence:14]
+ */
+
+#include "TestCommon.h"
+#include "../Shared/AoEcommon.h"
+#include "ChunkTracking.h"
+
+
+
+static void test_layout(void)
+{
+	// The fields cover the 30 bits below the user/broadcast bits, without overlapping
+	CHECK_EQUAL(TAG_SLOT_MASK & TAG_GENERATION_MASK, 0);
+	CHECK_EQUAL(TAG_SLOT_MASK & TAG_SEQUENCE_MASK, 0);
+	CHECK_EQUAL(TAG_GENERATION_MASK & TAG_SEQUENCE_MASK, 0);
+	CHECK_EQUAL(TAG_SLOT_MASK | TAG_GENERATION_MASK | TAG_SEQUENCE_MASK, ~(TAG_USER_MASK | TAG_BROADCAST_MASK));
+	
+	CHECK_EQUAL(TAG_SLOTS, 4096);
+	CHECK_EQUAL(TAG_GENERATIONS, 16);
+	
+	// The hash only ever gives a bucket that exists
+	CHECK(SENT_HASH(0xFFFFFFFF) < SENT_HASH_SIZE);
+	CHECK(SENT_HASH(TAG_MAKE(TAG_SLOTS-1, TAG_GENERATIONS-1, TAG_SEQUENCE_MASK)) < SENT_HASH_SIZE);
+}
+
+
+
+static void test_round_trip(void)
+{
+	static const UInt32 aSequences[] = { 0, 1, 0x1234, TAG_SEQUENCE_MASK-1, TAG_SEQUENCE_MASK };
+	UInt32 Tag;
+	int nSlot, nGeneration, nBadSlot, nBadGeneration, nBadSequence, nFlagged;
+	unsigned int n;
+	
+	nBadSlot = nBadGeneration = nBadSequence = nFlagged = 0;
+	
+	for (nSlot=0; nSlot<TAG_SLOTS; nSlot++)
+		for (nGeneration=0; nGeneration<TAG_GENERATIONS; nGeneration++)
+			for (n=0; n<numberof(aSequences); n++)
+			{
+				Tag = TAG_MAKE(nSlot, nGeneration, aSequences[n]);
+				
+				nBadSlot += (TAG_GET_SLOT(Tag)!=(UInt32)nSlot);
+				nBadGeneration += (TAG_GET_GENERATION(Tag)!=(UInt32)nGeneration);
+				nBadSequence += ((Tag & TAG_SEQUENCE_MASK)!=aSequences[n]);
+				nFlagged += (0!=(Tag & (TAG_USER_MASK|TAG_BROADCAST_MASK)));
+			}
+	
+	CHECK_EQUAL(nBadSlot, 0);
+	CHECK_EQUAL(nBadGeneration, 0);
+	CHECK_EQUAL(nBadSequence, 0);
+	CHECK_EQUAL(nFlagged, 0);
+}
+
+
+
+static void test_overflow(void)
+{
+	// A field that's too big is cut down to size rather than spilling into its neighbour
+	CHECK_EQUAL(TAG_MAKE(7, 3, TAG_SEQUENCE_MASK+1), TAG_MAKE(7, 3, 0));
+	CHECK_EQUAL(TAG_MAKE(7, TAG_GENERATIONS+3, 5), TAG_MAKE(7, 3, 5));
+	CHECK_EQUAL(TAG_MAKE(TAG_SLOTS+7, 3, 5), TAG_MAKE(7, 3, 5));
+	
+	// Responses for a previous user of a slot are told apart by the generation
+	CHECK(TAG_GET_GENERATION(TAG_MAKE(9, 15, 100)) != TAG_GET_GENERATION(TAG_MAKE(9, (15+1)%TAG_GENERATIONS, 100)));
+	CHECK(TAG_MAKE(9, 15, 100) != TAG_MAKE(9, 0, 100));
+}
+
+
+
+static void test_sequence_wrap(void)
+{
+	UInt32 BaseTag, Tag;
+	int n, nBad;
+	
+	CHECK_EQUAL(TAG_SEQUENCE_DIFF(TAG_MAKE(3, 1, 2), TAG_MAKE(3, 1, TAG_SEQUENCE_MASK-1)), 4);
+	CHECK_EQUAL(TAG_SEQUENCE_DIFF(TAG_MAKE(3, 1, 0), TAG_MAKE(3, 1, TAG_SEQUENCE_MASK)), 1);
+	CHECK_EQUAL(TAG_SEQUENCE_DIFF(TAG_MAKE(3, 1, 10), TAG_MAKE(3, 1, 10)), 0);
+	
+	// A command that runs over the end of the sequence space keeps its slot and generation on every chunk
+	BaseTag = TAG_MAKE(TAG_SLOTS-1, TAG_GENERATIONS-1, TAG_SEQUENCE_MASK-100);
+	nBad = 0;
+	for (n=0; n<1000; n++)
+	{
+		Tag = CHUNK_TAG(BaseTag, n);
+		nBad += (TAG_GET_SLOT(Tag)!=TAG_SLOTS-1) || (TAG_GET_GENERATION(Tag)!=TAG_GENERATIONS-1) || (TAG_SEQUENCE_DIFF(Tag, BaseTag)!=(UInt32)n);
+	}
+	CHECK_EQUAL(nBad, 0);
+	
+	// ...and its last chunk is still at the right place when the sequence has wrapped right round to the base
+	CHECK_EQUAL(TAG_SEQUENCE_DIFF(CHUNK_TAG(BaseTag, TAG_SEQUENCE_MASK), BaseTag), TAG_SEQUENCE_MASK);
+	CHECK_EQUAL(CHUNK_TAG(BaseTag, TAG_SEQUENCE_MASK+1), BaseTag);
+}
+
+
+
+int main(void)
+{
+	test_layout();
+	test_round_trip();
+	test_overflow();
+	test_sequence_wrap();
+	
+	return test_result("tag_test");
+}
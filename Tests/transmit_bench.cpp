@@ -0,0 +1,249 @@
+/*
+ *  transmit_bench.cpp
+ *  Tests
+ *
+ *  Copyright © 2009 Brantley Coile Company, Inc. All rights reserved.
+ *
+ *  Measures how many frames each work-loop wakeup of the transmit timer sends, and the frame rate that gives, at
+ *  different transmit budgets (aoed -b). A budget of 1 is how TransmitTimer used to work.
+ *
+ *  A work-loop thread does what the service's work loop does with the send queue:
+ *		- the transmit timer sends frames while the window has room, up to the budget, and re-arms itself
+ *		  (enable_transmit_timer's 3us) if the budget ran out with frames still queued
+ *		- each response frees a place in the window and, if the timer isn't armed, arms it (again 3us)
+ *	A target thread answers each frame TARGET_LATENCY_NS after it was sent. Frames are only sent while the window
+ *	has room, so the send queue drains at whatever rate the wakeups allow. How long responses wait for the work loop
+ *	shows what a larger budget costs the receive path.
+ *	Nothing else is simulated (sending a frame costs nothing here), so this only compares the budgets.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "TestCommon.h"
+#include "../Shared/AoEcommon.h"
+
+#define COMMAND_FRAMES				32				// 256KB commands in 8KB frames
+#define COMMANDS					512
+#define TOTAL_FRAMES				(COMMANDS*COMMAND_FRAMES)
+#define WINDOW						64
+#define TARGET_LATENCY_NS			20000
+#define REARM_DELAY_NS				3000			// enable_transmit_timer's default
+#define UNLIMITED_BUDGET			(TOTAL_FRAMES+1)
+
+struct Bench
+{
+	pthread_mutex_t		Mutex;
+	pthread_cond_t		WorkLoopWake;
+	pthread_cond_t		TargetWake;
+	int					nBudget;
+
+	// Work loop
+	int					nQueued;					// Frames on the send queue
+	int					nOutstanding;
+	int					nAnswered;
+	bool				fTimerArmed;
+	uint64_t			TimerDeadline;
+	int					nWakeups;
+	uint64_t			ResponseWaitNS;				// Total time responses waited for the work loop
+	uint64_t			MaxResponseWaitNS;
+
+	// Frames in flight, oldest first (at most WINDOW of them)
+	uint64_t			aSentTimes[WINDOW];
+	int					nSentHead, nSent;
+	// Responses waiting for the work loop
+	uint64_t			aAnsweredTimes[WINDOW];
+	int					nAnsweredHead;
+	volatile int		nResponses;
+};
+
+
+
+static void arm_timer(struct Bench* pBench, uint64_t Now, uint64_t Delay)
+{
+	if ( !pBench->fTimerArmed )
+	{
+		pBench->fTimerArmed = TRUE;
+		pBench->TimerDeadline = Now+Delay;
+	}
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * As TransmitTimer: send while the window has room, up to the budget. Called with the mutex held
+ ---------------------------------------------------------------------------*/
+static void transmit_timer(struct Bench* pBench, uint64_t Now)
+{
+	int nSent;
+
+	pBench->fTimerArmed = FALSE;
+	++pBench->nWakeups;
+
+	for (nSent=0; pBench->nQueued && (pBench->nOutstanding<WINDOW); /**/)
+	{
+		--pBench->nQueued;
+		++pBench->nOutstanding;
+		pBench->aSentTimes[(pBench->nSentHead+pBench->nSent++)%WINDOW] = Now;
+
+		if ( ++nSent>=pBench->nBudget )
+		{
+			if ( pBench->nQueued )
+				arm_timer(pBench, Now, REARM_DELAY_NS);
+			break;
+		}
+	}
+
+	if ( nSent )
+		pthread_cond_signal(&pBench->TargetWake);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * As the receive path: every response waiting is taken off the queue, and the window it frees re-arms the timer
+ ---------------------------------------------------------------------------*/
+static void receive_responses(struct Bench* pBench, uint64_t Now)
+{
+	uint64_t Wait;
+
+	while ( pBench->nResponses )
+	{
+		Wait = Now-pBench->aAnsweredTimes[pBench->nAnsweredHead];
+		pBench->ResponseWaitNS += Wait;
+		pBench->MaxResponseWaitNS = MAX(pBench->MaxResponseWaitNS, Wait);
+		pBench->nAnsweredHead = (pBench->nAnsweredHead+1)%WINDOW;
+		--pBench->nResponses;
+
+		--pBench->nOutstanding;
+		++pBench->nAnswered;
+	}
+
+	if ( pBench->nQueued )
+		arm_timer(pBench, Now, REARM_DELAY_NS);
+}
+
+
+
+static void* work_loop_thread(void* pContext)
+{
+	struct Bench* pBench = (struct Bench*) pContext;
+	uint64_t Now, Deadline;
+
+	pthread_mutex_lock(&pBench->Mutex);
+	while ( pBench->nAnswered<TOTAL_FRAMES )
+	{
+		Now = time_now_ns();
+
+		if ( pBench->nResponses )
+			receive_responses(pBench, Now);
+		else if ( pBench->fTimerArmed && (Now>=pBench->TimerDeadline) )
+			transmit_timer(pBench, Now);
+		else if ( pBench->fTimerArmed )
+		{
+			// A microsecond timer can't be had from a condition variable, so the wait for it is spun (giving way to
+			// the target, in case they share a CPU)
+			Deadline = pBench->TimerDeadline;
+			pthread_mutex_unlock(&pBench->Mutex);
+			while ( (time_now_ns()<Deadline) && (0==pBench->nResponses) )
+				sched_yield();
+			pthread_mutex_lock(&pBench->Mutex);
+		}
+		else
+			pthread_cond_wait(&pBench->WorkLoopWake, &pBench->Mutex);
+	}
+	pthread_cond_signal(&pBench->TargetWake);
+	pthread_mutex_unlock(&pBench->Mutex);
+
+	return NULL;
+}
+
+
+
+/*---------------------------------------------------------------------------
+ * Answers the frames in the order they were sent, each TARGET_LATENCY_NS after it went out
+ ---------------------------------------------------------------------------*/
+static void* target_thread(void* pContext)
+{
+	struct Bench* pBench = (struct Bench*) pContext;
+	uint64_t Due;
+	int nAnswered;
+
+	pthread_mutex_lock(&pBench->Mutex);
+	for (nAnswered=0; nAnswered<TOTAL_FRAMES; nAnswered++)
+	{
+		while ( 0==pBench->nSent )
+			pthread_cond_wait(&pBench->TargetWake, &pBench->Mutex);
+
+		Due = pBench->aSentTimes[pBench->nSentHead]+TARGET_LATENCY_NS;
+		pthread_mutex_unlock(&pBench->Mutex);
+		while ( time_now_ns()<Due )
+			sched_yield();
+		pthread_mutex_lock(&pBench->Mutex);
+
+		pBench->nSentHead = (pBench->nSentHead+1)%WINDOW;
+		--pBench->nSent;
+		pBench->aAnsweredTimes[(pBench->nAnsweredHead+pBench->nResponses)%WINDOW] = time_now_ns();
+		++pBench->nResponses;
+		pthread_cond_signal(&pBench->WorkLoopWake);
+	}
+	pthread_mutex_unlock(&pBench->Mutex);
+
+	return NULL;
+}
+
+
+
+static bool run(int nBudget)
+{
+	struct Bench Bench;
+	pthread_t WorkLoop, Target;
+	uint64_t Start, ElapsedNS;
+
+	memset(&Bench, 0, sizeof(Bench));
+	pthread_mutex_init(&Bench.Mutex, NULL);
+	pthread_cond_init(&Bench.WorkLoopWake, NULL);
+	pthread_cond_init(&Bench.TargetWake, NULL);
+	Bench.nBudget = nBudget;
+
+	// Every command is queued at once, and queueing arms the timer straight away (enable_transmit_timer(0))
+	Bench.nQueued = TOTAL_FRAMES;
+	Start = time_now_ns();
+	arm_timer(&Bench, Start, 0);
+
+	pthread_create(&Target, NULL, target_thread, &Bench);
+	pthread_create(&WorkLoop, NULL, work_loop_thread, &Bench);
+	pthread_join(WorkLoop, NULL);
+	pthread_join(Target, NULL);
+	ElapsedNS = time_now_ns()-Start;
+
+	if ( UNLIMITED_BUDGET==nBudget )
+		printf("  budget  none");
+	else
+		printf("  budget %5d", nBudget);
+	printf("   %6d wakeups  %5.1f frames/wakeup  %6.0f kframes/s   responses wait mean %5.1fus max %6.1fus\n",
+		   Bench.nWakeups, (double)TOTAL_FRAMES/Bench.nWakeups, (double)TOTAL_FRAMES*1000000/ElapsedNS,
+		   (double)Bench.ResponseWaitNS/(TOTAL_FRAMES*1000.0), Bench.MaxResponseWaitNS/1000.0);
+
+	pthread_cond_destroy(&Bench.TargetWake);
+	pthread_cond_destroy(&Bench.WorkLoopWake);
+	pthread_mutex_destroy(&Bench.Mutex);
+
+	return (Bench.nAnswered==TOTAL_FRAMES) && (0==Bench.nQueued) && (0==Bench.nOutstanding);
+}
+
+
+
+int main(void)
+{
+	const int anBudgets[] = { 1, 4, 16, DEFAULT_TRANSMIT_BUDGET, WINDOW, UNLIMITED_BUDGET };
+	bool fOK = TRUE;
+	int n;
+
+	printf("%d frames, window of %d frames, target answers in %dus\n", TOTAL_FRAMES, WINDOW, TARGET_LATENCY_NS/1000);
+	for (n=0; n<(int)numberof(anBudgets); n++)
+		fOK &= run(anBudgets[n]);
+
+	return fOK ? 0 : 1;
+}
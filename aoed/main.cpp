@@ -8,6 +8,7 @@
 #import <DiskArbitration/DiskArbitration.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <unistd.h>
+#include <sys/sysctl.h>
 #include "AoEDriverInterface.h"
 #include "AoEProperties.h"
 #include "Preferences.h"
@@ -154,7 +155,7 @@ int main (int argc,  char** argv)
 	if ( (0!=Properties.configure_matching()) || (0!=Properties.configure_complete()) )
 		fprintf(stderr, "Unable to find device's properties\n");
 	
-	while ((nOpt = getopt(argc, argv, ":c:C:De:hi:l:psu:wx:")) != -1)
+	while ((nOpt = getopt(argc, argv, ":b:c:C:De:f:hi:k:l:m:n:psq:u:wW:x:")) != -1)
 	{
 		switch ( nOpt )
 		{
@@ -277,20 +278,30 @@ int main (int argc,  char** argv)
 			}				
 			case 'h':
 			{
-				fprintf(stdout, "usage: AoEd [-e [PORT]] [-c TARGET] [-C TARGET] [-D] [-h] [-i TARGET] [-p] [-s] [-u SIZE] [-w] [-x SIZE]\n");
+				fprintf(stdout, "usage: AoEd [-b FRAMES] [-e [PORT]] [-c TARGET] [-C TARGET] [-D] [-f MODE] [-h] [-i TARGET] [-k PORT,STRATEGY] [-m MB] [-n MODE] [-p] [-q DEPTH] [-s] [-u SIZE] [-w] [-W USEC] [-x SIZE]\n");
 				fprintf(stdout, "\n");
+				fprintf(stdout, "b: Maximum number of frames sent in each transmit pass\n");
 				fprintf(stdout, "c: Claim TARGET\n");
 				fprintf(stdout, "C: Unclaim TARGET (clears config string)\n");
 				fprintf(stdout, "D: Discover new devices \n");
 				fprintf(stdout, "e: comma seperated list of ethernet port numbers to enable for AoE (eg -e0,1 would enable en0 and en1)\n");
 				fprintf(stdout, " : without an argument, \"-e\" disables all ethernet ports\n");
+				fprintf(stdout, "f: How FLUSH CACHE is handled. 0: answered locally, 1: sent to the target after all earlier writes complete\n");
+				fprintf(stdout, " : 2: UNSAFE. As 1, and writes complete as soon as they're sent. A write that then fails is logged and\n");
+				fprintf(stdout, " :    its data is lost, every command fails until the next flush reports the error\n");
+				fprintf(stdout, " : mode 2 needs a queue depth (-q) above 1, otherwise it behaves as mode 1\n");
 				fprintf(stdout, "h: display this help\n");
 				fprintf(stdout, "i: Information on AoE TARGET (or all if TARGET is not supplied)\n");
+				fprintf(stdout, "k: Congestion control used on ethernet port PORT. 0: slow start, 1: delay based (eg -k1,1 for en1)\n");
+				fprintf(stdout, "m: Memory (MB) used to cache sectors read from targets (0 disables the cache)\n");
+				fprintf(stdout, "n: What's published for targets found from now on. 0: an ATA device, 1: a block storage device\n");
 				fprintf(stdout, "p: display preference file\n");
+				fprintf(stdout, "q: Number of read/write commands each target can have outstanding\n");
 				fprintf(stdout, "s: don't save options in preference file\n");
 				fprintf(stdout, "x: Outstanding transfer size (kb)\n");
 				fprintf(stdout, "u: User defined maximum bufffer count\n");
 				fprintf(stdout, "w: wait for kext to load and accept settings before exiting\n");		// TODO: Add optional timeout?
+				fprintf(stdout, "W: Time (us) a write waits for adjacent writes to merge with (default 0, coalescing off. Try 50)\n");
 				fSetOptionsInKEXT = FALSE;
 				break;
 			}
@@ -315,6 +326,32 @@ int main (int argc,  char** argv)
 				fSetOptionsInKEXT = FALSE;
 				break;
 			}
+			case 'k':
+			{
+				AoEDriverInterface Interface;
+				CongestionControlInfo CCInfo;
+				char* pszNumber;
+				
+				// Passed as PORT,STRATEGY
+				pszNumber = strtok(optarg, ",");
+				CCInfo.nEthernetNumber = pszNumber ? strtol(pszNumber, NULL, 10) : 0;
+				pszNumber = strtok(NULL, ",");
+				if ( NULL==pszNumber )
+				{
+					fprintf(stderr, "Both a port and a strategy are required (eg -k0,%d)\n", DEFAULT_CONGESTION_CONTROL);
+					break;
+				}
+				CCInfo.nStrategy = strtol(pszNumber, NULL, 10);
+				
+				if ( 0 != Interface.connect_to_driver() )
+					fprintf(stderr, "Unable to connect to driver\n");
+				
+				if ( 0!=Interface.set_congestion_control(&CCInfo) )
+					fprintf(stderr, "Failed to set congestion control on en%d\n", CCInfo.nEthernetNumber);
+				
+				Interface.disconnect();
+				break;
+			}
 			case 'l':
 			{
 				int nLog = 0;
@@ -346,6 +383,26 @@ int main (int argc,  char** argv)
 				Prefs.set_user_buffer_size(nSize);
 				break;
 			}
+			case 'b':
+			{
+				int nFrames = 1;
+				
+				if ( optarg )
+					nFrames = strtol(optarg, NULL, 10);
+				
+				Prefs.set_transmit_budget(nFrames);
+				break;
+			}
+			case 'q':
+			{
+				int nQueueDepth = 1;
+				
+				if ( optarg )
+					nQueueDepth = strtol(optarg, NULL, 10);
+				
+				Prefs.set_queue_depth(nQueueDepth);
+				break;
+			}
 			case 'x':
 			{
 				int nSize = 1;
@@ -356,9 +413,49 @@ int main (int argc,  char** argv)
 				Prefs.set_max_outstanding_size(nSize*1024);
 				break;
 			}
+			case 'f':
+			{
+				int nMode = DEFAULT_FLUSH_MODE;
+				
+				if ( optarg )
+					nMode = strtol(optarg, NULL, 10);
+				
+				Prefs.set_flush_mode(nMode);
+				break;
+			}
+			case 'n':
+			{
+				int nMode = DEFAULT_PUBLISH_MODE;
+				
+				if ( optarg )
+					nMode = strtol(optarg, NULL, 10);
+				
+				Prefs.set_publish_mode(nMode);
+				break;
+			}
+			case 'm':
+			{
+				int nSize_MB = 0;
+				
+				if ( optarg )
+					nSize_MB = strtol(optarg, NULL, 10);
+				
+				Prefs.set_read_cache_size(nSize_MB);
+				break;
+			}
 			case 'w':
 				fWaitForKEXTToLoad = TRUE;
 				break;
+			case 'W':
+			{
+				int nWindow_us = 0;
+				
+				if ( optarg )
+					nWindow_us = strtol(optarg, NULL, 10);
+				
+				Prefs.set_write_coalesce(nWindow_us);
+				break;
+			}
 			case ':':
 			{
 				// Handle any characters that have optional arguments that are not supplied
@@ -373,8 +470,11 @@ int main (int argc,  char** argv)
 					case 'i':
 					{
 						UInt32 PayloadSize;
+						uint64_t CPUFrequency, NSPerKB;
+						size_t Len;
 						int n, nValue, nTargets;
 						ErrorInfo	Errs;
+						StatisticsInfo	Stats;
 						AoEDriverInterface Interface;
 						int nNumOfEthernetPorts;
 						char acEthernetName[100];
@@ -415,15 +515,50 @@ int main (int argc,  char** argv)
 							// Print Error info
 							Interface.get_error_info(&Errs);
 							fprintf(stdout, "%d Retransmits and %d unexpected responses on interfaces\n", Errs.nRetransmits, Errs.nUnexpectedResponses);
+
+							// Print internal statistics
+							if ( 0==Interface.get_statistics(&Stats) )
+							{
+								fprintf(stdout, "Queue records: %d allocated, %d in use, %d high-water\n", Stats.nPoolRecords, Stats.nPoolInUse, Stats.nPoolHighWater);
+								fprintf(stdout, "Queue records: pool ran out %d time(s), failed to grow %d time(s)\n", Stats.nPoolEmpty, Stats.nPoolAllocFailures);
+								fprintf(stdout, "Writes: %llu bytes sent, %llu bytes copied\n", (unsigned long long)Stats.nWriteBytes, (unsigned long long)Stats.nWriteBytesCopied);
+								if ( Stats.nReadBytesCopied )
+								{
+									// The kext times the copies with the uptime clock, so the cost in cycles is worked out at the nominal clock rate
+									NSPerKB = (Stats.nReadCopyNS*1024)/Stats.nReadBytesCopied;
+									Len = sizeof(CPUFrequency);
+									if ( (0==sysctlbyname("hw.cpufrequency", &CPUFrequency, &Len, NULL, 0)) && (Len==sizeof(CPUFrequency)) )
+										fprintf(stdout, "Reads: %llu bytes copied to clients, %llu cycles per KB (%llu ns)\n", (unsigned long long)Stats.nReadBytesCopied,
+												(unsigned long long)((Stats.nReadCopyNS*1024*(CPUFrequency/1000000))/(Stats.nReadBytesCopied*1000)), (unsigned long long)NSPerKB);
+									else
+										fprintf(stdout, "Reads: %llu bytes copied to clients, %llu ns per KB\n", (unsigned long long)Stats.nReadBytesCopied, (unsigned long long)NSPerKB);
+								}
+								fprintf(stdout, "Chunks: %d resent early, %d duplicate(s) ignored\n", Stats.nChunkResends, Stats.nDuplicateChunks);
+								fprintf(stdout, "Coalescing: %d write(s) merged into %d transfer(s)\n", Stats.nCoalescedWrites, Stats.nCoalescedTransfers);
+								fprintf(stdout, "Read-ahead: %d hit(s), %d miss(es), %llu bytes wasted\n", Stats.nReadAheadHits, Stats.nReadAheadMisses, (unsigned long long)Stats.nReadAheadWasted);
+								if ( Stats.nCacheBytesBudget )
+									fprintf(stdout, "Read cache: %d hit(s), %d miss(es) (%d%% hit ratio), %llu bytes served, %llu of %llu bytes used\n",
+											Stats.nCacheHits, Stats.nCacheMisses,
+											(Stats.nCacheHits+Stats.nCacheMisses) ? (int)((100ULL*Stats.nCacheHits)/(Stats.nCacheHits+Stats.nCacheMisses)) : 0,
+											(unsigned long long)Stats.nCacheBytesServed, (unsigned long long)Stats.nCacheBytesUsed, (unsigned long long)Stats.nCacheBytesBudget);
+								fprintf(stdout, "Tag slots: %d of %d in use, %d target(s) found none free\n", Stats.nTagSlotsInUse, TAG_SLOTS-1, Stats.nTagSlotFailures);
+							}
 							Interface.disconnect();
 						}
 						
 						fSetOptionsInKEXT = FALSE;
 						break;
 					}						
+					case 'b':
 					case 'c':
 					case 'C':
+					case 'f':
+					case 'k':
+					case 'm':
+					case 'n':
+					case 'q':
 					case 'u':
+					case 'W':
 					case 'x':
 					{
 						fprintf(stderr, "Options required for this argument\n");